@@ -0,0 +1,23 @@
+# - Try to find Zstandard
+# Once done this will define
+#  ZSTD_FOUND - System has Zstandard
+#  ZSTD_INCLUDE_DIRS - The Zstandard include directories
+#  ZSTD_LIBRARIES - The libraries needed to use Zstandard
+
+find_path(ZSTD_INCLUDE_DIR zstd.h
+          /usr/include
+          /usr/local/include )
+
+find_library(ZSTD_LIBRARY NAMES zstd
+             PATHS /usr/lib /usr/local/lib )
+
+set(ZSTD_LIBRARIES ${ZSTD_LIBRARY} )
+set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR} )
+
+include(FindPackageHandleStandardArgs)
+# handle the QUIETLY and REQUIRED arguments and set ZSTD_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args(zstd  DEFAULT_MSG
+                                  ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY )
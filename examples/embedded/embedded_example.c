@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <sherpa_comm_mediator.h>
+
+// Runs a mediator on a background thread of this process and queries it for
+// the list of remote peers through the in-process path, without zyre.
+// usage: embedded_example <mediator config file>
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s <config file>\n", argv[0]);
+        return -1;
+    }
+    json_t *config = load_config_file(argv[1]);
+    if (config == NULL)
+        return -1;
+    char *shortname = strdup(json_string_value(json_object_get(config, "short-name")));
+    // the mediator takes ownership of the configuration
+    zactor_t *mediator = zactor_new(mediator_actor, config);
+    assert (mediator);
+
+    zsock_t *client = mediator_client_new(shortname);
+    assert (client);
+    // give remote mediators time to show up
+    zclock_sleep(1000);
+
+    json_t *payload = json_object();
+    json_object_set_new(payload, "UID", json_string("embedded_peer_query"));
+    json_t *msg = json_object();
+    json_object_set_new(msg, "metamodel", json_string("sherpa_mgs"));
+    json_object_set_new(msg, "model", json_string("http://kul/request_remote_peers.json"));
+    json_object_set_new(msg, "type", json_string("query_remote_peer_list"));
+    json_object_set_new(msg, "payload", payload);
+    char *query = json_dumps(msg, JSON_ENCODE_ANY);
+    json_decref(msg);
+    mediator_submit(client, query);
+    printf("[embedded_example] sent peer query: %s\n", query);
+    free(query);
+
+    // the reply is whispered to us; shouts to all local components arrive as well
+    zsock_set_rcvtimeo(client, 5000);
+    char *reply = mediator_receive(client);
+    if (reply)
+        printf("[embedded_example] received: %s\n", reply);
+    else
+        printf("[embedded_example] no reply from mediator %s\n", shortname);
+    zstr_free(&reply);
+
+    zsock_destroy(&client);
+    zactor_destroy(&mediator);
+    free(shortname);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "mediator.h"
+
+// Compares the fetch and the push protocol of remote file transfers. A file
+// server and client actors are run in this process and talk over TCP on the
+// loopback interface, so the file is transferred exactly as between two
+// mediators, without zyre. Add latency to see the effect of the round trips:
+//   sudo tc qdisc add dev lo root netem delay 10ms
+//   sudo tc qdisc del dev lo root
+
+#define BENCHMARK_SOURCE "/tmp/transfer_benchmark.src"
+#define BENCHMARK_TARGET "/tmp/transfer_benchmark.dst"
+
+int create_source_file(size_t size) {
+	/**
+	 * writes a file of random bytes, so compression does not help either protocol
+	 *
+	 * @param size_t size of the file in bytes
+	 *
+	 * @return 0 if successful and -1 if an error occurred
+	 */
+	FILE *file = fopen(BENCHMARK_SOURCE, "w");
+	if (!file) {
+		printf("[transfer_benchmark] Cannot create %s\n", BENCHMARK_SOURCE);
+		return -1;
+	}
+	byte buffer[4096];
+	size_t written = 0;
+	while (written < size) {
+		size_t i;
+		for (i = 0; i < sizeof(buffer); i++)
+			buffer[i] = (byte) random ();
+		size_t n = size - written > sizeof(buffer) ? sizeof(buffer) : size - written;
+		fwrite(buffer, 1, n, file);
+		written += n;
+	}
+	fclose(file);
+	return 0;
+}
+
+double run_transfer(zactor_t *server, const char *endpoint, const char *uid, bool push) {
+	/**
+	 * transfers the source file once
+	 *
+	 * @param zactor_t* file server
+	 * @param char* endpoint of the file server
+	 * @param char* uid of the transfer
+	 * @param bool true to use the push protocol, false to fetch every chunk
+	 *
+	 * @return duration of the transfer in msec, or -1 if it failed
+	 */
+	// the previous run must not be taken for an older version of the file
+	unlink(BENCHMARK_TARGET);
+	zstr_sendx(server, "serve", uid, "benchmark", "benchmark:" BENCHMARK_SOURCE, "1", NULL);
+	char *command = NULL, *peerid = NULL, *served_uid = NULL, *size = NULL, *mtime = NULL;
+	zstr_recvx(server, &command, &peerid, &served_uid, &size, &mtime, NULL);
+	if (!command || !streq(command, "endpoint")) {
+		printf("[transfer_benchmark] File server could not serve %s\n", BENCHMARK_SOURCE);
+		zstr_free(&command);
+		zstr_free(&peerid);
+		zstr_free(&served_uid);
+		zstr_free(&size);
+		zstr_free(&mtime);
+		return -1;
+	}
+	const char *args[10];
+	args[0] = peerid;
+	args[1] = uid;
+	args[2] = endpoint;
+	args[3] = BENCHMARK_TARGET;
+	args[4] = "30";
+	args[5] = size;
+	args[6] = "";
+	args[7] = "0";
+	args[8] = "false";
+	args[9] = push ? "true" : "false";
+	int64_t start = zclock_mono();
+	zactor_t *client = zactor_new(client_actor, args);
+	assert (client);
+	double duration = -1;
+	while (!zsys_interrupted) {
+		zmsg_t *msg = zmsg_recv(client);
+		if (!msg)
+			break;
+		char *event = zmsg_popstr(msg);
+		if (streq(event, "remote_file_done")) {
+			char *client_peerid = zmsg_popstr(msg);
+			char *client_uid = zmsg_popstr(msg);
+			char *success = zmsg_popstr(msg);
+			if (success && streq(success, "true"))
+				duration = zclock_mono() - start;
+			zstr_free(&client_peerid);
+			zstr_free(&client_uid);
+			zstr_free(&success);
+			zstr_free(&event);
+			zmsg_destroy(&msg);
+			break;
+		}
+		zstr_free(&event);
+		zmsg_destroy(&msg);
+	}
+	zactor_destroy(&client);
+	zstr_sendx(server, "done", uid, NULL);
+	zstr_free(&command);
+	zstr_free(&peerid);
+	zstr_free(&served_uid);
+	zstr_free(&size);
+	zstr_free(&mtime);
+	return duration;
+}
+
+int main(int argc, char *argv[]) {
+	// usage: transfer_benchmark [file size in MB] [runs]
+	size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+	int runs = argc > 2 ? atoi(argv[2]) : 3;
+	if (megabytes == 0 || runs < 1) {
+		printf("usage: %s [file size in MB] [runs]\n", argv[0]);
+		return -1;
+	}
+	if (create_source_file(megabytes * 1000000) != 0)
+		return -1;
+
+	const char *server_args[5];
+	server_args[0] = "30";
+	server_args[1] = "2";
+	server_args[2] = "tcp://127.0.0.1:*";
+	server_args[3] = "0";
+	server_args[4] = "0";
+	zactor_t *server = zactor_new(file_server_actor, server_args);
+	assert (server);
+	char *endpoint = zstr_recv(server);
+	assert (endpoint);
+
+	int mode;
+	for (mode = 0; mode < 2; mode++) {
+		bool push = (mode == 1);
+		double best = -1;
+		double sum = 0;
+		int ok = 0;
+		int i;
+		for (i = 0; i < runs; i++) {
+			char uid[32];
+			sprintf(uid, "benchmark-%s-%d", push ? "push" : "fetch", i);
+			double duration = run_transfer(server, endpoint, uid, push);
+			if (duration < 0) {
+				printf("[transfer_benchmark] %s run %d failed\n", push ? "push" : "fetch", i);
+				continue;
+			}
+			sum += duration;
+			ok++;
+			if (best < 0 || duration < best)
+				best = duration;
+		}
+		if (ok > 0)
+			printf("[transfer_benchmark] %-5s %zu MB: average %.0f msec, best %.0f msec (%.1f MB/s)\n",
+					push ? "push" : "fetch", megabytes, sum / ok, best, megabytes * 1000.0 / (best > 0 ? best : 1));
+	}
+
+	zstr_free(&endpoint);
+	zactor_destroy(&server);
+	unlink(BENCHMARK_SOURCE);
+	unlink(BENCHMARK_TARGET);
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include "mediator.h"
+
+// Counts the heap allocations of handling one received msg: it is decoded as
+// event_decode does and answered as handle_remote_whisper answers a
+// query_remote_file, so the payload is parsed, a reply is encoded and sent.
+// Compares jansson on the heap, the arena of event_decode only, and the arena
+// handle_event keeps for the handler as well. Counts every malloc, calloc and
+// realloc of the process, which relies on the allocator interposition of glibc.
+
+#define BENCHMARK_MSGS 100000
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static size_t allocations = 0;
+
+void * malloc (size_t size) {
+	allocations++;
+	return __libc_malloc (size);
+}
+
+void * calloc (size_t nmemb, size_t size) {
+	allocations++;
+	return __libc_calloc (nmemb, size);
+}
+
+void * realloc (void *ptr, size_t size) {
+	allocations++;
+	return __libc_realloc (ptr, size);
+}
+
+void handle_msg(arena_t *arena, bool handler_scope) {
+	/**
+	 * decodes and answers one query_remote_file
+	 *
+	 * @param arena_t* scratch memory, NULL to use the heap
+	 * @param bool true to answer in the arena as well
+	 */
+	char message[] = "{\"metamodel\": \"sherpa_msgs\", \"model\": \"http://kul/query_remote_file.json\", "
+			"\"type\": \"query_remote_file\", \"payload\": {\"UID\": \"f8c6e1d2-3b0a-4c7e-9d15-6a2b7e0c4f91\", "
+			"\"URI\": \"wasp1:/home/sherpa/images/frame_0001.png\", \"weight\": 1}}";
+	json_msg_t *result = (json_msg_t *) zmalloc (sizeof (json_msg_t));
+	arena_begin(arena);
+	int rc = decode_json_content(message, result, true);
+	arena_end(arena);
+	assert (rc == 0);
+	// handle_event keeps an arena until the handler returns
+	if (handler_scope)
+		arena_begin(arena);
+	json_error_t error;
+	json_t *req = message_payload(result, &error);
+	assert (req);
+	json_t *pl;
+	pl = json_object();
+	json_object_set(pl, "UID", json_object_get(req, "UID"));
+	json_object_set_new(pl, "success", json_string("true"));
+	char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
+	// stands in for whisper_remote, which copies the msg into a zframe
+	zframe_t *frame = zframe_new(encoded_msg, strlen(encoded_msg));
+	free(encoded_msg);
+	json_decref(pl);
+	json_decref(req);
+	if (handler_scope)
+		arena_end(arena);
+	zframe_destroy(&frame);
+	message_destroy(&result);
+}
+
+double count_allocations(arena_t *arena, bool handler_scope) {
+	/**
+	 * @param arena_t* scratch memory, NULL to use the heap
+	 * @param bool true to answer in the arena as well
+	 *
+	 * @return heap allocations per msg
+	 */
+	int i;
+	// the first msgs allocate the blocks of the arena
+	for (i = 0; i < 100; i++)
+		handle_msg(arena, handler_scope);
+	size_t before = allocations;
+	for (i = 0; i < BENCHMARK_MSGS; i++)
+		handle_msg(arena, handler_scope);
+	return (double) (allocations - before) / BENCHMARK_MSGS;
+}
+
+int main(void) {
+	arena_t *arena = arena_new();
+	json_set_alloc_funcs(malloc, free);
+	double heap = count_allocations(NULL, false);
+	mediator_use_arena();
+	double decode = count_allocations(arena, false);
+	double handler = count_allocations(arena, true);
+	arena_destroy(&arena);
+	printf("[msg_benchmark] allocations per msg: %.1f on the heap, %.1f with the arena of event_decode, %.1f with the arena of handle_event as well\n",
+			heap, decode, handler);
+	return 0;
+}
@@ -1,766 +1,783 @@
 #ifndef MEDIATOR_H
 #define MEDIATOR_H
 
+// Internals of the mediator library, implemented in src/. Not installed; the
+// tools and tests link the library objects through sherpa_comm_mediator_internal.
+
 #include <zyre.h>
 #include <jansson.h>
+#include "sherpa_comm_mediator.h"
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+// Static probes of provider sherpa_comm_mediator for perf and bpftrace, see
+// the list in doc/probes.md. Without USDT they and their arguments vanish, so
+// arguments must not have side effects. Strings are passed as pointers, since
+// sys/sdt.h rejects arrays and literals. Every probe has a semaphore that the
+// tracer raises while it is attached (src/mediator_probes.c); arguments that
+// cost more than a load, e.g. a clock or strlen, are only computed if
+// MEDIATOR_PROBE_ENABLED (name).
+#ifdef HAVE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define MEDIATOR_PROBE(name, ...) STAP_PROBEV (sherpa_comm_mediator, name, __VA_ARGS__)
+#define MEDIATOR_PROBE_ENABLED(name) __builtin_expect (sherpa_comm_mediator_##name##_semaphore, 0)
+#define MEDIATOR_PROBE_SEMAPHORE(name) \
+	unsigned short sherpa_comm_mediator_##name##_semaphore __attribute__ ((unused)) __attribute__ ((section (".probes")))
+extern MEDIATOR_PROBE_SEMAPHORE(msg_receive);
+extern MEDIATOR_PROBE_SEMAPHORE(msg_dispatch);
+extern MEDIATOR_PROBE_SEMAPHORE(outbox_enqueue);
+extern MEDIATOR_PROBE_SEMAPHORE(outbox_ack);
+extern MEDIATOR_PROBE_SEMAPHORE(outbox_resend);
+extern MEDIATOR_PROBE_SEMAPHORE(outbox_delivered);
+extern MEDIATOR_PROBE_SEMAPHORE(outbox_timeout);
+extern MEDIATOR_PROBE_SEMAPHORE(filter_hit);
+extern MEDIATOR_PROBE_SEMAPHORE(filter_miss);
+extern MEDIATOR_PROBE_SEMAPHORE(transfer_chunk_send);
+extern MEDIATOR_PROBE_SEMAPHORE(transfer_chunk_receive);
+#else
+#define MEDIATOR_PROBE(name, ...) do { } while (0)
+#define MEDIATOR_PROBE_ENABLED(name) 0
+#endif
 //#include <loglevels.h>
 
-typedef struct _mediator_t {
+typedef struct _file_cache_t file_cache_t;
+typedef struct _compressor_t compressor_t;
+typedef struct _distribution_t distribution_t;
+typedef struct _arena_t arena_t;
+typedef struct _pool_t pool_t;
+typedef struct _intern_table_t intern_table_t;
+typedef uint32_t intern_t;
+typedef struct _stats_t stats_t;
+typedef struct _stats_page_t stats_page_t;
+typedef struct _recorder_t recorder_t;
+
+struct _mediator_t {
     const char *shortname;
     const char *localgroup;
     const char *remotegroup;
     zyre_t *local;
     zyre_t *remote;
     json_t *config;
-    zlist_t *filter_list;
-    zlist_t *send_msgs;
+    struct _filter_list_item_t *filter_list; // msgs forwarded to the local network, newest first
+    struct _send_msg_request_t *send_msgs; // msgs waiting for acknowledgements, newest first
+    int64_t outbox_deadline; // msec when the next of send_msgs has to be resent or times out, -1 for none
+    int64_t filter_deadline; // msec when the oldest entry of filter_list expires, -1 for none
+    pool_t *send_msg_pool; // records of send_msgs
+    pool_t *recipient_pool; // recipients of send_msgs
+    pool_t *filter_pool; // records of filter_list
+    pool_t *query_pool; // local and remote queries
+    intern_table_t *ids; // peerids and msg UIDs of send_msgs and filter_list
+    stats_t *stats; // counters and histograms reported by query_mediator_stats, in stats_page
+    stats_page_t *stats_page; // shared memory monitoring tools read the stats from, or heap memory
+    recorder_t *recorder; // trace of the lifecycle of msgs, NULL if disabled
+    char *trace_file; // file the trace is dumped to
+    int trace_signals; // dump signals handled so far, see mediator_trace_signal
     bool verbose;
     zpoller_t *poller;
-    zhash_t *queries;
-    zlist_t *remote_query_list;
-    zlist_t *local_query_list;
+    zhash_t *local_queries; // queries of local components (query_t*), by UID
+    zhash_t *remote_queries; // queries of remote peers (query_t*), by UID
+    zhash_t *query_actors; // local queries with a running client actor, by actor address
     const char* actor_timeout;
-} mediator_t;
+    zactor_t *file_server;
+    char *file_server_endpoint; // endpoint remote clients connect to
+    file_cache_t *file_cache; // NULL if caching of remote files is disabled
+    compressor_t *compressor; // NULL if compression is disabled
+    zhash_t *peer_codecs; // codecs advertised by remote peers, by peerid
+    zhash_t *peer_addresses; // address zyre reported on ENTER of remote peers, by peerid
+    zlist_t *transfer_queue; // local queries waiting for a free transfer slot
+    size_t max_file_transfers; // max. number of client actors running at once
+    size_t transfer_seq; // arrival counter of queued queries
+    zhash_t *distributions; // files distributed to remote peers (distribution_t*), by UID
+    char *distribution_dir; // files distributed by remote peers are stored below it, NULL if they are refused
+    arena_t *arena; // scratch memory of msgs decoded by the main loop
+    zactor_t **decoders; // threads decoding received msgs, NULL if they are decoded by the main loop
+    size_t nbr_decoders;
+    zsock_t *decoded; // decoded msgs of all decoders, in the order of each sender
+    size_t decoding; // events handed to the decoders and not yet received back from them
+    bool throttled; // zyre sockets are not polled until the decoders catch up
+    zsock_t *inproc; // ROUTER of components in the same process, NULL if it could not be bound
+    zhash_t *inproc_clients; // identities (zframe_t*) of in-process components, by peerid
+    zsock_t *pipe; // pipe of mediator_actor, NULL if the mediator runs on the main thread
+    bool terminated; // set when mediator_actor is asked to stop
+};
 
 typedef struct _json_msg_t {
     char *metamodel;
     char *model;
     char *type;
     char *payload;
+    int64_t decoded; // zclock_usecs when event_decode was done, 0 if not decoded by it
+    int64_t decode_usecs; // time event_decode took
+    json_t *content; // payload parsed by event_decode, see message_payload; NULL if not parsed
 } json_msg_t;
 
+// Records created and destroyed at the msg rate are taken from pools: a pool
+// allocates its records a slab at a time and keeps returned records on a free
+// list, so they are reused without calling malloc. The records are linked
+// through a next pointer of their own instead of zlist nodes.
+struct _pool_t {
+	size_t size;        // bytes per record
+	size_t per_slab;    // records allocated at once
+	void *slabs;        // slabs, linked through their first word
+	void *free;         // returned records, linked through their first word
+	size_t live;        // records in use
+	size_t capacity;    // records in all slabs
+};
+
+pool_t * pool_new (size_t size, size_t per_slab);
+void pool_destroy (pool_t **self_p);
+void * pool_alloc (pool_t *self);
+void pool_free (pool_t *self, void *record);
+
+// Peerids and msg UIDs are interned: every distinct string is stored once and
+// referred to by a handle, so records compare them as integers. UUIDs, the
+// 32 hex digits of zyre or the dashed form, are kept as 16 bytes; other
+// strings as they are. Handle 0 stands for no string.
+#define INTERN_BUF_SIZE 37 // buffer of intern_str, fits a dashed UUID
+
+enum { INTERN_STRING, INTERN_UUID_HEX, INTERN_UUID_DASHED };
+
+typedef struct _intern_entry_t {
+	uint32_t hash;     // of kind and key, 0 if the entry is free
+	uint32_t next;     // next handle in the bucket, or on the free list
+	uint32_t refs;
+	uint8_t kind;
+	byte uuid[16];     // binary UUID, unless kind is INTERN_STRING
+	char *str;         // string of kind INTERN_STRING
+} intern_entry_t;
+
+struct _intern_table_t {
+	intern_entry_t *entries;  // by handle, entries[0] is unused
+	size_t nbr_entries;       // allocated entries
+	uint32_t *buckets;        // first handle of each bucket, 0 if empty
+	size_t nbr_buckets;       // power of 2
+	uint32_t free;            // first free handle, 0 if none
+	size_t size;              // interned strings
+};
+
+intern_table_t * intern_table_new (void);
+void intern_table_destroy (intern_table_t **self_p);
+intern_t intern_lookup (intern_table_t *self, const char *str);
+intern_t intern (intern_table_t *self, const char *str);
+void intern_release (intern_table_t *self, intern_t id);
+const char * intern_str (intern_table_t *self, intern_t id, char *buf);
+
+// Counters and histograms of the mediator, reported by query_mediator_stats
+// and published in a shared memory page. They are updated with relaxed atomic
+// adds, so any thread may update them without a lock, and the struct holds no
+// pointers. Gauges that have to be consistent with each other are published
+// by the main loop with a seqlock. Histograms are HDR-style:
+// every power of 2 is split into HISTOGRAM_SUB linear buckets, which bounds
+// the relative error of a recorded value by 1/HISTOGRAM_SUB.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB      (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40 // larger values are counted as 2^40 - 1
+#define HISTOGRAM_BUCKETS  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+#define STATS_NAME_SIZE    64 // msg types and peerids are cut to fit
+#define STATS_MSG_TYPES    32 // further msg types are counted as other
+#define STATS_PEERS        32 // further peers have no ack RTT histogram
+
+#define STATS_ADD(counter, n) __atomic_fetch_add (&(counter), (n), __ATOMIC_RELAXED)
+#define STATS_SET(counter, v) __atomic_store_n (&(counter), (v), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n (&(counter), __ATOMIC_RELAXED)
+
+enum { STATS_LOCAL, STATS_REMOTE, STATS_NETWORKS };
+
+typedef struct _histogram_t {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct _stats_network_t {
+	uint64_t msgs_in;
+	uint64_t bytes_in;
+	uint64_t msgs_out;
+	uint64_t bytes_out;
+} stats_network_t;
+
+typedef struct _stats_type_t {
+	char type[STATS_NAME_SIZE];
+	uint64_t received;
+} stats_type_t;
+
+typedef struct _stats_peer_t {
+	char peerid[STATS_NAME_SIZE];
+	stats_network_t traffic; // with this remote peer; out counts whispers only
+	histogram_t ack_rtt; // usec from the last (re)send of a msg to its ack
+} stats_peer_t;
+
+typedef struct _stats_gauges_t {
+	uint64_t outbox;                 // send requests waiting for acks
+	uint64_t filter_list;            // msgs forwarded to the local network recently
+	uint64_t local_queries;
+	uint64_t remote_queries;
+	uint64_t transfers_running;      // client actors fetching files
+	uint64_t transfers_queued;
+	uint64_t distributions;
+	uint64_t interned_ids;
+} stats_gauges_t;
+
+struct _stats_t {
+	int64_t started;                 // zclock_time of mediator_new
+	uint64_t seq;                    // seqlock of gauges, odd while they are written
+	stats_gauges_t gauges;
+	stats_network_t networks[STATS_NETWORKS];
+	uint64_t send_requests;          // send requests with recipients
+	uint64_t delivered;              // acked by all recipients
+	uint64_t resends;
+	uint64_t timeouts;
+	uint64_t file_transfers;         // local queries fetched successfully
+	uint64_t file_transfers_failed;
+	uint64_t nbr_types;              // used entries of types, only grows
+	stats_type_t types[STATS_MSG_TYPES];
+	uint64_t other_types;            // msgs of types that did not fit
+	uint64_t nbr_peers;              // used entries of peers, only grows
+	stats_peer_t peers[STATS_PEERS];
+	histogram_t report_latency;      // usec from send_request to communication_report
+	histogram_t file_throughput;     // KB/s of successful file transfers
+	histogram_t loop_latency;        // usec the main loop spent on each wakeup
+};
+
+// The stats of a mediator are mapped to /dev/shm/sherpa_comm_mediator-<short-name>,
+// so monitoring tools can read them without joining a network. Readers check
+// magic, version and size before they use the page; magic is set last.
+#define STATS_PAGE_MAGIC   0x4d435353 // "SSCM"
+#define STATS_PAGE_VERSION 1
+#define STATS_PAGE_PREFIX  "/sherpa_comm_mediator-"
+
+struct _stats_page_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;                   // of the page, as built into the mediator
+	int64_t pid;                     // of the mediator
+	char name[STATS_NAME_SIZE];      // short-name of the mediator
+	bool shared;                     // false if the page is heap memory
+	stats_t stats;
+};
+
+size_t histogram_index (uint64_t value);
+uint64_t histogram_lowest (size_t index);
+void histogram_record (histogram_t *self, uint64_t value);
+uint64_t histogram_percentile (histogram_t *self, double percentile);
+json_t * histogram_json (histogram_t *self);
+void stats_count_type (stats_t *self, const char *type);
+stats_peer_t * stats_peer (stats_t *self, const char *peerid);
+void stats_publish_gauges (stats_t *self, const stats_gauges_t *gauges);
+void stats_read_gauges (stats_t *self, stats_gauges_t *gauges);
+json_t * stats_json (stats_t *self);
+stats_page_t * stats_page_new (const char *name, bool shared);
+void stats_page_destroy (stats_page_t **self_p);
+void mediator_publish_stats (mediator_t *self, int64_t woken);
+
+// The flight recorder keeps the last trace events of the msgs that pass the
+// mediator in a ring of fixed-size binary records, so it can always run. Only
+// the main loop records. A dump is the header followed by the records, oldest
+// first; sherpa_comm_mediator_trace turns it into a timeline of every msg.
+#define TRACE_MAGIC   "SCMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_ID_SIZE 40 // UIDs and peerids are cut to fit
+
+typedef enum {
+	TRACE_RECEIVED = 1,     // send_request decoded; value: usec decoding took
+	TRACE_HANDLED,          // send_request handled by send_remote
+	TRACE_SENT,             // shouted without recipients, fire and forget
+	TRACE_QUEUED,           // shouted and added to the outbox; value: recipients
+	TRACE_UNKNOWN,          // rejected; value: unknown recipients
+	TRACE_RESEND,           // shouted again; value: resends so far
+	TRACE_ACK,              // ack of peer received; value: usec since the last send
+	TRACE_REPORT,           // communication_report sent; value: 1 if delivered, 0 on timeout
+	TRACE_REMOTE_RECEIVED,  // send_remote of peer decoded; value: usec decoding took
+	TRACE_ACK_SENT,         // ack whispered to peer
+	TRACE_FORWARDED,        // payload shouted to the local network
+	TRACE_FILTERED,         // dropped, it was forwarded already
+	TRACE_EVENTS
+} trace_event_t;
+
+typedef struct _trace_record_t {
+	int64_t ts;             // zclock_usecs, monotonic
+	uint32_t event;         // trace_event_t
+	uint32_t value;
+	char uid[TRACE_ID_SIZE];
+	char peer[TRACE_ID_SIZE]; // requester, sender or acking peer
+} trace_record_t;
+
+typedef struct _trace_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;   // sizeof (trace_record_t)
+	uint64_t records;       // in the dump
+	uint64_t lost;          // overwritten before the dump
+	char name[TRACE_ID_SIZE]; // short-name of the mediator
+} trace_header_t;
+
+struct _recorder_t {
+	trace_record_t *records;
+	size_t capacity;
+	uint64_t next;          // records written so far
+};
+
+const char * trace_event_name (uint32_t event);
+recorder_t * recorder_new (size_t capacity);
+void recorder_destroy (recorder_t **self_p);
+void recorder_trace_at (recorder_t *self, int64_t ts, trace_event_t event, const char *uid, const char *peer, int64_t value);
+void recorder_trace (recorder_t *self, trace_event_t event, const char *uid, const char *peer, int64_t value);
+int recorder_dump (recorder_t *self, const char *name, const char *path);
+int mediator_dump_trace (mediator_t *self, const char *path);
+
 typedef struct _recipient_t {
-	const char *id;
+	struct _recipient_t *next;
+	intern_t id;
 	bool ack;
 } recipient_t;
 
 typedef struct _filter_list_item_t {
-	const char *sender;
-	const char *msg_UID;
+	struct _filter_list_item_t *next;
+	intern_t sender;
+	intern_t msg_UID;
 	int64_t ts;
 }filter_list_item_t;
 
 typedef struct _send_msg_request_t {
-	const char *uid;
-	const char *local_requester;
+	struct _send_msg_request_t *next;
+	intern_t uid;
+	intern_t local_requester;
 	const char* group;
         int64_t ts_added;
 	int64_t ts_last_sent;
 	int timeout; // in msec
-	zlist_t *recipients;
-	const char *payload_type;
-	const char *msg; // payload+metadata
+	int resends;
+	recipient_t *recipients;
+	char *payload_type;
+	char *msg; // payload+metadata
+	zframe_t *compressed; // msg compressed for resending, or NULL
 } send_msg_request_t;
 
+void send_msg_request_destroy (mediator_t *mediator, send_msg_request_t **self_p);
+void filter_list_item_destroy (mediator_t *mediator, filter_list_item_t **self_p);
+
+typedef enum {
+        QUERY_LOCAL,    // asked by a local component, we fetch the file
+        QUERY_REMOTE    // asked by a remote peer, we serve the file
+} query_role_t;
+
+typedef enum {
+        QUERY_WAITING,  // waiting for the sources to answer
+        QUERY_QUEUED,   // waiting for a free transfer slot
+        QUERY_RUNNING   // client actor is fetching the file
+} query_state_t;
+
 typedef struct _query_t {
-        const char *uid;
-        const char *requester;
+        pool_t *pool; // the query was taken from
+        char *uid;
+        char *requester;
         json_msg_t *msg;
-        zactor_t *loop;
+        zactor_t *loop; // client actor fetching the file, NULL if not running
+        query_role_t role;
+        query_state_t state;
+        zlist_t *sources; // peerids that sent an endpoint for this query
+        int candidates; // sources that have not answered the query yet
+        char *cache_key; // key under which the fetched file is cached
+        zhash_t *endpoints; // endpoint of each source, by peerid
+        char *file_size; // file size reported by the first source
+        int priority; // order in the transfer queue, higher first
+        size_t seq; // arrival in the transfer queue
+        size_t position; // queue position last reported to the requester
+        bool batch; // query for several files (URIs), fetched in a single session
+        bool distributed; // requester is a remote mediator distributing the file
+        int64_t started; // zclock_mono when the client actor was started, 0 if not yet
 } query_t;
 
-void mediator_destroy (mediator_t **self_p) {
-    assert (self_p);
-    if(*self_p) {
-        mediator_t *self = *self_p;
-        zyre_destroy (&self->local);
-        zyre_destroy (&self->remote);
-        zlist_destroy (&self->send_msgs);
-        zlist_destroy (&self->filter_list);
-	zlist_destroy (&self->remote_query_list);
- 	zlist_destroy (&self->local_query_list);
-	zhash_destroy (&self->queries);
-        zpoller_destroy (&self->poller);
-        json_decref(self->config);
-        free (self);
-        *self_p = NULL;
-    }
-}
-
-mediator_t * mediator_new (json_t *config) {
-    mediator_t *self = (mediator_t *) zmalloc (sizeof (mediator_t));
-    if (!self)
-        return NULL;
-    
-    int major, minor, patch;
-    zyre_version (&major, &minor, &patch);
-    if (major != ZYRE_VERSION_MAJOR)
-        return NULL;
-    if (minor != ZYRE_VERSION_MINOR)
-        return NULL;
-    if (patch != ZYRE_VERSION_PATCH)
-        return NULL;
-    self->config = config;
-    //init list of send msg requests
-    self->send_msgs = zlist_new();
-    if (!self->send_msgs) {
-        mediator_destroy (&self);
-        return NULL;
-    }
-
-    //init list for filtering msg requests
-    self->filter_list = zlist_new();
-    if (!self->filter_list) {
-        mediator_destroy (&self);
-        return NULL;
-    }
-
-    //init list for remote queries
-    self->remote_query_list = zlist_new();
-    if (!self->remote_query_list) {
-        mediator_destroy (&self);
-        return NULL;
-    }
-    
-    //init list for local queries
-    self->local_query_list = zlist_new();
-    if (!self->local_query_list) {
-        mediator_destroy (&self);
-        return NULL;
-    }
-
-    if (json_object_get(config, "short-name")) {
-    	self->shortname = json_string_value(json_object_get(config, "short-name"));
-	} else {
-		printf("No shortname given.\n");
-		return NULL;
-	}
-
-    if (json_object_get(config, "verbose")) {
-    	self->verbose = json_is_true(json_object_get(config, "verbose"));
-	} else {
-		self->verbose = false;
-	}
-
-    self->queries = zhash_new();
-    if (!self->queries) {
-        mediator_destroy (&self);
-        return NULL;
-    }
- 
-    //  Create two nodes: 
-    //  - local gossip node for backend
-    //  - remote udp node for frontend
-    self->local = zyre_new (self->shortname);
-    if (!self->local) {
-        mediator_destroy (&self);
-        return NULL;
-    }
-    self->remote = zyre_new (self->shortname);
-    if (!self->remote) {
-        mediator_destroy (&self);
-        return NULL;
-    }
-
-    printf("[%s] my remote UUID: %s\n", self->shortname, zyre_uuid(self->remote));
-    json_object_set_new(config, "peerid", json_string(zyre_uuid(self->remote)));
-    /* config is a JSON object */
-    // set values for config file as zyre header.
-    const char *key;
-    json_t *value;
-    json_object_foreach(config, key, value) {
-        /* block of code that uses key and value */
-    	const char *header_value;
-    	if(json_is_string(value)) {
-    		header_value = json_string_value(value);
-    	} else {
-    		header_value = json_dumps(value, JSON_ENCODE_ANY);
-    	}
-    	//printf(header_value);printf("\n");
-    	zyre_set_header(self->local, key, "%s", header_value);
-        zyre_set_header(self->remote, key, "%s", header_value);
-//        free(header_value);
-    }
- 
-    if(self->verbose) {
-    	zyre_set_verbose (self->local);
-        zyre_set_verbose (self->remote);
-    }
-    
-    int rc;
-    if(!json_is_null(json_object_get(config, "gossip_endpoint"))) {
-    	if(!json_is_null(json_object_get(config, "local_endpoint"))) {
-    		rc = zyre_set_endpoint (self->local, "%s", json_string_value(json_object_get(config, "local_endpoint")));
-    		assert (rc == 0);
-    	} else {
-    		printf("[%s] WARNING: no local gossip endpoint is set! \n", self->shortname);
-    	}
-
-    	//  Set up gossip network for this node
-    	zyre_gossip_bind (self->local, "%s", json_string_value(json_object_get(config, "gossip_endpoint")));
-    	printf("[%s] using gossip with gossip hub '%s' \n", self->shortname,json_string_value(json_object_get(config, "gossip_endpoint")));
-    } else {
-    	printf("[%s] WARNING: no local gossip communication is set! \n", self->shortname);
-    }
-    rc = zyre_start (self->local);
-    assert (rc == 0);
-    rc = zyre_start (self->remote);
-    assert (rc == 0);
-    assert (strneq (zyre_uuid (self->local), zyre_uuid (self->remote)));
-    
-	const char* localgroup;
-	if(!json_is_null(json_object_get(config, "local-network"))) {
-		localgroup = json_string_value(json_object_get(config, "local-network"));
-	} else {
-		printf("[%s] WARNING: no name for local network set! Will use default name [local].",self->shortname);
-		localgroup = "local";
-	}
-	const char* remotegroup;
-	if(!json_is_null(json_object_get(config, "remote-network"))) {
-		remotegroup = json_string_value(json_object_get(config, "remote-network"));
-	} else {
-		printf("[%s] WARNING: no name for local network set! Will use default name [local].",self->shortname);
-		remotegroup = "remote";
-	}
-    zyre_join (self->local, localgroup);
-    zyre_join (self->remote, remotegroup);
-    self->localgroup = localgroup;
-    self->remotegroup = remotegroup;
-    //  Give time for them to interconnect
-    zclock_sleep (100);
-    if (self->verbose) {
-        zyre_dump (self->local);
-        zyre_dump (self->remote);
-    }
-
-    zpoller_t *poller =  zpoller_new (zyre_socket(self->local), zyre_socket(self->remote), NULL);
-    self->poller = poller;
-
-//    zhash_t *hash = zhash_new ();
-//    if (!hash) {
-//        mediator_destroy (&self);
-//        return NULL;
-//    }
-
-    if (json_object_get(config, "actor_timeout")) {
-		self->actor_timeout = json_string_value(json_object_get(config, "actor_timeout"));
-	} else {
-		printf("No actor_timeout given, will use default 5s.\n");
-		self->actor_timeout = strdup("5");
-	}
-
-    return self;
-}
-
-
-void query_destroy (query_t **self_p) {
-        assert (self_p);
-        if(*self_p) {
-            query_t *self = *self_p;
-            free (self);
-            *self_p = NULL;
-        }
-}
-
-void message_destroy (json_msg_t **self_p) {
-        assert (self_p);
-        if(*self_p) {
-        	free((*self_p)->metamodel);
-        	free((*self_p)->model);
-        	free((*self_p)->payload);
-        	free((*self_p)->type);
-            free (*self_p);
-            *self_p = NULL;
-        }
-}
-
-
-query_t * query_new (const char *uid, const char *requester, json_msg_t *msg, zactor_t *loop) {
-        query_t *self = (query_t *) zmalloc (sizeof (query_t));
-        if (!self)
-            return NULL;
-        self->uid = uid;
-        self->requester = requester;
-        self->msg = msg;
-        self->loop = loop;
-        
-        return self;
-}
+// A file distributed to a group of remote peers. Recipients fetch it from all
+// copies known so far; every recipient that confirmed serves later ones, so the
+// origin does not send the file to every recipient itself.
+struct _distribution_t {
+	char *uid;
+	char *requester;    // local component that asked for the distribution
+	char *target;       // path the recipients store the file at
+	zlist_t *sources;   // URIs of the copies: the original first, then the recipients that confirmed
+	zlist_t *waiting;   // recipients (peerids) not asked to fetch the file yet
+	zhash_t *running;   // recipients fetching the file, by peerid
+	json_t *confirmed;  // recipients that stored the file
+	json_t *failed;     // recipients that did not, with the error
+	size_t fanout;      // recipients each copy serves at once
+	size_t next;        // source the next recipient is pointed to first
+};
+
+distribution_t * distribution_new (const char *uid, const char *requester, const char *target, size_t fanout);
+void distribution_destroy (distribution_t **self_p);
+
+// Cache of files fetched from remote peers. Entries are named after a digest of
+// (peer, path, size, mtime) of the source file and evicted least recently used first.
+// A cached file may share its inode with the targets it was provided at (see
+// file_cache_link), so entries remember size and mtime of the file they stored
+// and are dropped if a consumer changed it in place.
+#define FILE_CACHE_COPY_SIZE 262144 // bytes copied at once if a file can not be linked
+
+typedef struct _file_cache_entry_t {
+	char *name;
+	off_t size;
+	int64_t mtime;    // nsec, of the cached file when it was stored
+	int64_t used;     // msec, time of the last hit
+} file_cache_entry_t;
+
+struct _file_cache_t {
+	char *dir;
+	off_t limit;      // max. total size of files only the cache holds, in bytes
+	off_t size;       // total size of cached files in bytes
+	zhash_t *entries; // file_cache_entry_t, by name
+};
+
+int64_t file_cache_mtime (const struct stat *st);
+int file_cache_entry_compare (void *item1, void *item2);
+void file_cache_entry_destroy (file_cache_entry_t **self_p);
+void file_cache_destroy (file_cache_t **self_p);
+void file_cache_insert (file_cache_t *self, const char *name, off_t size, int64_t mtime, int64_t used);
+void file_cache_remove (file_cache_t *self, file_cache_entry_t *entry, bool unlink_file);
+void file_cache_evict (file_cache_t *self);
+file_cache_t * file_cache_new (const char *dir, off_t limit);
+char * file_cache_key (const char *peerid, const char *path, const char *size, const char *mtime);
+int file_cache_copy (int in, int out);
+int file_cache_link (const char *src, const char *dst, bool share);
+int file_cache_fetch (file_cache_t *self, const char *key, const char *target);
+int file_cache_store (file_cache_t *self, const char *key, const char *file);
+
+//  Compression of remote traffic. Peers advertise the codecs they understand
+//  in the "codecs" zyre header, followed by the ids of the dictionaries they
+//  loaded, e.g. "zstd 1880211402 3344122"; payloads are only compressed for
+//  peers that do, with a dictionary only if all of them list it, and only if
+//  they are large enough and actually shrink.
+
+#define COMPRESSION_CODEC     "zstd"
+#define COMPRESSION_THRESHOLD 1024  // payloads smaller than this are sent as they are
+#define COMPRESSION_LEVEL     3
+#define COMPRESSION_MIN_GAIN  10    // percent a payload has to shrink to be sent compressed
+
+struct _compressor_t {
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	zhash_t *cdicts; // ZSTD_CDict* by payload_type
+	zhash_t *ddicts; // ZSTD_DDict* by dictionary id
+	zhash_t *dict_ids; // dictionary id by payload_type
+#endif
+	size_t threshold;
+	int level;
+};
+
+#ifdef HAVE_ZSTD
+zframe_t * compress_frame (ZSTD_CCtx *cctx, const ZSTD_CDict *cdict, int level, const void *data, size_t size);
+zframe_t * decompress_frame (ZSTD_DCtx *dctx, zhash_t *ddicts, const void *data, size_t size, size_t limit);
+int compressor_load_dictionary (compressor_t *self, const char *payload_type, const char *path);
+#endif
 
+void compressor_destroy (compressor_t **self_p);
+compressor_t * compressor_new (json_t *config);
+char * compressor_codecs (compressor_t *self);
+bool codecs_accept (const char *codecs, unsigned dict_id);
+unsigned compressor_dictionary (compressor_t *self, const char *payload_type);
+unsigned compressor_frame_dictionary (zframe_t *frame);
+zframe_t * compressor_pack (compressor_t *self, const char *payload_type, const char *msg, bool dictionary);
+char * compressor_unpack (compressor_t *self, const char *codec, zframe_t *data);
+
+// Scratch memory for handling a received msg, see src/mediator_arena.c. Once
+// mediator_use_arena installed its hooks, jansson allocates from the arena
+// that is active on the thread instead of the heap. event_decode keeps the
+// parse tree of the msg there and resets the arena when the fields are
+// copied out; handle_event keeps everything the handlers parse or encode
+// there until they return. What outlives the event escapes to the heap:
+// encode_msg returns its msg through arena_escape, so it may be kept in the
+// outbox, and distributions collect their results with the arena suspended.
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN      16
+
+typedef struct _arena_block_t {
+	struct _arena_block_t *next;
+	size_t size;
+	size_t used;
+	byte *data;
+} arena_block_t;
+
+struct _arena_t {
+	arena_block_t *blocks;  // newest first; the oldest block is kept on reset
+};
+
+arena_t * arena_new (void);
+void arena_reset (arena_t *self);
+void arena_destroy (arena_t **self_p);
+void * arena_alloc (arena_t *self, size_t size);
+bool arena_owns (arena_t *self, void *ptr);
+void arena_begin (arena_t *self);
+arena_t * arena_suspend (void);
+char * arena_escape (char *str);
+void arena_end (arena_t *self);
+void arena_json_free (void *ptr);
+
+void query_destroy (query_t **self_p);
+void message_destroy (json_msg_t **self_p);
+query_t * query_new (pool_t *pool, char *uid, char *requester, json_msg_t *msg, zactor_t *loop);
+
+//  Queries are indexed by UID per role, and by actor address while a client
+//  actor runs, so routing an event to its query does not depend on the
+//  number of queries in flight.
+
+void query_actor_key (void *actor, char *key);
+int mediator_add_query (mediator_t *self, query_t *query);
+query_t * mediator_lookup_query (mediator_t *self, query_role_t role, const char *uid);
+query_t * mediator_lookup_actor (mediator_t *self, void *actor);
+void mediator_set_query_actor (mediator_t *self, query_t *query, zactor_t *actor);
+void mediator_remove_query (mediator_t *self, query_t **query_p);
+int query_compare_priority (void *item1, void *item2);
+
+// Event loops block until their next deadline instead of polling, so an idle
+// mediator does not wake up. Deadlines are absolute times in msec, -1 for none.
+int64_t deadline_earliest (int64_t deadline, int64_t other);
+int deadline_timeout (int64_t deadline, int64_t now);
+int64_t send_msg_deadline (mediator_t *self, send_msg_request_t *msg);
+int mediator_poll_timeout (mediator_t *self);
 
 // File transfer protocol
 #define CHUNK_SIZE 250000
 #define PIPELINE   10
-
-static void
-client_actor (zsock_t *pipe, void *args)
-{
-    char* peerid = strdup(((char**)args)[0]);
-    char* uid = strdup(((char**)args)[1]);
-    char* endpoint = strdup(((char**)args)[2]);
-    char* target = strdup(((char**)args)[3]);
-    char* timeout_str = strdup(((char**)args)[4]);
-    char* filesize = strdup(((char**)args)[5]);
-    char *eptr;
-    off_t fs = strtoll(filesize, &eptr, 10);
-    assert (timeout_str);
-    int timeout = atoi(timeout_str);
-
-    char* success = NULL;
-    char* error = NULL;
-
-    // time when thread was spawned; will be updated whenever a message is received
-    int64_t com_time = zclock_mono();
-
-    zsock_t *dealer = zsock_new_dealer(endpoint);
-    
-    //  Up to this many chunks in transit
-    size_t credit = PIPELINE;
-    
-    size_t total = 0;       //  Total bytes received
-    size_t chunks = 0;      //  Total chunks received
-    size_t offset = 0;      //  Offset of next chunk request
-    
-    zsock_signal (pipe, 0);     //  Signal "ready" to caller
-    
-    zpoller_t *poller = zpoller_new (pipe, dealer, NULL);
-
-    FILE *file = fopen (target, "w");
-	printf("[client_actor] peerid: %s\n",peerid);
-	printf("[client_actor] uid: %s\n",uid);
-	printf("[client_actor] endpoint: %s\n",endpoint);
-	printf("[client_actor] storing file at %s\n",target);
-	printf("[client_actor] timeout %d\n",timeout);
-	printf("[client_actor] file size %s\n",filesize);
-	if(!file) {
-		printf("[client_actor] errno = %d\n", errno);
-		printf("[client_actor] Check http://www.virtsync.com/c-error-codes-include-errno for explanation\n");
-		printf ("[client_actor] Cannot open target file %s for file transfer: \n", target);
-		success = strdup("false");
-		error = strdup("[client_actor] Could not create file. Please check target folder.");
-		goto cleanup;
-	}
-
-    while (!zsys_interrupted) {//!zsys_interrupted
-        void *which = zpoller_wait (poller, 1);
-        ///TODO: remove hardcoded timeout
-        if (which == pipe) {
-            zmsg_t *msg = zmsg_recv (which);
-            if (!msg){
-            	printf("[client_actor] Pipe interrupted.\n");
-            	success = strdup("false");
-				error = strdup("[client_actor] Pipe interrupted.");
-				fclose(file);
-				goto cleanup;              //  Interrupted
-            }
-            char *command = zmsg_popstr (msg);
-            if (streq (command, "$TERM")){
-            	printf("[client_actor] Received term signal.\n");
-            	success = strdup("false");
-				error = strdup("[client_actor] Received $TERM signal.");
-				fclose(file);
-				zmsg_destroy (&msg);
-				goto cleanup;
-            }
-            zmsg_destroy (&msg);
-        }
-        else if (which == dealer) {
-			zframe_t *chunk = zframe_recv (dealer);
-			if (!chunk){
-				printf("[client_actor] Dealer socket interrupted.\n");
-				success = strdup("false");
-				error = strdup("[client_actor] Dealer socket interrupted.");
-				fclose(file);
-				goto cleanup;
-			}
-			chunks++;
-			credit++;
-			com_time = zclock_mono(); // reset timeout when receiving a package
-			size_t size = zframe_size (chunk);
-			fwrite (zframe_data(chunk) , sizeof(char), size, file);
-			zframe_destroy (&chunk);
-			total += size;
-			printf ("[client_actor] %zd chunks received, %zd bytes of %s\n", chunks, total, filesize);
-			if (size < CHUNK_SIZE)
-				break;              //  Last chunk received; exit
-        }
-        while (credit) {
-			// Ask for next chunk
-        	if (offset > fs) {
-        		printf("[client_actor] offset larger than file size. Will not send fetch request.\n");
-        		break;
-        	}
-			zstr_sendm  (dealer, "fetch");
-			zstr_sendfm (dealer, "%ld", offset);
-			zstr_sendf  (dealer, "%ld", (long) CHUNK_SIZE);
-			printf ("[client_actor] Sending fetch request with offset %zu\n",offset);
-			offset += CHUNK_SIZE;
-			credit--;
-		}
-        // check for timeout
-        int64_t curr_time = zclock_mono ();
-		if (curr_time > 0) {
-			//printf("time: %zu", (curr_time - com_time));
-			if (curr_time - com_time > (1000 * timeout)) {
-				success = strdup("false");
-				error = strdup("[client_actor] Timeout.");
-				printf("[client_actor] timeout!\n");
-				fclose(file);
-				///TODO:test
-				goto cleanup;
-			}
-		} else {
-			printf ("[client_actor] could not get current time\n");
-		}
-    }
-    printf ("[client_actor] File transfer complete. Received %zd bytes\n", total);
-    success = strdup("true");
-    error = strdup("");
-    fclose(file);
-cleanup:
-	printf ("[client_actor] Creating report\n");
-	// Query type
-    zstr_sendm (pipe, "remote_file_done");
-    zstr_sendm (pipe, peerid);
-    zstr_sendm (pipe, uid);
-    zstr_sendm (pipe, success);
-    zstr_sendm (pipe, error);
-    zstr_send (pipe, target);
-
-    zstr_free(&peerid);
-    zstr_free(&uid);
-    zstr_free(&endpoint);
-    zstr_free(&target);
-    zstr_free(&timeout_str);
-    zstr_free(&filesize);
-    zstr_free(&success);
-    zstr_free(&error);
-    
-	printf ("[client_actor] Cleaning up client actor\n");
-    zpoller_destroy(&poller);
-    zsock_destroy(&dealer);
-}
-
-//  The server thread waits for a chunk request from a client,
-//  reads that chunk and sends it back to the client:
-
-static void
-server_actor (zsock_t *pipe, void *args)
-{
-    // TODO: use JSON with parsed URI upfront?
-    char* uri = strdup(((char**)args)[0]);
-    char* token;
-    token = strtok(uri, ":"); // Remove host/peerid
-    token = strtok(NULL, ":");
-    char* filename = strdup(token);
-
-    char* success = NULL;
-    char* error = NULL;
-
-	char* uid = strdup(((char**)args)[2]);
-	char* peerid = strdup(((char**)args)[3]);
-
-	char* timeout_str = strdup(((char**)args)[1]);
-	assert (timeout_str);
-	int timeout = atoi(timeout_str);
-
-    zsock_t *router = zsock_new_router ("tcp://*:*");
-    assert(router);
-	//  We have two parts per message so HWM is PIPELINE * 2
-	zsocket_set_hwm (zsock_resolve(router), PIPELINE * 2);
-	zpoller_t *poller = zpoller_new (pipe, router, NULL);
-	assert(poller);
-
-	zsock_signal (pipe, 0);     //  Signal "ready" to caller
-
-    FILE *file = fopen (filename, "r");
-    if(!file) {
-		printf ("[server_actor] Cannot open target file %s for file transfer: \n", filename);
-		printf("[server_actor] errno = %d\n", errno);
-		printf("Check http://www.virtsync.com/c-error-codes-include-errno for explanation\n");
-		success = strdup("false");
-		error = strdup("[server_actor] Could not create file. Please check target folder.");
-		// Query type
-		zstr_sendm (pipe, "remote_file_transfer_error");
-		zstr_sendm (pipe, peerid);
-		zstr_sendm (pipe, uid);
-		zstr_sendm (pipe, success);
-		zstr_send (pipe, error);
-		printf ("[server_actor] waiting for msg\n");
-		int rc;
-		rc = zsock_wait (pipe);
-		if (rc == 123){
-			printf("[server_actor] Received signal from pipe. Cleaning up %s.\n", zsock_endpoint(router));
-		} else {
-			printf("[server_actor] Received wrong signal from pipe. Cleaning up %s anyway.\n", zsock_endpoint(router));
-		}
-		goto cleanup;
-	}
-	// time when thread was spawned; will be updated whenever a message is received
-	int64_t com_time = zclock_mono();
-
-    // get file size
-    off_t file_size;
-	struct stat st;
-	if (stat(filename, &st) == 0){
-		file_size=st.st_size;
-		printf("[server_actor] Opened file of size %zu.\n",file_size);
-	}
-	else {
-		printf("[server_actor] could not determine file size. Errno: = %d\n",errno);
-		success = strdup("false");
-		error = strdup("[server_actor] could not determine file size.");
-		fclose (file);
-		// Query type
-		zstr_sendm (pipe, "remote_file_transfer_error");
-		zstr_sendm (pipe, peerid);
-		zstr_sendm (pipe, uid);
-		zstr_sendm (pipe, success);
-		zstr_send (pipe, error);
-
-		int rc;
-		rc = zsock_wait (pipe);
-		if (rc == 123){
-			printf("[server_actor] Received signal from pipe. Cleaning up %s.\n", zsock_endpoint(router));
-		} else {
-			printf("[server_actor] Received wrong signal from pipe. Cleaning up %s anyway.\n", zsock_endpoint(router));
-		}
-		goto cleanup;
-	}
-
-    // Inform caller our endpoint
-	zstr_send (pipe, zsock_endpoint(router));
-	char file_size_str[20];
-	sprintf(file_size_str, "%zu", file_size);
-	zstr_send (pipe, file_size_str);
-
-    while (!zsys_interrupted) {
-        void *which = zpoller_wait (poller, 1);
-        ///TODO: replace hardcoded timeout
-        if (which == pipe) {
-            zmsg_t *msg = zmsg_recv (which);
-            if (!msg){
-            	success = strdup("false");
-				error = strdup("[server_actor] pipe interrupted");
-				fclose (file);
-				// Query type
-				zstr_sendm (pipe, "remote_file_transfer_error");
-				zstr_sendm (pipe, peerid);
-				zstr_sendm (pipe, uid);
-				zstr_sendm (pipe, success);
-				zstr_send (pipe, error);
-
-				int rc;
-				rc = zsock_wait (pipe);
-				if (rc == 123){
-					printf("[server_actor] Received signal from pipe. Cleaning up %s.\n", zsock_endpoint(router));
-				} else {
-					printf("[server_actor] Received wrong signal from pipe. Cleaning up %s anyway.\n", zsock_endpoint(router));
-				}
-				goto cleanup;
-            }
-
-            char *command = zmsg_popstr (msg);
-            if (streq (command, "$TERM")){
-            	printf("[server_actor] Received term signal.\n");
-            	success = strdup("false");
-            	error = strdup("[server_actor] Received $TERM signal.");
-				fclose (file);
-				goto cleanup;
-            }
-            zmsg_destroy (&msg);
-        } else if (which == router) {
-        	// reset timeout timer
-        	com_time = zclock_mono ();
-
-            //  First frame in each message is the sender identity
-            zframe_t *identity = zframe_recv (router);
-            if (!identity){
-            	success = strdup("false");
-            	error = strdup("[server_actor] router interrupted");
-            	fclose (file);
-            	// Query type
-				zstr_sendm (pipe, "remote_file_transfer_error");
-				zstr_sendm (pipe, peerid);
-				zstr_sendm (pipe, uid);
-				zstr_sendm (pipe, success);
-				zstr_send (pipe, error);
-
-				int rc;
-				rc = zsock_wait (pipe);
-				if (rc == 123){
-					printf("[server_actor] Received signal from pipe. Cleaning up %s.\n", zsock_endpoint(router));
-				} else {
-					printf("[server_actor] Received wrong signal from pipe. Cleaning up %s anyway.\n", zsock_endpoint(router));
-				}
-                goto cleanup;             //  Shutting down, quit
-            }
-            //zframe_print(identity,"identity frame: ");
-            
-            //  Second frame is "fetch" command
-            char *command = zstr_recv (router);
-            assert (streq (command, "fetch"));
-            printf("[server_actor] Received fetch.\n");
-            zstr_free(&command);
-
-            //  Third frame is chunk offset in file
-            char *offset_str = zstr_recv (router);
-            assert (offset_str);
-            size_t offset = atoi (offset_str);
-            if (offset > file_size){
-            	printf("[server_actor] Offset larger than file_size. Ignoring fetch request\n");
-            } else {
-				printf("[server_actor] Offset %zu in file_size %zu.\n",offset, file_size);
-				zstr_free(&offset_str);
-
-				//  Fourth frame is maximum chunk size
-				char *chunksz_str = zstr_recv (router);
-				assert (chunksz_str);
-				size_t chunksz = atoi (chunksz_str);
-				printf("[server_actor] chunk size %zu.\n",chunksz);
-				zstr_free(&chunksz_str);
-
-				//  Read chunk of data from file
-				fseek (file, offset, SEEK_SET);
-				byte *data = malloc (chunksz);
-				assert (data);
-
-				//  Send resulting chunk to client
-				size_t size = fread (data, 1, chunksz, file);
-				zframe_t *chunk = zframe_new (data, size);
-				//  zframe_send destroys the frames automatically
-				printf("[server_actor] Serving chunk\n");
-				//zframe_print(identity,"identity frame: ");
-				zframe_send (&identity, router, ZFRAME_MORE);
-				zframe_send (&chunk, router, 0);
-				free(data);
-            }
-        }
-        // check for timeout
-		int64_t curr_time = zclock_mono ();
-		if (curr_time > 0) {
-			if (curr_time - com_time > (1000 * timeout)) {
-				///TODO: test
-				printf("[client_actor] timeout!\n");
-				success = strdup("false");
-				error = strdup("[server_actor] Timeout");
-				fclose (file);
-				// Query type
-				zstr_sendm (pipe, "remote_file_transfer_error");
-				zstr_sendm (pipe, peerid);
-				zstr_sendm (pipe, uid);
-				zstr_sendm (pipe, success);
-				zstr_send (pipe, error);
-				int rc;
-				rc = zsock_wait (pipe);
-				if (rc == 123){
-					printf("[server_actor] Received signal from pipe. Cleaning up %s.\n", zsock_endpoint(router));
-				} else {
-					printf("[server_actor] Received wrong signal from pipe. Cleaning up %s anyway.\n", zsock_endpoint(router));
-				}
-				goto cleanup;
-			}
-		} else {
-			printf ("[client_actor] could not get current time\n");
-		}
-    }
-    printf("Finished serving %s on %s\n", filename, zsock_endpoint(router));
-    success = strdup("true");
-    error = strdup("");
-    fclose (file);
-cleanup:
-    zstr_free(&uri);
-    zstr_free(&filename);
-    zstr_free(&timeout_str);
-    zstr_free(&uid);
-    zstr_free(&peerid);
-    zstr_free(&success);
-    zstr_free(&error);
-
-    zpoller_destroy(&poller);
-    zsock_destroy(&router);
-}
+#define PUSH_SPAN  40   // max. chunks requested by a single push request
+
+// Delta transfer: a client that already has an older version of a file sends
+// weak (rolling) and strong checksums of its blocks; the server answers with a
+// map of the new file telling which ranges can be copied from the old version.
+#define DELTA_MIN_BLOCK   2048
+#define DELTA_STRONG_SIZE 20                        // SHA-1
+#define DELTA_SIG_SIZE    (4 + DELTA_STRONG_SIZE)   // weak + strong checksum
+#define DELTA_RECORD_SIZE 24                        // new offset, length, old offset
+#define DELTA_LITERAL     UINT64_MAX                // old offset of ranges that must be fetched
+
+void delta_put_u64 (byte *dst, uint64_t value);
+uint64_t delta_get_u64 (const byte *src);
+uint32_t delta_weak (const byte *data, size_t len, uint32_t *a_p, uint32_t *b_p);
+void delta_strong (const byte *data, size_t len, byte *strong);
+size_t delta_block_size (off_t size);
+zframe_t * delta_signatures (int fd, off_t size, size_t block);
+
+// Index of the block checksums of an old version: a chained hash table on the
+// weak checksum, so looking up the window at every byte costs O(1).
+typedef struct _delta_index_t {
+	uint32_t *weak;     // weak checksum of every block
+	uint32_t *next;     // next block in the same bucket, DELTA_NONE at the end
+	uint32_t *buckets;  // first block of every bucket, DELTA_NONE if empty
+	uint32_t mask;      // number of buckets - 1
+} delta_index_t;
+
+#define DELTA_NONE        UINT32_MAX
+#define DELTA_READ_SIZE   (1 << 20)   // bytes read at once while mapping
+#define DELTA_PROGRESS    500         // msec between progress reports while mapping
+
+// Called while a map is computed, so the client knows the server is still at it.
+typedef void (delta_progress_fn) (void *arg, off_t pos);
+
+uint32_t delta_bucket (const delta_index_t *self, uint32_t weak);
+void delta_index_init (delta_index_t *self, const byte *sigs, size_t nbr_sigs);
+void delta_index_clear (delta_index_t *self);
+void delta_map_add (byte **map, size_t *map_size, uint64_t new_offset, uint64_t length, uint64_t old_offset);
+zframe_t * delta_map (int fd, off_t size, size_t block, zframe_t *signatures, delta_progress_fn *progress, void *arg);
+
+int file_write_atomic (const char *path, const void *data, size_t size);
+
+// A range of the file a client_actor still has to fetch.
+typedef struct _file_range_t {
+	off_t offset;
+	size_t size;
+	int64_t ts_requested; // zclock_usecs when it was requested from a source
+} file_range_t;
+
+file_range_t * file_range_new (off_t offset, size_t size);
+void file_ranges_add (zlist_t *ranges, off_t offset, off_t size);
+void file_ranges_purge (zlist_t *ranges);
+
+// A peer serving (a copy of) the file that is being fetched by a client_actor.
+// Several sources can serve the same query; every source gets its own dealer
+// and its own window of chunks in transit.
+typedef struct _transfer_source_t {
+	char *peerid;
+	char *endpoint;
+	zsock_t *dealer;
+	zlist_t *inflight;  // ranges (file_range_t*) requested from this source
+	size_t window;      // max. number of chunks in transit from this source
+	size_t bytes;       // bytes received from this source
+	int64_t ts_added;   // time the source was added
+	int64_t ts_last;    // time the last chunk was received from this source
+	bool compress;      // source may send compressed chunks
+	bool push;          // source streams chunks within the credit instead of answering fetches
+	size_t received;    // chunks received from this source
+	size_t credit;      // chunks this source may have pushed in total
+} transfer_source_t;
+
+transfer_source_t * transfer_source_new (const char *peerid, const char *endpoint);
+void transfer_source_destroy (transfer_source_t **self_p);
+double transfer_source_rate (transfer_source_t *self);
+void transfer_sources_rebalance (zlist_t *sources);
+void transfer_source_requeue (transfer_source_t *self, zlist_t *pending);
+void transfer_source_push (transfer_source_t *self, const char *uid, zlist_t *pending);
+off_t file_ranges_contiguous (zlist_t *pending, zlist_t *sources, off_t size);
+off_t delta_apply (zframe_t *map, int old_fd, off_t old_size, int new_fd, off_t new_size, zlist_t *pending);
+void client_actor (zsock_t *pipe, void *args);
+
+// A file of a batch fetched by a batch_client_actor
+typedef struct _batch_file_t {
+	char *uid;          // uid under which the server serves the file (uid of the query/number)
+	char *target;       // path the file is stored at
+	char *partial;      // file being written, renamed to target when complete
+	int fd;
+	off_t size;
+	off_t received;
+	zlist_t *pending;   // ranges (file_range_t*) still to be requested
+	zlist_t *inflight;  // ranges requested from the server
+	json_t *result;     // entry of the file in the report of the batch
+} batch_file_t;
+
+void batch_file_destroy (batch_file_t **self_p);
+void batch_result (json_t *result, const char *target, bool success, const char *error);
+bool batch_name_valid (const char *name);
+int batch_make_dirs (const char *path);
+
+//  The batch client fetches the files of a batch query into a target directory
+//  in a single session with the file server: the server opens a few files of the
+//  batch at a time and announces them, and the chunks of all announced files are
+//  requested over one dealer, up to PIPELINE chunks in transit.
+
+void batch_client_actor (zsock_t *pipe, void *args);
+
+//  The file server serves the files of all remote queries through a single
+//  router socket. Clients fetch chunks by query UID; the reads are done by a
+//  pool of worker threads, and transfers of the same file share one open handle.
+
+// Jobs of the file server workers. A worker asks for its next job with
+// ["ready"] once it is done, so a chunk read never waits behind a delta or a
+// directory listing that another worker happens to be busy with.
+typedef struct _file_jobs_t {
+	zsock_t *router;    // workers connect with a DEALER
+	zlist_t *idle;      // zframe_t* identities of workers waiting for a job
+	zlist_t *queue;     // zmsg_t* jobs waiting for a worker
+} file_jobs_t;
+
+void file_jobs_dispatch (file_jobs_t *self);
+void file_jobs_send (file_jobs_t *self, zmsg_t **job_p);
+void file_jobs_ready (file_jobs_t *self);
+void file_jobs_clear (file_jobs_t *self);
+
+// A file opened by the file server, shared by all transfers serving it.
+typedef struct _served_file_t {
+	char *path;
+	int fd;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	int refs;       // transfers and chunk reads using this file
+	bool detached;  // file changed on disk, no longer handed out to new transfers
+} served_file_t;
+
+// A reply of a transfer waiting in the file shaper
+typedef struct _queued_reply_t {
+	zmsg_t *reply;
+	int64_t ts_queued; // usec, only set while transfer_chunk_send is traced
+} queued_reply_t;
+
+// A transfer served by the file server, i.e. a query_remote_file of a remote peer.
+typedef struct _served_transfer_t {
+	char *uid;
+	char *peerid;
+	served_file_t *file;
+	int64_t com_time; // time of last fetch request
+	zlist_t *ready;   // replies (queued_reply_t*) waiting for bandwidth
+	double weight;    // share of the bandwidth relative to other transfers
+	double vtime;     // bytes sent divided by weight; lowest is served next
+	zframe_t *push_identity; // client chunks are pushed to, NULL if it fetches them
+	zlist_t *push_ranges;    // chunks (file_range_t*) still to be pushed
+	char *push_codec;        // codec the client accepts for pushed chunks
+	size_t push_sent;        // chunks pushed so far
+	size_t push_credit;      // chunks the client allows to be pushed in total
+	zlist_t *batch;          // files (served_batch_file_t*) of a batch not opened yet, NULL if no batch
+	size_t batch_count;      // files of a batch
+	size_t batch_next;       // number of the next file of a batch to be opened
+	size_t batch_open;       // files of a batch being served at the moment
+	zframe_t *client;        // client of a batch
+	char *session;           // uid of the batch a file belongs to, NULL if not part of a batch
+	char *name;              // path of a file of a batch relative to the requested directory
+} served_transfer_t;
+
+// A file of a batch, listed by a worker
+typedef struct _served_batch_file_t {
+	char *path;
+	char *name;
+} served_batch_file_t;
+
+// Token bucket shared by all transfers of the file server
+typedef struct _file_shaper_t {
+	int64_t rate;       // bytes per second, 0 if unlimited
+	double tokens;      // bytes that may be sent now; negative after a large chunk
+	int64_t ts_refill;  // time the bucket was last refilled
+	double vclock;      // virtual time of the last reply sent
+} file_shaper_t;
+
+served_file_t * served_file_adopt (zhash_t *files, const char *path, int fd, const struct stat *st);
+void served_file_release (zhash_t *files, served_file_t **self_p);
+served_transfer_t * served_transfer_new (const char *uid, const char *peerid, double weight, double vclock);
+void served_transfer_end (zhash_t *transfers, zhash_t *files, served_transfer_t *self);
+void served_transfer_fetch (served_transfer_t *self, file_jobs_t *jobs, zframe_t **identity_p, const char *offset, const char *size, const char *codec);
+void served_transfer_push (served_transfer_t *self, file_jobs_t *jobs);
+
+#define BATCH_OPEN 4    // files of a batch served at once
+
+void served_batch_open (served_transfer_t *self, zhash_t *transfers, file_jobs_t *jobs, const char *inline_size);
+served_transfer_t * served_batch_close (zhash_t *transfers, zhash_t *files, served_transfer_t *file);
+void batch_list (zmsg_t *reply, const char *path, const char *name, bool recursive, const char *pattern, off_t *total, int depth);
+void file_shaper_queue (file_shaper_t *self, served_transfer_t *transfer, zmsg_t **reply_p);
+void file_shaper_send (file_shaper_t *self, zhash_t *transfers, zsock_t *router);
+int64_t file_shaper_deadline (file_shaper_t *self, zhash_t *transfers);
+
+//  Sends ["delta_progress"][position] for the job whose result is being
+//  built while a delta map is computed, so the client keeps waiting.
+
+typedef struct _delta_progress_t {
+	zsock_t *results;
+	zmsg_t *result;     // [identity][served_file_t*][uid] of the job
+} delta_progress_t;
+
+void file_server_delta_progress (void *arg, off_t pos);
+
+void file_server_actor (zsock_t *pipe, void *args);
 
 ///////////////////////////////////////////////////
 // helper functions
 
-json_t * load_config_file(char* file) {
-	/**
-	 * loads the config file
-	 *
-	 * @param char* giving the path and filename to be loaded. Must point to a JSON file.
-	 *
-	 * @return jansson encoded json_t* (new reference) containing the content of the file as json object
-	 */
-    json_error_t error;
-    json_t * root;
-    root = json_load_file(file, JSON_ENSURE_ASCII, &error);
-    if(!root) {
-    	printf("Error parsing JSON file! file: %s, line %d: %s\n", error.source, error.line, error.text);
-    	return NULL;
-    }
-    char* dump =  json_dumps(root, JSON_ENCODE_ANY);
-    printf("[%s] config file: %s\n", json_string_value(json_object_get(root, "short-name")), dump);
-    free(dump);
-    return root;
-}
-
-char* encode_msg(char* metamodel, char* model, const char* type, json_t* payload) {
-	/**
-	 * encodes a Sherpa msg in its proper form
-	 *
-	 * @param char* to metamodel
-	 * @param char* to model
-	 * @param char* to msg type
-	 * @param jansson encoded json_t* to payload
-	 *
-	 * @return returns a char* that can be sent by zyre (user must free it afterwards)
-	 */
-	json_t *msg;
-	msg = json_object();
-	json_object_set_new(msg, "metamodel", json_string(metamodel));
-	json_object_set_new(msg, "model", json_string(model));
-	json_object_set_new(msg, "type", json_string(type));
-	json_object_set(msg, "payload", payload);
-	char *ret = json_dumps(msg, JSON_ENCODE_ANY);
-	json_decref(msg);
-	return ret;
-}
-
-int decode_json(char* message, json_msg_t *result) {
-	/**
-	 * decodes a received msg to json_msg types
-	 *
-	 * @param received msg as char*
-	 * @param json_msg_t* at which the result is stored
-	 *
-	 * @return returns 0 if successful and -1 if an error occurred
-	 */
-    json_t *root;
-    json_error_t error;
-    root = json_loads(message, 0, &error);
-
-    if(!root) {
-    	printf("Error parsing JSON string! line %d: %s\n", error.line, error.text);
-    	return -1;
-    }
-    if (json_object_get(root, "metamodel")) {
-    	result->metamodel = strdup(json_string_value(json_object_get(root, "metamodel")));
-    } else {
-    	printf("Error parsing JSON string! Does not conform to msg model. No metamodel specified.\n");
-    	return -1;
-    }
-    if (json_object_get(root, "model")) {
-		result->model = strdup(json_string_value(json_object_get(root, "model")));
-	} else {
-		printf("Error parsing JSON string! Does not conform to msg model. No model specified.\n");
-		return -1;
-	}
-    if (json_object_get(root, "type")) {
-		result->type = strdup(json_string_value(json_object_get(root, "type")));
-	} else {
-		printf("Error parsing JSON string! Does not conform to msg model.\n");
-		return -1;
-	}
-    if (json_object_get(root, "payload")) {
-    	result->payload = json_dumps(json_object_get(root, "payload"), JSON_ENCODE_ANY);
-	} else {
-		printf("Error parsing JSON string! Does not conform to msg model. No payload specified.\n");
-		return -1;
-	}
-    json_decref(root);
-    return 0;
-}
+char* encode_msg(char* metamodel, char* model, const char* type, json_t* payload);
+int decode_json_content(char* message, json_msg_t *result, bool content);
+int decode_json(char* message, json_msg_t *result);
+json_t * message_payload(json_msg_t *msg, json_error_t *error);
+void event_decode (compressor_t *compressor, arena_t *arena, zmsg_t *msg);
+void event_discard (zmsg_t **msg_p);
+json_msg_t * event_pop_decoded (zmsg_t *msg);
+
+//  A decoder decompresses and parses the msgs of the peers assigned to it and
+//  hands them back to the main loop, which owns all mediator state. The main
+//  loop keeps less than DECODER_INFLIGHT events in the decoders, fewer than
+//  the pipes to them and the decoded socket hold, so no side ever blocks.
+#define DECODER_INFLIGHT 256
+
+void decoder_actor (zsock_t *pipe, void *args);
+
 #endif
@@ -0,0 +1,69 @@
+#ifndef SHERPA_COMM_MEDIATOR_H
+#define SHERPA_COMM_MEDIATOR_H
+
+// Public API of the mediator library (libsherpa_comm_mediator).
+//
+// A mediator either runs on the thread that calls mediator_run, like the
+// sherpa_comm_mediator executable does, or on a background thread:
+//
+//   zactor_t *mediator = zactor_new (mediator_actor, load_config_file ("donkey.json"));
+//   ...
+//   zactor_destroy (&mediator);
+//
+// Components linked into the same process can bypass the local zyre network:
+// mediator_client_new connects to the mediator with the given short-name over
+// an inproc socket. Msgs submitted on it are handled as if they were shouted
+// on the local network, and every msg the mediator whispers to the component,
+// or shouts to all local components, can be received on it.
+
+#include <czmq.h>
+#include <jansson.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library is built with -fvisibility=hidden; only the functions below
+// are exported
+#if defined (__GNUC__) && __GNUC__ >= 4
+#define MEDIATOR_EXPORT __attribute__ ((visibility ("default")))
+#else
+#define MEDIATOR_EXPORT
+#endif
+
+typedef struct _mediator_t mediator_t;
+
+// loads a configuration file, see doc/msg.md
+MEDIATOR_EXPORT json_t * load_config_file (char* file);
+
+// lets jansson parse received msgs in scratch memory that is released as a
+// whole. This replaces the allocator of jansson for the whole process, so
+// call it once before any json_t is created, and not at all if another part
+// of the process sets its own with json_set_alloc_funcs
+MEDIATOR_EXPORT void mediator_use_arena (void);
+
+// creates a mediator, which takes ownership of the configuration
+MEDIATOR_EXPORT mediator_t * mediator_new (json_t *config);
+MEDIATOR_EXPORT void mediator_destroy (mediator_t **self_p);
+
+// runs the event loop until the process is interrupted
+MEDIATOR_EXPORT int mediator_run (mediator_t *self);
+
+// zactor running a mediator; args is the json_t* configuration, owned by the mediator
+MEDIATOR_EXPORT void mediator_actor (zsock_t *pipe, void *args);
+
+// signal handler that makes every mediator of the process dump its trace of
+// the last msgs to its trace_file, waking up idle ones; e.g. install it for
+// SIGUSR1
+MEDIATOR_EXPORT void mediator_trace_signal (int signum);
+
+// in-process path for components in the same process as the mediator
+MEDIATOR_EXPORT zsock_t * mediator_client_new (const char *shortname);
+MEDIATOR_EXPORT int mediator_submit (zsock_t *client, const char *msg);
+MEDIATOR_EXPORT char * mediator_receive (zsock_t *client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
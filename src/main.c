@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sherpa_comm_mediator.h>
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+      printf("usage: %s <config file>\n", argv[0]);
+      return -1;
+    }
+    mediator_use_arena();
+    // load configuration file
+    json_t * config = load_config_file(argv[1]);
+    if (config == NULL) {
+      return -1;
+    }
+    mediator_t *self = mediator_new(config);
+    if (!self) {
+      printf("could not create mediator\n");
+      return -1;
+    }
+    printf("mediator initialised!\n");
+
+    // kill -USR1 dumps the trace of the last msgs, see trace_file in doc/msg.md
+    struct sigaction action;
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = mediator_trace_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGUSR1, &action, NULL);
+
+    int rc = mediator_run(self);
+    mediator_destroy (&self);
+
+    //  @end
+    printf ("SHUTDOWN\n");
+    return rc;
+}
@@ -0,0 +1,683 @@
+#include <mediator.h>
+
+// Creation and destruction of a mediator, its outbox records, queries and
+// the deadlines of its event loop
+
+void send_msg_request_destroy (mediator_t *mediator, send_msg_request_t **self_p) {
+	/**
+	 * returns an outbox entry and its recipients to their pools
+	 *
+	 * @param mediator_t* owning the pools
+	 * @param send_msg_request_t** to the entry, unlinked from the outbox
+	 */
+	assert (self_p);
+	if (*self_p) {
+		send_msg_request_t *self = *self_p;
+		recipient_t *rec = self->recipients;
+		while (rec != NULL) {
+			recipient_t *next = rec->next;
+			intern_release (mediator->ids, rec->id);
+			pool_free (mediator->recipient_pool, rec);
+			rec = next;
+		}
+		intern_release (mediator->ids, self->uid);
+		intern_release (mediator->ids, self->local_requester);
+		free (self->payload_type);
+		free (self->msg);
+		zframe_destroy (&self->compressed);
+		pool_free (mediator->send_msg_pool, self);
+		*self_p = NULL;
+	}
+}
+
+void filter_list_item_destroy (mediator_t *mediator, filter_list_item_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		filter_list_item_t *self = *self_p;
+		intern_release (mediator->ids, self->sender);
+		intern_release (mediator->ids, self->msg_UID);
+		pool_free (mediator->filter_pool, self);
+		*self_p = NULL;
+	}
+}
+
+distribution_t * distribution_new (const char *uid, const char *requester, const char *target, size_t fanout) {
+	distribution_t *self = (distribution_t *) zmalloc (sizeof (distribution_t));
+	assert (self);
+	self->uid = strdup (uid);
+	self->requester = strdup (requester);
+	self->target = strdup (target);
+	self->sources = zlist_new ();
+	zlist_autofree (self->sources);
+	self->waiting = zlist_new ();
+	zlist_autofree (self->waiting);
+	self->running = zhash_new ();
+	zhash_autofree (self->running);
+	// the results are collected over many events, not in the arena of one
+	arena_t *arena = arena_suspend ();
+	self->confirmed = json_array ();
+	self->failed = json_array ();
+	arena_begin (arena);
+	self->fanout = fanout > 0 ? fanout : 1;
+	return self;
+}
+
+void distribution_destroy (distribution_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		distribution_t *self = *self_p;
+		zlist_destroy (&self->sources);
+		zlist_destroy (&self->waiting);
+		zhash_destroy (&self->running);
+		json_decref (self->confirmed);
+		json_decref (self->failed);
+		free (self->uid);
+		free (self->requester);
+		free (self->target);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+void mediator_destroy (mediator_t **self_p) {
+    assert (self_p);
+    if(*self_p) {
+        mediator_t *self = *self_p;
+        size_t i;
+        for (i = 0; i < self->nbr_decoders; i++)
+            zactor_destroy (&self->decoders[i]);
+        free (self->decoders);
+        // events the decoders handed back that were never handled
+        while (self->decoded && (zsock_events (self->decoded) & ZMQ_POLLIN)) {
+            zmsg_t *msg = zmsg_recv (self->decoded);
+            if (!msg)
+                break;
+            event_discard (&msg);
+        }
+        zsock_destroy (&self->decoded);
+        arena_destroy (&self->arena);
+        zsock_destroy (&self->inproc);
+        zhash_destroy (&self->inproc_clients);
+        zyre_destroy (&self->local);
+        zyre_destroy (&self->remote);
+        zactor_destroy (&self->file_server);
+        free (self->file_server_endpoint);
+        file_cache_destroy (&self->file_cache);
+        compressor_destroy (&self->compressor);
+        zhash_destroy (&self->peer_codecs);
+        zhash_destroy (&self->peer_addresses);
+        while (self->send_msgs != NULL) {
+            send_msg_request_t *next = self->send_msgs->next;
+            send_msg_request_destroy (self, &self->send_msgs);
+            self->send_msgs = next;
+        }
+        while (self->filter_list != NULL) {
+            filter_list_item_t *next = self->filter_list->next;
+            filter_list_item_destroy (self, &self->filter_list);
+            self->filter_list = next;
+        }
+	if (self->local_queries) {
+		query_t *q = (query_t *) zhash_first (self->local_queries);
+		while (q != NULL) {
+			zactor_destroy (&q->loop);
+			query_destroy (&q);
+			q = (query_t *) zhash_next (self->local_queries);
+		}
+	}
+	if (self->remote_queries) {
+		query_t *q = (query_t *) zhash_first (self->remote_queries);
+		while (q != NULL) {
+			query_destroy (&q);
+			q = (query_t *) zhash_next (self->remote_queries);
+		}
+	}
+	zhash_destroy (&self->local_queries);
+	zhash_destroy (&self->remote_queries);
+	zhash_destroy (&self->query_actors);
+	zlist_destroy (&self->transfer_queue);
+	if (self->distributions) {
+		distribution_t *d = (distribution_t *) zhash_first (self->distributions);
+		while (d != NULL) {
+			distribution_destroy (&d);
+			d = (distribution_t *) zhash_next (self->distributions);
+		}
+	}
+	zhash_destroy (&self->distributions);
+	// every record has been returned by now, anything else is a leak
+	if (self->send_msg_pool && self->send_msg_pool->live > 0)
+		printf("[%s] %zu send msg requests were not returned to their pool\n", self->shortname, self->send_msg_pool->live);
+	if (self->recipient_pool && self->recipient_pool->live > 0)
+		printf("[%s] %zu recipients were not returned to their pool\n", self->shortname, self->recipient_pool->live);
+	if (self->filter_pool && self->filter_pool->live > 0)
+		printf("[%s] %zu filter list items were not returned to their pool\n", self->shortname, self->filter_pool->live);
+	if (self->query_pool && self->query_pool->live > 0)
+		printf("[%s] %zu queries were not returned to their pool\n", self->shortname, self->query_pool->live);
+	pool_destroy (&self->send_msg_pool);
+	pool_destroy (&self->recipient_pool);
+	pool_destroy (&self->filter_pool);
+	pool_destroy (&self->query_pool);
+	if (self->ids && self->ids->size > 0)
+		printf("[%s] %zu interned ids were not released\n", self->shortname, self->ids->size);
+	intern_table_destroy (&self->ids);
+	stats_page_destroy (&self->stats_page);
+	recorder_destroy (&self->recorder);
+	free (self->trace_file);
+	free (self->distribution_dir);
+        zpoller_destroy (&self->poller);
+        json_decref(self->config);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+mediator_t * mediator_new (json_t *config) {
+    mediator_t *self = (mediator_t *) zmalloc (sizeof (mediator_t));
+    if (!self)
+        return NULL;
+    
+    int major, minor, patch;
+    zyre_version (&major, &minor, &patch);
+    if (major != ZYRE_VERSION_MAJOR)
+        return NULL;
+    if (minor != ZYRE_VERSION_MINOR)
+        return NULL;
+    if (patch != ZYRE_VERSION_PATCH)
+        return NULL;
+    self->config = config;
+    self->arena = arena_new ();
+    //init pools of the records of send msg requests, filtered msgs and queries
+    self->send_msg_pool = pool_new (sizeof (send_msg_request_t), 64);
+    self->outbox_deadline = -1;
+    self->filter_deadline = -1;
+    self->recipient_pool = pool_new (sizeof (recipient_t), 256);
+    self->filter_pool = pool_new (sizeof (filter_list_item_t), 256);
+    self->query_pool = pool_new (sizeof (query_t), 64);
+    self->ids = intern_table_new ();
+    if (!self->send_msg_pool || !self->recipient_pool || !self->filter_pool || !self->query_pool || !self->ids) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+
+
+    //init indexes of remote and local queries
+    self->remote_queries = zhash_new();
+    self->local_queries = zhash_new();
+    self->query_actors = zhash_new();
+    if (!self->remote_queries || !self->local_queries || !self->query_actors) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+
+    //init queue for local queries waiting for a transfer slot
+    self->transfer_queue = zlist_new();
+    self->distributions = zhash_new();
+    if (!self->transfer_queue || !self->distributions) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    self->max_file_transfers = 4;
+    if (json_is_integer(json_object_get(config, "max_file_transfers")) && json_integer_value(json_object_get(config, "max_file_transfers")) > 0)
+        self->max_file_transfers = json_integer_value(json_object_get(config, "max_file_transfers"));
+
+    if (json_object_get(config, "short-name")) {
+    	self->shortname = json_string_value(json_object_get(config, "short-name"));
+	} else {
+		printf("No shortname given.\n");
+		return NULL;
+	}
+
+    // stats are published to shared memory unless the configuration disables it
+    self->stats_page = stats_page_new (self->shortname, !json_is_false(json_object_get(config, "stats_page")));
+    if (!self->stats_page) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    self->stats = &self->stats_page->stats;
+
+    // the flight recorder keeps the last trace_records events, dumped to trace_file
+    int trace_records = 4096;
+    if (json_is_integer(json_object_get(config, "trace_records")))
+    	trace_records = json_integer_value(json_object_get(config, "trace_records"));
+    if (trace_records > 0) {
+    	self->recorder = recorder_new (trace_records);
+    	if (!self->recorder) {
+    		mediator_destroy (&self);
+    		return NULL;
+    	}
+    }
+    if (json_is_string(json_object_get(config, "trace_file")))
+    	self->trace_file = strdup (json_string_value(json_object_get(config, "trace_file")));
+    else {
+    	self->trace_file = (char *) malloc (strlen (self->shortname) + 48);
+    	assert (self->trace_file);
+    	sprintf (self->trace_file, "/tmp/sherpa_comm_mediator-%s.trace", self->shortname);
+    }
+
+    if (json_object_get(config, "verbose")) {
+    	self->verbose = json_is_true(json_object_get(config, "verbose"));
+	} else {
+		self->verbose = false;
+	}
+
+ 
+    //  Create two nodes: 
+    //  - local gossip node for backend
+    //  - remote udp node for frontend
+    self->local = zyre_new (self->shortname);
+    if (!self->local) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    self->remote = zyre_new (self->shortname);
+    if (!self->remote) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+
+    printf("[%s] my remote UUID: %s\n", self->shortname, zyre_uuid(self->remote));
+    json_object_set_new(config, "peerid", json_string(zyre_uuid(self->remote)));
+    /* config is a JSON object */
+    // set values for config file as zyre header.
+    const char *key;
+    json_t *value;
+    json_object_foreach(config, key, value) {
+        /* block of code that uses key and value */
+    	const char *header_value;
+    	if(json_is_string(value)) {
+    		header_value = json_string_value(value);
+    	} else {
+    		header_value = json_dumps(value, JSON_ENCODE_ANY);
+    	}
+    	//printf(header_value);printf("\n");
+    	zyre_set_header(self->local, key, "%s", header_value);
+        zyre_set_header(self->remote, key, "%s", header_value);
+//        free(header_value);
+    }
+
+    // advertise the codecs we accept, so peers can compress what they send us
+    self->compressor = compressor_new (config);
+    char *codecs = compressor_codecs (self->compressor);
+    if (codecs)
+        zyre_set_header(self->remote, "codecs", "%s", codecs);
+    zstr_free (&codecs);
+    self->peer_codecs = zhash_new ();
+    if (!self->peer_codecs) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    zhash_autofree (self->peer_codecs);
+    self->peer_addresses = zhash_new ();
+    if (!self->peer_addresses) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    zhash_autofree (self->peer_addresses);
+ 
+    if(self->verbose) {
+    	zyre_set_verbose (self->local);
+        zyre_set_verbose (self->remote);
+    }
+    
+    int rc;
+    if(!json_is_null(json_object_get(config, "gossip_endpoint"))) {
+    	if(!json_is_null(json_object_get(config, "local_endpoint"))) {
+    		rc = zyre_set_endpoint (self->local, "%s", json_string_value(json_object_get(config, "local_endpoint")));
+    		assert (rc == 0);
+    	} else {
+    		printf("[%s] WARNING: no local gossip endpoint is set! \n", self->shortname);
+    	}
+
+    	//  Set up gossip network for this node
+    	zyre_gossip_bind (self->local, "%s", json_string_value(json_object_get(config, "gossip_endpoint")));
+    	printf("[%s] using gossip with gossip hub '%s' \n", self->shortname,json_string_value(json_object_get(config, "gossip_endpoint")));
+    } else {
+    	printf("[%s] WARNING: no local gossip communication is set! \n", self->shortname);
+    }
+    rc = zyre_start (self->local);
+    assert (rc == 0);
+    rc = zyre_start (self->remote);
+    assert (rc == 0);
+    assert (strneq (zyre_uuid (self->local), zyre_uuid (self->remote)));
+    
+	const char* localgroup;
+	if(!json_is_null(json_object_get(config, "local-network"))) {
+		localgroup = json_string_value(json_object_get(config, "local-network"));
+	} else {
+		printf("[%s] WARNING: no name for local network set! Will use default name [local].",self->shortname);
+		localgroup = "local";
+	}
+	const char* remotegroup;
+	if(!json_is_null(json_object_get(config, "remote-network"))) {
+		remotegroup = json_string_value(json_object_get(config, "remote-network"));
+	} else {
+		printf("[%s] WARNING: no name for local network set! Will use default name [local].",self->shortname);
+		remotegroup = "remote";
+	}
+    zyre_join (self->local, localgroup);
+    zyre_join (self->remote, remotegroup);
+    self->localgroup = localgroup;
+    self->remotegroup = remotegroup;
+    //  Give time for them to interconnect
+    zclock_sleep (100);
+    if (self->verbose) {
+        zyre_dump (self->local);
+        zyre_dump (self->remote);
+    }
+
+    zpoller_t *poller =  zpoller_new (zyre_socket(self->local), zyre_socket(self->remote), NULL);
+    self->poller = poller;
+
+    // components linked into the same process talk to the mediator without zyre
+    self->inproc_clients = zhash_new ();
+    if (!self->inproc_clients) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    char *inproc_endpoint = (char *) malloc (strlen ("@inproc://sherpa_comm_mediator-") + strlen (self->shortname) + 1);
+    assert (inproc_endpoint);
+    sprintf (inproc_endpoint, "@inproc://sherpa_comm_mediator-%s", self->shortname);
+    self->inproc = zsock_new_router (inproc_endpoint);
+    free (inproc_endpoint);
+    if (self->inproc)
+        zpoller_add(self->poller, self->inproc);
+    else
+        printf("[%s] WARNING: in-process endpoint could not be bound.\n", self->shortname);
+
+    // received msgs are decoded (decompressed and parsed) by a pool of threads;
+    // all msgs of a peer go to the same decoder, so they stay in order
+    int nbr_decoders = 2;
+    if (json_is_integer(json_object_get(config, "decoder_threads")))
+    	nbr_decoders = json_integer_value(json_object_get(config, "decoder_threads"));
+    if (nbr_decoders > 0) {
+    	char decoded_endpoint[64];
+    	sprintf (decoded_endpoint, "inproc://mediator-%p-decoded", (void *) self);
+    	self->decoded = zsock_new_pull (decoded_endpoint);
+    	if (!self->decoded) {
+    		mediator_destroy (&self);
+    		return NULL;
+    	}
+    	char connect_decoded[66];
+    	sprintf (connect_decoded, ">%s", decoded_endpoint);
+    	char *config_str = json_dumps(config, JSON_COMPACT);
+    	const char *decoder_args[2];
+    	decoder_args[0] = connect_decoded;
+    	decoder_args[1] = config_str;
+    	self->decoders = (zactor_t **) zmalloc (nbr_decoders * sizeof (zactor_t *));
+    	assert (self->decoders);
+    	for (self->nbr_decoders = 0; self->nbr_decoders < (size_t) nbr_decoders; self->nbr_decoders++) {
+    		self->decoders[self->nbr_decoders] = zactor_new (decoder_actor, decoder_args);
+    		assert (self->decoders[self->nbr_decoders]);
+    	}
+    	free(config_str);
+    	zpoller_add(self->poller, self->decoded);
+    }
+
+//    zhash_t *hash = zhash_new ();
+//    if (!hash) {
+//        mediator_destroy (&self);
+//        return NULL;
+//    }
+
+    if (json_object_get(config, "actor_timeout")) {
+		self->actor_timeout = json_string_value(json_object_get(config, "actor_timeout"));
+	} else {
+		printf("No actor_timeout given, will use default 5s.\n");
+		self->actor_timeout = strdup("5");
+	}
+
+    // start the file server that serves all remote file queries
+    char workers[12];
+    if (json_is_integer(json_object_get(config, "file_server_workers"))) {
+    	sprintf(workers, "%d", (int) json_integer_value(json_object_get(config, "file_server_workers")));
+    } else {
+    	strcpy(workers, "2");
+    }
+    // outgoing bandwidth of all file transfers, 0 for unlimited
+    char bandwidth[24];
+    if (json_is_integer(json_object_get(config, "file_bandwidth"))) {
+    	sprintf(bandwidth, "%ld", (long) json_integer_value(json_object_get(config, "file_bandwidth")));
+    } else {
+    	strcpy(bandwidth, "0");
+    }
+    // files up to this size are sent along with the reply to a remote file query
+    char inline_size[24];
+    if (json_is_integer(json_object_get(config, "inline_file_size"))) {
+    	sprintf(inline_size, "%ld", (long) json_integer_value(json_object_get(config, "inline_file_size")));
+    } else {
+    	strcpy(inline_size, "65536");
+    }
+    const char *file_server_args[5];
+    file_server_args[0] = self->actor_timeout;
+    file_server_args[1] = workers;
+    if (json_is_string(json_object_get(config, "file_server_endpoint"))) {
+    	file_server_args[2] = json_string_value(json_object_get(config, "file_server_endpoint"));
+    } else {
+    	file_server_args[2] = "tcp://*:*";
+    }
+    file_server_args[3] = bandwidth;
+    file_server_args[4] = inline_size;
+    self->file_server = zactor_new (file_server_actor, file_server_args);
+    if (!self->file_server) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    // a wildcard host is advertised as it is; requesters fill in the address
+    // they reach us at, see peer_endpoint
+    self->file_server_endpoint = zstr_recv (self->file_server);
+    if (!self->file_server_endpoint) {
+        mediator_destroy (&self);
+        return NULL;
+    }
+    zpoller_add(self->poller, self->file_server);
+    printf("[%s] file server endpoint: %s\n", self->shortname, self->file_server_endpoint);
+
+    if (json_is_string(json_object_get(config, "file_cache_dir"))) {
+    	off_t limit = 100 * 1024 * 1024;
+    	if (json_is_integer(json_object_get(config, "file_cache_size")))
+    		limit = json_integer_value(json_object_get(config, "file_cache_size"));
+    	self->file_cache = file_cache_new(json_string_value(json_object_get(config, "file_cache_dir")), limit);
+    	if (!self->file_cache)
+    		printf("[%s] WARNING: file cache could not be opened, caching is disabled.\n", self->shortname);
+    }
+    // remote peers may only write files below this directory
+    if (json_is_string(json_object_get(config, "distribution_dir")))
+    	self->distribution_dir = strdup(json_string_value(json_object_get(config, "distribution_dir")));
+
+    return self;
+}
+
+void query_destroy (query_t **self_p) {
+        assert (self_p);
+        if(*self_p) {
+            query_t *self = *self_p;
+            zlist_destroy (&self->sources);
+            zhash_destroy (&self->endpoints);
+            message_destroy (&self->msg);
+            free (self->cache_key);
+            free (self->file_size);
+            free (self->uid);
+            free (self->requester);
+            pool_free (self->pool, self);
+            *self_p = NULL;
+        }
+}
+
+void message_destroy (json_msg_t **self_p) {
+        assert (self_p);
+        if(*self_p) {
+        	free((*self_p)->metamodel);
+        	free((*self_p)->model);
+        	free((*self_p)->payload);
+        	free((*self_p)->type);
+        	json_decref((*self_p)->content);
+            free (*self_p);
+            *self_p = NULL;
+        }
+}
+
+query_t * query_new (pool_t *pool, char *uid, char *requester, json_msg_t *msg, zactor_t *loop) {
+        /**
+         * @param pool_t* to take the query from
+         * @param char* uid, owned by the query
+         * @param char* peerid of the requester, owned by the query
+         * @param json_msg_t* msg of the query, owned by the query
+         * @param zactor_t* client actor, may be NULL
+         */
+        query_t *self = (query_t *) pool_alloc (pool);
+        if (!self)
+            return NULL;
+        self->pool = pool;
+        self->uid = uid;
+        self->requester = requester;
+        self->msg = msg;
+        self->loop = loop;
+        self->sources = zlist_new ();
+        if (!self->sources) {
+            pool_free (pool, self);
+            return NULL;
+        }
+        zlist_autofree (self->sources);
+        self->endpoints = zhash_new ();
+        if (!self->endpoints) {
+            zlist_destroy (&self->sources);
+            pool_free (pool, self);
+            return NULL;
+        }
+        zhash_autofree (self->endpoints);
+        self->candidates = 1;
+        
+        return self;
+}
+
+void query_actor_key (void *actor, char *key) {
+	sprintf (key, "%p", actor);
+}
+
+int mediator_add_query (mediator_t *self, query_t *query) {
+	/**
+	 * indexes a new query by its UID
+	 * @param mediator_t* to the mediator data
+	 * @param query_t* to the new query
+	 * @return 0 on success, -1 if a query with the same UID is already known
+	 */
+	zhash_t *index = query->role == QUERY_LOCAL ? self->local_queries : self->remote_queries;
+	return zhash_insert (index, query->uid, query);
+}
+
+query_t * mediator_lookup_query (mediator_t *self, query_role_t role, const char *uid) {
+	zhash_t *index = role == QUERY_LOCAL ? self->local_queries : self->remote_queries;
+	return uid ? (query_t *) zhash_lookup (index, uid) : NULL;
+}
+
+query_t * mediator_lookup_actor (mediator_t *self, void *actor) {
+	char key[32];
+	query_actor_key (actor, key);
+	return (query_t *) zhash_lookup (self->query_actors, key);
+}
+
+void mediator_set_query_actor (mediator_t *self, query_t *query, zactor_t *actor) {
+	/**
+	 * records the client actor that fetches the file of a local query
+	 * @param mediator_t* to the mediator data
+	 * @param query_t* to the local query
+	 * @param zactor_t* to the client actor, now owned by the query
+	 */
+	char key[32];
+	query_actor_key (actor, key);
+	query->loop = actor;
+	query->state = QUERY_RUNNING;
+	query->started = zclock_mono ();
+	zhash_insert (self->query_actors, key, query);
+	// Required to know when transfer is completed
+	zpoller_add (self->poller, actor);
+}
+
+void mediator_remove_query (mediator_t *self, query_t **query_p) {
+	/**
+	 * removes a query from all indexes, stops its client actor and destroys it
+	 * @param mediator_t* to the mediator data
+	 * @param query_t** to the query
+	 */
+	assert (query_p);
+	query_t *query = *query_p;
+	if (!query)
+		return;
+	if (query->loop) {
+		char key[32];
+		query_actor_key (query->loop, key);
+		zpoller_remove (self->poller, query->loop);
+		zhash_delete (self->query_actors, key);
+		zactor_destroy (&query->loop);
+	}
+	if (query->state == QUERY_QUEUED)
+		zlist_remove (self->transfer_queue, query);
+	if (mediator_lookup_query (self, query->role, query->uid) == query)
+		zhash_delete (query->role == QUERY_LOCAL ? self->local_queries : self->remote_queries, query->uid);
+	query_destroy (query_p);
+}
+
+int query_compare_priority (void *item1, void *item2) {
+	// sorts the transfer queue by priority, then by arrival
+	query_t *q1 = (query_t *) item1;
+	query_t *q2 = (query_t *) item2;
+	if (q1->priority != q2->priority)
+		return q1->priority < q2->priority ? 1 : -1;
+	return q1->seq > q2->seq ? 1 : (q1->seq < q2->seq ? -1 : 0);
+}
+
+int64_t deadline_earliest (int64_t deadline, int64_t other) {
+	/**
+	 * @param int64_t deadline, -1 for none
+	 * @param int64_t other deadline, -1 for none
+	 *
+	 * @return the earlier of both deadlines, -1 if neither is set
+	 */
+	if (deadline < 0)
+		return other;
+	if (other < 0)
+		return deadline;
+	return other < deadline ? other : deadline;
+}
+
+int deadline_timeout (int64_t deadline, int64_t now) {
+	/**
+	 * converts a deadline to a timeout for zpoller_wait
+	 *
+	 * @param int64_t deadline in msec, -1 for none
+	 * @param int64_t current time in msec, in the same clock as the deadline
+	 *
+	 * @return msec until the deadline, 0 if it passed and -1 to block if there is none
+	 */
+	if (deadline < 0)
+		return -1;
+	if (deadline <= now)
+		return 0;
+	return deadline - now > INT_MAX ? INT_MAX : (int) (deadline - now);
+}
+
+int64_t send_msg_deadline (mediator_t *self, send_msg_request_t *msg) {
+	/**
+	 * @param mediator_t* to the mediator data strucure
+	 * @param send_msg_request_t* msg waiting for acknowledgements
+	 *
+	 * @return msec when the msg has to be resent or times out
+	 */
+	// these timestamps are taken with zclock_usecs; the checks in
+	// process_send_msgs are strict, hence the extra msec
+	int64_t resend = json_integer_value(json_object_get(self->config, "resend_interval"));
+	return deadline_earliest(msg->ts_added / 1000 + msg->timeout + 1, msg->ts_last_sent / 1000 + resend + 1);
+}
+
+int mediator_poll_timeout (mediator_t *self) {
+	/**
+	 * computes how long the main loop may block: until the next msg has to be
+	 * resent or times out, or the next entry of the filter list expires. Both
+	 * deadlines are kept up to date as msgs are added and processed.
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 *
+	 * @return timeout in msec for zpoller_wait, -1 if there is nothing to do
+	 */
+	int64_t deadline = deadline_earliest(self->outbox_deadline, self->filter_deadline);
+	return deadline_timeout(deadline, zclock_usecs() / 1000);
+}
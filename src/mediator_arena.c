@@ -0,0 +1,144 @@
+#include <czmq.h>
+#include <jansson.h>
+#include <mediator.h>
+
+// Arenas for parsing received msgs, see arena_t in mediator.h
+
+// arena jansson allocates from on this thread, NULL to use the heap
+static __thread arena_t *arena_current = NULL;
+
+arena_t * arena_new (void) {
+	return (arena_t *) zmalloc (sizeof (arena_t));
+}
+
+void arena_reset (arena_t *self) {
+	/**
+	 * releases everything allocated from the arena; the first block is reused
+	 *
+	 * @param arena_t* to the arena
+	 */
+	while (self->blocks && self->blocks->next) {
+		arena_block_t *block = self->blocks;
+		self->blocks = block->next;
+		free (block);
+	}
+	if (self->blocks)
+		self->blocks->used = 0;
+}
+
+void arena_destroy (arena_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		arena_t *self = *self_p;
+		arena_reset (self);
+		free (self->blocks);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+void * arena_alloc (arena_t *self, size_t size) {
+	/**
+	 * @param arena_t* to the arena
+	 * @param size_t bytes to allocate
+	 *
+	 * @return pointer valid until the arena is reset
+	 */
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	arena_block_t *block = self->blocks;
+	if (!block || block->size - block->used < size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		// the header is padded, so the data stays aligned
+		size_t header = (sizeof (arena_block_t) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+		block = (arena_block_t *) malloc (header + block_size);
+		if (!block)
+			return NULL;
+		block->data = (byte *) block + header;
+		block->size = block_size;
+		block->used = 0;
+		block->next = self->blocks;
+		self->blocks = block;
+	}
+	void *ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
+
+bool arena_owns (arena_t *self, void *ptr) {
+	arena_block_t *block = self->blocks;
+	while (block != NULL) {
+		if ((byte *) ptr >= block->data && (byte *) ptr < block->data + block->size)
+			return true;
+		block = block->next;
+	}
+	return false;
+}
+
+void arena_begin (arena_t *self) {
+	/**
+	 * lets jansson allocate from the arena on this thread until arena_end
+	 *
+	 * @param arena_t* to the arena, may be NULL to keep using the heap
+	 */
+	arena_current = self;
+}
+
+arena_t * arena_suspend (void) {
+	/**
+	 * switches jansson back to the heap without releasing the arena, e.g. for
+	 * results that outlive it; arena_begin resumes it
+	 *
+	 * @return arena_t* that was active on this thread, or NULL
+	 */
+	arena_t *arena = arena_current;
+	arena_current = NULL;
+	return arena;
+}
+
+char * arena_escape (char *str) {
+	/**
+	 * moves a string jansson allocated, e.g. by json_dumps, out of the arena
+	 * active on this thread, so it outlives the arena and may be freed with free
+	 *
+	 * @param char* string, may be NULL
+	 *
+	 * @return char* on the heap, str itself if it is not in the arena
+	 */
+	if (!str || !arena_current || !arena_owns (arena_current, str))
+		return str;
+	return strdup (str);
+}
+
+void arena_end (arena_t *self) {
+	/**
+	 * switches jansson back to the heap and releases the arena
+	 *
+	 * @param arena_t* to the arena passed to arena_begin, may be NULL
+	 */
+	arena_current = NULL;
+	if (self)
+		arena_reset (self);
+}
+
+static void * arena_json_malloc (size_t size) {
+	if (arena_current)
+		return arena_alloc (arena_current, size);
+	return malloc (size);
+}
+
+void arena_json_free (void *ptr) {
+	// memory of the arena is released by arena_end
+	if (arena_current && arena_owns (arena_current, ptr))
+		return;
+	free (ptr);
+}
+
+void mediator_use_arena (void) {
+	/**
+	 * installs the jansson hooks that allocate from the arena active on the
+	 * calling thread. They replace the allocator of jansson for the whole
+	 * process; threads without an active arena, and objects created before,
+	 * keep using malloc and free.
+	 */
+	json_set_alloc_funcs (arena_json_malloc, arena_json_free);
+}
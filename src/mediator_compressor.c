@@ -0,0 +1,306 @@
+#include <mediator.h>
+
+// Compression of remote traffic, see compressor_t in mediator.h
+
+#ifdef HAVE_ZSTD
+zframe_t * compress_frame (ZSTD_CCtx *cctx, const ZSTD_CDict *cdict, int level, const void *data, size_t size) {
+	/**
+	 * compresses data into a new frame
+	 * @param ZSTD_CCtx* compression context of the calling thread
+	 * @param ZSTD_CDict* dictionary to compress with, or NULL
+	 * @param int compression level, if no dictionary is given
+	 * @param void* data to compress
+	 * @param size_t size of the data
+	 * @return zframe_t* with the compressed data, or NULL if it does not compress well enough
+	 */
+	size_t bound = ZSTD_compressBound (size);
+	byte *buffer = (byte *) malloc (bound);
+	if (!buffer)
+		return NULL;
+	size_t rc;
+	if (cdict)
+		rc = ZSTD_compress_usingCDict (cctx, buffer, bound, data, size, cdict);
+	else
+		rc = ZSTD_compressCCtx (cctx, buffer, bound, data, size, level);
+	zframe_t *frame = NULL;
+	if (!ZSTD_isError (rc) && rc < size - size * COMPRESSION_MIN_GAIN / 100)
+		frame = zframe_new (buffer, rc);
+	free (buffer);
+	return frame;
+}
+
+zframe_t * decompress_frame (ZSTD_DCtx *dctx, zhash_t *ddicts, const void *data, size_t size, size_t limit) {
+	/**
+	 * decompresses data compressed by compress_frame
+	 * @param ZSTD_DCtx* decompression context of the calling thread
+	 * @param zhash_t* dictionaries by id, or NULL
+	 * @param void* compressed data
+	 * @param size_t size of the compressed data
+	 * @param size_t maximum size of the decompressed data
+	 * @return zframe_t* with the original data, or NULL on error
+	 */
+	unsigned long long content = ZSTD_getFrameContentSize (data, size);
+	if (content == ZSTD_CONTENTSIZE_ERROR || content == ZSTD_CONTENTSIZE_UNKNOWN || content > limit)
+		return NULL;
+	const ZSTD_DDict *ddict = NULL;
+	unsigned dict_id = ZSTD_getDictID_fromFrame (data, size);
+	if (dict_id) {
+		char key[12];
+		sprintf (key, "%u", dict_id);
+		ddict = ddicts ? (const ZSTD_DDict *) zhash_lookup (ddicts, key) : NULL;
+		if (!ddict)
+			return NULL;
+	}
+	zframe_t *frame = zframe_new (NULL, content);
+	size_t rc;
+	if (ddict)
+		rc = ZSTD_decompress_usingDDict (dctx, zframe_data (frame), content, data, size, ddict);
+	else
+		rc = ZSTD_decompressDCtx (dctx, zframe_data (frame), content, data, size);
+	if (ZSTD_isError (rc) || rc != content) {
+		zframe_destroy (&frame);
+		return NULL;
+	}
+	return frame;
+}
+
+static void compressor_cdict_free (void *data) {
+	ZSTD_freeCDict ((ZSTD_CDict *) data);
+}
+
+static void compressor_ddict_free (void *data) {
+	ZSTD_freeDDict ((ZSTD_DDict *) data);
+}
+
+int compressor_load_dictionary (compressor_t *self, const char *payload_type, const char *path) {
+	/**
+	 * loads a dictionary trained for the payloads of one type
+	 * @param compressor_t* compressor
+	 * @param char* payload_type the dictionary is used for
+	 * @param char* path of the dictionary, as created by `zstd --train`
+	 * @return 0 on success, -1 on error
+	 */
+	FILE *file = fopen (path, "rb");
+	if (!file)
+		return -1;
+	byte *buffer = NULL;
+	long size = -1;
+	if (fseek (file, 0, SEEK_END) == 0 && (size = ftell (file)) > 0 && fseek (file, 0, SEEK_SET) == 0) {
+		buffer = (byte *) malloc (size);
+		if (buffer && fread (buffer, 1, size, file) != (size_t) size)
+			size = -1;
+	}
+	fclose (file);
+	unsigned dict_id = buffer && size > 0 ? ZSTD_getDictID_fromDict (buffer, size) : 0;
+	if (!dict_id) {
+		free (buffer);
+		return -1;
+	}
+	ZSTD_CDict *cdict = ZSTD_createCDict (buffer, size, self->level);
+	ZSTD_DDict *ddict = ZSTD_createDDict (buffer, size);
+	free (buffer);
+	if (!cdict || !ddict) {
+		ZSTD_freeCDict (cdict);
+		ZSTD_freeDDict (ddict);
+		return -1;
+	}
+	char key[12];
+	sprintf (key, "%u", dict_id);
+	zhash_update (self->cdicts, payload_type, cdict);
+	zhash_freefn (self->cdicts, payload_type, compressor_cdict_free);
+	zhash_update (self->ddicts, key, ddict);
+	zhash_freefn (self->ddicts, key, compressor_ddict_free);
+	zhash_update (self->dict_ids, payload_type, key);
+	return 0;
+}
+
+#endif
+void compressor_destroy (compressor_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		compressor_t *self = *self_p;
+#ifdef HAVE_ZSTD
+		ZSTD_freeCCtx (self->cctx);
+		ZSTD_freeDCtx (self->dctx);
+		zhash_destroy (&self->cdicts);
+		zhash_destroy (&self->ddicts);
+		zhash_destroy (&self->dict_ids);
+#endif
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+compressor_t * compressor_new (json_t *config) {
+	/**
+	 * creates the compressor for remote traffic
+	 * @param json_t* mediator configuration
+	 * @return compressor_t*, or NULL if compression is disabled or not available
+	 */
+#ifdef HAVE_ZSTD
+	if (json_is_false (json_object_get (config, "compression")))
+		return NULL;
+	compressor_t *self = (compressor_t *) zmalloc (sizeof (compressor_t));
+	if (!self)
+		return NULL;
+	self->threshold = COMPRESSION_THRESHOLD;
+	if (json_is_integer (json_object_get (config, "compression_threshold")))
+		self->threshold = json_integer_value (json_object_get (config, "compression_threshold"));
+	self->level = COMPRESSION_LEVEL;
+	if (json_is_integer (json_object_get (config, "compression_level")))
+		self->level = json_integer_value (json_object_get (config, "compression_level"));
+	self->cctx = ZSTD_createCCtx ();
+	self->dctx = ZSTD_createDCtx ();
+	self->cdicts = zhash_new ();
+	self->ddicts = zhash_new ();
+	self->dict_ids = zhash_new ();
+	if (!self->cctx || !self->dctx || !self->cdicts || !self->ddicts || !self->dict_ids) {
+		compressor_destroy (&self);
+		return NULL;
+	}
+	zhash_autofree (self->dict_ids);
+	const char *payload_type;
+	json_t *path;
+	json_object_foreach (json_object_get (config, "compression_dictionaries"), payload_type, path) {
+		if (!json_is_string (path) || compressor_load_dictionary (self, payload_type, json_string_value (path)) != 0)
+			printf ("WARNING: could not load compression dictionary for %s.\n", payload_type);
+	}
+	return self;
+#else
+	(void) config;
+	return NULL;
+#endif
+}
+
+char * compressor_codecs (compressor_t *self) {
+	/**
+	 * @param compressor_t* compressor, may be NULL
+	 * @return char* value of the "codecs" header: the codec and the ids of the
+	 *         loaded dictionaries, to be freed by the caller; NULL if compression is disabled
+	 */
+#ifdef HAVE_ZSTD
+	if (!self)
+		return NULL;
+	char *codecs = strdup (COMPRESSION_CODEC);
+	assert (codecs);
+	zhash_first (self->ddicts);
+	const char *key = zhash_cursor (self->ddicts);
+	while (key) {
+		char *extended = (char *) realloc (codecs, strlen (codecs) + strlen (key) + 2);
+		assert (extended);
+		strcat (extended, " ");
+		strcat (extended, key);
+		codecs = extended;
+		zhash_next (self->ddicts);
+		key = zhash_cursor (self->ddicts);
+	}
+	return codecs;
+#else
+	(void) self;
+	return NULL;
+#endif
+}
+
+bool codecs_accept (const char *codecs, unsigned dict_id) {
+	/**
+	 * @param char* "codecs" header of a peer, may be NULL
+	 * @param unsigned id of a dictionary the peer has to list, 0 for none
+	 * @return true if the peer decompresses what we compress with this dictionary
+	 */
+	size_t len = strlen (COMPRESSION_CODEC);
+	if (!codecs || strncmp (codecs, COMPRESSION_CODEC, len) != 0 || (codecs[len] != '\0' && codecs[len] != ' '))
+		return false;
+	const char *it = codecs + len;
+	while (dict_id != 0 && *it == ' ') {
+		char *end;
+		unsigned long id = strtoul (it + 1, &end, 10);
+		if (end == it + 1)
+			return false;
+		if (id == dict_id)
+			return true;
+		it = end;
+	}
+	return dict_id == 0;
+}
+
+unsigned compressor_dictionary (compressor_t *self, const char *payload_type) {
+	/**
+	 * @param compressor_t* compressor, may be NULL
+	 * @param char* payload_type of a message, may be NULL
+	 * @return unsigned id of the dictionary for this payload_type, 0 if there is none
+	 */
+#ifdef HAVE_ZSTD
+	const char *key = self && payload_type ? (const char *) zhash_lookup (self->dict_ids, payload_type) : NULL;
+	return key ? (unsigned) strtoul (key, NULL, 10) : 0;
+#else
+	(void) self;
+	(void) payload_type;
+	return 0;
+#endif
+}
+
+unsigned compressor_frame_dictionary (zframe_t *frame) {
+	/**
+	 * @param zframe_t* message packed by compressor_pack
+	 * @return unsigned id of the dictionary it was compressed with, 0 if none
+	 */
+#ifdef HAVE_ZSTD
+	return ZSTD_getDictID_fromFrame (zframe_data (frame), zframe_size (frame));
+#else
+	(void) frame;
+	return 0;
+#endif
+}
+
+zframe_t * compressor_pack (compressor_t *self, const char *payload_type, const char *msg, bool dictionary) {
+	/**
+	 * compresses an encoded message for remote peers
+	 * @param compressor_t* compressor, may be NULL
+	 * @param char* payload_type of the message, selects the dictionary
+	 * @param char* encoded message
+	 * @param bool false to compress without the dictionary, because a receiver did not load it
+	 * @return zframe_t* with the compressed message, or NULL if it should be sent as it is
+	 */
+#ifdef HAVE_ZSTD
+	size_t size = strlen (msg);
+	if (!self || size < self->threshold)
+		return NULL;
+	const ZSTD_CDict *cdict = dictionary && payload_type ? (const ZSTD_CDict *) zhash_lookup (self->cdicts, payload_type) : NULL;
+	return compress_frame (self->cctx, cdict, self->level, msg, size);
+#else
+	(void) self;
+	(void) payload_type;
+	(void) msg;
+	(void) dictionary;
+	return NULL;
+#endif
+}
+
+char * compressor_unpack (compressor_t *self, const char *codec, zframe_t *data) {
+	/**
+	 * decompresses a message packed by compressor_pack
+	 * @param compressor_t* compressor, may be NULL
+	 * @param char* codec the message was compressed with
+	 * @param zframe_t* compressed message
+	 * @return char* with the decoded message, to be freed by the caller; NULL on error
+	 */
+#ifdef HAVE_ZSTD
+	if (!self || !codec || !data || !streq (codec, COMPRESSION_CODEC))
+		return NULL;
+	// zyre does not deliver messages larger than its own limits anyway
+	zframe_t *frame = decompress_frame (self->dctx, self->ddicts, zframe_data (data), zframe_size (data), 64 * 1024 * 1024);
+	if (!frame)
+		return NULL;
+	char *msg = (char *) malloc (zframe_size (frame) + 1);
+	assert (msg);
+	memcpy (msg, zframe_data (frame), zframe_size (frame));
+	msg [zframe_size (frame)] = 0;
+	zframe_destroy (&frame);
+	return msg;
+#else
+	(void) self;
+	(void) codec;
+	(void) data;
+	return NULL;
+#endif
+}
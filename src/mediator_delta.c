@@ -0,0 +1,319 @@
+#include <mediator.h>
+
+// Delta transfers of files a client already has an older version of
+
+void delta_put_u64 (byte *dst, uint64_t value) {
+	int i;
+	for (i = 0; i < 8; i++)
+		dst[i] = (byte) (value >> (56 - 8 * i));
+}
+
+uint64_t delta_get_u64 (const byte *src) {
+	uint64_t value = 0;
+	int i;
+	for (i = 0; i < 8; i++)
+		value = (value << 8) | src[i];
+	return value;
+}
+
+uint32_t delta_weak (const byte *data, size_t len, uint32_t *a_p, uint32_t *b_p) {
+	/**
+	 * computes the rolling checksum of a block (as used by rsync)
+	 *
+	 * @param byte* to the block
+	 * @param size_t length of the block
+	 * @param uint32_t* where the sum of the bytes is stored (for rolling)
+	 * @param uint32_t* where the weighted sum of the bytes is stored (for rolling)
+	 *
+	 * @return the weak checksum
+	 */
+	uint32_t a = 0;
+	uint32_t b = 0;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		a += data[i];
+		b += (uint32_t) (len - i) * data[i];
+	}
+	*a_p = a & 0xffff;
+	*b_p = b & 0xffff;
+	return *a_p | (*b_p << 16);
+}
+
+void delta_strong (const byte *data, size_t len, byte *strong) {
+	zdigest_t *digest = zdigest_new ();
+	assert (digest);
+	zdigest_update (digest, (byte *) data, len);
+	memcpy (strong, zdigest_data (digest), DELTA_STRONG_SIZE);
+	zdigest_destroy (&digest);
+}
+
+size_t delta_block_size (off_t size) {
+	/**
+	 * block size for delta transfers of a file, roughly the square root of its size
+	 */
+	size_t block = DELTA_MIN_BLOCK;
+	while ((off_t) block * (off_t) block < size && block < CHUNK_SIZE)
+		block *= 2;
+	return block;
+}
+
+zframe_t * delta_signatures (int fd, off_t size, size_t block) {
+	/**
+	 * computes the checksums of all full blocks of the old version of a file
+	 *
+	 * @param int file descriptor of the old version
+	 * @param off_t size of the old version
+	 * @param size_t block size
+	 *
+	 * @return frame with a weak and strong checksum per block or NULL if the file could not be read
+	 */
+	size_t nbr_blocks = size / block;
+	zframe_t *signatures = zframe_new (NULL, nbr_blocks * DELTA_SIG_SIZE);
+	byte *sig = zframe_data (signatures);
+	byte *data = (byte *) malloc (block);
+	assert (data);
+	size_t i;
+	for (i = 0; i < nbr_blocks; i++) {
+		if (pread (fd, data, block, (off_t) i * block) != (ssize_t) block) {
+			zframe_destroy (&signatures);
+			break;
+		}
+		uint32_t a, b;
+		uint32_t weak = delta_weak (data, block, &a, &b);
+		sig[0] = (byte) (weak >> 24);
+		sig[1] = (byte) (weak >> 16);
+		sig[2] = (byte) (weak >> 8);
+		sig[3] = (byte) weak;
+		delta_strong (data, block, sig + 4);
+		sig += DELTA_SIG_SIZE;
+	}
+	free (data);
+	return signatures;
+}
+
+uint32_t delta_bucket (const delta_index_t *self, uint32_t weak) {
+	// the low bits of the weak checksum alone are just the sum of the bytes
+	uint32_t hash = weak * 2654435761u;
+	return (hash ^ (hash >> 16)) & self->mask;
+}
+
+void delta_index_init (delta_index_t *self, const byte *sigs, size_t nbr_sigs) {
+	uint32_t nbr_buckets = 1;
+	while (nbr_buckets < 2 * nbr_sigs)
+		nbr_buckets <<= 1;
+	self->mask = nbr_buckets - 1;
+	self->weak = (uint32_t *) malloc ((nbr_sigs + 1) * sizeof (uint32_t));
+	self->next = (uint32_t *) malloc ((nbr_sigs + 1) * sizeof (uint32_t));
+	self->buckets = (uint32_t *) malloc (nbr_buckets * sizeof (uint32_t));
+	assert (self->weak && self->next && self->buckets);
+	memset (self->buckets, 0xff, nbr_buckets * sizeof (uint32_t));
+	// inserted back to front, so a bucket lists the blocks in file order
+	size_t i = nbr_sigs;
+	while (i-- > 0) {
+		const byte *sig = sigs + i * DELTA_SIG_SIZE;
+		self->weak[i] = ((uint32_t) sig[0] << 24) | ((uint32_t) sig[1] << 16) | ((uint32_t) sig[2] << 8) | sig[3];
+		uint32_t bucket = delta_bucket (self, self->weak[i]);
+		self->next[i] = self->buckets[bucket];
+		self->buckets[bucket] = (uint32_t) i;
+	}
+}
+
+void delta_index_clear (delta_index_t *self) {
+	free (self->weak);
+	free (self->next);
+	free (self->buckets);
+}
+
+void delta_map_add (byte **map, size_t *map_size, uint64_t new_offset, uint64_t length, uint64_t old_offset) {
+	// extend the previous record if this range continues it
+	if (*map_size > 0) {
+		byte *last = *map + *map_size - DELTA_RECORD_SIZE;
+		uint64_t last_length = delta_get_u64 (last + 8);
+		uint64_t last_old = delta_get_u64 (last + 16);
+		if (delta_get_u64 (last) + last_length == new_offset
+		&& ((old_offset == DELTA_LITERAL && last_old == DELTA_LITERAL)
+		 || (old_offset != DELTA_LITERAL && last_old != DELTA_LITERAL && last_old + last_length == old_offset))) {
+			delta_put_u64 (last + 8, last_length + length);
+			return;
+		}
+	}
+	*map = (byte *) realloc (*map, *map_size + DELTA_RECORD_SIZE);
+	assert (*map);
+	delta_put_u64 (*map + *map_size, new_offset);
+	delta_put_u64 (*map + *map_size + 8, length);
+	delta_put_u64 (*map + *map_size + 16, old_offset);
+	*map_size += DELTA_RECORD_SIZE;
+}
+
+zframe_t * delta_map (int fd, off_t size, size_t block, zframe_t *signatures, delta_progress_fn *progress, void *arg) {
+	/**
+	 * compares the current version of a file with the block checksums of an
+	 * old version and maps every range of the current version either to a range
+	 * of the old version or to a literal range that has to be transferred. The
+	 * file is read with pread, so it may be truncated meanwhile.
+	 *
+	 * @param int file descriptor of the current version
+	 * @param off_t size of the current version
+	 * @param size_t block size used for the checksums
+	 * @param zframe_t* checksums of the old version (see delta_signatures)
+	 * @param delta_progress_fn* called every DELTA_PROGRESS msec, may be NULL
+	 * @param void* argument of the progress function
+	 *
+	 * @return frame with the records of the map or NULL if the file could not be read
+	 */
+	size_t nbr_sigs = zframe_size (signatures) / DELTA_SIG_SIZE;
+	const byte *sigs = zframe_data (signatures);
+	if (nbr_sigs >= DELTA_NONE)
+		return NULL;
+	delta_index_t index;
+	delta_index_init (&index, sigs, nbr_sigs);
+
+	// window of the file: the block at pos and the byte in front of it
+	size_t capacity = block + DELTA_READ_SIZE;
+	byte *window = (byte *) malloc (capacity);
+	assert (window);
+	off_t window_start = 0;
+	size_t window_size = 0;
+	int64_t reported = zclock_mono ();
+	bool failed = false;
+
+	byte *map = NULL;
+	size_t map_size = 0;
+	off_t literal = 0;  // start of the range not matched yet
+	off_t pos = 0;
+	uint32_t a = 0, b = 0;
+	bool rolling = false;
+	while (nbr_sigs > 0 && pos + (off_t) block <= size) {
+		if (pos + (off_t) block > window_start + (off_t) window_size) {
+			// keep what is still needed and read the next part of the file
+			off_t keep = pos > 0 ? pos - 1 : 0;
+			if (keep > window_start + (off_t) window_size)
+				keep = window_start + window_size;
+			size_t kept = window_start + window_size - keep;
+			memmove (window, window + (keep - window_start), kept);
+			window_start = keep;
+			window_size = kept;
+			size_t wanted = capacity - window_size;
+			if ((off_t) wanted > size - (window_start + (off_t) window_size))
+				wanted = size - (window_start + window_size);
+			ssize_t rc = pread (fd, window + window_size, wanted, window_start + window_size);
+			if (rc != (ssize_t) wanted) {
+				failed = true;
+				break;
+			}
+			window_size += rc;
+			if (progress && zclock_mono () - reported >= DELTA_PROGRESS) {
+				progress (arg, pos);
+				reported = zclock_mono ();
+			}
+		}
+		const byte *data = window + (pos - window_start);
+		uint32_t weak;
+		if (rolling) {
+			// slide the window by one byte
+			byte out = data[-1];
+			byte in = data[block - 1];
+			a = (a - out + in) & 0xffff;
+			b = (b - (uint32_t) block * out + a) & 0xffff;
+			weak = a | (b << 16);
+		} else {
+			weak = delta_weak (data, block, &a, &b);
+		}
+		uint32_t match = index.buckets[delta_bucket (&index, weak)];
+		bool strong_done = false;
+		byte strong[DELTA_STRONG_SIZE];
+		while (match != DELTA_NONE) {
+			if (index.weak[match] == weak) {
+				if (!strong_done) {
+					delta_strong (data, block, strong);
+					strong_done = true;
+				}
+				if (memcmp (strong, sigs + (size_t) match * DELTA_SIG_SIZE + 4, DELTA_STRONG_SIZE) == 0)
+					break;
+			}
+			match = index.next[match];
+		}
+		if (match != DELTA_NONE) {
+			if (pos > literal)
+				delta_map_add (&map, &map_size, literal, pos - literal, DELTA_LITERAL);
+			delta_map_add (&map, &map_size, pos, block, (uint64_t) match * block);
+			pos += block;
+			literal = pos;
+			rolling = false;
+		} else {
+			pos++;
+			rolling = true;
+		}
+	}
+	free (window);
+	delta_index_clear (&index);
+	if (failed) {
+		free (map);
+		return NULL;
+	}
+	if (size > literal)
+		delta_map_add (&map, &map_size, literal, size - literal, DELTA_LITERAL);
+	zframe_t *frame = zframe_new (map, map_size);
+	free (map);
+	return frame;
+}
+
+off_t delta_apply (zframe_t *map, int old_fd, off_t old_size, int new_fd, off_t new_size, zlist_t *pending) {
+	/**
+	 * copies the ranges the new version of a file shares with the old version
+	 * and queues the other ranges for fetching
+	 *
+	 * @param zframe_t* map received from the server (see delta_map)
+	 * @param int file descriptor of the old version
+	 * @param off_t size of the old version
+	 * @param int file descriptor of the new version
+	 * @param off_t size of the new version
+	 * @param zlist_t* of file_range_t* to which the ranges to fetch are appended
+	 *
+	 * @return number of bytes copied from the old version or -1 if the map is invalid
+	 */
+	if (zframe_size (map) % DELTA_RECORD_SIZE != 0)
+		return -1;
+	off_t copied = 0;
+	off_t expected = 0;
+	byte *buffer = (byte *) malloc (CHUNK_SIZE);
+	assert (buffer);
+	const byte *record = zframe_data (map);
+	const byte *end = record + zframe_size (map);
+	for (; record < end; record += DELTA_RECORD_SIZE) {
+		uint64_t new_offset = delta_get_u64 (record);
+		uint64_t length = delta_get_u64 (record + 8);
+		uint64_t old_offset = delta_get_u64 (record + 16);
+		// ranges must cover the new version without gaps
+		if ((off_t) new_offset != expected || (off_t) (new_offset + length) > new_size) {
+			copied = -1;
+			break;
+		}
+		expected += length;
+		if (old_offset == DELTA_LITERAL) {
+			file_ranges_add (pending, new_offset, length);
+			continue;
+		}
+		if ((off_t) (old_offset + length) > old_size) {
+			copied = -1;
+			break;
+		}
+		uint64_t done = 0;
+		while (done < length) {
+			size_t size = (length - done > CHUNK_SIZE) ? CHUNK_SIZE : (size_t) (length - done);
+			if (pread (old_fd, buffer, size, old_offset + done) != (ssize_t) size
+			 || pwrite (new_fd, buffer, size, new_offset + done) != (ssize_t) size) {
+				copied = -1;
+				break;
+			}
+			done += size;
+		}
+		if (copied < 0)
+			break;
+		copied += length;
+	}
+	if (copied >= 0 && expected != new_size)
+		copied = -1;
+	free (buffer);
+	return copied;
+}
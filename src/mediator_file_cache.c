@@ -0,0 +1,308 @@
+#include <mediator.h>
+
+// Cache of fetched files, see file_cache_t in mediator.h
+
+int64_t file_cache_mtime (const struct stat *st) {
+	return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int file_cache_entry_compare (void *item1, void *item2) {
+	file_cache_entry_t *entry1 = (file_cache_entry_t *) item1;
+	file_cache_entry_t *entry2 = (file_cache_entry_t *) item2;
+	return (entry1->used > entry2->used) - (entry1->used < entry2->used);
+}
+
+void file_cache_entry_destroy (file_cache_entry_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		free ((*self_p)->name);
+		free (*self_p);
+		*self_p = NULL;
+	}
+}
+
+static void file_cache_entry_free (void *data) {
+	file_cache_entry_t *entry = (file_cache_entry_t *) data;
+	file_cache_entry_destroy (&entry);
+}
+
+void file_cache_destroy (file_cache_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		file_cache_t *self = *self_p;
+		zhash_destroy (&self->entries);
+		free (self->dir);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+void file_cache_insert (file_cache_t *self, const char *name, off_t size, int64_t mtime, int64_t used) {
+	file_cache_entry_t *entry = (file_cache_entry_t *) zmalloc (sizeof (file_cache_entry_t));
+	assert (entry);
+	entry->name = strdup (name);
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->used = used;
+	zhash_update (self->entries, name, entry);
+	zhash_freefn (self->entries, name, file_cache_entry_free);
+	self->size += size;
+}
+
+void file_cache_remove (file_cache_t *self, file_cache_entry_t *entry, bool unlink_file) {
+	/**
+	 * @param file_cache_t* to the cache
+	 * @param file_cache_entry_t* to drop, freed
+	 * @param bool also remove the cached file
+	 */
+	if (unlink_file) {
+		char path[PATH_MAX];
+		snprintf (path, sizeof (path), "%s/%s", self->dir, entry->name);
+		unlink (path);
+	}
+	self->size -= entry->size;
+	char *name = strdup (entry->name);
+	zhash_delete (self->entries, name);
+	free (name);
+}
+
+void file_cache_evict (file_cache_t *self) {
+	/**
+	 * removes the least recently used files until the files only the cache
+	 * holds are within its limit. Files still linked at a target are kept:
+	 * removing them would free no space.
+	 *
+	 * @param file_cache_t* to the cache
+	 */
+	zlist_t *candidates = zlist_new ();
+	zlist_t *gone = zlist_new ();
+	off_t held = 0;
+	file_cache_entry_t *entry = (file_cache_entry_t *) zhash_first (self->entries);
+	while (entry != NULL) {
+		char path[PATH_MAX];
+		struct stat st;
+		snprintf (path, sizeof (path), "%s/%s", self->dir, entry->name);
+		if (stat (path, &st) != 0)
+			zlist_append (gone, entry);
+		else if (st.st_nlink == 1) {
+			held += entry->size;
+			zlist_append (candidates, entry);
+		}
+		entry = (file_cache_entry_t *) zhash_next (self->entries);
+	}
+	while ((entry = (file_cache_entry_t *) zlist_pop (gone)))
+		file_cache_remove (self, entry, false);
+	zlist_destroy (&gone);
+	zlist_sort (candidates, file_cache_entry_compare);
+	while (held > self->limit && zlist_size (candidates) > 0) {
+		entry = (file_cache_entry_t *) zlist_pop (candidates);
+		printf ("[file_cache] evicting %s (%ld bytes)\n", entry->name, (long) entry->size);
+		held -= entry->size;
+		file_cache_remove (self, entry, true);
+	}
+	zlist_destroy (&candidates);
+}
+
+file_cache_t * file_cache_new (const char *dir, off_t limit) {
+	/**
+	 * opens the cache directory, creating it if needed, and indexes the files already in it
+	 *
+	 * @param char* path of the cache directory
+	 * @param off_t max. total size of cached files in bytes
+	 *
+	 * @return file_cache_t* or NULL if the directory can not be used
+	 */
+	if (mkdir (dir, 0755) != 0 && errno != EEXIST) {
+		printf ("[file_cache] could not create cache directory %s. Errno: = %d\n", dir, errno);
+		return NULL;
+	}
+	DIR *handle = opendir (dir);
+	if (!handle) {
+		printf ("[file_cache] could not open cache directory %s. Errno: = %d\n", dir, errno);
+		return NULL;
+	}
+	file_cache_t *self = (file_cache_t *) zmalloc (sizeof (file_cache_t));
+	assert (self);
+	self->dir = strdup (dir);
+	self->limit = limit;
+	self->entries = zhash_new ();
+	assert (self->entries);
+	struct dirent *dirent;
+	while ((dirent = readdir (handle)) != NULL) {
+		char path[PATH_MAX];
+		struct stat st;
+		snprintf (path, sizeof (path), "%s/%s", dir, dirent->d_name);
+		if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+			continue;
+		// the access time is touched on every hit
+		file_cache_insert (self, dirent->d_name, st.st_size, file_cache_mtime (&st), (int64_t) st.st_atime * 1000);
+	}
+	closedir (handle);
+	file_cache_evict (self);
+	printf ("[file_cache] %zu files (%ld bytes) in %s\n", zhash_size (self->entries), (long) self->size, dir);
+	return self;
+}
+
+char * file_cache_key (const char *peerid, const char *path, const char *size, const char *mtime) {
+	/**
+	 * computes the name of the cache entry of a remote file
+	 *
+	 * @param char* peer serving the file
+	 * @param char* path of the file on that peer
+	 * @param char* size of the file as reported by that peer
+	 * @param char* modification time of the file as reported by that peer
+	 *
+	 * @return hex digest of the file's identity (user must free it)
+	 */
+	zdigest_t *digest = zdigest_new ();
+	assert (digest);
+	const char *parts[4] = {peerid, path, size, mtime};
+	int i;
+	for (i = 0; i < 4; i++) {
+		// include the terminating zero, so parts can not run into each other
+		zdigest_update (digest, (byte *) parts[i], strlen (parts[i]) + 1);
+	}
+	char *key = strdup (zdigest_string (digest));
+	zdigest_destroy (&digest);
+	return key;
+}
+
+int file_cache_copy (int in, int out) {
+	/**
+	 * @param int descriptor to read from, at its start
+	 * @param int descriptor to write to
+	 *
+	 * @return 0 if successful and -1 otherwise
+	 */
+	byte *buffer = (byte *) malloc (FILE_CACHE_COPY_SIZE);
+	assert (buffer);
+	off_t offset = 0;
+	ssize_t size;
+	while ((size = pread (in, buffer, FILE_CACHE_COPY_SIZE, offset)) > 0) {
+		ssize_t done = 0;
+		while (done < size) {
+			ssize_t rc = write (out, buffer + done, size - done);
+			if (rc < 0) {
+				free (buffer);
+				return -1;
+			}
+			done += rc;
+		}
+		offset += size;
+	}
+	free (buffer);
+	return size < 0 ? -1 : 0;
+}
+
+int file_cache_link (const char *src, const char *dst, bool share) {
+	/**
+	 * makes the content of src available at dst without copying if possible:
+	 * a reflink if the file system supports it, then a hard link if sharing the
+	 * inode is allowed, and a copy otherwise, e.g. across file systems
+	 *
+	 * @param char* existing file
+	 * @param char* new file; an existing file at this path is replaced
+	 * @param bool a hard link may be used
+	 *
+	 * @return 0 if successful and -1 otherwise
+	 */
+	if (unlink (dst) != 0 && errno != ENOENT)
+		return -1;
+	int in = open (src, O_RDONLY);
+	if (in < 0)
+		return -1;
+#ifdef FICLONE
+	int out = open (dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (out >= 0) {
+		int rc = ioctl (out, FICLONE, in);
+		close (out);
+		if (rc == 0) {
+			close (in);
+			return 0;
+		}
+		unlink (dst);
+	}
+#endif
+	if (share && link (src, dst) == 0) {
+		close (in);
+		return 0;
+	}
+	// EXDEV, EMLINK, EPERM on file systems without hard links, ...
+	int out_fd = open (dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	int rc = out_fd >= 0 ? file_cache_copy (in, out_fd) : -1;
+	if (out_fd >= 0 && close (out_fd) != 0)
+		rc = -1;
+	if (rc != 0 && out_fd >= 0)
+		unlink (dst);
+	close (in);
+	return rc;
+}
+
+int file_cache_fetch (file_cache_t *self, const char *key, const char *target) {
+	/**
+	 * provides a cached file at the target location
+	 *
+	 * @param file_cache_t* to the cache
+	 * @param char* key of the file (see file_cache_key)
+	 * @param char* path where the file is requested
+	 *
+	 * @return 0 on a cache hit and -1 otherwise
+	 */
+	file_cache_entry_t *entry = (file_cache_entry_t *) zhash_lookup (self->entries, key);
+	if (!entry)
+		return -1;
+	char path[PATH_MAX];
+	snprintf (path, sizeof (path), "%s/%s", self->dir, key);
+	struct stat st;
+	if (stat (path, &st) != 0 || st.st_size != entry->size || file_cache_mtime (&st) != entry->mtime) {
+		// changed through a target sharing its inode, or removed
+		printf ("[file_cache] dropping %s, it changed since it was stored\n", key);
+		file_cache_remove (self, entry, true);
+		return -1;
+	}
+	// a file still linked at another target is copied, so consumers of
+	// the same file do not share it with each other
+	if (file_cache_link (path, target, st.st_nlink == 1) != 0) {
+		printf ("[file_cache] could not provide %s at %s. Errno: = %d\n", path, target, errno);
+		return -1;
+	}
+	// most recently used now; the access time survives restarts, the
+	// modification time identifies the content
+	struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+	utimensat (AT_FDCWD, path, times, 0);
+	entry->used = zclock_time ();
+	printf ("[file_cache] hit %s for %s\n", key, target);
+	return 0;
+}
+
+int file_cache_store (file_cache_t *self, const char *key, const char *file) {
+	/**
+	 * adds a fetched file to the cache
+	 *
+	 * @param file_cache_t* to the cache
+	 * @param char* key of the file (see file_cache_key)
+	 * @param char* path of the fetched file
+	 *
+	 * @return 0 if successful and -1 otherwise
+	 */
+	struct stat st;
+	if (stat (file, &st) != 0 || st.st_size > self->limit)
+		return -1;
+	char path[PATH_MAX];
+	snprintf (path, sizeof (path), "%s/%s", self->dir, key);
+	file_cache_entry_t *entry = (file_cache_entry_t *) zhash_lookup (self->entries, key);
+	if (entry)
+		file_cache_remove (self, entry, false);
+	if (file_cache_link (file, path, true) != 0) {
+		printf ("[file_cache] could not add %s to cache. Errno: = %d\n", file, errno);
+		return -1;
+	}
+	if (stat (path, &st) != 0) {
+		unlink (path);
+		return -1;
+	}
+	file_cache_insert (self, key, st.st_size, file_cache_mtime (&st), zclock_time ());
+	printf ("[file_cache] stored %s as %s\n", file, key);
+	file_cache_evict (self);
+	return 0;
+}
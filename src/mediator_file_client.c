@@ -0,0 +1,966 @@
+#include <mediator.h>
+
+// Client side of file transfers: client_actor fetches a file, possibly from
+// several sources, batch_client_actor a batch of files
+
+int file_write_atomic (const char *path, const void *data, size_t size) {
+	/**
+	 * writes a file next to path (path.part) and renames it to path, so path
+	 * never holds a partial file
+	 *
+	 * @param char* path of the file
+	 * @param void* contents of the file
+	 * @param size_t size of the contents
+	 *
+	 * @return 0 if successful and -1 otherwise
+	 */
+	char *partial = (char *) malloc (strlen (path) + strlen (".part") + 1);
+	assert (partial);
+	sprintf (partial, "%s.part", path);
+	// never write through a link into the file cache
+	unlink (partial);
+	int fd = open (partial, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int rc = -1;
+	if (fd >= 0) {
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = write (fd, (const byte *) data + done, size - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		if (close (fd) == 0 && done == size && rename (partial, path) == 0)
+			rc = 0;
+	}
+	if (rc != 0) {
+		printf ("[file] could not write %s. Errno: = %d\n", path, errno);
+		unlink (partial);
+	}
+	free (partial);
+	return rc;
+}
+
+file_range_t * file_range_new (off_t offset, size_t size) {
+	file_range_t *self = (file_range_t *) zmalloc (sizeof (file_range_t));
+	assert (self);
+	self->offset = offset;
+	self->size = size;
+	return self;
+}
+
+void file_ranges_add (zlist_t *ranges, off_t offset, off_t size) {
+	/**
+	 * splits a range of a file in chunks that can be fetched one by one
+	 *
+	 * @param zlist_t* of file_range_t* to which the chunks are appended
+	 * @param off_t start of the range
+	 * @param off_t size of the range
+	 */
+	off_t end = offset + size;
+	while (offset < end) {
+		size_t chunk = (end - offset > CHUNK_SIZE) ? CHUNK_SIZE : (size_t) (end - offset);
+		zlist_append (ranges, file_range_new (offset, chunk));
+		offset += chunk;
+	}
+}
+
+void file_ranges_purge (zlist_t *ranges) {
+	file_range_t *range = (file_range_t *) zlist_pop(ranges);
+	while (range != NULL) {
+		free(range);
+		range = (file_range_t *) zlist_pop(ranges);
+	}
+}
+
+transfer_source_t * transfer_source_new (const char *peerid, const char *endpoint) {
+	transfer_source_t *self = (transfer_source_t *) zmalloc (sizeof (transfer_source_t));
+	if (!self)
+		return NULL;
+	self->dealer = zsock_new_dealer(endpoint);
+	if (!self->dealer) {
+		free (self);
+		return NULL;
+	}
+	self->peerid = strdup(peerid);
+	self->endpoint = strdup(endpoint);
+	self->inflight = zlist_new();
+	self->window = PIPELINE;
+	self->ts_added = zclock_mono();
+	self->ts_last = self->ts_added;
+	return self;
+}
+
+void transfer_source_destroy (transfer_source_t **self_p) {
+	assert (self_p);
+	if(*self_p) {
+		transfer_source_t *self = *self_p;
+		file_ranges_purge(self->inflight);
+		zlist_destroy(&self->inflight);
+		zsock_destroy(&self->dealer);
+		free(self->peerid);
+		free(self->endpoint);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+double transfer_source_rate (transfer_source_t *self) {
+	/**
+	 * average throughput of a source since it was added
+	 *
+	 * @param transfer_source_t* to the source
+	 *
+	 * @return bytes per msec
+	 */
+	int64_t elapsed = self->ts_last - self->ts_added;
+	return (double) self->bytes / (elapsed > 0 ? elapsed : 1);
+}
+
+void transfer_sources_rebalance (zlist_t *sources) {
+	/**
+	 * shrinks the window of slow sources relative to the fastest one, so chunks
+	 * are requested from whichever source delivers them fastest and a slow source
+	 * does not hold back the tail of the file
+	 *
+	 * @param zlist_t* of transfer_source_t*
+	 */
+	double best = 0;
+	transfer_source_t *src = (transfer_source_t *) zlist_first(sources);
+	while (src != NULL) {
+		if (transfer_source_rate(src) > best)
+			best = transfer_source_rate(src);
+		src = (transfer_source_t *) zlist_next(sources);
+	}
+	src = (transfer_source_t *) zlist_first(sources);
+	while (src != NULL) {
+		if (best > 0 && src->bytes > 0) {
+			src->window = (size_t) (PIPELINE * transfer_source_rate(src) / best);
+			if (src->window < 1)
+				src->window = 1;
+		}
+		src = (transfer_source_t *) zlist_next(sources);
+	}
+}
+
+void transfer_source_requeue (transfer_source_t *self, zlist_t *pending) {
+	/**
+	 * moves all chunks still in transit from a source to the pending list, so
+	 * they can be fetched from another source
+	 *
+	 * @param transfer_source_t* to the source that is dropped
+	 * @param zlist_t* of ranges that still need to be fetched
+	 */
+	file_range_t *range = (file_range_t *) zlist_pop(self->inflight);
+	while (range != NULL) {
+		zlist_append(pending, range);
+		range = (file_range_t *) zlist_pop(self->inflight);
+	}
+}
+
+void transfer_source_push (transfer_source_t *self, const char *uid, zlist_t *pending) {
+	/**
+	 * hands a source in push mode runs of contiguous chunks before it runs dry,
+	 * and extends its credit by a chunk for every chunk received. The credit is
+	 * cumulative, so the window follows transfer_sources_rebalance and a server
+	 * never has more than window chunks in transit.
+	 *
+	 * @param transfer_source_t* to the source
+	 * @param char* uid of the query
+	 * @param zlist_t* of ranges that still need to be fetched
+	 */
+	while (zlist_size(self->inflight) < 2 * self->window) {
+		file_range_t *next = (file_range_t *) zlist_pop(pending);
+		if (!next)
+			break;
+		off_t offset = next->offset;
+		off_t end = next->offset + next->size;
+		int64_t now = zclock_usecs();
+		next->ts_requested = now;
+		zlist_append(self->inflight, next);
+		size_t count = 1;
+		next = (file_range_t *) zlist_first(pending);
+		while (next != NULL && next->offset == end && count < PUSH_SPAN) {
+			next->ts_requested = now;
+			zlist_append(self->inflight, zlist_pop(pending));
+			end += next->size;
+			count++;
+			next = (file_range_t *) zlist_first(pending);
+		}
+		zstr_sendm  (self->dealer, "push");
+		zstr_sendm  (self->dealer, uid);
+		zstr_sendfm (self->dealer, "%ld", (long) offset);
+		if (self->compress) {
+			zstr_sendfm (self->dealer, "%ld", (long) (end - offset));
+			zstr_send   (self->dealer, COMPRESSION_CODEC);
+		} else
+			zstr_sendf  (self->dealer, "%ld", (long) (end - offset));
+	}
+	if (self->received + self->window > self->credit) {
+		self->credit = self->received + self->window;
+		zstr_sendm  (self->dealer, "credit");
+		zstr_sendm  (self->dealer, uid);
+		zstr_sendf  (self->dealer, "%zu", self->credit);
+	}
+}
+
+off_t file_ranges_contiguous (zlist_t *pending, zlist_t *sources, off_t size) {
+	/**
+	 * returns how many bytes from the start of the file are complete, i.e. the
+	 * offset of the first range that is still pending or in transit
+	 *
+	 * @param zlist_t* of ranges that still need to be fetched
+	 * @param zlist_t* of sources with the ranges in transit
+	 * @param off_t size of the file
+	 */
+	off_t contiguous = size;
+	file_range_t *range = (file_range_t *) zlist_first(pending);
+	while (range != NULL) {
+		if (range->offset < contiguous)
+			contiguous = range->offset;
+		range = (file_range_t *) zlist_next(pending);
+	}
+	transfer_source_t *src = (transfer_source_t *) zlist_first(sources);
+	while (src != NULL) {
+		range = (file_range_t *) zlist_first(src->inflight);
+		while (range != NULL) {
+			if (range->offset < contiguous)
+				contiguous = range->offset;
+			range = (file_range_t *) zlist_next(src->inflight);
+		}
+		src = (transfer_source_t *) zlist_next(sources);
+	}
+	return contiguous;
+}
+
+void
+client_actor (zsock_t *pipe, void *args)
+{
+    char* peerid = strdup(((char**)args)[0]);
+    char* uid = strdup(((char**)args)[1]);
+    char* endpoint = strdup(((char**)args)[2]);
+    char* target = strdup(((char**)args)[3]);
+    char* timeout_str = strdup(((char**)args)[4]);
+    char* filesize = strdup(((char**)args)[5]);
+    // codec the first source may compress chunks with, "" if it does not
+    const char* codec = ((char**)args)[6];
+    // interval in msec at which progress is reported, 0 to report only completion
+    int progress_interval = atoi(((char**)args)[7]);
+    // report the complete part at the start of the file, so it can be read early
+    bool stream = streq(((char**)args)[8], "true");
+    // let the sources push chunks instead of fetching every chunk
+    bool push = streq(((char**)args)[9], "true");
+    char *eptr;
+    off_t fs = strtoll(filesize, &eptr, 10);
+    assert (timeout_str);
+    int timeout = atoi(timeout_str);
+
+    char* success = NULL;
+    char* error = NULL;
+
+    // time when thread was spawned; will be updated whenever a message is received
+    int64_t com_time = zclock_mono();
+
+    // peers serving this file; more can be added through the pipe while we run
+    zlist_t *sources = zlist_new();
+    // ranges of the file that still need to be requested
+    zlist_t *pending = zlist_new();
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *dctx = ZSTD_createDCtx ();
+#endif
+    transfer_source_t *src = transfer_source_new(peerid, endpoint);
+    assert (src);
+    src->compress = codec && streq (codec, COMPRESSION_CODEC);
+    src->push = push;
+    zlist_append(sources, src);
+    zpoller_add(poller, src->dealer);
+
+    size_t total = 0;       //  Total bytes received
+    size_t chunks = 0;      //  Total chunks received
+    off_t needed = fs;      //  Bytes that have to be received
+    int64_t progress_time = com_time;   //  Time of the last progress report
+    size_t progress_total = 0;          //  Bytes received at the last progress report
+    
+    zsock_signal (pipe, 0);     //  Signal "ready" to caller
+
+	printf("[client_actor] peerid: %s\n",peerid);
+	printf("[client_actor] uid: %s\n",uid);
+	printf("[client_actor] endpoint: %s\n",endpoint);
+	printf("[client_actor] storing file at %s\n",target);
+	printf("[client_actor] timeout %d\n",timeout);
+	printf("[client_actor] file size %s\n",filesize);
+
+    // If an older version of the file is at the target, only fetch what changed.
+    // The new version is built next to the target (TARGET.delta, or TARGET.part
+    // for a full fetch) and atomically replaces it when complete.
+    char *partial = NULL;
+    int old_fd = open (target, O_RDONLY);
+    struct stat old_st;
+    transfer_source_t *delta_src = NULL;
+    if (old_fd >= 0 && fstat (old_fd, &old_st) == 0 && S_ISREG (old_st.st_mode) && old_st.st_size >= DELTA_MIN_BLOCK && fs > 0) {
+    	size_t block = delta_block_size (old_st.st_size);
+    	zframe_t *signatures = delta_signatures (old_fd, old_st.st_size, block);
+    	if (signatures) {
+    		printf("[client_actor] requesting delta against %ld bytes at %s\n", (long) old_st.st_size, target);
+    		zstr_sendm  (src->dealer, "signatures");
+    		zstr_sendm  (src->dealer, uid);
+    		zstr_sendfm (src->dealer, "%zu", block);
+    		zframe_send (&signatures, src->dealer, 0);
+    		delta_src = src;
+    		partial = (char *) malloc (strlen (target) + strlen (".delta") + 1);
+    		assert (partial);
+    		sprintf (partial, "%s.delta", target);
+    	}
+    }
+    if (!delta_src) {
+    	if (old_fd >= 0)
+    		close (old_fd);
+    	old_fd = -1;
+    	partial = (char *) malloc (strlen (target) + strlen (".part") + 1);
+    	assert (partial);
+    	sprintf (partial, "%s.part", target);
+    	file_ranges_add (pending, 0, fs);
+    }
+    // never write through a link into the file cache
+    unlink (partial);
+    int fd = open (partial, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		printf("[client_actor] errno = %d\n", errno);
+		printf("[client_actor] Check http://www.virtsync.com/c-error-codes-include-errno for explanation\n");
+		printf ("[client_actor] Cannot open target file %s for file transfer: \n", target);
+		success = strdup("false");
+		error = strdup("[client_actor] Could not create file. Please check target folder.");
+		goto cleanup;
+	}
+	// reserve the whole file up front, so it is not extended chunk by chunk
+	// and a full disk is reported before anything is fetched
+	int rc = fs > 0 ? posix_fallocate (fd, 0, fs) : 0;
+	if (rc == ENOSPC) {
+		printf ("[client_actor] Not enough space for %ld bytes at %s\n", (long) fs, partial);
+		close (fd);
+		success = strdup("false");
+		error = strdup("[client_actor] Not enough space for file.");
+		goto cleanup;
+	}
+	if (rc != 0 && ftruncate (fd, fs) != 0)
+		printf ("[client_actor] Could not preallocate %s. Errno: = %d\n", partial, errno);
+
+    while (!zsys_interrupted && (delta_src || total < (size_t) needed)) {
+        // check for timeout
+        int64_t curr_time = zclock_mono ();
+		if (curr_time > 0 && progress_interval > 0 && curr_time - progress_time >= progress_interval) {
+			// throughput over the last interval, so the ETA follows changing links
+			double rate = (total - progress_total) * 1000.0 / (curr_time - progress_time);
+			long eta = rate > 0 ? (long) ((needed - (off_t) total) / rate) : -1;
+			off_t contiguous = 0;
+			if (stream && !delta_src)
+				contiguous = file_ranges_contiguous (pending, sources, fs);
+			zstr_sendm  (pipe, "remote_file_progress");
+			zstr_sendm  (pipe, uid);
+			zstr_sendfm (pipe, "%zu", total);
+			zstr_sendfm (pipe, "%ld", (long) needed);
+			zstr_sendfm (pipe, "%.0f", rate);
+			zstr_sendfm (pipe, "%ld", eta);
+			zstr_sendfm (pipe, "%ld", (long) contiguous);
+			zstr_send   (pipe, stream ? partial : "");
+			progress_time = curr_time;
+			progress_total = total;
+		}
+		if (curr_time > 0) {
+			//printf("time: %zu", (curr_time - com_time));
+			if (curr_time - com_time > (1000 * timeout)) {
+				success = strdup("false");
+				error = strdup("[client_actor] Timeout.");
+				printf("[client_actor] timeout!\n");
+				close(fd);
+				///TODO:test
+				goto cleanup;
+			}
+			if (delta_src && curr_time - com_time > (500 * timeout)) {
+				// the server does not answer with a delta; fetch the whole file instead
+				printf("[client_actor] no delta received, fetching whole file\n");
+				delta_src = NULL;
+				file_ranges_add (pending, 0, fs);
+			}
+			// hand the chunks of a stalled source over to the others
+			if (zlist_size(sources) > 1) {
+				src = (transfer_source_t *) zlist_first(sources);
+				while (src != NULL) {
+					if (zlist_size(src->inflight) > 0 && curr_time - src->ts_last > (500 * timeout)) {
+						printf("[client_actor] source %s stalled, dropping it\n", src->peerid);
+						zlist_remove(sources, src);
+						zpoller_remove(poller, src->dealer);
+						transfer_source_requeue(src, pending);
+						transfer_source_destroy(&src);
+						break;
+					}
+					src = (transfer_source_t *) zlist_next(sources);
+				}
+			}
+		} else {
+			printf ("[client_actor] could not get current time\n");
+		}
+        src = (transfer_source_t *) zlist_first(sources);
+        while (src != NULL) {
+        	// Ask for next chunks, up to the window of each source
+        	if (src->push)
+        		transfer_source_push(src, uid, pending);
+        	while (!src->push && zlist_size(src->inflight) < src->window) {
+				file_range_t *next = (file_range_t *) zlist_pop(pending);
+				if (!next)
+					break;
+				zstr_sendm  (src->dealer, "fetch");
+				zstr_sendm  (src->dealer, uid);
+				zstr_sendfm (src->dealer, "%ld", (long) next->offset);
+				if (src->compress) {
+					zstr_sendfm (src->dealer, "%zu", next->size);
+					zstr_send   (src->dealer, COMPRESSION_CODEC);
+				} else
+					zstr_sendf  (src->dealer, "%zu", next->size);
+				next->ts_requested = zclock_usecs();
+				zlist_append(src->inflight, next);
+        	}
+        	src = (transfer_source_t *) zlist_next(sources);
+        }
+        // sleep until a chunk arrives or one of the checks above is due
+        int64_t deadline = com_time + 1000 * timeout + 1;
+        if (delta_src)
+        	deadline = deadline_earliest (deadline, com_time + 500 * timeout + 1);
+        if (zlist_size(sources) > 1) {
+        	src = (transfer_source_t *) zlist_first(sources);
+        	while (src != NULL) {
+        		if (zlist_size(src->inflight) > 0)
+        			deadline = deadline_earliest (deadline, src->ts_last + 500 * timeout + 1);
+        		src = (transfer_source_t *) zlist_next(sources);
+        	}
+        }
+        if (progress_interval > 0)
+        	deadline = deadline_earliest (deadline, progress_time + progress_interval);
+        void *which = zpoller_wait (poller, deadline_timeout (deadline, zclock_mono ()));
+        if (which == pipe) {
+            zmsg_t *msg = zmsg_recv (which);
+            if (!msg){
+            	printf("[client_actor] Pipe interrupted.\n");
+            	success = strdup("false");
+				error = strdup("[client_actor] Pipe interrupted.");
+				close(fd);
+				goto cleanup;              //  Interrupted
+            }
+            char *command = zmsg_popstr (msg);
+            if (streq (command, "$TERM")){
+            	printf("[client_actor] Received term signal.\n");
+            	success = strdup("false");
+				error = strdup("[client_actor] Received $TERM signal.");
+				close(fd);
+				zstr_free (&command);
+				zmsg_destroy (&msg);
+				goto cleanup;
+            } else if (streq (command, "source")) {
+            	// another peer serves the same file
+            	char *src_peerid = zmsg_popstr (msg);
+            	char *src_endpoint = zmsg_popstr (msg);
+            	char *src_size = zmsg_popstr (msg);
+            	char *src_codec = zmsg_popstr (msg);
+            	if (src_peerid && src_endpoint && src_size && strtoll(src_size, &eptr, 10) == fs) {
+            		src = transfer_source_new(src_peerid, src_endpoint);
+            		if (src) {
+            			src->compress = src_codec && streq (src_codec, COMPRESSION_CODEC);
+            			src->push = push;
+            			printf("[client_actor] adding source %s at %s\n", src_peerid, src_endpoint);
+            			zlist_append(sources, src);
+            			zpoller_add(poller, src->dealer);
+            			com_time = zclock_mono();
+            		} else {
+            			printf("[client_actor] could not connect to source %s at %s\n", src_peerid, src_endpoint);
+            		}
+            	} else {
+            		printf("[client_actor] ignoring source %s: file size %s does not match %s\n", src_peerid, src_size, filesize);
+            	}
+            	zstr_free (&src_peerid);
+            	zstr_free (&src_endpoint);
+            	zstr_free (&src_size);
+            	zstr_free (&src_codec);
+            } else if (streq (command, "drop_source")) {
+            	// a source reported an error; fetch its chunks from the others
+            	char *src_peerid = zmsg_popstr (msg);
+            	src = (transfer_source_t *) zlist_first(sources);
+            	while (src_peerid && src != NULL) {
+            		if (streq(src->peerid, src_peerid)) {
+            			printf("[client_actor] dropping source %s\n", src_peerid);
+            			zlist_remove(sources, src);
+            			zpoller_remove(poller, src->dealer);
+            			transfer_source_requeue(src, pending);
+            			if (src == delta_src) {
+            				// fall back to fetching the whole file
+            				delta_src = NULL;
+            				file_ranges_add (pending, 0, fs);
+            			}
+            			transfer_source_destroy(&src);
+            			break;
+            		}
+            		src = (transfer_source_t *) zlist_next(sources);
+            	}
+            	zstr_free (&src_peerid);
+            }
+            zstr_free (&command);
+            zmsg_destroy (&msg);
+        }
+        else if (which) {
+        	src = (transfer_source_t *) zlist_first(sources);
+        	while (src != NULL && src->dealer != which)
+        		src = (transfer_source_t *) zlist_next(sources);
+        	assert (src);
+			//  Reply is [offset][chunk], [offset][compressed chunk][codec] or ["delta"][map]
+			zmsg_t *reply = zmsg_recv (which);
+			if (!reply){
+				printf("[client_actor] Dealer socket interrupted.\n");
+				success = strdup("false");
+				error = strdup("[client_actor] Dealer socket interrupted.");
+				close(fd);
+				goto cleanup;
+			}
+			char *offset_str = zmsg_popstr (reply);
+			zframe_t *chunk = zmsg_pop (reply);
+			char *chunk_codec = zmsg_popstr (reply);
+			zmsg_destroy (&reply);
+			com_time = zclock_mono(); // reset timeout when receiving a package
+			if (offset_str && streq (offset_str, "delta_progress")) {
+				// the server is still mapping the file; waiting is all there is to do
+				zstr_free (&offset_str);
+				zframe_destroy (&chunk);
+				zstr_free (&chunk_codec);
+				continue;
+			}
+			if (!offset_str || !streq (offset_str, "delta"))
+				src->received++;
+			if (offset_str && streq (offset_str, "delta")) {
+				if (src == delta_src && chunk) {
+					off_t copied = delta_apply (chunk, old_fd, old_st.st_size, fd, fs, pending);
+					if (copied < 0) {
+						printf("[client_actor] invalid delta from %s, fetching whole file\n", src->peerid);
+						file_ranges_purge (pending);
+						file_ranges_add (pending, 0, fs);
+					} else {
+						printf("[client_actor] delta: %ld of %s bytes copied from old version\n", (long) copied, filesize);
+						needed = fs - copied;
+					}
+					delta_src = NULL;
+				}
+				zstr_free (&offset_str);
+				zframe_destroy (&chunk);
+				continue;
+			}
+			// chunks may be read by different workers of the server and arrive in any order
+			file_range_t *range = (file_range_t *) zlist_first(src->inflight);
+			while (offset_str && range != NULL && range->offset != strtoll(offset_str, &eptr, 10))
+				range = (file_range_t *) zlist_next(src->inflight);
+			zstr_free (&offset_str);
+			if (range && chunk && chunk_codec) {
+				zframe_t *compressed = chunk;
+				chunk = NULL;
+#ifdef HAVE_ZSTD
+				if (dctx && streq (chunk_codec, COMPRESSION_CODEC))
+					chunk = decompress_frame (dctx, NULL, zframe_data (compressed), zframe_size (compressed), range->size);
+#endif
+				zframe_destroy (&compressed);
+			}
+			if (!range || !chunk) {
+				printf("[client_actor] Ignoring unexpected chunk from %s\n", src->peerid);
+				zframe_destroy (&chunk);
+				zstr_free (&chunk_codec);
+				continue;
+			}
+			zstr_free (&chunk_codec);
+			zlist_remove(src->inflight, range);
+			chunks++;
+			size_t size = zframe_size (chunk);
+			if (size > range->size || pwrite (fd, zframe_data (chunk), size, range->offset) != (ssize_t) size) {
+				printf ("[client_actor] Could not write %zu bytes at offset %ld. Errno: = %d\n", size, (long) range->offset, errno);
+				success = strdup("false");
+				error = strdup("[client_actor] Could not write file.");
+				zframe_destroy (&chunk);
+				free (range);
+				close(fd);
+				goto cleanup;
+			}
+			zframe_destroy (&chunk);
+			if (MEDIATOR_PROBE_ENABLED(transfer_chunk_receive))
+				MEDIATOR_PROBE(transfer_chunk_receive, uid, src->peerid, (long) range->offset, size, zclock_usecs() - range->ts_requested);
+			free (range);
+			total += size;
+			src->bytes += size;
+			src->ts_last = com_time;
+			transfer_sources_rebalance(sources);
+        }
+    }
+    close(fd);
+    if (delta_src || total < (size_t) needed) {
+    	printf ("[client_actor] File transfer interrupted. Received %zd of %ld bytes\n", total, (long) needed);
+    	success = strdup("false");
+    	error = strdup("[client_actor] Interrupted.");
+    	goto cleanup;
+    }
+    if (rename (partial, target) != 0) {
+    	printf ("[client_actor] Could not rename %s to %s. Errno: = %d\n", partial, target, errno);
+    	success = strdup("false");
+    	error = strdup("[client_actor] Could not move file to target.");
+    	goto cleanup;
+    }
+    printf ("[client_actor] File transfer complete. Received %zd bytes in %zu chunks\n", total, chunks);
+    src = (transfer_source_t *) zlist_first(sources);
+    while (src != NULL) {
+    	printf ("[client_actor] %zd bytes from %s\n", src->bytes, src->peerid);
+    	src = (transfer_source_t *) zlist_next(sources);
+    }
+    success = strdup("true");
+    error = strdup("");
+cleanup:
+	printf ("[client_actor] Creating report\n");
+	// Query type
+    zstr_sendm (pipe, "remote_file_done");
+    zstr_sendm (pipe, peerid);
+    zstr_sendm (pipe, uid);
+    zstr_sendm (pipe, success);
+    zstr_sendm (pipe, error);
+    zstr_send (pipe, target);
+
+    if (old_fd >= 0)
+    	close (old_fd);
+    if (partial && streq (success, "false"))
+    	unlink (partial);
+    free(partial);
+    zstr_free(&peerid);
+    zstr_free(&uid);
+    zstr_free(&endpoint);
+    zstr_free(&target);
+    zstr_free(&timeout_str);
+    zstr_free(&filesize);
+    zstr_free(&success);
+    zstr_free(&error);
+    
+	printf ("[client_actor] Cleaning up client actor\n");
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(dctx);
+#endif
+    zpoller_destroy(&poller);
+    src = (transfer_source_t *) zlist_pop(sources);
+    while (src != NULL) {
+    	transfer_source_destroy(&src);
+    	src = (transfer_source_t *) zlist_pop(sources);
+    }
+    zlist_destroy(&sources);
+    file_ranges_purge(pending);
+    zlist_destroy(&pending);
+}
+
+void batch_file_destroy (batch_file_t **self_p) {
+	assert (self_p);
+	if(*self_p) {
+		batch_file_t *self = *self_p;
+		if (self->fd >= 0)
+			close(self->fd);
+		file_ranges_purge(self->pending);
+		zlist_destroy(&self->pending);
+		file_ranges_purge(self->inflight);
+		zlist_destroy(&self->inflight);
+		free(self->uid);
+		free(self->target);
+		free(self->partial);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+void batch_result (json_t *result, const char *target, bool success, const char *error) {
+	json_object_set_new(result, "target", json_string(target));
+	json_object_set_new(result, "success", json_string(success ? "true" : "false"));
+	json_object_set_new(result, "error", json_string(error));
+}
+
+bool batch_name_valid (const char *name) {
+	/**
+	 * checks that the name of a file of a batch stays inside the target directory
+	 *
+	 * @param char* name of the file relative to the target directory
+	 *
+	 * @return true if the name may be used
+	 */
+	if (!name || strlen(name) == 0 || name[0] == '/')
+		return false;
+	const char *part = name;
+	while (part) {
+		if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+			return false;
+		part = strchr(part, '/');
+		if (part)
+			part++;
+	}
+	return true;
+}
+
+int batch_make_dirs (const char *path) {
+	/**
+	 * creates the missing parent directories of a file
+	 *
+	 * @param char* path of the file
+	 *
+	 * @return 0 if successful and -1 otherwise
+	 */
+	char *dir = strdup(path);
+	assert (dir);
+	char *sep = strchr(dir + 1, '/');
+	int rc = 0;
+	while (sep != NULL && rc == 0) {
+		*sep = '\0';
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+			rc = -1;
+		*sep = '/';
+		sep = strchr(sep + 1, '/');
+	}
+	free(dir);
+	return rc;
+}
+
+void
+batch_client_actor (zsock_t *pipe, void *args)
+{
+    char* peerid = strdup(((char**)args)[0]);
+    char* uid = strdup(((char**)args)[1]);
+    const char* endpoint = ((char**)args)[2];
+    char* target = strdup(((char**)args)[3]);
+    int timeout = atoi(((char**)args)[4]);
+    // codec the server may compress chunks with, "" if it does not
+    bool compress = streq(((char**)args)[5], COMPRESSION_CODEC);
+
+    zhash_t *active = zhash_new();  // files being fetched (batch_file_t*), by uid
+    zlist_t *order = zlist_new();   // the same files, in the order they were announced
+    json_t *report = json_array();
+    long count = -1;                // files of the batch, -1 until the server told
+    size_t done = 0;                // files finished or failed
+    size_t failed = 0;
+    size_t inflight = 0;            // chunks in transit
+    size_t total = 0;               // bytes received
+    int64_t com_time = zclock_mono();
+    const char *error = NULL;
+    char *eptr;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *dctx = ZSTD_createDCtx ();
+#endif
+    zsock_t *dealer = zsock_new_dealer(endpoint);
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    zsock_signal (pipe, 0);     //  Signal "ready" to caller
+
+	printf("[batch_client_actor] fetching batch %s from %s at %s into %s\n", uid, peerid, endpoint, target);
+    if (!dealer)
+    	error = "[batch_client_actor] Could not connect to file server.";
+    else {
+    	zpoller_add(poller, dealer);
+    	zstr_sendx (dealer, "batch", uid, NULL);
+    }
+
+    while (!zsys_interrupted && !error && (count < 0 || done < (size_t) count)) {
+        void *which = zpoller_wait (poller, deadline_timeout (com_time + 1000 * timeout + 1, zclock_mono ()));
+        if (which == pipe) {
+            zmsg_t *msg = zmsg_recv (which);
+            char *command = msg ? zmsg_popstr (msg) : NULL;
+            if (!msg || streq (command, "$TERM"))
+            	error = "[batch_client_actor] Received $TERM signal.";
+            zstr_free (&command);
+            zmsg_destroy (&msg);
+        } else if (which == dealer) {
+        	//  Replies are ["files"][uid][count], ["file"][uid][name][size]([contents])
+        	//  and ["chunk"][uid][offset][chunk]([codec])
+        	zmsg_t *reply = zmsg_recv (dealer);
+        	if (!reply) {
+        		error = "[batch_client_actor] Dealer socket interrupted.";
+        		break;
+        	}
+        	com_time = zclock_mono();
+        	char *type = zmsg_popstr (reply);
+        	char *file_uid = zmsg_popstr (reply);
+        	if (type && streq (type, "files")) {
+        		char *files = zmsg_popstr (reply);
+        		count = files ? atol (files) : 0;
+        		printf("[batch_client_actor] batch %s has %ld files\n", uid, count);
+        		zstr_free (&files);
+        	} else if (type && streq (type, "file") && file_uid) {
+        		char *name = zmsg_popstr (reply);
+        		char *size_str = zmsg_popstr (reply);
+        		zframe_t *contents = zmsg_pop (reply);
+        		off_t size = size_str ? strtoll (size_str, &eptr, 10) : -1;
+        		json_t *result = json_object();
+        		json_object_set_new(result, "name", json_string(name ? name : ""));
+        		json_array_append_new(report, result);
+        		char *path = NULL;
+        		if (batch_name_valid (name)) {
+        			path = (char *) malloc (strlen (target) + strlen (name) + 2);
+        			assert (path);
+        			sprintf (path, "%s/%s", target, name);
+        		}
+        		if (size < 0 || !path) {
+        			batch_result (result, "", false, size < 0 ? "Could not open file." : "Invalid file name.");
+        			if (size >= 0)
+        				zstr_sendx (dealer, "close", file_uid, NULL);
+        			failed++;
+        			done++;
+        		} else if (batch_make_dirs (path) != 0) {
+        			batch_result (result, "", false, "Could not create directory.");
+        			if (!contents)
+        				zstr_sendx (dealer, "close", file_uid, NULL);
+        			failed++;
+        			done++;
+        		} else if (contents) {
+        			//  small files come along with their announcement
+        			bool ok = file_write_atomic (path, zframe_data (contents), zframe_size (contents)) == 0;
+        			batch_result (result, ok ? path : "", ok, ok ? "" : "Could not write file.");
+        			total += zframe_size (contents);
+        			failed += ok ? 0 : 1;
+        			done++;
+        		} else {
+        			batch_file_t *file = (batch_file_t *) zmalloc (sizeof (batch_file_t));
+        			assert (file);
+        			file->uid = strdup (file_uid);
+        			file->target = strdup (path);
+        			file->partial = (char *) malloc (strlen (path) + strlen (".part") + 1);
+        			assert (file->partial);
+        			sprintf (file->partial, "%s.part", path);
+        			file->size = size;
+        			file->pending = zlist_new ();
+        			file->inflight = zlist_new ();
+        			file->result = result;
+        			// never write through a link into the file cache
+        			unlink (file->partial);
+        			file->fd = open (file->partial, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        			if (file->fd >= 0 && size > 0 && posix_fallocate (file->fd, 0, size) != 0 && ftruncate (file->fd, size) != 0)
+        				printf("[batch_client_actor] Could not preallocate %s. Errno: = %d\n", file->partial, errno);
+        			file_ranges_add (file->pending, 0, size);
+        			if (file->fd < 0 || size == 0) {
+        				bool ok = file->fd >= 0 && rename (file->partial, path) == 0;
+        				batch_result (result, ok ? path : "", ok, ok ? "" : "Could not create file. Please check target folder.");
+        				zstr_sendx (dealer, "close", file_uid, NULL);
+        				failed += ok ? 0 : 1;
+        				done++;
+        				batch_file_destroy (&file);
+        			} else {
+        				zhash_insert (active, file->uid, file);
+        				zlist_append (order, file);
+        			}
+        		}
+        		free (path);
+        		zstr_free (&name);
+        		zstr_free (&size_str);
+        		zframe_destroy (&contents);
+        	} else if (type && streq (type, "chunk") && file_uid) {
+        		char *offset_str = zmsg_popstr (reply);
+        		zframe_t *chunk = zmsg_pop (reply);
+        		char *codec = zmsg_popstr (reply);
+        		batch_file_t *file = (batch_file_t *) zhash_lookup (active, file_uid);
+        		file_range_t *range = file && offset_str ? (file_range_t *) zlist_first (file->inflight) : NULL;
+        		while (range != NULL && range->offset != strtoll (offset_str, &eptr, 10))
+        			range = (file_range_t *) zlist_next (file->inflight);
+        		if (range && chunk && codec) {
+        			zframe_t *compressed = chunk;
+        			chunk = NULL;
+#ifdef HAVE_ZSTD
+        			if (dctx && streq (codec, COMPRESSION_CODEC))
+        				chunk = decompress_frame (dctx, NULL, zframe_data (compressed), zframe_size (compressed), range->size);
+#endif
+        			zframe_destroy (&compressed);
+        		}
+        		if (range && chunk) {
+        			zlist_remove (file->inflight, range);
+        			inflight--;
+        			size_t size = zframe_size (chunk);
+        			bool ok = size <= range->size && pwrite (file->fd, zframe_data (chunk), size, range->offset) == (ssize_t) size;
+        			file->received += size;
+        			total += size;
+        			free (range);
+        			if (!ok || file->received >= file->size) {
+        				close (file->fd);
+        				file->fd = -1;
+        				ok = ok && rename (file->partial, file->target) == 0;
+        				if (!ok)
+        					unlink (file->partial);
+        				batch_result (file->result, ok ? file->target : "", ok, ok ? "" : "Could not write file.");
+        				zstr_sendx (dealer, "close", file->uid, NULL);
+        				failed += ok ? 0 : 1;
+        				done++;
+        				// replies still in transit for this file are ignored
+        				inflight -= zlist_size (file->inflight);
+        				zhash_delete (active, file->uid);
+        				zlist_remove (order, file);
+        				batch_file_destroy (&file);
+        			}
+        		} else
+        			printf("[batch_client_actor] Ignoring unexpected chunk of %s\n", file_uid);
+        		zstr_free (&offset_str);
+        		zstr_free (&codec);
+        		zframe_destroy (&chunk);
+        	}
+        	zstr_free (&type);
+        	zstr_free (&file_uid);
+        	zmsg_destroy (&reply);
+        }
+        // Ask for the next chunks of the announced files, in the order they were announced
+        batch_file_t *file = (batch_file_t *) zlist_first (order);
+        while (file != NULL && inflight < PIPELINE) {
+        	file_range_t *next = (file_range_t *) zlist_pop (file->pending);
+        	if (!next) {
+        		file = (batch_file_t *) zlist_next (order);
+        		continue;
+        	}
+        	zstr_sendm  (dealer, "fetch");
+        	zstr_sendm  (dealer, file->uid);
+        	zstr_sendfm (dealer, "%ld", (long) next->offset);
+        	if (compress) {
+        		zstr_sendfm (dealer, "%zu", next->size);
+        		zstr_send   (dealer, COMPRESSION_CODEC);
+        	} else
+        		zstr_sendf  (dealer, "%zu", next->size);
+        	zlist_append (file->inflight, next);
+        	inflight++;
+        }
+        if (zclock_mono () - com_time > (1000 * timeout)) {
+        	printf("[batch_client_actor] timeout!\n");
+        	error = "[batch_client_actor] Timeout.";
+        }
+    }
+    if (!error && (count < 0 || done < (size_t) count))
+    	error = "[batch_client_actor] Interrupted.";
+    // files that were not completed
+    batch_file_t *file = (batch_file_t *) zlist_pop (order);
+    while (file != NULL) {
+    	unlink (file->partial);
+    	batch_result (file->result, "", false, error ? error : "Interrupted.");
+    	failed++;
+    	batch_file_destroy (&file);
+    	file = (batch_file_t *) zlist_pop (order);
+    }
+    char failures[64] = "";
+    if (!error && failed > 0) {
+    	sprintf (failures, "%zu of %ld files failed.", failed, count);
+    	error = failures;
+    }
+    printf ("[batch_client_actor] Batch %s finished: %zu of %ld files, %zu bytes received\n", uid, done - failed, count, total);
+    char *encoded_report = json_dumps (report, JSON_ENCODE_ANY);
+    zstr_sendm (pipe, "remote_batch_done");
+    zstr_sendm (pipe, peerid);
+    zstr_sendm (pipe, uid);
+    zstr_sendm (pipe, error ? "false" : "true");
+    zstr_sendm (pipe, error ? error : "");
+    zstr_sendm (pipe, target);
+    zstr_send  (pipe, encoded_report);
+
+    free (encoded_report);
+    json_decref (report);
+    zhash_destroy (&active);
+    zlist_destroy (&order);
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx (dctx);
+#endif
+    zpoller_destroy (&poller);
+    zsock_destroy (&dealer);
+    zstr_free (&peerid);
+    zstr_free (&uid);
+    zstr_free (&target);
+}
@@ -0,0 +1,1091 @@
+#include <mediator.h>
+
+// Server side of file transfers: file_server_actor and its workers
+
+void file_jobs_dispatch (file_jobs_t *self) {
+	while (zlist_size (self->idle) > 0 && zlist_size (self->queue) > 0) {
+		zframe_t *worker = (zframe_t *) zlist_pop (self->idle);
+		zmsg_t *job = (zmsg_t *) zlist_pop (self->queue);
+		zmsg_prepend (job, &worker);
+		zmsg_send (&job, self->router);
+	}
+}
+
+void file_jobs_send (file_jobs_t *self, zmsg_t **job_p) {
+	/**
+	 * hands a job to the next idle worker, or queues it until one is idle
+	 *
+	 * @param file_jobs_t* jobs of the workers
+	 * @param zmsg_t** job, set to NULL
+	 */
+	zlist_append (self->queue, *job_p);
+	*job_p = NULL;
+	file_jobs_dispatch (self);
+}
+
+void file_jobs_ready (file_jobs_t *self) {
+	// [identity]["ready"] of a worker that is done with its job
+	zmsg_t *msg = zmsg_recv (self->router);
+	if (!msg)
+		return;
+	zframe_t *worker = zmsg_pop (msg);
+	zlist_append (self->idle, worker);
+	zmsg_destroy (&msg);
+	file_jobs_dispatch (self);
+}
+
+void file_jobs_clear (file_jobs_t *self) {
+	zframe_t *worker = (zframe_t *) zlist_pop (self->idle);
+	while (worker != NULL) {
+		zframe_destroy (&worker);
+		worker = (zframe_t *) zlist_pop (self->idle);
+	}
+	zlist_destroy (&self->idle);
+	zmsg_t *job = (zmsg_t *) zlist_pop (self->queue);
+	while (job != NULL) {
+		zmsg_destroy (&job);
+		job = (zmsg_t *) zlist_pop (self->queue);
+	}
+	zlist_destroy (&self->queue);
+	zsock_destroy (&self->router);
+}
+
+served_file_t * served_file_adopt (zhash_t *files, const char *path, int fd, const struct stat *st) {
+	/**
+	 * returns the shared handle of a file a worker has opened; if the same
+	 * version of the file is already served, its handle is shared instead
+	 *
+	 * @param zhash_t* of served files by path
+	 * @param char* path of the file
+	 * @param int file descriptor opened by the worker, owned by the served file afterwards
+	 * @param struct stat* of the opened file
+	 *
+	 * @return served_file_t* with an additional reference
+	 */
+	served_file_t *self = (served_file_t *) zhash_lookup(files, path);
+	if (self && (self->dev != st->st_dev || self->ino != st->st_ino || self->size != st->st_size || self->mtime != st->st_mtime)) {
+		// file changed on disk; running transfers keep the old handle
+		zhash_delete(files, path);
+		self->detached = true;
+		self = NULL;
+	}
+	if (self) {
+		close(fd);
+	} else {
+		self = (served_file_t *) zmalloc (sizeof (served_file_t));
+		assert (self);
+		self->path = strdup(path);
+		self->fd = fd;
+		self->size = st->st_size;
+		self->dev = st->st_dev;
+		self->ino = st->st_ino;
+		self->mtime = st->st_mtime;
+		zhash_insert(files, path, self);
+		printf("[file_server] Opened file %s of size %ld.\n", path, (long) self->size);
+	}
+	self->refs++;
+	return self;
+}
+
+void served_file_release (zhash_t *files, served_file_t **self_p) {
+	/**
+	 * drops a reference to a served file and closes it when it is no longer used
+	 *
+	 * @param zhash_t* of served files by path
+	 * @param served_file_t** to the file, set to NULL
+	 */
+	assert (self_p);
+	if (*self_p) {
+		served_file_t *self = *self_p;
+		if (--self->refs == 0) {
+			if (!self->detached)
+				zhash_delete(files, self->path);
+			close(self->fd);
+			free(self->path);
+			free(self);
+		}
+		*self_p = NULL;
+	}
+}
+
+served_transfer_t * served_transfer_new (const char *uid, const char *peerid, double weight, double vclock) {
+	served_transfer_t *self = (served_transfer_t *) zmalloc (sizeof (served_transfer_t));
+	assert (self);
+	self->uid = strdup(uid);
+	self->peerid = strdup(peerid);
+	self->com_time = zclock_mono();
+	self->ready = zlist_new ();
+	assert (self->ready);
+	self->push_ranges = zlist_new ();
+	assert (self->push_ranges);
+	self->weight = weight > 0 ? weight : 1;
+	self->vtime = vclock;
+	return self;
+}
+
+void served_transfer_end (zhash_t *transfers, zhash_t *files, served_transfer_t *self) {
+	/**
+	 * removes a transfer from the file server and releases its file; a batch
+	 * ends with all of its files
+	 *
+	 * @param zhash_t* of served transfers by uid
+	 * @param zhash_t* of served files by path
+	 * @param served_transfer_t* to the transfer
+	 */
+	zhash_delete(transfers, self->uid);
+	if (self->batch) {
+		zlist_t *open = zlist_new();
+		served_transfer_t *file = (served_transfer_t *) zhash_first(transfers);
+		while (file != NULL) {
+			if (file->session && streq(file->session, self->uid))
+				zlist_append(open, file);
+			file = (served_transfer_t *) zhash_next(transfers);
+		}
+		file = (served_transfer_t *) zlist_pop(open);
+		while (file != NULL) {
+			served_transfer_end(transfers, files, file);
+			file = (served_transfer_t *) zlist_pop(open);
+		}
+		zlist_destroy(&open);
+		served_batch_file_t *entry = (served_batch_file_t *) zlist_pop(self->batch);
+		while (entry != NULL) {
+			free(entry->path);
+			free(entry->name);
+			free(entry);
+			entry = (served_batch_file_t *) zlist_pop(self->batch);
+		}
+		zlist_destroy(&self->batch);
+	}
+	zframe_destroy(&self->client);
+	free(self->session);
+	free(self->name);
+	served_file_release(files, &self->file);
+	queued_reply_t *queued = (queued_reply_t *) zlist_pop(self->ready);
+	while (queued != NULL) {
+		zmsg_destroy(&queued->reply);
+		free(queued);
+		queued = (queued_reply_t *) zlist_pop(self->ready);
+	}
+	zlist_destroy(&self->ready);
+	zframe_destroy(&self->push_identity);
+	file_ranges_purge(self->push_ranges);
+	zlist_destroy(&self->push_ranges);
+	free(self->push_codec);
+	free(self->uid);
+	free(self->peerid);
+	free(self);
+}
+
+void served_transfer_fetch (served_transfer_t *self, file_jobs_t *jobs, zframe_t **identity_p, const char *offset, const char *size, const char *codec) {
+	/**
+	 * hands the read of a chunk to the workers
+	 *
+	 * @param served_transfer_t* the chunk belongs to
+	 * @param file_jobs_t* jobs of the workers
+	 * @param zframe_t** to the identity of the client, set to NULL
+	 * @param char* offset of the chunk
+	 * @param char* size of the chunk
+	 * @param char* codec the client accepts, or NULL
+	 */
+	//  The file must stay open until the worker is done with it
+	self->file->refs++;
+	zmsg_t *job = zmsg_new ();
+	zmsg_append (job, identity_p);
+	zmsg_addmem (job, &self->file, sizeof (self->file));
+	zmsg_addstr (job, self->uid);
+	zmsg_addstr (job, "fetch");
+	zmsg_addstr (job, offset);
+	zmsg_addstr (job, size);
+	if (codec)
+		zmsg_addstr (job, codec);
+	file_jobs_send (jobs, &job);
+}
+
+void served_transfer_push (served_transfer_t *self, file_jobs_t *jobs) {
+	/**
+	 * reads the next chunks of a transfer in push mode, as far as the credit
+	 * of the client allows
+	 *
+	 * @param served_transfer_t* to the transfer
+	 * @param file_jobs_t* jobs of the workers
+	 */
+	while (self->push_identity && self->push_sent < self->push_credit) {
+		file_range_t *range = (file_range_t *) zlist_pop(self->push_ranges);
+		if (!range)
+			break;
+		char offset[24];
+		char size[24];
+		sprintf (offset, "%ld", (long) range->offset);
+		sprintf (size, "%zu", range->size);
+		zframe_t *identity = zframe_dup (self->push_identity);
+		served_transfer_fetch (self, jobs, &identity, offset, size, self->push_codec);
+		self->push_sent++;
+		free (range);
+	}
+}
+
+void served_batch_open (served_transfer_t *self, zhash_t *transfers, file_jobs_t *jobs, const char *inline_size) {
+	/**
+	 * opens the next files of a batch, so that up to BATCH_OPEN of its files are
+	 * served at once. Every file is served as a transfer of its own, named
+	 * uid/number, and announced to the client once it is open.
+	 *
+	 * @param served_transfer_t* to the batch
+	 * @param zhash_t* of served transfers by uid
+	 * @param file_jobs_t* jobs of the workers
+	 * @param char* size up to which files are sent along with their announcement
+	 */
+	while (self->client && self->batch_open < BATCH_OPEN) {
+		served_batch_file_t *entry = (served_batch_file_t *) zlist_pop(self->batch);
+		if (!entry)
+			break;
+		char *uid = (char *) malloc (strlen (self->uid) + 24);
+		assert (uid);
+		sprintf (uid, "%s/%zu", self->uid, self->batch_next++);
+		served_transfer_t *file = served_transfer_new (uid, self->peerid, self->weight, self->vtime);
+		file->session = strdup (self->uid);
+		file->name = entry->name;
+		zhash_insert (transfers, uid, file);
+		self->batch_open++;
+		served_file_t *no_file = NULL;
+		zmsg_t *job = zmsg_new ();
+		zmsg_addmem (job, NULL, 0);
+		zmsg_addmem (job, &no_file, sizeof (no_file));
+		zmsg_addstr (job, uid);
+		zmsg_addstr (job, "open");
+		zmsg_addstr (job, entry->path);
+		zmsg_addstr (job, inline_size);
+		file_jobs_send (jobs, &job);
+		free (entry->path);
+		free (entry);
+		free (uid);
+	}
+}
+
+served_transfer_t * served_batch_close (zhash_t *transfers, zhash_t *files, served_transfer_t *file) {
+	/**
+	 * ends the transfer of a file of a batch
+	 *
+	 * @param zhash_t* of served transfers by uid
+	 * @param zhash_t* of served files by path
+	 * @param served_transfer_t* to the file
+	 *
+	 * @return served_transfer_t* to the batch, NULL if it ended meanwhile
+	 */
+	served_transfer_t *session = (served_transfer_t *) zhash_lookup (transfers, file->session);
+	served_transfer_end (transfers, files, file);
+	if (session)
+		session->batch_open--;
+	return session;
+}
+
+void batch_list (zmsg_t *reply, const char *path, const char *name, bool recursive, const char *pattern, off_t *total, int depth) {
+	/**
+	 * adds the files at a path to the listing of a batch as [path][name] pairs;
+	 * the files in a directory are named relative to it
+	 *
+	 * @param zmsg_t* listing
+	 * @param char* path of a file or directory
+	 * @param char* name of the file in the batch
+	 * @param bool true to list subdirectories as well
+	 * @param char* shell pattern the file names must match; "" for all files
+	 * @param off_t* total size of the listed files
+	 * @param int depth of the path below the requested path
+	 */
+	struct stat st;
+	if (lstat (path, &st) != 0)
+		return;
+	// links to files are followed, links to directories are not
+	if (S_ISLNK (st.st_mode) && (stat (path, &st) != 0 || !S_ISREG (st.st_mode)))
+		return;
+	if (S_ISREG (st.st_mode)) {
+		const char *base = strrchr (name, '/') ? strrchr (name, '/') + 1 : name;
+		if (strlen (pattern) == 0 || fnmatch (pattern, base, 0) == 0) {
+			zmsg_addstr (reply, path);
+			zmsg_addstr (reply, name);
+			*total += st.st_size;
+		}
+	} else if (S_ISDIR (st.st_mode) && (depth == 0 || recursive)) {
+		DIR *dir = opendir (path);
+		if (!dir)
+			return;
+		struct dirent *entry;
+		while ((entry = readdir (dir)) != NULL) {
+			if (streq (entry->d_name, ".") || streq (entry->d_name, ".."))
+				continue;
+			char child[PATH_MAX];
+			char child_name[PATH_MAX];
+			snprintf (child, sizeof (child), "%s/%s", path, entry->d_name);
+			if (depth == 0)
+				snprintf (child_name, sizeof (child_name), "%s", entry->d_name);
+			else
+				snprintf (child_name, sizeof (child_name), "%s/%s", name, entry->d_name);
+			batch_list (reply, child, child_name, recursive, pattern, total, depth + 1);
+		}
+		closedir (dir);
+	}
+}
+
+void file_shaper_queue (file_shaper_t *self, served_transfer_t *transfer, zmsg_t **reply_p) {
+	/**
+	 * queues a reply of a transfer until the shaper lets it through
+	 *
+	 * @param file_shaper_t* to the shaper
+	 * @param served_transfer_t* the reply belongs to
+	 * @param zmsg_t** to the reply, set to NULL
+	 */
+	// a transfer that was idle gets no credit for the time it did not send
+	if (zlist_size(transfer->ready) == 0 && transfer->vtime < self->vclock)
+		transfer->vtime = self->vclock;
+	queued_reply_t *queued = (queued_reply_t *) zmalloc(sizeof(queued_reply_t));
+	queued->reply = *reply_p;
+	if (MEDIATOR_PROBE_ENABLED(transfer_chunk_send))
+		queued->ts_queued = zclock_usecs();
+	zlist_append(transfer->ready, queued);
+	*reply_p = NULL;
+}
+
+void file_shaper_send (file_shaper_t *self, zhash_t *transfers, zsock_t *router) {
+	/**
+	 * sends queued replies while the budget allows; the transfer that sent the
+	 * least relative to its weight goes first
+	 *
+	 * @param file_shaper_t* to the shaper
+	 * @param zhash_t* of served transfers by uid
+	 * @param zsock_t* router to send the replies on
+	 */
+	if (self->rate > 0) {
+		int64_t now = zclock_mono();
+		self->tokens += (now - self->ts_refill) * self->rate / 1000.0;
+		// allow bursts of at most 100 msec
+		if (self->tokens > self->rate / 10.0)
+			self->tokens = self->rate / 10.0;
+		self->ts_refill = now;
+	}
+	while (self->rate == 0 || self->tokens > 0) {
+		served_transfer_t *next = NULL;
+		served_transfer_t *transfer = (served_transfer_t *) zhash_first(transfers);
+		while (transfer != NULL) {
+			if (zlist_size(transfer->ready) > 0 && (!next || transfer->vtime < next->vtime))
+				next = transfer;
+			transfer = (served_transfer_t *) zhash_next(transfers);
+		}
+		if (!next)
+			break;
+		queued_reply_t *queued = (queued_reply_t *) zlist_pop(next->ready);
+		zmsg_t *reply = queued->reply;
+		size_t size = zmsg_content_size(reply);
+		self->vclock = next->vtime;
+		next->vtime += size / next->weight;
+		if (self->rate > 0)
+			self->tokens -= size;
+		if (MEDIATOR_PROBE_ENABLED(transfer_chunk_send) && queued->ts_queued > 0)
+			MEDIATOR_PROBE(transfer_chunk_send, next->uid, next->peerid, size, zlist_size(next->ready), zclock_usecs() - queued->ts_queued);
+		free(queued);
+		zmsg_send(&reply, router);
+	}
+}
+
+int64_t file_shaper_deadline (file_shaper_t *self, zhash_t *transfers) {
+	/**
+	 * @param file_shaper_t* to the shaper
+	 * @param zhash_t* of served transfers by uid
+	 *
+	 * @return time at which the budget allows queued replies to be sent, -1 if
+	 * nothing is waiting for the budget
+	 */
+	if (self->rate == 0 || self->tokens > 0)
+		return -1;
+	served_transfer_t *transfer = (served_transfer_t *) zhash_first(transfers);
+	while (transfer != NULL && zlist_size(transfer->ready) == 0)
+		transfer = (served_transfer_t *) zhash_next(transfers);
+	if (!transfer)
+		return -1;
+	return self->ts_refill + (int64_t) (-self->tokens * 1000 / self->rate) + 1;
+}
+
+void file_server_delta_progress (void *arg, off_t pos) {
+	delta_progress_t *self = (delta_progress_t *) arg;
+	zmsg_t *progress = zmsg_new ();
+	zframe_t *frame = zmsg_first (self->result);
+	while (frame) {
+		zframe_t *copy = zframe_dup (frame);
+		zmsg_append (progress, &copy);
+		frame = zmsg_next (self->result);
+	}
+	zmsg_addstr (progress, "delta_progress");
+	zmsg_addstrf (progress, "%ld", (long) pos);
+	zmsg_send (&progress, self->results);
+}
+
+//  A file server worker reads the requested chunks from the shared file
+//  handles and hands them back to the file server.
+
+static void
+file_server_worker (zsock_t *pipe, void *args)
+{
+	const char *jobs_endpoint = ((char**)args)[0];
+	const char *results_endpoint = ((char**)args)[1];
+	zsock_t *jobs = zsock_new_dealer(jobs_endpoint);
+	assert (jobs);
+	zsock_t *results = zsock_new_push(results_endpoint);
+	assert (results);
+	zpoller_t *poller = zpoller_new (pipe, jobs, NULL);
+	assert (poller);
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx = ZSTD_createCCtx ();
+#endif
+
+	zsock_signal (pipe, 0);     //  Signal "ready" to caller
+	zstr_send (jobs, "ready");  //  Ask the file server for the first job
+
+	while (!zsys_interrupted) {
+		void *which = zpoller_wait (poller, -1);
+		if (which == pipe) {
+			zmsg_t *msg = zmsg_recv (which);
+			if (!msg)
+				break;              //  Interrupted
+			char *command = zmsg_popstr (msg);
+			bool term = command && streq (command, "$TERM");
+			zstr_free (&command);
+			zmsg_destroy (&msg);
+			if (term)
+				break;
+		} else if (which == jobs) {
+			//  Job is [identity][served_file_t*][uid]["fetch"][offset][chunk size]([codec])
+			//  or [identity][served_file_t*][uid]["signatures"][block size][signatures]
+			//  or [][NULL][uid]["open"][path][inline size]
+			//  or [][NULL][uid]["list"][recursive][pattern][path]...
+			zmsg_t *job = zmsg_recv (jobs);
+			if (!job)
+				break;
+			zframe_t *identity = zmsg_pop (job);
+			zframe_t *file_frame = zmsg_pop (job);
+			zframe_t *uid_frame = zmsg_pop (job);
+			char *command = zmsg_popstr (job);
+			served_file_t *file;
+			memcpy (&file, zframe_data(file_frame), sizeof (file));
+			//  Result is [identity][served_file_t*][uid][reply...]
+			zmsg_t *result = zmsg_new ();
+			zmsg_append (result, &identity);
+			zmsg_append (result, &file_frame);
+			zmsg_append (result, &uid_frame);
+			if (streq (command, "open")) {
+				//  Opening may block on slow or network file systems, so it is
+				//  done here instead of in the file server.
+				//  Reply is ["opened"][path][fd][struct stat], followed by [contents]
+				//  if the file is not larger than the inline size
+				char *path = zmsg_popstr (job);
+				char *inline_str = zmsg_popstr (job);
+				off_t inline_size = inline_str ? strtoll (inline_str, NULL, 10) : 0;
+				struct stat st;
+				int fd = open (path, O_RDONLY);
+				if (fd < 0)
+					printf("[file_server] Cannot open file %s for file transfer. Errno: = %d\n", path, errno);
+				else if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+					printf("[file_server] could not determine file size of %s. Errno: = %d\n", path, errno);
+					close (fd);
+					fd = -1;
+				}
+				zmsg_addstr (result, "opened");
+				zmsg_addstr (result, path);
+				zmsg_addstrf (result, "%d", fd);
+				zmsg_addmem (result, &st, fd >= 0 ? sizeof (st) : 0);
+				if (fd >= 0 && inline_size > 0 && st.st_size <= inline_size) {
+					byte *data = (byte *) malloc (st.st_size > 0 ? st.st_size : 1);
+					assert (data);
+					ssize_t size = pread (fd, data, st.st_size, 0);
+					// a file that changes meanwhile is served the usual way
+					if (size == st.st_size)
+						zmsg_addmem (result, data, size);
+					free (data);
+				}
+				zstr_free (&path);
+				zstr_free (&inline_str);
+			} else if (streq (command, "list")) {
+				//  Reply is ["listed"][total size] followed by [path][name] of every file
+				char *recursive = zmsg_popstr (job);
+				char *pattern = zmsg_popstr (job);
+				zmsg_t *listing = zmsg_new ();
+				off_t total = 0;
+				char *path = zmsg_popstr (job);
+				while (path != NULL) {
+					const char *base = strrchr (path, '/') ? strrchr (path, '/') + 1 : path;
+					batch_list (listing, path, base, recursive && streq (recursive, "true"), pattern ? pattern : "", &total, 0);
+					zstr_free (&path);
+					path = zmsg_popstr (job);
+				}
+				zmsg_addstr (result, "listed");
+				zmsg_addstrf (result, "%ld", (long) total);
+				zframe_t *frame = zmsg_pop (listing);
+				while (frame != NULL) {
+					zmsg_append (result, &frame);
+					frame = zmsg_pop (listing);
+				}
+				zmsg_destroy (&listing);
+				zstr_free (&recursive);
+				zstr_free (&pattern);
+			} else if (streq (command, "fetch")) {
+				char *offset_str = zmsg_popstr (job);
+				char *chunksz_str = zmsg_popstr (job);
+				char *codec = zmsg_popstr (job);
+				off_t offset = strtoll (offset_str, NULL, 10);
+				size_t chunksz = strtoul (chunksz_str, NULL, 10);
+				if (chunksz > CHUNK_SIZE)
+					chunksz = CHUNK_SIZE;
+				byte *data = malloc (chunksz);
+				assert (data);
+				//  The handle is shared; pread does not move a common file position
+				ssize_t size = pread (file->fd, data, chunksz, offset);
+				if (size < 0) {
+					printf("[file_server] could not read %s at offset %ld. Errno: = %d\n", file->path, (long) offset, errno);
+					size = 0;
+				}
+				//  Reply is [offset][chunk], or [offset][compressed chunk][codec]
+				//  if the client asked for it and the chunk compresses well
+				zmsg_addstr (result, offset_str);
+				zframe_t *compressed = NULL;
+#ifdef HAVE_ZSTD
+				if (codec && cctx && streq (codec, COMPRESSION_CODEC) && size > 0)
+					compressed = compress_frame (cctx, NULL, COMPRESSION_LEVEL, data, size);
+#endif
+				if (compressed) {
+					zmsg_append (result, &compressed);
+					zmsg_addstr (result, COMPRESSION_CODEC);
+				} else
+					zmsg_addmem (result, data, size);
+				free (data);
+				zstr_free (&offset_str);
+				zstr_free (&chunksz_str);
+				zstr_free (&codec);
+			} else {
+				char *block_str = zmsg_popstr (job);
+				zframe_t *signatures = zmsg_pop (job);
+				size_t block = strtoul (block_str, NULL, 10);
+				zframe_t *map = NULL;
+				delta_progress_t progress = {results, result};
+				if (block >= DELTA_MIN_BLOCK && block <= CHUNK_SIZE && signatures)
+					map = delta_map (file->fd, file->size, block, signatures, file_server_delta_progress, &progress);
+				//  Reply is ["delta"][map]; an empty map makes the client fetch the whole file.
+				//  It may be preceded by any number of ["delta_progress"][position].
+				zmsg_addstr (result, "delta");
+				if (map)
+					zmsg_append (result, &map);
+				else
+					zmsg_addmem (result, NULL, 0);
+				zstr_free (&block_str);
+				zframe_destroy (&signatures);
+			}
+			zmsg_send (&result, results);
+			zstr_send (jobs, "ready");
+			zstr_free (&command);
+			zmsg_destroy (&job);
+		}
+	}
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx (cctx);
+#endif
+	zpoller_destroy (&poller);
+	zsock_destroy (&jobs);
+	zsock_destroy (&results);
+}
+
+void
+file_server_actor (zsock_t *pipe, void *args)
+{
+	char* timeout_str = strdup(((char**)args)[0]);
+	assert (timeout_str);
+	int timeout = atoi(timeout_str);
+	int nbr_workers = atoi(((char**)args)[1]);
+	if (nbr_workers < 1)
+		nbr_workers = 1;
+	const char *bind_endpoint = ((char**)args)[2];
+	// outgoing bandwidth of all transfers together, in bytes per second
+	file_shaper_t shaper;
+	memset (&shaper, 0, sizeof (shaper));
+	shaper.rate = atoll(((char**)args)[3]);
+	shaper.ts_refill = zclock_mono ();
+	// files up to this size are sent along with the reply instead of being fetched
+	const char *inline_size = ((char**)args)[4];
+
+	zsock_t *router = zsock_new_router (bind_endpoint);
+	assert (router);
+
+	//  Chunk reads are handed to idle workers and collected again here,
+	//  so only this thread uses the router
+	char jobs_endpoint[64];
+	char results_endpoint[64];
+	sprintf (jobs_endpoint, "inproc://file_server-%p-jobs", (void *) pipe);
+	sprintf (results_endpoint, "inproc://file_server-%p-results", (void *) pipe);
+	char bind_jobs[66];
+	char bind_results[66];
+	sprintf (bind_jobs, "@%s", jobs_endpoint);
+	sprintf (bind_results, "@%s", results_endpoint);
+	file_jobs_t file_jobs;
+	file_jobs.router = zsock_new_router (bind_jobs);
+	file_jobs.idle = zlist_new ();
+	file_jobs.queue = zlist_new ();
+	assert (file_jobs.router && file_jobs.idle && file_jobs.queue);
+	file_jobs_t *jobs = &file_jobs;
+	zsock_t *results = zsock_new_pull (bind_results);
+	assert (results);
+	char connect_jobs[66];
+	char connect_results[66];
+	sprintf (connect_jobs, ">%s", jobs_endpoint);
+	sprintf (connect_results, ">%s", results_endpoint);
+	const char *worker_args[2];
+	worker_args[0] = connect_jobs;
+	worker_args[1] = connect_results;
+	zlist_t *workers = zlist_new ();
+	int i;
+	for (i = 0; i < nbr_workers; i++) {
+		zactor_t *worker = zactor_new (file_server_worker, worker_args);
+		assert (worker);
+		zlist_append (workers, worker);
+	}
+
+	zhash_t *files = zhash_new ();      // served_file_t by path
+	zhash_t *transfers = zhash_new ();  // served_transfer_t by uid
+
+	zpoller_t *poller = zpoller_new (pipe, router, results, jobs->router, NULL);
+	assert (poller);
+
+	zsock_signal (pipe, 0);     //  Signal "ready" to caller
+	// Inform caller our endpoint
+	zstr_send (pipe, zsock_endpoint(router));
+	printf("[file_server] serving files on %s with %d workers\n", zsock_endpoint(router), nbr_workers);
+
+	while (!zsys_interrupted) {
+		served_transfer_t *pushing = (served_transfer_t *) zhash_first (transfers);
+		while (pushing != NULL) {
+			served_transfer_push (pushing, jobs);
+			pushing = (served_transfer_t *) zhash_next (transfers);
+		}
+		file_shaper_send (&shaper, transfers, router);
+		// check for timeouts
+		int64_t curr_time = zclock_mono ();
+		served_transfer_t *transfer = (served_transfer_t *) zhash_first (transfers);
+		while (transfer != NULL) {
+			// files of a batch time out with their batch
+			if (!transfer->session && curr_time - transfer->com_time > (1000 * timeout)) {
+				printf("[file_server] timeout of query %s!\n", transfer->uid);
+				zstr_sendm (pipe, "remote_file_transfer_error");
+				zstr_sendm (pipe, transfer->peerid);
+				zstr_sendm (pipe, transfer->uid);
+				zstr_sendm (pipe, "false");
+				zstr_send (pipe, "[file_server] Timeout");
+				served_transfer_end (transfers, files, transfer);
+				// hash was modified, start over
+				transfer = (served_transfer_t *) zhash_first (transfers);
+			} else {
+				transfer = (served_transfer_t *) zhash_next (transfers);
+			}
+		}
+		// sleep until a request arrives, the shaper has budget again or a transfer times out
+		int64_t deadline = file_shaper_deadline (&shaper, transfers);
+		served_transfer_t *served = (served_transfer_t *) zhash_first (transfers);
+		while (served != NULL) {
+			if (!served->session)
+				deadline = deadline_earliest (deadline, served->com_time + 1000 * timeout + 1);
+			served = (served_transfer_t *) zhash_next (transfers);
+		}
+		void *which = zpoller_wait (poller, deadline_timeout (deadline, zclock_mono ()));
+		if (which == pipe) {
+			zmsg_t *msg = zmsg_recv (which);
+			if (!msg)
+				break;              //  Interrupted
+			char *command = zmsg_popstr (msg);
+			if (streq (command, "$TERM")) {
+				printf("[file_server] Received term signal.\n");
+				zstr_free (&command);
+				zmsg_destroy (&msg);
+				break;
+			} else if (streq (command, "serve")) {
+				char *uid = zmsg_popstr (msg);
+				char *peerid = zmsg_popstr (msg);
+				char *uri = zmsg_popstr (msg);
+				char *weight = zmsg_popstr (msg);
+				// Remove host/peerid
+				const char *filename = uri ? strchr(uri, ':') : NULL;
+				if (!filename || zhash_lookup (transfers, uid)) {
+					zstr_sendm (pipe, "remote_file_transfer_error");
+					zstr_sendm (pipe, peerid);
+					zstr_sendm (pipe, uid);
+					zstr_sendm (pipe, "false");
+					zstr_send (pipe, "[file_server] Could not open file. Please check URI.");
+				} else {
+					served_transfer_t *transfer = served_transfer_new (uid, peerid, weight ? atof (weight) : 1, shaper.vclock);
+					zhash_insert (transfers, uid, transfer);
+					// the endpoint is reported once a worker has opened the file
+					served_file_t *no_file = NULL;
+					zmsg_t *job = zmsg_new ();
+					zmsg_addmem (job, NULL, 0);
+					zmsg_addmem (job, &no_file, sizeof (no_file));
+					zmsg_addstr (job, uid);
+					zmsg_addstr (job, "open");
+					zmsg_addstr (job, filename + 1);
+					zmsg_addstr (job, inline_size);
+					file_jobs_send (jobs, &job);
+				}
+				zstr_free (&uid);
+				zstr_free (&peerid);
+				zstr_free (&uri);
+				zstr_free (&weight);
+			} else if (streq (command, "batch")) {
+				//  ["batch"][uid][peerid][weight][recursive][pattern][path]...
+				char *uid = zmsg_popstr (msg);
+				char *peerid = zmsg_popstr (msg);
+				char *weight = zmsg_popstr (msg);
+				if (!uid || !peerid || zhash_lookup (transfers, uid)) {
+					zstr_sendm (pipe, "remote_file_transfer_error");
+					zstr_sendm (pipe, peerid ? peerid : "");
+					zstr_sendm (pipe, uid ? uid : "");
+					zstr_sendm (pipe, "false");
+					zstr_send (pipe, "[file_server] Query UID already in use.");
+				} else {
+					served_transfer_t *transfer = served_transfer_new (uid, peerid, weight ? atof (weight) : 1, shaper.vclock);
+					transfer->batch = zlist_new ();
+					assert (transfer->batch);
+					zhash_insert (transfers, uid, transfer);
+					//  Listing a directory may take a while, so a worker does it
+					served_file_t *no_file = NULL;
+					zmsg_pushstr (msg, "list");
+					zmsg_pushstr (msg, uid);
+					zmsg_pushmem (msg, &no_file, sizeof (no_file));
+					zmsg_pushmem (msg, NULL, 0);
+					file_jobs_send (jobs, &msg);
+				}
+				zstr_free (&uid);
+				zstr_free (&peerid);
+				zstr_free (&weight);
+			} else if (streq (command, "shape")) {
+				//  ["shape"][bandwidth][uid][weight]; empty fields are left unchanged
+				char *rate = zmsg_popstr (msg);
+				char *uid = zmsg_popstr (msg);
+				char *weight = zmsg_popstr (msg);
+				if (rate && strlen (rate) > 0) {
+					shaper.rate = atoll (rate);
+					shaper.tokens = 0;
+					shaper.ts_refill = zclock_mono ();
+					printf("[file_server] bandwidth set to %ld bytes/s\n", (long) shaper.rate);
+				}
+				served_transfer_t *transfer = uid && strlen (uid) > 0 ? (served_transfer_t *) zhash_lookup (transfers, uid) : NULL;
+				if (transfer && weight && atof (weight) > 0) {
+					transfer->weight = atof (weight);
+					printf("[file_server] weight of query %s set to %s\n", uid, weight);
+				}
+				zstr_free (&rate);
+				zstr_free (&uid);
+				zstr_free (&weight);
+			} else if (streq (command, "done")) {
+				char *uid = zmsg_popstr (msg);
+				served_transfer_t *transfer = uid ? (served_transfer_t *) zhash_lookup (transfers, uid) : NULL;
+				if (transfer) {
+					printf("[file_server] Finished serving query %s\n", uid);
+					served_transfer_end (transfers, files, transfer);
+				}
+				zstr_free (&uid);
+			}
+			zstr_free (&command);
+			zmsg_destroy (&msg);
+		} else if (which == router) {
+			//  Request is [identity]["fetch"][uid][offset][chunk size]([codec]),
+			//  [identity]["push"][uid][offset][size]([codec]), [identity]["credit"][uid][chunks]
+			//  or [identity]["signatures"][uid][block size][signatures]
+			//  Clients of a batch send [identity]["batch"][uid] first and [identity]["close"][uid]
+			//  for every file of the batch they have received
+			zmsg_t *request = zmsg_recv (router);
+			if (!request)
+				break;              //  Shutting down, quit
+			if (zmsg_size (request) < 3 || zmsg_size (request) > 6) {
+				printf("[file_server] Ignoring malformed request.\n");
+				zmsg_destroy (&request);
+				continue;
+			}
+			zframe_t *identity = zmsg_pop (request);
+			char *command = zmsg_popstr (request);
+			char *uid = zmsg_popstr (request);
+			served_transfer_t *transfer = (served_transfer_t *) zhash_lookup (transfers, uid);
+			if (transfer && transfer->session) {
+				//  Traffic of a file keeps its batch alive
+				served_transfer_t *session = (served_transfer_t *) zhash_lookup (transfers, transfer->session);
+				if (session)
+					session->com_time = zclock_mono ();
+			}
+			if (streq (command, "batch") && transfer && transfer->batch && transfer->batch_count > 0 && !transfer->client) {
+				//  Reply is ["files"][uid][number of files]; the files are announced as they are opened
+				transfer->com_time = zclock_mono ();
+				transfer->client = zframe_dup (identity);
+				zmsg_t *reply = zmsg_new ();
+				zmsg_append (reply, &identity);
+				zmsg_addstr (reply, "files");
+				zmsg_addstr (reply, uid);
+				zmsg_addstrf (reply, "%zu", transfer->batch_count);
+				file_shaper_queue (&shaper, transfer, &reply);
+				served_batch_open (transfer, transfers, jobs, inline_size);
+				zstr_free (&command);
+				zstr_free (&uid);
+				zmsg_destroy (&request);
+				continue;
+			}
+			if (streq (command, "close") && transfer && transfer->session) {
+				served_transfer_t *session = served_batch_close (transfers, files, transfer);
+				if (session)
+					served_batch_open (session, transfers, jobs, inline_size);
+				zframe_destroy (&identity);
+				zstr_free (&command);
+				zstr_free (&uid);
+				zmsg_destroy (&request);
+				continue;
+			}
+			if (streq (command, "signatures") && transfer && transfer->file) {
+				// the delta is computed by a worker as well
+				transfer->com_time = zclock_mono ();
+				transfer->file->refs++;
+				zmsg_pushstr (request, command);
+				zmsg_pushstr (request, uid);
+				zmsg_pushmem (request, &transfer->file, sizeof (transfer->file));
+				zmsg_prepend (request, &identity);
+				file_jobs_send (jobs, &request);
+				zstr_free (&command);
+				zstr_free (&uid);
+				continue;
+			}
+			if (streq (command, "credit") && transfer && transfer->file) {
+				//  Credit is the number of chunks the client allows to be pushed in total
+				char *credit = zmsg_popstr (request);
+				size_t chunks = credit ? strtoul (credit, NULL, 10) : 0;
+				if (chunks > transfer->push_credit)
+					transfer->push_credit = chunks;
+				transfer->com_time = zclock_mono ();
+				zstr_free (&credit);
+				zstr_free (&command);
+				zstr_free (&uid);
+				zframe_destroy (&identity);
+				zmsg_destroy (&request);
+				continue;
+			}
+			char *offset_str = zmsg_popstr (request);
+			char *chunksz_str = zmsg_popstr (request);
+			char *codec = zmsg_popstr (request);
+			off_t offset = offset_str ? strtoll (offset_str, NULL, 10) : -1;
+			if ((!streq (command, "fetch") && !streq (command, "push")) || !transfer || !transfer->file || !chunksz_str) {
+				printf("[file_server] Ignoring %s for unknown query %s.\n", command, uid);
+				zframe_destroy (&identity);
+			} else if (offset < 0 || offset > transfer->file->size) {
+				printf("[file_server] Offset larger than file_size. Ignoring %s request\n", command);
+				zframe_destroy (&identity);
+			} else if (streq (command, "push")) {
+				//  Chunks of the range are read and sent as the credit allows
+				transfer->com_time = zclock_mono ();
+				off_t size = strtoll (chunksz_str, NULL, 10);
+				if (size > transfer->file->size - offset)
+					size = transfer->file->size - offset;
+				file_ranges_add (transfer->push_ranges, offset, size);
+				zframe_destroy (&transfer->push_identity);
+				transfer->push_identity = identity;
+				identity = NULL;
+				free (transfer->push_codec);
+				transfer->push_codec = codec ? strdup (codec) : NULL;
+			} else {
+				// reset timeout timer
+				transfer->com_time = zclock_mono ();
+				served_transfer_fetch (transfer, jobs, &identity, offset_str, chunksz_str, codec);
+			}
+			zstr_free (&command);
+			zstr_free (&uid);
+			zstr_free (&offset_str);
+			zstr_free (&chunksz_str);
+			zstr_free (&codec);
+			zmsg_destroy (&request);
+		} else if (which == jobs->router) {
+			file_jobs_ready (jobs);
+		} else if (which == results) {
+			zmsg_t *result = zmsg_recv (results);
+			if (!result)
+				break;
+			zframe_t *identity = zmsg_pop (result);
+			zframe_t *file_frame = zmsg_pop (result);
+			served_file_t *file;
+			memcpy (&file, zframe_data(file_frame), sizeof (file));
+			zframe_destroy (&file_frame);
+			char *uid = zmsg_popstr (result);
+			if (zframe_size (identity) == 0) {
+				zframe_destroy (&identity);
+				char *reply_type = zmsg_popstr (result);
+				if (reply_type && streq (reply_type, "listed")) {
+					//  A worker listed the files of a batch
+					char *total = zmsg_popstr (result);
+					served_transfer_t *transfer = uid ? (served_transfer_t *) zhash_lookup (transfers, uid) : NULL;
+					if (transfer && transfer->batch && transfer->batch_count == 0) {
+						char *path = zmsg_popstr (result);
+						char *name = zmsg_popstr (result);
+						while (path && name) {
+							served_batch_file_t *entry = (served_batch_file_t *) zmalloc (sizeof (served_batch_file_t));
+							assert (entry);
+							entry->path = path;
+							entry->name = name;
+							zlist_append (transfer->batch, entry);
+							transfer->batch_count++;
+							path = zmsg_popstr (result);
+							name = zmsg_popstr (result);
+						}
+						zstr_free (&path);
+						zstr_free (&name);
+						if (transfer->batch_count > 0) {
+							printf("[file_server] serving %zu files to %s for query %s\n", transfer->batch_count, transfer->peerid, uid);
+							zstr_sendm (pipe, "endpoint");
+							zstr_sendm (pipe, transfer->peerid);
+							zstr_sendm (pipe, uid);
+							zstr_sendm (pipe, total);
+							zstr_sendm (pipe, "");
+							zstr_sendf (pipe, "%zu", transfer->batch_count);
+						} else {
+							zstr_sendm (pipe, "remote_file_transfer_error");
+							zstr_sendm (pipe, transfer->peerid);
+							zstr_sendm (pipe, uid);
+							zstr_sendm (pipe, "false");
+							zstr_send (pipe, "[file_server] No files found. Please check URIs.");
+							served_transfer_end (transfers, files, transfer);
+						}
+					}
+					zstr_free (&total);
+					zstr_free (&reply_type);
+					zstr_free (&uid);
+					zmsg_destroy (&result);
+					continue;
+				}
+				//  A worker opened the file of a new transfer
+				zstr_free (&reply_type);
+				char *path = zmsg_popstr (result);
+				char *fd_str = zmsg_popstr (result);
+				zframe_t *stat_frame = zmsg_pop (result);
+				zframe_t *contents = zmsg_pop (result);
+				int fd = fd_str ? atoi (fd_str) : -1;
+				served_transfer_t *transfer = uid ? (served_transfer_t *) zhash_lookup (transfers, uid) : NULL;
+				bool opened = fd >= 0 && zframe_size (stat_frame) == sizeof (struct stat);
+				if (transfer && transfer->session) {
+					//  File of a batch, announced to the client as ["file"][uid][name][size]([contents]);
+					//  a size of -1 tells the file could not be opened
+					served_transfer_t *session = (served_transfer_t *) zhash_lookup (transfers, transfer->session);
+					if (session) {
+						zframe_t *client = zframe_dup (session->client);
+						zmsg_t *announce = zmsg_new ();
+						zmsg_append (announce, &client);
+						zmsg_addstr (announce, "file");
+						zmsg_addstr (announce, uid);
+						zmsg_addstr (announce, transfer->name);
+						if (opened)
+							zmsg_addstrf (announce, "%ld", (long) ((struct stat *) zframe_data (stat_frame))->st_size);
+						else
+							zmsg_addstr (announce, "-1");
+						if (opened && contents)
+							zmsg_append (announce, &contents);
+						else if (opened) {
+							transfer->file = served_file_adopt (files, path, fd, (struct stat *) zframe_data (stat_frame));
+							transfer->com_time = zclock_mono ();
+							fd = -1;
+						}
+						file_shaper_queue (&shaper, session, &announce);
+					}
+					if (fd >= 0)
+						close (fd);
+					if (!transfer->file) {
+						// nothing left to serve of this file
+						session = served_batch_close (transfers, files, transfer);
+						if (session)
+							served_batch_open (session, transfers, jobs, inline_size);
+					}
+				} else if (transfer && !transfer->file && fd >= 0 && contents) {
+					//  Small file: hand the contents over, there is nothing left to serve
+					struct stat *st = (struct stat *) zframe_data (stat_frame);
+					printf("[file_server] sending %s (%ld bytes) inline to %s for query %s\n", path, (long) st->st_size, transfer->peerid, uid);
+					zstr_sendm (pipe, "inline");
+					zstr_sendm (pipe, transfer->peerid);
+					zstr_sendm (pipe, uid);
+					zstr_sendfm (pipe, "%ld", (long) st->st_size);
+					zstr_sendfm (pipe, "%ld", (long) st->st_mtime);
+					zframe_send (&contents, pipe, 0);
+					close (fd);
+					served_transfer_end (transfers, files, transfer);
+				} else if (transfer && !transfer->file && fd >= 0 && zframe_size (stat_frame) == sizeof (struct stat)) {
+					transfer->file = served_file_adopt (files, path, fd, (struct stat *) zframe_data (stat_frame));
+					transfer->com_time = zclock_mono ();
+					printf("[file_server] serving %s to %s for query %s\n", transfer->file->path, transfer->peerid, uid);
+					zstr_sendm (pipe, "endpoint");
+					zstr_sendm (pipe, transfer->peerid);
+					zstr_sendm (pipe, uid);
+					zstr_sendfm (pipe, "%ld", (long) transfer->file->size);
+					zstr_sendf (pipe, "%ld", (long) transfer->file->mtime);
+				} else {
+					// the transfer timed out meanwhile, or the file could not be opened
+					if (fd >= 0)
+						close (fd);
+					if (transfer && !transfer->file) {
+						zstr_sendm (pipe, "remote_file_transfer_error");
+						zstr_sendm (pipe, transfer->peerid);
+						zstr_sendm (pipe, uid);
+						zstr_sendm (pipe, "false");
+						zstr_send (pipe, "[file_server] Could not open file. Please check URI.");
+						served_transfer_end (transfers, files, transfer);
+					}
+				}
+				zstr_free (&uid);
+				zstr_free (&path);
+				zstr_free (&fd_str);
+				zframe_destroy (&stat_frame);
+				zframe_destroy (&contents);
+				zmsg_destroy (&result);
+				continue;
+			}
+			//  The worker is still mapping the file, which is released with the map
+			bool progress = zmsg_first (result) && zframe_streq (zmsg_first (result), "delta_progress");
+			if (!progress)
+				served_file_release (files, &file);
+			//  Reply is [identity][offset][chunk], [identity]["delta"][map] or
+			//  [identity]["delta_progress"][position], and
+			//  [identity]["chunk"][uid][offset][chunk] for the files of a batch
+			served_transfer_t *transfer = uid ? (served_transfer_t *) zhash_lookup (transfers, uid) : NULL;
+			if (transfer && progress)
+				transfer->com_time = zclock_mono ();
+			if (transfer && transfer->session) {
+				zmsg_pushstr (result, uid);
+				zmsg_pushstr (result, "chunk");
+			}
+			zmsg_prepend (result, &identity);
+			if (transfer)
+				file_shaper_queue (&shaper, transfer, &result);
+			else
+				zmsg_destroy (&result);     //  Transfer ended meanwhile
+			zstr_free (&uid);
+		}
+	}
+	printf("[file_server] Cleaning up %s.\n", zsock_endpoint(router));
+	zactor_t *worker = (zactor_t *) zlist_pop (workers);
+	while (worker != NULL) {
+		zactor_destroy (&worker);
+		worker = (zactor_t *) zlist_pop (workers);
+	}
+	zlist_destroy (&workers);
+	served_transfer_t *transfer = (served_transfer_t *) zhash_first (transfers);
+	while (transfer != NULL) {
+		served_transfer_end (transfers, files, transfer);
+		transfer = (served_transfer_t *) zhash_first (transfers);
+	}
+	zhash_destroy (&transfers);
+	//  Files of chunk reads that were still in progress
+	served_file_t *file = (served_file_t *) zhash_first (files);
+	while (file != NULL) {
+		zhash_delete (files, file->path);
+		close (file->fd);
+		free (file->path);
+		free (file);
+		file = (served_file_t *) zhash_first (files);
+	}
+	zhash_destroy (&files);
+	zstr_free (&timeout_str);
+	zpoller_destroy (&poller);
+	file_jobs_clear (jobs);
+	zsock_destroy (&results);
+	zsock_destroy (&router);
+}
@@ -0,0 +1,245 @@
+#include <mediator.h>
+
+// Interned peerids and msg UIDs, see intern_table_t in mediator.h
+
+intern_table_t * intern_table_new (void) {
+	intern_table_t *self = (intern_table_t *) zmalloc (sizeof (intern_table_t));
+	if (!self)
+		return NULL;
+	self->nbr_buckets = 64;
+	self->buckets = (uint32_t *) calloc (self->nbr_buckets, sizeof (uint32_t));
+	self->nbr_entries = 1;
+	self->entries = (intern_entry_t *) calloc (self->nbr_entries, sizeof (intern_entry_t));
+	if (!self->buckets || !self->entries) {
+		free (self->buckets);
+		free (self->entries);
+		free (self);
+		return NULL;
+	}
+	return self;
+}
+
+void intern_table_destroy (intern_table_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		intern_table_t *self = *self_p;
+		size_t i;
+		for (i = 1; i < self->nbr_entries; i++)
+			free (self->entries[i].str);
+		free (self->entries);
+		free (self->buckets);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+static int intern_hex_digit (char c, bool upper) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (upper && c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (!upper && c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static uint8_t intern_parse (const char *str, byte *uuid) {
+	/**
+	 * converts a UUID to 16 bytes, if it is printed back the same way
+	 *
+	 * @param char* string to intern
+	 * @param byte* 16 bytes for the UUID
+	 *
+	 * @return kind of the string
+	 */
+	size_t length = strlen (str);
+	bool dashed = (length == 36);
+	if (length != 32 && !dashed)
+		return INTERN_STRING;
+	size_t i, n = 0;
+	for (i = 0; i < length; i++) {
+		if (dashed && (i == 8 || i == 13 || i == 18 || i == 23)) {
+			if (str[i] != '-')
+				return INTERN_STRING;
+			continue;
+		}
+		// zyre prints upper case, the dashed form is usually lower case
+		int digit = intern_hex_digit (str[i], !dashed);
+		if (digit < 0)
+			return INTERN_STRING;
+		if (n % 2 == 0)
+			uuid[n / 2] = (byte) (digit << 4);
+		else
+			uuid[n / 2] |= (byte) digit;
+		n++;
+	}
+	return dashed ? INTERN_UUID_DASHED : INTERN_UUID_HEX;
+}
+
+static uint32_t intern_hash (uint8_t kind, const byte *key, size_t size) {
+	// FNV-1a, never 0 as that marks free entries
+	uint32_t hash = (2166136261u ^ kind) * 16777619u;
+	size_t i;
+	for (i = 0; i < size; i++)
+		hash = (hash ^ key[i]) * 16777619u;
+	return hash ? hash : 1;
+}
+
+static intern_t intern_find (intern_table_t *self, const char *str, uint8_t *kind_p, byte *uuid, uint32_t *hash_p) {
+	uint8_t kind = intern_parse (str, uuid);
+	uint32_t hash = kind == INTERN_STRING
+		? intern_hash (kind, (const byte *) str, strlen (str))
+		: intern_hash (kind, uuid, 16);
+	if (kind_p)
+		*kind_p = kind;
+	if (hash_p)
+		*hash_p = hash;
+	intern_t id = self->buckets[hash & (self->nbr_buckets - 1)];
+	while (id != 0) {
+		intern_entry_t *entry = &self->entries[id];
+		if (entry->hash == hash && entry->kind == kind) {
+			if (kind == INTERN_STRING ? streq (entry->str, str) : memcmp (entry->uuid, uuid, 16) == 0)
+				return id;
+		}
+		id = entry->next;
+	}
+	return 0;
+}
+
+intern_t intern_lookup (intern_table_t *self, const char *str) {
+	/**
+	 * @param intern_table_t* to the table
+	 * @param char* string to look up, may be NULL
+	 *
+	 * @return handle of the string, 0 if it is not interned; no reference is taken
+	 */
+	if (!str)
+		return 0;
+	byte uuid[16];
+	return intern_find (self, str, NULL, uuid, NULL);
+}
+
+static int intern_grow (intern_table_t *self) {
+	// doubles the entries, and the buckets along with them
+	size_t nbr_entries = self->nbr_entries * 2;
+	if (nbr_entries > UINT32_MAX)
+		return -1;
+	intern_entry_t *entries = (intern_entry_t *) realloc (self->entries, nbr_entries * sizeof (intern_entry_t));
+	if (!entries)
+		return -1;
+	memset (entries + self->nbr_entries, 0, (nbr_entries - self->nbr_entries) * sizeof (intern_entry_t));
+	self->entries = entries;
+	size_t i;
+	for (i = nbr_entries - 1; i >= self->nbr_entries; i--) {
+		entries[i].next = self->free;
+		self->free = (uint32_t) i;
+	}
+	self->nbr_entries = nbr_entries;
+	if (nbr_entries > self->nbr_buckets) {
+		size_t nbr_buckets = self->nbr_buckets * 2;
+		uint32_t *buckets = (uint32_t *) calloc (nbr_buckets, sizeof (uint32_t));
+		if (!buckets)
+			return 0; // the old buckets still work, only the chains get longer
+		for (i = 1; i < self->nbr_entries; i++) {
+			if (entries[i].hash == 0)
+				continue;
+			uint32_t *bucket = &buckets[entries[i].hash & (nbr_buckets - 1)];
+			entries[i].next = *bucket;
+			*bucket = (uint32_t) i;
+		}
+		free (self->buckets);
+		self->buckets = buckets;
+		self->nbr_buckets = nbr_buckets;
+	}
+	return 0;
+}
+
+intern_t intern (intern_table_t *self, const char *str) {
+	/**
+	 * takes a reference to a string, interning it if it is new
+	 *
+	 * @param intern_table_t* to the table
+	 * @param char* string to intern, may be NULL
+	 *
+	 * @return handle of the string, 0 if str is NULL or out of memory
+	 */
+	if (!str)
+		return 0;
+	uint8_t kind;
+	byte uuid[16];
+	uint32_t hash;
+	intern_t id = intern_find (self, str, &kind, uuid, &hash);
+	if (id != 0) {
+		self->entries[id].refs++;
+		return id;
+	}
+	if (self->free == 0 && intern_grow (self) != 0)
+		return 0;
+	id = self->free;
+	intern_entry_t *entry = &self->entries[id];
+	if (kind == INTERN_STRING) {
+		entry->str = strdup (str);
+		if (!entry->str)
+			return 0;
+	} else
+		memcpy (entry->uuid, uuid, 16);
+	self->free = entry->next;
+	entry->hash = hash;
+	entry->kind = kind;
+	entry->refs = 1;
+	uint32_t *bucket = &self->buckets[hash & (self->nbr_buckets - 1)];
+	entry->next = *bucket;
+	*bucket = id;
+	self->size++;
+	return id;
+}
+
+void intern_release (intern_table_t *self, intern_t id) {
+	/**
+	 * drops a reference taken by intern, the string is removed with the last one
+	 *
+	 * @param intern_table_t* to the table
+	 * @param intern_t handle, may be 0
+	 */
+	if (id == 0)
+		return;
+	intern_entry_t *entry = &self->entries[id];
+	assert (entry->hash != 0 && entry->refs > 0);
+	if (--entry->refs > 0)
+		return;
+	intern_t *link = &self->buckets[entry->hash & (self->nbr_buckets - 1)];
+	while (*link != id)
+		link = &self->entries[*link].next;
+	*link = entry->next;
+	free (entry->str);
+	memset (entry, 0, sizeof (intern_entry_t));
+	entry->next = self->free;
+	self->free = id;
+	self->size--;
+}
+
+const char * intern_str (intern_table_t *self, intern_t id, char *buf) {
+	/**
+	 * @param intern_table_t* to the table
+	 * @param intern_t handle of an interned string
+	 * @param char* buffer of INTERN_BUF_SIZE bytes to print a UUID to
+	 *
+	 * @return the string, in buf or owned by the table; NULL for handle 0
+	 */
+	if (id == 0)
+		return NULL;
+	intern_entry_t *entry = &self->entries[id];
+	if (entry->kind == INTERN_STRING)
+		return entry->str;
+	const char *digits = entry->kind == INTERN_UUID_HEX ? "0123456789ABCDEF" : "0123456789abcdef";
+	char *out = buf;
+	size_t i;
+	for (i = 0; i < 16; i++) {
+		if (entry->kind == INTERN_UUID_DASHED && (i == 4 || i == 6 || i == 8 || i == 10))
+			*out++ = '-';
+		*out++ = digits[entry->uuid[i] >> 4];
+		*out++ = digits[entry->uuid[i] & 0xf];
+	}
+	*out = '\0';
+	return buf;
+}
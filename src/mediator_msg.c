@@ -0,0 +1,291 @@
+#include <mediator.h>
+
+// Encoding and decoding of msgs, and the decoder threads
+
+json_t * load_config_file(char* file) {
+	/**
+	 * loads the config file
+	 *
+	 * @param char* giving the path and filename to be loaded. Must point to a JSON file.
+	 *
+	 * @return jansson encoded json_t* (new reference) containing the content of the file as json object
+	 */
+    json_error_t error;
+    json_t * root;
+    root = json_load_file(file, JSON_ENSURE_ASCII, &error);
+    if(!root) {
+    	printf("Error parsing JSON file! file: %s, line %d: %s\n", error.source, error.line, error.text);
+    	return NULL;
+    }
+    char* dump =  json_dumps(root, JSON_ENCODE_ANY);
+    printf("[%s] config file: %s\n", json_string_value(json_object_get(root, "short-name")), dump);
+    free(dump);
+    return root;
+}
+
+char* encode_msg(char* metamodel, char* model, const char* type, json_t* payload) {
+	/**
+	 * encodes a Sherpa msg in its proper form
+	 *
+	 * @param char* to metamodel
+	 * @param char* to model
+	 * @param char* to msg type
+	 * @param jansson encoded json_t* to payload
+	 *
+	 * @return returns a char* that can be sent by zyre (user must free it afterwards),
+	 * on the heap even if an arena is active
+	 */
+	json_t *msg;
+	msg = json_object();
+	json_object_set_new(msg, "metamodel", json_string(metamodel));
+	json_object_set_new(msg, "model", json_string(model));
+	json_object_set_new(msg, "type", json_string(type));
+	json_object_set(msg, "payload", payload);
+	char *ret = json_dumps(msg, JSON_ENCODE_ANY);
+	json_decref(msg);
+	// it is sent, or kept in the outbox, after the arena of the handler is reset
+	return arena_escape(ret);
+}
+
+int decode_json_content(char* message, json_msg_t *result, bool content) {
+	/**
+	 * decodes a received msg to json_msg types; the fields of the result are
+	 * copied to the heap, so the msg may be parsed in an arena
+	 *
+	 * @param received msg as char*
+	 * @param json_msg_t* at which the result is stored
+	 * @param bool true to keep the parsed payload in result->content as well
+	 *
+	 * @return returns 0 if successful and -1 if an error occurred
+	 */
+    json_t *root;
+    json_error_t error;
+    root = json_loads(message, 0, &error);
+
+    if(!root) {
+    	printf("Error parsing JSON string! line %d: %s\n", error.line, error.text);
+    	return -1;
+    }
+    if (json_object_get(root, "metamodel")) {
+    	result->metamodel = strdup(json_string_value(json_object_get(root, "metamodel")));
+    } else {
+    	printf("Error parsing JSON string! Does not conform to msg model. No metamodel specified.\n");
+    	json_decref(root);
+    	return -1;
+    }
+    if (json_object_get(root, "model")) {
+		result->model = strdup(json_string_value(json_object_get(root, "model")));
+	} else {
+		printf("Error parsing JSON string! Does not conform to msg model. No model specified.\n");
+		json_decref(root);
+		return -1;
+	}
+    if (json_object_get(root, "type")) {
+		result->type = strdup(json_string_value(json_object_get(root, "type")));
+	} else {
+		printf("Error parsing JSON string! Does not conform to msg model.\n");
+		json_decref(root);
+		return -1;
+	}
+    if (json_object_get(root, "payload")) {
+    	char *payload = json_dumps(json_object_get(root, "payload"), JSON_ENCODE_ANY);
+    	result->payload = payload ? strdup(payload) : NULL;
+    	arena_json_free(payload);
+    	if (content) {
+    		// the parsed payload outlives the arena
+    		arena_t *arena = arena_suspend();
+    		result->content = json_deep_copy(json_object_get(root, "payload"));
+    		arena_begin(arena);
+    	}
+	} else {
+		printf("Error parsing JSON string! Does not conform to msg model. No payload specified.\n");
+		json_decref(root);
+		return -1;
+	}
+    json_decref(root);
+    return 0;
+}
+
+int decode_json(char* message, json_msg_t *result) {
+	/**
+	 * decodes a received msg to json_msg types, see decode_json_content
+	 *
+	 * @param received msg as char*
+	 * @param json_msg_t* at which the result is stored
+	 *
+	 * @return returns 0 if successful and -1 if an error occurred
+	 */
+	return decode_json_content(message, result, false);
+}
+
+json_t * message_payload(json_msg_t *msg, json_error_t *error) {
+	/**
+	 * hands the payload parsed by event_decode over to the first handler that
+	 * asks for it, so the main loop does not parse it again; later callers get
+	 * a payload parsed from the string
+	 *
+	 * @param json_msg_t* decoded msg
+	 * @param json_error_t* set if the payload has to be parsed and cannot be
+	 *
+	 * @return json_t* new reference to the payload, NULL on error
+	 */
+	json_t *payload = msg->content;
+	msg->content = NULL;
+	if (payload)
+		return payload;
+	return json_loads(msg->payload, 0, error);
+}
+
+void event_decode (compressor_t *compressor, arena_t *arena, zmsg_t *msg) {
+	/**
+	 * decodes the msg of a zyre SHOUT or WHISPER event, leaving the other
+	 * events as they are. The content is replaced by the message as a string
+	 * and a frame holding the decoded json_msg_t*, which is empty if the
+	 * message could not be decoded; see event_pop_decoded.
+	 *   remote SHOUT:   [peerid][name][group][message][decoded]
+	 *   remote WHISPER: [peerid][name][message][decoded]([contents of a small file])
+	 *   local SHOUT:    [peerid][name][group][message][decoded]
+	 *
+	 * @param compressor_t* to decompress remote msgs, may be NULL
+	 * @param arena_t* scratch memory for parsing, may be NULL
+	 * @param zmsg_t* ["local" or "remote"][event][frames of the event]
+	 */
+	zframe_t *network_frame = zmsg_first (msg);
+	zframe_t *event_frame = zmsg_next (msg);
+	if (!network_frame || !event_frame)
+		return;
+	bool remote = zframe_streq (network_frame, "remote");
+	bool shout = zframe_streq (event_frame, "SHOUT");
+	if (!shout && !(remote && zframe_streq (event_frame, "WHISPER")))
+		return;
+	int64_t start = zclock_usecs ();
+	// the frames in front of the content are kept as they are
+	size_t headers = shout ? 5 : 4;
+	if (zmsg_size (msg) < headers + 1)
+		return;
+	zmsg_t *head = zmsg_new ();
+	while (zmsg_size (head) < headers) {
+		zframe_t *frame = zmsg_pop (msg);
+		zmsg_append (head, &frame);
+	}
+	zmsg_t *content = zmsg_new ();
+	while (zmsg_size (msg) > 0) {
+		zframe_t *frame = zmsg_pop (msg);
+		zmsg_append (content, &frame);
+	}
+	while (zmsg_size (head) > 0) {
+		zframe_t *frame = zmsg_pop (head);
+		zmsg_append (msg, &frame);
+	}
+	zmsg_destroy (&head);
+	char *message = NULL;
+	zframe_t *contents = NULL;
+	if (zmsg_size (content) == 1)
+		message = zmsg_popstr (content);
+	else if (zmsg_size (content) == 3) {
+		// ["file_content"][message][contents of a small file]
+		char *kind = zmsg_popstr (content);
+		zstr_free (&kind);
+		message = zmsg_popstr (content);
+		contents = zmsg_pop (content);
+	} else if (remote && zmsg_size (content) == 2) {
+		// [codec][data] sent by send_compressed
+		char *codec = zmsg_popstr (content);
+		zframe_t *data = zmsg_pop (content);
+		message = compressor_unpack (compressor, codec, data);
+		if (!message)
+			printf ("could not decompress message with codec %s\n", codec);
+		zstr_free (&codec);
+		zframe_destroy (&data);
+	}
+	zmsg_destroy (&content);
+	json_msg_t *result = (json_msg_t *) zmalloc (sizeof (json_msg_t));
+	// the parsed msg is only needed until its fields are copied into result
+	arena_begin (arena);
+	int rc = message ? decode_json_content (message, result, true) : -1;
+	arena_end (arena);
+	if (rc != 0)
+		message_destroy (&result);
+	else {
+		result->decoded = zclock_usecs ();
+		result->decode_usecs = result->decoded - start;
+	}
+	zmsg_addstr (msg, message ? message : "");
+	if (result)
+		zmsg_addmem (msg, &result, sizeof (result));
+	else
+		zmsg_addmem (msg, NULL, 0);
+	if (contents)
+		zmsg_append (msg, &contents);
+	zstr_free (&message);
+}
+
+void event_discard (zmsg_t **msg_p) {
+	/**
+	 * destroys an event decoded by event_decode that is not handled
+	 *
+	 * @param zmsg_t** event, set to NULL
+	 */
+	zmsg_t *msg = *msg_p;
+	zframe_t *network = zmsg_first (msg);
+	zframe_t *event = zmsg_next (msg);
+	bool shout = event && zframe_streq (event, "SHOUT");
+	if (shout || (network && event && zframe_streq (network, "remote") && zframe_streq (event, "WHISPER"))) {
+		// the decoded frame follows the headers and the message
+		size_t position = shout ? 5 : 4;
+		zframe_t *frame = event;
+		while (frame && position-- > 1)
+			frame = zmsg_next (msg);
+		frame = frame ? zmsg_next (msg) : NULL;
+		json_msg_t *result = NULL;
+		if (frame && zframe_size (frame) == sizeof (result)) {
+			memcpy (&result, zframe_data (frame), sizeof (result));
+			message_destroy (&result);
+		}
+	}
+	zmsg_destroy (msg_p);
+}
+
+json_msg_t * event_pop_decoded (zmsg_t *msg) {
+	/**
+	 * @param zmsg_t* event decoded by event_decode, positioned at the decoded frame
+	 *
+	 * @return json_msg_t* to be destroyed by the caller, NULL if the message could not be decoded
+	 */
+	json_msg_t *result = NULL;
+	zframe_t *frame = zmsg_pop (msg);
+	if (frame && zframe_size (frame) == sizeof (result))
+		memcpy (&result, zframe_data (frame), sizeof (result));
+	zframe_destroy (&frame);
+	return result;
+}
+
+void
+decoder_actor (zsock_t *pipe, void *args)
+{
+	const char *decoded_endpoint = ((char**)args)[0];
+	zsock_t *decoded = zsock_new_push (decoded_endpoint);
+	assert (decoded);
+	json_error_t error;
+	json_t *config = json_loads (((char**)args)[1], 0, &error);
+	compressor_t *compressor = config ? compressor_new (config) : NULL;
+	json_decref (config);
+	arena_t *arena = arena_new ();
+
+	zsock_signal (pipe, 0);     //  Signal "ready" to caller
+
+	while (!zsys_interrupted) {
+		zmsg_t *msg = zmsg_recv (pipe);
+		if (!msg)
+			break;              //  Interrupted
+		if (zmsg_size (msg) == 1 && zframe_streq (zmsg_first (msg), "$TERM")) {
+			zmsg_destroy (&msg);
+			break;
+		}
+		event_decode (compressor, arena, msg);
+		zmsg_send (&msg, decoded);
+	}
+	arena_destroy (&arena);
+	compressor_destroy (&compressor);
+	zsock_destroy (&decoded);
+}
@@ -0,0 +1,77 @@
+#include <mediator.h>
+
+// Pools of fixed size records, see pool_t in mediator.h
+
+pool_t * pool_new (size_t size, size_t per_slab) {
+	/**
+	 * @param size_t bytes per record
+	 * @param size_t records allocated at once
+	 *
+	 * @return pool_t*, or NULL on error
+	 */
+	pool_t *self = (pool_t *) zmalloc (sizeof (pool_t));
+	if (!self)
+		return NULL;
+	// free records hold the link, slabs start with one
+	self->size = size < sizeof (void *) ? sizeof (void *) : size;
+	self->size = (self->size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+	self->per_slab = per_slab > 0 ? per_slab : 1;
+	return self;
+}
+
+void pool_destroy (pool_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		pool_t *self = *self_p;
+		void *slab = self->slabs;
+		while (slab != NULL) {
+			void *next = *(void **) slab;
+			free (slab);
+			slab = next;
+		}
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+void * pool_alloc (pool_t *self) {
+	/**
+	 * @param pool_t* to the pool
+	 *
+	 * @return a zeroed record, NULL if out of memory
+	 */
+	if (!self->free) {
+		// the first record of a slab is its link to the next slab
+		byte *slab = (byte *) malloc ((self->per_slab + 1) * self->size);
+		if (!slab)
+			return NULL;
+		*(void **) slab = self->slabs;
+		self->slabs = slab;
+		size_t i;
+		for (i = self->per_slab; i > 0; i--) {
+			void *record = slab + i * self->size;
+			*(void **) record = self->free;
+			self->free = record;
+		}
+		self->capacity += self->per_slab;
+	}
+	void *record = self->free;
+	self->free = *(void **) record;
+	self->live++;
+	memset (record, 0, self->size);
+	return record;
+}
+
+void pool_free (pool_t *self, void *record) {
+	/**
+	 * returns a record taken from the pool
+	 *
+	 * @param pool_t* to the pool
+	 * @param void* record, may be NULL
+	 */
+	if (!record)
+		return;
+	*(void **) record = self->free;
+	self->free = record;
+	self->live--;
+}
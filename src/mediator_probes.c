@@ -0,0 +1,18 @@
+#include <mediator.h>
+
+// Semaphores of the static probes, see MEDIATOR_PROBE in mediator.h. A tracer
+// attaching to a probe increments its semaphore, so the arguments of a probe
+// are only computed while somebody listens.
+#ifdef HAVE_USDT
+MEDIATOR_PROBE_SEMAPHORE(msg_receive);
+MEDIATOR_PROBE_SEMAPHORE(msg_dispatch);
+MEDIATOR_PROBE_SEMAPHORE(outbox_enqueue);
+MEDIATOR_PROBE_SEMAPHORE(outbox_ack);
+MEDIATOR_PROBE_SEMAPHORE(outbox_resend);
+MEDIATOR_PROBE_SEMAPHORE(outbox_delivered);
+MEDIATOR_PROBE_SEMAPHORE(outbox_timeout);
+MEDIATOR_PROBE_SEMAPHORE(filter_hit);
+MEDIATOR_PROBE_SEMAPHORE(filter_miss);
+MEDIATOR_PROBE_SEMAPHORE(transfer_chunk_send);
+MEDIATOR_PROBE_SEMAPHORE(transfer_chunk_receive);
+#endif
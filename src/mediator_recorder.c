@@ -0,0 +1,128 @@
+#include <mediator.h>
+
+// Trace of the last msgs, see recorder_t in mediator.h
+
+const char * trace_event_name (uint32_t event) {
+	static const char *names[TRACE_EVENTS] = { "?",
+		"received", "handled", "sent", "queued", "unknown", "resend", "ack", "report",
+		"remote_received", "ack_sent", "forwarded", "filtered" };
+	return event < TRACE_EVENTS ? names[event] : "?";
+}
+
+recorder_t * recorder_new (size_t capacity) {
+	/**
+	 * @param size_t records kept, at least 1
+	 *
+	 * @return recorder_t*, or NULL on error
+	 */
+	recorder_t *self = (recorder_t *) zmalloc (sizeof (recorder_t));
+	if (!self)
+		return NULL;
+	self->capacity = capacity > 0 ? capacity : 1;
+	self->records = (trace_record_t *) calloc (self->capacity, sizeof (trace_record_t));
+	if (!self->records) {
+		free (self);
+		return NULL;
+	}
+	return self;
+}
+
+void recorder_destroy (recorder_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		recorder_t *self = *self_p;
+		free (self->records);
+		free (self);
+		*self_p = NULL;
+	}
+}
+
+void recorder_trace_at (recorder_t *self, int64_t ts, trace_event_t event, const char *uid, const char *peer, int64_t value) {
+	/**
+	 * records an event of a msg
+	 *
+	 * @param recorder_t* to the recorder, may be NULL if tracing is disabled
+	 * @param int64_t zclock_usecs of the event
+	 * @param trace_event_t what happened
+	 * @param char* UID of the msg, may be NULL
+	 * @param char* peerid involved, may be NULL
+	 * @param int64_t value of the event, clamped to 32 bits
+	 */
+	if (!self)
+		return;
+	trace_record_t *record = &self->records[self->next++ % self->capacity];
+	record->ts = ts;
+	record->event = event;
+	record->value = value < 0 ? 0 : value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+	strncpy (record->uid, uid ? uid : "", TRACE_ID_SIZE - 1);
+	record->uid[TRACE_ID_SIZE - 1] = '\0';
+	strncpy (record->peer, peer ? peer : "", TRACE_ID_SIZE - 1);
+	record->peer[TRACE_ID_SIZE - 1] = '\0';
+}
+
+void recorder_trace (recorder_t *self, trace_event_t event, const char *uid, const char *peer, int64_t value) {
+	if (self)
+		recorder_trace_at (self, zclock_usecs (), event, uid, peer, value);
+}
+
+int recorder_dump (recorder_t *self, const char *name, const char *path) {
+	/**
+	 * writes the records to a file, replacing it once they are complete
+	 *
+	 * @param recorder_t* to the recorder
+	 * @param char* short-name of the mediator
+	 * @param char* path of the file
+	 *
+	 * @return number of records written, -1 if an error occurred
+	 */
+	char *tmp = (char *) malloc (strlen (path) + 5);
+	assert (tmp);
+	sprintf (tmp, "%s.tmp", path);
+	FILE *file = fopen (tmp, "w");
+	if (!file) {
+		printf("[%s] cannot write trace to %s: %s\n", name, tmp, strerror (errno));
+		free (tmp);
+		return -1;
+	}
+	trace_header_t header;
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, TRACE_MAGIC, sizeof (header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof (trace_record_t);
+	header.records = self->next < self->capacity ? self->next : self->capacity;
+	header.lost = self->next - header.records;
+	strncpy (header.name, name, TRACE_ID_SIZE - 1);
+	bool ok = fwrite (&header, sizeof (header), 1, file) == 1;
+	// the oldest record is the next one to be overwritten
+	uint64_t i;
+	for (i = self->next - header.records; ok && i < self->next; i++)
+		ok = fwrite (&self->records[i % self->capacity], sizeof (trace_record_t), 1, file) == 1;
+	ok = (fclose (file) == 0) && ok;
+	if (ok && rename (tmp, path) != 0)
+		ok = false;
+	if (!ok) {
+		printf("[%s] cannot write trace to %s: %s\n", name, path, strerror (errno));
+		unlink (tmp);
+	}
+	free (tmp);
+	return ok ? (int) header.records : -1;
+}
+
+int mediator_dump_trace (mediator_t *self, const char *path) {
+	/**
+	 * writes the flight recorder of a mediator to a file
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* file to dump to, NULL for the configured trace_file
+	 *
+	 * @return number of records dumped, -1 if tracing is disabled or an error occurred
+	 */
+	if (!self->recorder) {
+		printf("[%s] tracing is disabled\n", self->shortname);
+		return -1;
+	}
+	int records = recorder_dump(self->recorder, self->shortname, path ? path : self->trace_file);
+	if (records >= 0)
+		printf("[%s] dumped %d trace records to %s\n", self->shortname, records, path ? path : self->trace_file);
+	return records;
+}
@@ -0,0 +1,108 @@
+#include "mediator.h"
+
+// Shows the stats a running mediator publishes in shared memory, see
+// stats_page_t. The page is only read, so the mediator is not slowed down.
+//   sherpa_comm_mediator_stats <short-name> [interval in msec]
+
+void print_histogram(const char *name, histogram_t *histogram, const char *unit) {
+	printf("  %-16s count %-8lu p50 %-8lu p99 %-8lu p99.9 %-8lu max %lu %s\n", name,
+			(unsigned long) STATS_GET(histogram->count),
+			(unsigned long) histogram_percentile(histogram, 50),
+			(unsigned long) histogram_percentile(histogram, 99),
+			(unsigned long) histogram_percentile(histogram, 99.9),
+			(unsigned long) STATS_GET(histogram->max), unit);
+}
+
+void print_traffic(const char *name, stats_network_t *traffic) {
+	printf("  %-34s in %8lu msgs %12lu bytes   out %8lu msgs %12lu bytes\n", name,
+			(unsigned long) STATS_GET(traffic->msgs_in), (unsigned long) STATS_GET(traffic->bytes_in),
+			(unsigned long) STATS_GET(traffic->msgs_out), (unsigned long) STATS_GET(traffic->bytes_out));
+}
+
+void print_page(stats_page_t *page) {
+	/**
+	 * @param stats_page_t* mapped read-only
+	 */
+	stats_t *stats = &page->stats;
+	stats_gauges_t gauges;
+	stats_read_gauges(stats, &gauges);
+	printf("mediator %s (pid %ld), up %ld sec\n", page->name, (long) page->pid,
+			(long) ((zclock_time() - stats->started) / 1000));
+	printf("gauges\n");
+	printf("  outbox %lu, filter list %lu, local queries %lu, remote queries %lu\n",
+			(unsigned long) gauges.outbox, (unsigned long) gauges.filter_list,
+			(unsigned long) gauges.local_queries, (unsigned long) gauges.remote_queries);
+	printf("  transfers running %lu, queued %lu, distributions %lu, interned ids %lu\n",
+			(unsigned long) gauges.transfers_running, (unsigned long) gauges.transfers_queued,
+			(unsigned long) gauges.distributions, (unsigned long) gauges.interned_ids);
+	printf("traffic\n");
+	print_traffic("local", &stats->networks[STATS_LOCAL]);
+	print_traffic("remote", &stats->networks[STATS_REMOTE]);
+	uint64_t nbr_peers = __atomic_load_n(&stats->nbr_peers, __ATOMIC_ACQUIRE);
+	size_t i;
+	for (i = 0; i < nbr_peers && i < STATS_PEERS; i++)
+		print_traffic(stats->peers[i].peerid, &stats->peers[i].traffic);
+	printf("outbox\n");
+	printf("  send requests %lu, delivered %lu, resends %lu, timeouts %lu\n",
+			(unsigned long) STATS_GET(stats->send_requests), (unsigned long) STATS_GET(stats->delivered),
+			(unsigned long) STATS_GET(stats->resends), (unsigned long) STATS_GET(stats->timeouts));
+	print_histogram("report latency", &stats->report_latency, "usec");
+	for (i = 0; i < nbr_peers && i < STATS_PEERS; i++) {
+		if (STATS_GET(stats->peers[i].ack_rtt.count) > 0)
+			print_histogram(stats->peers[i].peerid, &stats->peers[i].ack_rtt, "usec");
+	}
+	printf("file transfers\n");
+	printf("  completed %lu, failed %lu\n",
+			(unsigned long) STATS_GET(stats->file_transfers), (unsigned long) STATS_GET(stats->file_transfers_failed));
+	print_histogram("throughput", &stats->file_throughput, "KB/s");
+	printf("main loop\n");
+	print_histogram("latency", &stats->loop_latency, "usec");
+	printf("msgs received\n");
+	uint64_t nbr_types = __atomic_load_n(&stats->nbr_types, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nbr_types && i < STATS_MSG_TYPES; i++)
+		printf("  %-34s %lu\n", stats->types[i].type, (unsigned long) STATS_GET(stats->types[i].received));
+	if (STATS_GET(stats->other_types) > 0)
+		printf("  %-34s %lu\n", "other", (unsigned long) STATS_GET(stats->other_types));
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("usage: %s <short-name> [interval in msec]\n", argv[0]);
+		return -1;
+	}
+	int interval = argc > 2 ? atoi(argv[2]) : 0;
+	char path[STATS_NAME_SIZE + 32];
+	snprintf(path, sizeof(path), STATS_PAGE_PREFIX "%s", argv[1]);
+	int fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		printf("[mediator_stats] No stats of mediator %s: %s\n", argv[1], strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(stats_page_t)) {
+		printf("[mediator_stats] Stats page %s is too small, is the mediator of another version?\n", path);
+		close(fd);
+		return -1;
+	}
+	stats_page_t *page = (stats_page_t *) mmap(NULL, sizeof(stats_page_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		printf("[mediator_stats] Cannot map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATS_PAGE_MAGIC
+	||  page->version != STATS_PAGE_VERSION || page->size != sizeof(stats_page_t)) {
+		printf("[mediator_stats] %s is not a stats page of version %d\n", path, STATS_PAGE_VERSION);
+		munmap(page, sizeof(stats_page_t));
+		return -1;
+	}
+	while (!zsys_interrupted) {
+		print_page(page);
+		if (interval <= 0)
+			break;
+		printf("\n");
+		zclock_sleep(interval);
+	}
+	munmap(page, sizeof(stats_page_t));
+	return 0;
+}
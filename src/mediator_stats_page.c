@@ -0,0 +1,336 @@
+#include <mediator.h>
+
+// Counters and histograms of the mediator and the shared memory page they
+// are published in, see stats_t in mediator.h
+
+size_t histogram_index (uint64_t value) {
+	if (value >= ((uint64_t) 1 << HISTOGRAM_MAX_BITS))
+		value = ((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1;
+	if (value < 2 * HISTOGRAM_SUB)
+		return (size_t) value;
+	int msb = 63 - __builtin_clzll (value);
+	return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB
+		+ ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+uint64_t histogram_lowest (size_t index) {
+	/**
+	 * @param size_t index of a bucket
+	 *
+	 * @return lowest value counted in the bucket
+	 */
+	if (index < 2 * HISTOGRAM_SUB)
+		return index;
+	int msb = index / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+	return (uint64_t) (HISTOGRAM_SUB + index % HISTOGRAM_SUB) << (msb - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_record (histogram_t *self, uint64_t value) {
+	STATS_ADD (self->buckets[histogram_index (value)], 1);
+	STATS_ADD (self->count, 1);
+	STATS_ADD (self->sum, value);
+	uint64_t max = STATS_GET (self->max);
+	while (value > max
+		&& !__atomic_compare_exchange_n (&self->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t histogram_percentile (histogram_t *self, double percentile) {
+	/**
+	 * @param histogram_t* to the histogram
+	 * @param double percentile, 0 to 100
+	 *
+	 * @return highest value of the bucket the percentile falls in, 0 if empty
+	 */
+	uint64_t count = STATS_GET (self->count);
+	if (count == 0)
+		return 0;
+	uint64_t rank = (uint64_t) (percentile / 100.0 * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	size_t i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += STATS_GET (self->buckets[i]);
+		if (seen >= rank)
+			break;
+	}
+	uint64_t max = STATS_GET (self->max);
+	if (i >= HISTOGRAM_BUCKETS - 1)
+		return max;
+	uint64_t highest = histogram_lowest (i + 1) - 1;
+	return highest < max ? highest : max;
+}
+
+json_t * histogram_json (histogram_t *self) {
+	/**
+	 * @param histogram_t* to the histogram
+	 *
+	 * @return json object with the count, mean, max, percentiles and the
+	 *         non-empty buckets as [lowest value, count] pairs
+	 */
+	json_t *histogram = json_object();
+	uint64_t count = STATS_GET (self->count);
+	json_object_set_new(histogram, "count", json_integer(count));
+	json_object_set_new(histogram, "mean", json_integer(count ? STATS_GET (self->sum) / count : 0));
+	json_object_set_new(histogram, "max", json_integer(STATS_GET (self->max)));
+	json_object_set_new(histogram, "p50", json_integer(histogram_percentile (self, 50)));
+	json_object_set_new(histogram, "p90", json_integer(histogram_percentile (self, 90)));
+	json_object_set_new(histogram, "p99", json_integer(histogram_percentile (self, 99)));
+	json_object_set_new(histogram, "p99.9", json_integer(histogram_percentile (self, 99.9)));
+	json_t *buckets = json_array();
+	size_t i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t n = STATS_GET (self->buckets[i]);
+		if (n == 0)
+			continue;
+		json_t *bucket = json_array();
+		json_array_append_new(bucket, json_integer(histogram_lowest (i)));
+		json_array_append_new(bucket, json_integer(n));
+		json_array_append_new(buckets, bucket);
+	}
+	json_object_set_new(histogram, "buckets", buckets);
+	return histogram;
+}
+
+void stats_count_type (stats_t *self, const char *type) {
+	/**
+	 * counts a received msg by its type
+	 *
+	 * Only the main loop adds types; the entry is filled in before it is
+	 * published through nbr_types.
+	 *
+	 * @param stats_t* to the stats
+	 * @param char* type of the decoded msg
+	 */
+	uint64_t nbr_types = __atomic_load_n (&self->nbr_types, __ATOMIC_ACQUIRE);
+	size_t i;
+	for (i = 0; i < nbr_types; i++) {
+		if (strncmp (self->types[i].type, type, STATS_NAME_SIZE - 1) == 0) {
+			STATS_ADD (self->types[i].received, 1);
+			return;
+		}
+	}
+	if (nbr_types == STATS_MSG_TYPES) {
+		STATS_ADD (self->other_types, 1);
+		return;
+	}
+	strncpy (self->types[nbr_types].type, type, STATS_NAME_SIZE - 1);
+	self->types[nbr_types].received = 1;
+	__atomic_store_n (&self->nbr_types, nbr_types + 1, __ATOMIC_RELEASE);
+}
+
+stats_peer_t * stats_peer (stats_t *self, const char *peerid) {
+	/**
+	 * Only the main loop adds peers, like stats_count_type.
+	 *
+	 * @param stats_t* to the stats
+	 * @param char* peerid of a remote peer
+	 *
+	 * @return stats of the peer, NULL if all entries are taken
+	 */
+	uint64_t nbr_peers = __atomic_load_n (&self->nbr_peers, __ATOMIC_ACQUIRE);
+	size_t i;
+	for (i = 0; i < nbr_peers; i++) {
+		if (strncmp (self->peers[i].peerid, peerid, STATS_NAME_SIZE - 1) == 0)
+			return &self->peers[i];
+	}
+	if (nbr_peers == STATS_PEERS)
+		return NULL;
+	strncpy (self->peers[nbr_peers].peerid, peerid, STATS_NAME_SIZE - 1);
+	__atomic_store_n (&self->nbr_peers, nbr_peers + 1, __ATOMIC_RELEASE);
+	return &self->peers[nbr_peers];
+}
+
+void stats_publish_gauges (stats_t *self, const stats_gauges_t *gauges) {
+	/**
+	 * writes the gauges; only the main loop writes them
+	 *
+	 * @param stats_t* to the stats
+	 * @param stats_gauges_t* new values
+	 */
+	uint64_t seq = self->seq;
+	__atomic_store_n (&self->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	const uint64_t *from = (const uint64_t *) gauges;
+	uint64_t *to = (uint64_t *) &self->gauges;
+	size_t i;
+	for (i = 0; i < sizeof (stats_gauges_t) / sizeof (uint64_t); i++)
+		__atomic_store_n (&to[i], from[i], __ATOMIC_RELAXED);
+	__atomic_store_n (&self->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void stats_read_gauges (stats_t *self, stats_gauges_t *gauges) {
+	/**
+	 * reads a consistent copy of the gauges, from any thread or process
+	 *
+	 * @param stats_t* to the stats
+	 * @param stats_gauges_t* copy of the gauges
+	 */
+	uint64_t *from = (uint64_t *) &self->gauges;
+	uint64_t *to = (uint64_t *) gauges;
+	uint64_t before, after;
+	do {
+		before = __atomic_load_n (&self->seq, __ATOMIC_ACQUIRE);
+		size_t i;
+		for (i = 0; i < sizeof (stats_gauges_t) / sizeof (uint64_t); i++)
+			to[i] = __atomic_load_n (&from[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		after = __atomic_load_n (&self->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+}
+
+json_t * stats_json (stats_t *self) {
+	/**
+	 * @param stats_t* to the stats
+	 *
+	 * @return json object with all counters and histograms
+	 */
+	json_t *stats = json_object();
+	json_object_set_new(stats, "uptime", json_integer(zclock_time () - self->started));
+	stats_gauges_t gauges;
+	stats_read_gauges (self, &gauges);
+	json_t *current = json_object();
+	json_object_set_new(current, "filter_list", json_integer(gauges.filter_list));
+	json_object_set_new(current, "local_queries", json_integer(gauges.local_queries));
+	json_object_set_new(current, "remote_queries", json_integer(gauges.remote_queries));
+	json_object_set_new(current, "transfers_running", json_integer(gauges.transfers_running));
+	json_object_set_new(current, "transfers_queued", json_integer(gauges.transfers_queued));
+	json_object_set_new(current, "distributions", json_integer(gauges.distributions));
+	json_object_set_new(current, "interned_ids", json_integer(gauges.interned_ids));
+	json_object_set_new(stats, "gauges", current);
+	json_object_set_new(stats, "loop_latency", histogram_json (&self->loop_latency));
+	const char *names[STATS_NETWORKS] = { "local", "remote" };
+	json_t *networks = json_object();
+	size_t i;
+	for (i = 0; i < STATS_NETWORKS; i++) {
+		json_t *network = json_object();
+		json_object_set_new(network, "msgs_in", json_integer(STATS_GET (self->networks[i].msgs_in)));
+		json_object_set_new(network, "bytes_in", json_integer(STATS_GET (self->networks[i].bytes_in)));
+		json_object_set_new(network, "msgs_out", json_integer(STATS_GET (self->networks[i].msgs_out)));
+		json_object_set_new(network, "bytes_out", json_integer(STATS_GET (self->networks[i].bytes_out)));
+		json_object_set_new(networks, names[i], network);
+	}
+	json_object_set_new(stats, "networks", networks);
+	json_t *types = json_object();
+	uint64_t nbr_types = __atomic_load_n (&self->nbr_types, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nbr_types; i++)
+		json_object_set_new(types, self->types[i].type, json_integer(STATS_GET (self->types[i].received)));
+	if (STATS_GET (self->other_types) > 0)
+		json_object_set_new(types, "other", json_integer(STATS_GET (self->other_types)));
+	json_object_set_new(stats, "msgs_received", types);
+	json_t *outbox = json_object();
+	json_object_set_new(outbox, "depth", json_integer(gauges.outbox));
+	json_object_set_new(outbox, "send_requests", json_integer(STATS_GET (self->send_requests)));
+	json_object_set_new(outbox, "delivered", json_integer(STATS_GET (self->delivered)));
+	json_object_set_new(outbox, "resends", json_integer(STATS_GET (self->resends)));
+	json_object_set_new(outbox, "timeouts", json_integer(STATS_GET (self->timeouts)));
+	json_object_set_new(outbox, "report_latency", histogram_json (&self->report_latency));
+	json_t *rtt = json_object();
+	json_t *peers = json_object();
+	uint64_t nbr_peers = __atomic_load_n (&self->nbr_peers, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nbr_peers; i++) {
+		stats_peer_t *peer = &self->peers[i];
+		if (STATS_GET (peer->ack_rtt.count) > 0)
+			json_object_set_new(rtt, peer->peerid, histogram_json (&peer->ack_rtt));
+		json_t *traffic = json_object();
+		json_object_set_new(traffic, "msgs_in", json_integer(STATS_GET (peer->traffic.msgs_in)));
+		json_object_set_new(traffic, "bytes_in", json_integer(STATS_GET (peer->traffic.bytes_in)));
+		json_object_set_new(traffic, "msgs_out", json_integer(STATS_GET (peer->traffic.msgs_out)));
+		json_object_set_new(traffic, "bytes_out", json_integer(STATS_GET (peer->traffic.bytes_out)));
+		json_object_set_new(peers, peer->peerid, traffic);
+	}
+	json_object_set_new(outbox, "ack_rtt", rtt);
+	json_object_set_new(stats, "outbox", outbox);
+	json_object_set_new(stats, "peers", peers);
+	json_t *transfers = json_object();
+	json_object_set_new(transfers, "completed", json_integer(STATS_GET (self->file_transfers)));
+	json_object_set_new(transfers, "failed", json_integer(STATS_GET (self->file_transfers_failed)));
+	json_object_set_new(transfers, "throughput", histogram_json (&self->file_throughput));
+	json_object_set_new(stats, "file_transfers", transfers);
+	return stats;
+}
+
+stats_page_t * stats_page_new (const char *name, bool shared) {
+	/**
+	 * @param char* short-name of the mediator
+	 * @param bool true to map the page to shared memory; heap memory is used
+	 *        if that fails
+	 *
+	 * @return stats_page_t*, NULL if out of memory
+	 */
+	stats_page_t *self = NULL;
+	char path[STATS_NAME_SIZE + 32];
+	snprintf (path, sizeof (path), STATS_PAGE_PREFIX "%s", name);
+	int fd = shared ? shm_open (path, O_CREAT | O_RDWR, 0644) : -1;
+	if (fd >= 0 && ftruncate (fd, sizeof (stats_page_t)) == 0) {
+		void *page = mmap (NULL, sizeof (stats_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (page != MAP_FAILED) {
+			self = (stats_page_t *) page;
+			// short-names do not have to be unique; leave the page to the mediator that
+			// runs, possibly in this process, and take it over from one that crashed
+			if (self->magic == STATS_PAGE_MAGIC && kill ((pid_t) self->pid, 0) == 0) {
+				printf("[%s] stats page %s is used by process %ld\n", name, path, (long) self->pid);
+				munmap (page, sizeof (stats_page_t));
+				self = NULL;
+			}
+		}
+	}
+	if (fd >= 0)
+		close (fd);
+	else if (shared)
+		printf("[%s] could not open stats page %s: %s\n", name, path, strerror (errno));
+	if (self) {
+		__atomic_store_n (&self->magic, 0, __ATOMIC_RELAXED);
+		memset (self, 0, sizeof (stats_page_t));
+		self->shared = true;
+	} else {
+		self = (stats_page_t *) zmalloc (sizeof (stats_page_t));
+		if (!self)
+			return NULL;
+	}
+	self->version = STATS_PAGE_VERSION;
+	self->size = sizeof (stats_page_t);
+	self->pid = getpid ();
+	strncpy (self->name, name, STATS_NAME_SIZE - 1);
+	self->stats.started = zclock_time ();
+	__atomic_store_n (&self->magic, STATS_PAGE_MAGIC, __ATOMIC_RELEASE);
+	return self;
+}
+
+void stats_page_destroy (stats_page_t **self_p) {
+	assert (self_p);
+	if (*self_p) {
+		stats_page_t *self = *self_p;
+		if (self->shared) {
+			char path[STATS_NAME_SIZE + 32];
+			snprintf (path, sizeof (path), STATS_PAGE_PREFIX "%s", self->name);
+			shm_unlink (path);
+			munmap (self, sizeof (stats_page_t));
+		} else
+			free (self);
+		*self_p = NULL;
+	}
+}
+
+void mediator_publish_stats (mediator_t *self, int64_t woken) {
+	/**
+	 * records how long the main loop was busy and publishes the gauges if
+	 * they changed
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param int64_t zclock_usecs when the main loop woke up
+	 */
+	histogram_record (&self->stats->loop_latency, zclock_usecs () - woken);
+	stats_gauges_t gauges;
+	gauges.outbox = self->send_msg_pool->live;
+	gauges.filter_list = self->filter_pool->live;
+	gauges.local_queries = zhash_size (self->local_queries);
+	gauges.remote_queries = zhash_size (self->remote_queries);
+	gauges.transfers_running = zhash_size (self->query_actors);
+	gauges.transfers_queued = zlist_size (self->transfer_queue);
+	gauges.distributions = zhash_size (self->distributions);
+	gauges.interned_ids = self->ids->size;
+	if (memcmp (&gauges, &self->stats->gauges, sizeof (stats_gauges_t)) != 0)
+		stats_publish_gauges (self->stats, &gauges);
+}
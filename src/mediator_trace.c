@@ -0,0 +1,99 @@
+#include "mediator.h"
+
+// Prints the trace a mediator dumps on SIGUSR1 or the dump_trace msg, see
+// recorder_t: one timeline per msg UID, in the order the msgs were first seen.
+//   sherpa_comm_mediator_trace <trace file> [UID]
+
+typedef struct _timeline_t {
+	char uid[TRACE_ID_SIZE];
+	zlist_t *records; // trace_record_t*, owned by the array read from the file
+} timeline_t;
+
+void timeline_destroy(timeline_t **self_p) {
+	timeline_t *self = *self_p;
+	zlist_destroy(&self->records);
+	free(self);
+	*self_p = NULL;
+}
+
+void print_timeline(timeline_t *timeline) {
+	/**
+	 * @param timeline_t* records of one msg in the order they were written
+	 */
+	printf("%s\n", timeline->uid[0] ? timeline->uid : "(no UID)");
+	trace_record_t *first = (trace_record_t *) zlist_first(timeline->records);
+	trace_record_t *previous = first;
+	trace_record_t *it = first;
+	while (it) {
+		printf("  +%-10ld (+%-10ld) %-16s %-36s %u\n",
+				(long) (it->ts - first->ts), (long) (it->ts - previous->ts),
+				trace_event_name(it->event), it->peer, it->value);
+		previous = it;
+		it = (trace_record_t *) zlist_next(timeline->records);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("usage: %s <trace file> [UID]\n", argv[0]);
+		return -1;
+	}
+	const char *only = argc > 2 ? argv[2] : NULL;
+	FILE *file = fopen(argv[1], "r");
+	if (!file) {
+		printf("[mediator_trace] Cannot open %s: %s\n", argv[1], strerror(errno));
+		return -1;
+	}
+	trace_header_t header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+	||  memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+	||  header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+		printf("[mediator_trace] %s is not a trace of version %d\n", argv[1], TRACE_VERSION);
+		fclose(file);
+		return -1;
+	}
+	header.name[TRACE_ID_SIZE - 1] = '\0';
+	trace_record_t *records = (trace_record_t *) calloc(header.records ? header.records : 1, sizeof(trace_record_t));
+	assert(records);
+	size_t nbr_records = fread(records, sizeof(trace_record_t), header.records, file);
+	fclose(file);
+	if (nbr_records < header.records)
+		printf("[mediator_trace] %s is truncated, %lu of %lu records read\n", argv[1],
+				(unsigned long) nbr_records, (unsigned long) header.records);
+	printf("trace of mediator %s: %lu records, %lu older ones overwritten\n\n", header.name,
+			(unsigned long) nbr_records, (unsigned long) header.lost);
+
+	// group the records by UID, keeping the order of the first record of each
+	zhash_t *by_uid = zhash_new();
+	zlist_t *timelines = zlist_new();
+	size_t i;
+	for (i = 0; i < nbr_records; i++) {
+		trace_record_t *record = &records[i];
+		record->uid[TRACE_ID_SIZE - 1] = '\0';
+		record->peer[TRACE_ID_SIZE - 1] = '\0';
+		if (only && !streq(record->uid, only))
+			continue;
+		timeline_t *timeline = (timeline_t *) zhash_lookup(by_uid, record->uid);
+		if (!timeline) {
+			timeline = (timeline_t *) zmalloc(sizeof(timeline_t));
+			strcpy(timeline->uid, record->uid);
+			timeline->records = zlist_new();
+			zhash_insert(by_uid, record->uid, timeline);
+			zlist_append(timelines, timeline);
+		}
+		zlist_append(timeline->records, record);
+	}
+	timeline_t *timeline = (timeline_t *) zlist_first(timelines);
+	while (timeline) {
+		print_timeline(timeline);
+		timeline = (timeline_t *) zlist_next(timelines);
+	}
+	if (only && zlist_size(timelines) == 0)
+		printf("[mediator_trace] No records of %s\n", only);
+	zhash_destroy(&by_uid);
+	while ((timeline = (timeline_t *) zlist_pop(timelines)))
+		timeline_destroy(&timeline);
+	zlist_destroy(&timelines);
+	free(records);
+	return 0;
+}
@@ -4,8 +4,14 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
 #include <mediator.h>
 
+static void inproc_client_free (void *data) {
+	zframe_t *identity = (zframe_t *) data;
+	zframe_destroy (&identity);
+}
+
 
 
 
@@ -39,50 +45,837 @@ void create_team(zyre_t *remote, char *payload) {
 }
 */
 
+///////////////////////////////////////////////////
+// compressed remote traffic
+bool peer_accepts_dictionary(mediator_t *self, const char *peerid, unsigned dict_id) {
+	/**
+	 * checks whether remote peers advertised the codec we compress with and
+	 * the dictionary we would compress with
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid to check, or NULL to check all remote peers
+	 * @param unsigned dictionary id, 0 to check the codec only
+	 *
+	 * @return true if messages compressed this way may be sent
+	 */
+	if (!self->compressor)
+		return false;
+	if (peerid)
+		return codecs_accept((const char *) zhash_lookup(self->peer_codecs, peerid), dict_id);
+	if (zhash_size(self->peer_codecs) == 0)
+		return false;
+	const char *codecs = (const char *) zhash_first(self->peer_codecs);
+	while (codecs != NULL) {
+		if (!codecs_accept(codecs, dict_id))
+			return false;
+		codecs = (const char *) zhash_next(self->peer_codecs);
+	}
+	return true;
+}
+
+bool peer_accepts_compression(mediator_t *self, const char *peerid) {
+	/**
+	 * checks whether remote peers advertised the codec we compress with
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid to check, or NULL to check all remote peers
+	 *
+	 * @return true if compressed messages may be sent
+	 */
+	return peer_accepts_dictionary(self, peerid, 0);
+}
+
+char * peer_endpoint(mediator_t *self, const char *peerid, const char *uri) {
+	/**
+	 * resolves the endpoint a remote peer advertised for its file server. A
+	 * wildcard host is replaced by the host zyre reported for the peer on ENTER,
+	 * which we know to be reachable.
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the remote peer
+	 * @param char* advertised endpoint, e.g. tcp://\*:40123
+	 *
+	 * @return endpoint to connect to, to be freed by the caller
+	 */
+	const char *wildcard = strstr(uri, "://*:");
+	const char *address = (const char *) zhash_lookup(self->peer_addresses, peerid);
+	const char *host = address ? strstr(address, "://") : NULL;
+	const char *port = host ? strrchr(address, ':') : NULL;
+	if (!wildcard || !host || port <= host + 3)
+		return strdup(uri);
+	host += 3;
+	size_t prefix = wildcard + 3 - uri;
+	char *endpoint = (char *) malloc(prefix + (port - host) + strlen(wildcard + 4) + 1);
+	assert (endpoint);
+	sprintf(endpoint, "%.*s%.*s%s", (int) prefix, uri, (int) (port - host), host, wildcard + 4);
+	return endpoint;
+}
+
+void stats_count_out(mediator_t *self, const char *peerid, size_t bytes) {
+	/**
+	 * counts a msg sent to the remote network
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid it was whispered to, NULL if it was shouted
+	 * @param size_t size of the msg
+	 */
+	STATS_ADD(self->stats->networks[STATS_REMOTE].msgs_out, 1);
+	STATS_ADD(self->stats->networks[STATS_REMOTE].bytes_out, bytes);
+	stats_peer_t *peer = peerid ? stats_peer(self->stats, peerid) : NULL;
+	if (peer) {
+		STATS_ADD(peer->traffic.msgs_out, 1);
+		STATS_ADD(peer->traffic.bytes_out, bytes);
+	}
+}
+
+void send_compressed(mediator_t *self, const char *target, bool shout, const char *payload_type, const char *msg, zframe_t **compressed_p) {
+	/**
+	 * sends an encoded msg to remote peers, as [codec][data] if they accept it
+	 * and it compresses well, as a plain string otherwise
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* group to shout to or peer to whisper to
+	 * @param bool true to shout, false to whisper
+	 * @param char* payload_type of the msg, selects the compression dictionary
+	 * @param char* encoded msg
+	 * @param zframe_t** keeps the compressed msg for resending; may be NULL
+	 */
+	if (peer_accepts_compression(self, shout ? NULL : target)) {
+		// the dictionary is only used if every receiver loaded it
+		unsigned dict_id = compressor_dictionary(self->compressor, payload_type);
+		bool dictionary = dict_id && peer_accepts_dictionary(self, shout ? NULL : target, dict_id);
+		// a peer without it may have joined since the msg was compressed
+		if (compressed_p && *compressed_p && compressor_frame_dictionary(*compressed_p) != (dictionary ? dict_id : 0))
+			zframe_destroy(compressed_p);
+		zframe_t *compressed = NULL;
+		if (compressed_p && *compressed_p)
+			compressed = zframe_dup(*compressed_p);
+		else
+			compressed = compressor_pack(self->compressor, payload_type, msg, dictionary);
+		if (compressed) {
+			if (compressed_p && !*compressed_p)
+				*compressed_p = zframe_dup(compressed);
+			zmsg_t *zmsg = zmsg_new();
+			zmsg_addstr(zmsg, COMPRESSION_CODEC);
+			zmsg_append(zmsg, &compressed);
+			stats_count_out(self, shout ? NULL : target, zmsg_content_size(zmsg));
+			if (shout)
+				zyre_shout(self->remote, target, &zmsg);
+			else
+				zyre_whisper(self->remote, target, &zmsg);
+			return;
+		}
+	}
+	stats_count_out(self, shout ? NULL : target, strlen(msg));
+	if (shout)
+		zyre_shouts(self->remote, target, "%s", msg);
+	else
+		zyre_whispers(self->remote, target, "%s", msg);
+}
+
+void whisper_remote(mediator_t *self, const char *peerid, const char *msg) {
+	/**
+	 * whispers an uncompressed msg to a remote peer
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the remote peer
+	 * @param char* encoded msg
+	 */
+	stats_count_out(self, peerid, strlen(msg));
+	zyre_whispers(self->remote, peerid, "%s", msg);
+}
+
+void whisper_local(mediator_t *self, const char *peerid, const char *msg) {
+	/**
+	 * whispers a msg to a local component, on the local network or in-process
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the component
+	 * @param char* encoded msg
+	 */
+	STATS_ADD(self->stats->networks[STATS_LOCAL].msgs_out, 1);
+	STATS_ADD(self->stats->networks[STATS_LOCAL].bytes_out, strlen(msg));
+	zframe_t *identity = (zframe_t *) zhash_lookup(self->inproc_clients, peerid);
+	if (identity) {
+		zframe_t *copy = zframe_dup(identity);
+		zframe_send(&copy, self->inproc, ZFRAME_MORE);
+		zstr_send(self->inproc, msg);
+	} else
+		zyre_whispers(self->local, peerid, "%s", msg);
+}
+
+void shout_local(mediator_t *self, const char *msg) {
+	/**
+	 * shouts a msg to all local components, on the local network and in-process
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* encoded msg
+	 */
+	STATS_ADD(self->stats->networks[STATS_LOCAL].msgs_out, 1);
+	STATS_ADD(self->stats->networks[STATS_LOCAL].bytes_out, strlen(msg));
+	zyre_shouts(self->local, self->localgroup, "%s", msg);
+	zframe_t *identity = (zframe_t *) zhash_first(self->inproc_clients);
+	while (identity != NULL) {
+		zframe_t *copy = zframe_dup(identity);
+		zframe_send(&copy, self->inproc, ZFRAME_MORE);
+		zstr_send(self->inproc, msg);
+		identity = (zframe_t *) zhash_next(self->inproc_clients);
+	}
+}
+
 ///////////////////////////////////////////////////
 // remote file query
-void query_remote_file(mediator_t *self, json_msg_t *msg) {
+int query_remote_file(mediator_t *self, json_msg_t *msg) {
 	/**
-	 * fetches a file from a remote location
+	 * fetches a file from a remote location. Besides the URI, the query may list
+	 * further "sources" (URIs of copies of the same file on other peers); every
+	 * source is asked for an endpoint and the file is fetched from all of them at once
 	 *
 	 * @param mediator_t* to the mediator data strucure
 	 * @param json_msg_t* to the decoded zyre msg
+	 *
+	 * @return number of peers the query was sent to
 	 */
 	json_t *pl;
 	json_error_t error;
-	pl = json_loads(msg->payload,0,&error);
+	pl = message_payload(msg, &error);
 	if(!pl) {
 		printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
 		json_decref(pl);
+		return 0;
+	}
+	if (json_is_array(json_object_get(pl,"URIs"))) {
+		// batch: all files are fetched from one peer in a single session
+		char *peerid = NULL;
+		size_t index;
+		json_t *value;
+		json_array_foreach(json_object_get(pl,"URIs"), index, value) {
+			const char *uri = json_string_value(value);
+			const char *sep = uri ? strchr(uri, ':') : NULL;
+			if (!sep || sep == uri || (peerid && (strlen(peerid) != (size_t) (sep - uri) || strncmp(peerid, uri, sep - uri) != 0))) {
+				printf("[%s] URIs of a batch must all contain the same peer id, ignoring query!\n", self->shortname);
+				free(peerid);
+				json_decref(pl);
+				return 0;
+			}
+			if (!peerid)
+				peerid = strndup(uri, sep - uri);
+		}
+		if (!peerid) {
+			printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
+			json_decref(pl);
+			return 0;
+		}
+		printf("[%s] query batch of %zu URIs from %s\n", self->shortname, json_array_size(json_object_get(pl,"URIs")), peerid);
+		char* encoded_msg =  encode_msg("sherpa_mgs","http://kul/query_remote_file.json","query_remote_file",pl);
+		send_compressed(self, peerid, false, "query_remote_file", encoded_msg, NULL);
+		free(encoded_msg);
+		free(peerid);
+		json_decref(pl);
+		return 1;
+	}
+	json_t *uris = json_array();
+	if (json_is_string(json_object_get(pl,"URI"))) {
+		json_array_append(uris, json_object_get(pl,"URI"));
+	}
+	json_t *sources = json_object_get(pl,"sources");
+	if (json_is_array(sources)) {
+		size_t index;
+		json_t *value;
+		json_array_foreach(sources, index, value) {
+			if (!json_is_string(value)) {
+				printf("[%s] WARNING: ignoring source that is not a proper JSON string.\n", self->shortname);
+				continue;
+			}
+			// every source only needs to be asked once
+			size_t i;
+			json_t *known;
+			int duplicate = 0;
+			json_array_foreach(uris, i, known) {
+				if (streq(json_string_value(known), json_string_value(value))) {
+					duplicate = 1;
+					break;
+				}
+			}
+			if (!duplicate)
+				json_array_append(uris, value);
+		}
+	}
+	// the remote mediators only need the URI they serve
+	json_object_del(pl, "sources");
+	if (json_array_size(uris) == 0) {
+		printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
+		json_decref(uris);
+		json_decref(pl);
+		return 0;
+	}
+	int count = 0;
+	size_t index;
+	json_t *value;
+	json_array_foreach(uris, index, value) {
+		const char *uri = json_string_value(value);
+		const char *sep = strchr(uri, ':');
+		if (!sep || sep == uri) {
+			printf("[%s] URI %s does not contain a peer id, ignoring it!\n", self->shortname, uri);
+			continue;
+		}
+		printf("[%s] query remote file with URI: %s\n", self->shortname,uri);
+		char* peerid = strndup(uri, sep - uri);
+		json_object_set(pl, "URI", value);
+		printf("[%s] Sending whisper to %s\n", self->shortname, peerid);
+		char* encoded_msg =  encode_msg("sherpa_mgs","http://kul/query_remote_file.json","query_remote_file",pl);
+		send_compressed(self, peerid, false, "query_remote_file", encoded_msg, NULL);
+		free(encoded_msg);
+		free(peerid);
+		count++;
+	}
+	json_decref(uris);
+	json_decref(pl);
+	return count;
+}
+
+char* remote_file_path(json_msg_t *msg, const char *peerid) {
+	/**
+	 * looks up the path of a file on a given peer in a query_remote_file msg
+	 *
+	 * @param json_msg_t* to the decoded query
+	 * @param char* peer serving the file
+	 *
+	 * @return path of the file on that peer (user must free it) or NULL if the peer is not a source of the query
+	 */
+	json_t *pl;
+	json_error_t error;
+	pl = message_payload(msg, &error);
+	if(!pl) {
+		printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
+		return NULL;
+	}
+	char *path = NULL;
+	json_t *uris = json_array();
+	json_array_append(uris, json_object_get(pl,"URI"));
+	if (json_is_array(json_object_get(pl,"sources")))
+		json_array_extend(uris, json_object_get(pl,"sources"));
+	size_t index;
+	json_t *value;
+	json_array_foreach(uris, index, value) {
+		const char *uri = json_string_value(value);
+		if (uri && strncmp(uri, peerid, strlen(peerid)) == 0 && uri[strlen(peerid)] == ':') {
+			path = strdup(uri + strlen(peerid) + 1);
+			break;
+		}
+	}
+	json_decref(uris);
+	json_decref(pl);
+	return path;
+}
+
+char* remote_file_target(json_msg_t *msg) {
+	/**
+	 * looks up the local TARGET of a query_remote_file msg
+	 *
+	 * @param json_msg_t* to the decoded query
+	 *
+	 * @return path at which the file is stored (user must free it) or NULL if none is given
+	 */
+	json_t *pl;
+	json_error_t error;
+	pl = message_payload(msg, &error);
+	if(!pl) {
+		printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
+		return NULL;
+	}
+	char *target = NULL;
+	if (json_is_string(json_object_get(pl, "TARGET")))
+		target = strdup(json_string_value(json_object_get(pl, "TARGET")));
+	else
+		printf("TARGET for storing file not found in query!\n");
+	json_decref(pl);
+	return target;
+}
+
+///////////////////////////////////////////////////
+// file transfer queue
+void query_whisper_requester(mediator_t *self, query_t *q, const char *encoded_msg) {
+	/**
+	 * whispers a msg to the requester of a local query, which is a local
+	 * component, or the remote mediator that distributes the file
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param query_t* to the local query
+	 * @param char* encoded msg
+	 */
+	if (q->distributed)
+		whisper_remote(self, q->requester, encoded_msg);
+	else
+		whisper_local(self, q->requester, encoded_msg);
+}
+
+int file_transfer_start(mediator_t *self, query_t *q) {
+	/**
+	 * starts the client actor fetching the file of a local query from all
+	 * sources that answered so far
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param query_t* to the local query
+	 *
+	 * @return 0 on success, -1 if the transfer could not be started
+	 */
+	char *peerid = (char *) zlist_first(q->sources);
+	char *target = remote_file_target(q->msg);
+	if (!peerid || !target) {
+		free(target);
+		return -1;
+	}
+	if (q->batch) {
+		// the files of a batch are fetched in a single session with the source
+		const char *args[6];
+		args[0] = peerid;
+		args[1] = q->uid;
+		args[2] = (const char *) zhash_lookup(q->endpoints, peerid);
+		args[3] = target;
+		args[4] = self->actor_timeout;
+		args[5] = peer_accepts_compression(self, peerid) ? COMPRESSION_CODEC : "";
+		printf("using target directory: %s\n",target);
+		zactor_t *batch_client = zactor_new (batch_client_actor, args);
+		free(target);
+		if (!batch_client)
+			return -1;
+		mediator_set_query_actor(self, q, batch_client);
+		return 0;
+	}
+	json_t *pl;
+	json_error_t error;
+	pl = message_payload(q->msg, &error);
+	// progress reports: the query may override the configured interval
+	json_int_t interval = 1000;
+	if (json_is_integer(json_object_get(self->config, "file_progress_interval")))
+		interval = json_integer_value(json_object_get(self->config, "file_progress_interval"));
+	if (json_is_integer(json_object_get(pl, "progress_interval")))
+		interval = json_integer_value(json_object_get(pl, "progress_interval"));
+	char progress[12];
+	sprintf(progress, "%d", (int) interval);
+	// chunks are pushed by the sources instead of fetched one by one if the
+	// query or the configuration asks for it
+	bool push = json_is_true(json_object_get(self->config, "file_push"));
+	if (json_is_boolean(json_object_get(pl, "push")))
+		push = json_is_true(json_object_get(pl, "push"));
+	const char *args[10];
+	args[0] = peerid;
+	args[1] = q->uid;
+	args[2] = (const char *) zhash_lookup(q->endpoints, peerid);
+	args[3] = target;
+	args[4] = self->actor_timeout;
+	args[5] = q->file_size;
+	// only peers that advertise the codec understand compressed fetch requests
+	args[6] = peer_accepts_compression(self, peerid) ? COMPRESSION_CODEC : "";
+	args[7] = progress;
+	args[8] = json_is_true(json_object_get(pl, "stream")) ? "true" : "false";
+	args[9] = push ? "true" : "false";
+	json_decref(pl);
+	printf("using target: %s\n",target);
+	zactor_t *file_client = zactor_new (client_actor, args);
+	free(target);
+	if (!file_client)
+		return -1;
+	mediator_set_query_actor(self, q, file_client);
+	// sources that answered while the transfer was queued
+	char *source = (char *) zlist_next(q->sources);
+	while (source != NULL) {
+		printf("[%s] adding source %s to query %s\n", self->shortname, source, q->uid);
+		zstr_sendx (file_client, "source", source, (const char *) zhash_lookup(q->endpoints, source), q->file_size,
+				peer_accepts_compression(self, source) ? COMPRESSION_CODEC : "", NULL);
+		source = (char *) zlist_next(q->sources);
+	}
+	return 0;
+}
+
+void file_transfer_report_queue(mediator_t *self) {
+	/**
+	 * tells the requesters of queued transfers whose position in the queue changed
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 */
+	size_t position = 1;
+	query_t *q = (query_t *) zlist_first(self->transfer_queue);
+	while (q != NULL) {
+		if (q->position != position) {
+			q->position = position;
+			json_t *pl;
+			pl = json_object();
+			json_object_set_new(pl, "UID", json_string(q->uid));
+			json_object_set_new(pl, "position", json_integer(position));
+			json_object_set_new(pl, "queue_length", json_integer(zlist_size(self->transfer_queue)));
+			char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_queued.json", "file_transfer_queued", pl);
+			query_whisper_requester(self, q, encoded_msg);
+			free(encoded_msg);
+			json_decref(pl);
+		}
+		position++;
+		q = (query_t *) zlist_next(self->transfer_queue);
+	}
+}
+
+void file_transfer_enqueue(mediator_t *self, query_t *q) {
+	/**
+	 * queues a local query until a transfer slot is free. Queries with a higher
+	 * "priority" go first; queries of the same priority are served in arrival order
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param query_t* to the local query
+	 */
+	json_t *pl;
+	json_error_t error;
+	pl = message_payload(q->msg, &error);
+	q->priority = json_is_integer(json_object_get(pl, "priority")) ? json_integer_value(json_object_get(pl, "priority")) : 0;
+	json_decref(pl);
+	q->seq = self->transfer_seq++;
+	q->state = QUERY_QUEUED;
+	zlist_append(self->transfer_queue, q);
+	zlist_sort(self->transfer_queue, query_compare_priority);
+	printf("[%s] %zu file transfers running, queued query %s\n", self->shortname, zhash_size(self->query_actors), q->uid);
+	file_transfer_report_queue(self);
+}
+
+void file_transfer_dequeue(mediator_t *self) {
+	/**
+	 * starts queued transfers while slots are free
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 */
+	while (zlist_size(self->transfer_queue) > 0 && zhash_size(self->query_actors) < self->max_file_transfers) {
+		query_t *q = (query_t *) zlist_pop(self->transfer_queue);
+		q->state = QUERY_WAITING;
+		if (file_transfer_start(self, q) != 0) {
+			printf("[%s] could not start queued file transfer for query %s\n", self->shortname, q->uid);
+			json_t *pl;
+			pl = json_object();
+			json_object_set_new(pl, "UID", json_string(q->uid));
+			// release the servers of all sources
+			char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
+			char *source = (char *) zlist_first(q->sources);
+			while (source != NULL) {
+				whisper_remote(self, source, encoded_msg);
+				source = (char *) zlist_next(q->sources);
+			}
+			free(encoded_msg);
+			json_object_set_new(pl, "error", json_string("Could not start file transfer."));
+			json_object_set_new(pl, "success", json_string("false"));
+			json_object_set_new(pl, "target", json_string(""));
+			encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+			query_whisper_requester(self, q, encoded_msg);
+			free(encoded_msg);
+			json_decref(pl);
+			mediator_remove_query(self, &q);
+		}
+	}
+	file_transfer_report_queue(self);
+}
+
+void file_transfer_finish(mediator_t *self, query_t **q_p, const char *peerid, const char *success, const char *error, const char *file_path, json_t *files) {
+	/**
+	 * releases the sources of a finished transfer, reports the result to the
+	 * requester and removes the query
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param query_t** to the local query, set to NULL
+	 * @param char* peerid the client actor fetched from
+	 * @param char* "true" if the transfer succeeded
+	 * @param char* error message
+	 * @param char* path of the fetched file, or target directory of a batch
+	 * @param json_t* report of every file of a batch, NULL if no batch
+	 */
+	query_t *q = *q_p;
+	json_t *pl;
+	pl = json_object();
+	json_object_set(pl, "UID", json_string(q->uid));
+	// release the servers of all sources of this file
+	char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
+	char *source = (char *) zlist_first(q->sources);
+	if (source == NULL) {
+		printf("[%s] whispering remote peerid %s that query %s is done\n", self->shortname, peerid, q->uid);
+		whisper_remote(self, peerid, encoded_msg);
+	}
+	while (source != NULL) {
+		printf("[%s] whispering remote peerid %s that query %s is done\n", self->shortname, source, q->uid);
+		whisper_remote(self, source, encoded_msg);
+		source = (char *) zlist_next(q->sources);
+	}
+	free(encoded_msg);
+	json_object_set(pl, "target", json_string(file_path));
+	json_object_set(pl, "error", json_string(error));
+	json_object_set(pl, "success", json_string(success));
+	if (files)
+		json_object_set(pl, "files", files);
+	if (q->cache_key && self->file_cache && streq(success, "true"))
+		file_cache_store(self->file_cache, q->cache_key, file_path);
+	if (success && streq(success, "true")) {
+		STATS_ADD(self->stats->file_transfers, 1);
+		// throughput of single files fetched by a client actor, in KB/s
+		struct stat st;
+		int64_t duration = zclock_mono() - q->started;
+		if (q->started > 0 && duration > 0 && file_path && stat(file_path, &st) == 0 && S_ISREG(st.st_mode))
+			histogram_record(&self->stats->file_throughput, (uint64_t) st.st_size * 1000 / 1024 / duration);
+	} else
+		STATS_ADD(self->stats->file_transfers_failed, 1);
+	printf("[%s] whispering file_transfer_report to local peerid %s\n", self->shortname, q->requester);
+	encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+	query_whisper_requester(self, q, encoded_msg);
+	free(encoded_msg);
+	json_decref(pl);
+	mediator_remove_query(self, q_p);
+	// start the next queued transfer
+	file_transfer_dequeue(self);
+}
+
+///////////////////////////////////////////////////
+// file distribution
+void distribution_report(mediator_t *self, const char *requester, const char *uid, const char *error, json_t *confirmed, json_t *failed) {
+	/**
+	 * tells the local component which recipients confirmed a distribution
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the local component
+	 * @param char* uid of the distribution
+	 * @param char* error message, NULL if all recipients confirmed
+	 * @param json_t* array of the recipients that confirmed, may be NULL
+	 * @param json_t* array of the recipients that failed, may be NULL
+	 */
+	json_t *pl;
+	pl = json_object();
+	json_object_set_new(pl, "UID", json_string(uid));
+	json_object_set_new(pl, "success", json_string(error ? "false" : "true"));
+	json_object_set_new(pl, "error", json_string(error ? error : ""));
+	json_object_set(pl, "confirmed", confirmed ? confirmed : json_array());
+	json_object_set(pl, "failed", failed ? failed : json_array());
+	printf("[%s] whispering distribution_report of %s to local peerid %s\n", self->shortname, uid, requester);
+	char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/distribution_report.json", "distribution_report", pl);
+	whisper_local(self, requester, encoded_msg);
+	free(encoded_msg);
+	json_decref(pl);
+}
+
+void distribution_schedule(mediator_t *self, distribution_t *d) {
+	/**
+	 * asks waiting recipients to fetch the file, as long as every copy serves
+	 * less than fanout recipients, and reports the distribution once all
+	 * recipients are done
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param distribution_t* to the distribution
+	 */
+	while (zlist_size(d->waiting) > 0 && zhash_size(d->running) < d->fanout * zlist_size(d->sources)) {
+		char *peer = (char *) zlist_pop(d->waiting);
+		// every recipient fetches from all copies; the URI it asks first rotates
+		json_t *sources = json_array();
+		const char *first = NULL;
+		size_t index = 0;
+		const char *source = (const char *) zlist_first(d->sources);
+		while (source != NULL) {
+			json_array_append_new(sources, json_string(source));
+			if (index++ == d->next % zlist_size(d->sources))
+				first = source;
+			source = (const char *) zlist_next(d->sources);
+		}
+		d->next++;
+		// the UID has to be unique on the copies that serve several recipients
+		char *uid = (char *) malloc(strlen(d->uid) + strlen(peer) + 2);
+		assert (uid);
+		sprintf(uid, "%s@%s", d->uid, peer);
+		json_t *pl;
+		pl = json_object();
+		json_object_set_new(pl, "UID", json_string(uid));
+		json_object_set_new(pl, "URI", json_string(first));
+		json_object_set_new(pl, "sources", sources);
+		json_object_set_new(pl, "TARGET", json_string(d->target));
+		printf("[%s] asking %s to fetch %s from %zu copies\n", self->shortname, peer, d->uid, zlist_size(d->sources));
+		char* encoded_msg = encode_msg("sherpa_mgs", "http://kul/distribute_file.json", "distribute_file", pl);
+		send_compressed(self, peer, false, "distribute_file", encoded_msg, NULL);
+		free(encoded_msg);
+		json_decref(pl);
+		zhash_insert(d->running, peer, peer);
+		free(uid);
+		free(peer);
+	}
+	if (zlist_size(d->waiting) == 0 && zhash_size(d->running) == 0) {
+		char error[64];
+		if (json_array_size(d->failed) > 0)
+			sprintf(error, "%zu recipients did not confirm.", json_array_size(d->failed));
+		distribution_report(self, d->requester, d->uid, json_array_size(d->failed) > 0 ? error : NULL, d->confirmed, d->failed);
+		zhash_delete(self->distributions, d->uid);
+		distribution_destroy(&d);
+	}
+}
+
+void distribution_start(mediator_t *self, const char *requester, json_msg_t *msg) {
+	/**
+	 * distributes a local file to remote peers, see distribute_file in doc/msg.md
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the local component
+	 * @param json_msg_t* to the decoded zyre msg
+	 */
+	json_t *pl;
+	json_error_t error;
+	pl = message_payload(msg, &error);
+	if(!pl) {
+		printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
+		return;
+	}
+	const char *uid = json_string_value(json_object_get(pl, "UID"));
+	const char *uri = json_string_value(json_object_get(pl, "URI"));
+	// the file is on this robot; a peer id in front of the path is optional
+	const char *path = uri && strchr(uri, ':') ? strchr(uri, ':') + 1 : uri;
+	// recipients store the file below their distribution_dir
+	const char *base = path && strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	const char *target = json_is_string(json_object_get(pl, "TARGET")) ? json_string_value(json_object_get(pl, "TARGET")) : base;
+	size_t fanout = 2;
+	if (json_is_integer(json_object_get(pl, "fanout")) && json_integer_value(json_object_get(pl, "fanout")) > 0)
+		fanout = json_integer_value(json_object_get(pl, "fanout"));
+	if (!uid || !path || strlen(path) == 0) {
+		printf("[%s] WARNING: distribute_file needs UID and URI! Will abort. \n", self->shortname);
+		if (uid)
+			distribution_report(self, requester, uid, "No valid URI given.", NULL, NULL);
+		json_decref(pl);
+		return;
+	}
+	if (zhash_lookup(self->distributions, uid)) {
+		distribution_report(self, requester, uid, "Query UID already in use.", NULL, NULL);
+		json_decref(pl);
 		return;
 	}
-	char *uri = NULL;
-    if (json_object_get(pl,"URI")) {
-    	uri = strdup((char*)json_string_value(json_object_get(pl,"URI")));
+	if (!batch_name_valid(target)) {
+		distribution_report(self, requester, uid, "TARGET has to be a relative path without '..'.", NULL, NULL);
+		json_decref(pl);
+		return;
+	}
+	distribution_t *d = distribution_new(uid, requester, target, fanout);
+	char *source = (char *) malloc(strlen(zyre_uuid(self->remote)) + strlen(path) + 2);
+	assert (source);
+	sprintf(source, "%s:%s", zyre_uuid(self->remote), path);
+	zlist_append(d->sources, source);
+	free(source);
+	// all remote peers, unless the recipients are given
+	json_t *recipients = json_object_get(pl, "recipients");
+	if (json_is_array(recipients)) {
+		size_t index;
+		json_t *value;
+		json_array_foreach(recipients, index, value) {
+			if (json_is_string(value) && !streq(json_string_value(value), zyre_uuid(self->remote)))
+				zlist_append(d->waiting, (void *) json_string_value(value));
+		}
 	} else {
-		printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
+		zlist_t *peers = zyre_peers(self->remote);
+		char *peer = peers ? (char *) zlist_first(peers) : NULL;
+		while (peer != NULL) {
+			zlist_append(d->waiting, peer);
+			peer = (char *) zlist_next(peers);
+		}
+		zlist_destroy(&peers);
+	}
+	json_decref(pl);
+	if (zlist_size(d->waiting) == 0) {
+		distribution_report(self, requester, uid, "No recipients.", NULL, NULL);
+		distribution_destroy(&d);
 		return;
 	}
-    if (!uri) {
-       printf("[%s] URI not specified, ignoring query!\n", self->shortname); 
-       return;
-    }
-    printf("[%s] query remote file with URI: %s\n", self->shortname,uri);
-    const char s[2] = ":";
-    char *token;
-    token = strtok(uri, s);
-    char* peerid = strdup(token);
-    token = strtok(uri, s);
-    while( token != NULL ) { 
-      token = strtok(NULL, s);
-    }
-    printf("[%s] Sending whisper to %s\n", self->shortname, peerid);
-    char* encoded_msg =  encode_msg("sherpa_mgs","http://kul/query_remote_file.json","query_remote_file",pl);
-    zyre_whispers(self->remote, peerid, "%s", encoded_msg);
-    free(encoded_msg);
-    free(uri);
-    json_decref(pl);
-    
+	printf("[%s] distributing %s to %zu peers\n", self->shortname, path, zlist_size(d->waiting));
+	zhash_insert(self->distributions, d->uid, d);
+	distribution_schedule(self, d);
+}
+
+void distribution_confirm(mediator_t *self, const char *peerid, json_msg_t *msg) {
+	/**
+	 * handles the file_transfer_report of a recipient of a distribution; a
+	 * recipient that stored the file serves it to the next recipients
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the recipient
+	 * @param json_msg_t* to the decoded zyre msg
+	 */
+	json_t *pl;
+	json_error_t error;
+	pl = message_payload(msg, &error);
+	const char *uid = pl ? json_string_value(json_object_get(pl, "UID")) : NULL;
+	const char *at = uid ? strrchr(uid, '@') : NULL;
+	char *distribution_uid = at ? strndup(uid, at - uid) : NULL;
+	distribution_t *d = distribution_uid ? (distribution_t *) zhash_lookup(self->distributions, distribution_uid) : NULL;
+	if (!d || !zhash_lookup(d->running, peerid)) {
+		printf("[%s] ignoring file_transfer_report of %s\n", self->shortname, peerid);
+	} else {
+		zhash_delete(d->running, peerid);
+		const char *success = json_string_value(json_object_get(pl, "success"));
+		if (success && streq(success, "true")) {
+			printf("[%s] %s confirmed %s\n", self->shortname, peerid, d->uid);
+			arena_t *arena = arena_suspend();
+			json_array_append_new(d->confirmed, json_string(peerid));
+			arena_begin(arena);
+			char *source = (char *) malloc(strlen(peerid) + strlen(d->target) + 2);
+			assert (source);
+			sprintf(source, "%s:%s", peerid, d->target);
+			zlist_append(d->sources, source);
+			free(source);
+		} else {
+			// the payload is in the arena of the handler, the failure outlives it
+			arena_t *arena = arena_suspend();
+			json_t *failure = json_object();
+			json_object_set_new(failure, "peer", json_string(peerid));
+			json_object_set_new(failure, "error", json_deep_copy(json_object_get(pl, "error")));
+			json_array_append_new(d->failed, failure);
+			arena_begin(arena);
+		}
+		distribution_schedule(self, d);
+	}
+	free(distribution_uid);
+	json_decref(pl);
+}
+
+void distribution_peer_left(mediator_t *self, const char *peerid) {
+	/**
+	 * drops a remote peer that left from all distributions
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param char* peerid of the remote peer
+	 */
+	zlist_t *affected = zlist_new();
+	distribution_t *d = (distribution_t *) zhash_first(self->distributions);
+	while (d != NULL) {
+		zlist_append(affected, d);
+		d = (distribution_t *) zhash_next(self->distributions);
+	}
+	d = (distribution_t *) zlist_pop(affected);
+	while (d != NULL) {
+		bool changed = false;
+		char *peer = (char *) zlist_first(d->waiting);
+		while (peer != NULL && !streq(peer, peerid))
+			peer = (char *) zlist_next(d->waiting);
+		if (peer) {
+			zlist_remove(d->waiting, peer);
+			changed = true;
+		}
+		if (zhash_lookup(d->running, peerid)) {
+			zhash_delete(d->running, peerid);
+			changed = true;
+		}
+		if (changed) {
+			arena_t *arena = arena_suspend();
+			json_t *failure = json_object();
+			json_object_set_new(failure, "peer", json_string(peerid));
+			json_object_set_new(failure, "error", json_string("Peer left."));
+			json_array_append_new(d->failed, failure);
+			arena_begin(arena);
+		}
+		// its copy can no longer be fetched
+		char *source = (char *) zlist_first(d->sources);
+		while (source != NULL) {
+			if (strncmp(source, peerid, strlen(peerid)) == 0 && source[strlen(peerid)] == ':') {
+				zlist_remove(d->sources, source);
+				changed = true;
+				break;
+			}
+			source = (char *) zlist_next(d->sources);
+		}
+		if (changed)
+			distribution_schedule(self, d);
+		d = (distribution_t *) zlist_pop(affected);
+	}
+	zlist_destroy(&affected);
 }
 
 ///////////////////////////////////////////////////
@@ -99,7 +892,7 @@ char* generate_mediator_uuid(mediator_t *self, json_msg_t *msg) {
 	char *ret = NULL;
 	json_t *pl;
 	json_error_t error;
-	pl= json_loads(msg->payload,0,&error);
+	pl= message_payload(msg, &error);
 	if(!pl) {
 		printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
 		json_decref(pl);
@@ -122,6 +915,35 @@ char* generate_mediator_uuid(mediator_t *self, json_msg_t *msg) {
 	json_decref(pl);
 	return ret;
 }
+
+char* generate_mediator_stats(mediator_t *self, json_msg_t *msg) {
+    /**
+     * generates a msg containing the counters and histograms of the mediator
+     *
+     * @param mediator_t* pointer to struct containing all the info about the mediator
+     * @param json_msg_t* to the decoded zyre msg
+     *
+     * @return returns NULL if it fails and a json object with the query ID and the stats
+     */
+	json_t *pl;
+	json_error_t error;
+	pl= message_payload(msg, &error);
+	if(!pl) {
+		printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
+		return NULL;
+	}
+	if (!json_object_get(pl,"UID")) {
+		printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
+		json_decref(pl);
+		return NULL;
+	}
+	json_t *payload = stats_json(self->stats);
+	json_object_set(payload, "UID", json_object_get(pl,"UID"));
+	char *ret = encode_msg("sherpa_mgs","http://kul/mediator_stats.json","mediator_stats",payload);
+	json_decref(payload);
+	json_decref(pl);
+	return ret;
+}
 ///////////////////////////////////////////////////
 // remote peer query
 
@@ -137,7 +959,7 @@ char* generate_peer_list(mediator_t *self, json_msg_t *msg) {
     char *ret = NULL;
     json_t *pl;
     json_error_t error;
-    pl= json_loads(msg->payload,0,&error);
+    pl= message_payload(msg, &error);
     if(!pl) {
         printf("Error parsing JSON payload! line %d: %s\n", error.line, error.text);
         json_decref(pl);
@@ -202,12 +1024,17 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 	 */
 	json_t *send_rqst;
 	json_error_t error;
-	send_rqst= json_loads(result->payload,0,&error);
+	send_rqst= message_payload(result, &error);
 	if(!send_rqst) {
 		printf("Error parsing JSON send_remote! line %d: %s\n", error.line, error.text);
 		json_decref(send_rqst);
 		return;
 	}
+	const char *trace_uid = json_string_value(json_object_get(send_rqst,"UID"));
+	const char *trace_requester = json_string_value(json_object_get(send_rqst,"local_requester"));
+	if (result->decoded > 0)
+		recorder_trace_at(self->recorder, result->decoded, TRACE_RECEIVED, trace_uid, trace_requester, result->decode_usecs);
+	recorder_trace(self->recorder, TRACE_HANDLED, trace_uid, trace_requester, 0);
 	json_t *recipients;
 	if (json_object_get(send_rqst,"recipients")) {
 		recipients = json_object_get(send_rqst,"recipients");
@@ -258,20 +1085,20 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 		strcat(res,type);
 		strcat(res,".json");
 		char* encoded_msg = encode_msg("sherpa_mgs",res,type,send_rqst);
-		zyre_shouts(self->remote, group, "%s", encoded_msg);
+		send_compressed(self, group, true, type, encoded_msg, NULL);
+		recorder_trace(self->recorder, TRACE_SENT, trace_uid, trace_requester, 0);
 		free(encoded_msg);
 		free(res);
 		char* dump = json_dumps(send_rqst, JSON_ENCODE_ANY);
 		printf("sending %s \n",dump);
-		free(dump);
+		arena_json_free(dump);
 		json_decref(send_rqst);
 		//if (res) {free(res);}
 		return;
 	} else {
 		zlist_t * peers = zyre_peers(self->remote);
-		zlist_t * recip = zlist_new ();
-		assert (recip);
-		assert (zlist_size (recip) == 0);
+		recipient_t *recip = NULL;
+		recipient_t **recip_tail = &recip;
 		// go through list of recipients and check if all are known
 		json_t *unknown_recipients = json_array();
 		size_t index;
@@ -279,13 +1106,17 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 		json_array_foreach(recipients, index, value) {
 			if (!json_string_value(value)) {
 				printf("[%s] Recipient is not a proper JSON string.\n",self->shortname);
+				while (recip != NULL) {
+					recipient_t *next = recip->next;
+					intern_release(self->ids, recip->id);
+					pool_free(self->recipient_pool, recip);
+					recip = next;
+				}
+				zlist_destroy(&peers);
 				json_decref(send_rqst);
 				json_decref(unknown_recipients);
 				return;
 			}
-			recipient_t *rec = (recipient_t*)malloc(sizeof(recipient_t));
-			rec->ack = false;
-			rec->id = json_string_value(value);
 			const char *it = zlist_first(peers);
 			int flag = 0;
 			while (it != NULL) {
@@ -300,12 +1131,25 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 					printf("[%s] could not append unknown recipient \n",self->shortname);
 				}
 			} else {
-				zlist_append(recip,rec);
+				recipient_t *rec = (recipient_t *) pool_alloc(self->recipient_pool);
+				assert(rec);
+				rec->ack = false;
+				rec->id = intern(self->ids, json_string_value(value));
+				assert(rec->id);
+				*recip_tail = rec;
+				recip_tail = &rec->next;
 			}
 		}
 		//if not all are known, send communication report incl list of unknown recipients to requester. otherwise, generate struct and store it.
 		if (json_array_size(unknown_recipients) != 0) {
 			printf("[%s] %zu of the recipients are not known!\n",self->shortname,json_array_size(unknown_recipients));
+			recorder_trace(self->recorder, TRACE_UNKNOWN, trace_uid, trace_requester, json_array_size(unknown_recipients));
+			while (recip != NULL) {
+				recipient_t *next = recip->next;
+				intern_release(self->ids, recip->id);
+				pool_free(self->recipient_pool, recip);
+				recip = next;
+			}
 			json_t *pl;
 			pl = json_object();
 			json_t *tmp;
@@ -316,45 +1160,51 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 			json_object_set(pl, "recipients_delivered", tmp);
 			json_object_set(pl, "recipients_undelivered", unknown_recipients);
 			char* encoded_msg =  encode_msg("sherpa_mgs","http://kul/communication_report.json","communication_report",pl);
-			zyre_whispers(self->local, json_string_value(json_object_get(send_rqst,"local_requester")), "%s", encoded_msg);
+			whisper_local(self, json_string_value(json_object_get(send_rqst,"local_requester")), encoded_msg);
 			free(encoded_msg);
 			json_decref(tmp);
 			json_decref(pl);
 		} else {
-                        send_msg_request_t *msg_req = (send_msg_request_t*)malloc(sizeof(send_msg_request_t));;
-			//build msg_req struct and append it to global list
+			send_msg_request_t *msg_req = (send_msg_request_t *) pool_alloc(self->send_msg_pool);
+			assert(msg_req);
+			// the request owns its recipients from here on
+			msg_req->recipients = recip;
+			//build msg_req struct and prepend it to global list
 			json_t *dummy;
 			dummy = json_object_get(send_rqst,"UID");
 			if ((!dummy)||(!json_is_string(dummy))) {
 				printf("[%s] could not find UID of send_request \n",self->shortname);
+				send_msg_request_destroy(self, &msg_req);
 				zlist_destroy(&peers);
 				json_decref(unknown_recipients);
 				json_decref(send_rqst);
 				return;
 			}
-			msg_req->uid = json_string_value(dummy);
-			msg_req->recipients = recip;
+			msg_req->uid = intern(self->ids, json_string_value(dummy));
 			dummy = json_object_get(send_rqst,"local_requester");
 			if ((!dummy)||(!json_is_string(dummy))) {
 				printf("[%s] could not find requester in send_request \n",self->shortname);
+				send_msg_request_destroy(self, &msg_req);
 				zlist_destroy(&peers);
 				json_decref(unknown_recipients);
 				json_decref(send_rqst);
 				return;
 			}
-			msg_req->local_requester = json_string_value(dummy);
+			msg_req->local_requester = intern(self->ids, json_string_value(dummy));
 			dummy = json_object_get(send_rqst,"payload_type");
 			if ((!dummy)||(!json_is_string(dummy))) {
 				printf("[%s] could not find payload_type in send_request \n",self->shortname);
+				send_msg_request_destroy(self, &msg_req);
 				zlist_destroy(&peers);
 				json_decref(unknown_recipients);
 				json_decref(send_rqst);
 				return;
 			}
-			msg_req->payload_type = json_string_value(dummy);
+			msg_req->payload_type = strdup(json_string_value(dummy));
 			dummy = json_object_get(send_rqst,"timeout");
 			if ((!dummy)||(!json_is_integer(dummy))) {
 				printf("[%s] could not find payload in send_request \n",self->shortname);
+				send_msg_request_destroy(self, &msg_req);
 				zlist_destroy(&peers);
 				json_decref(unknown_recipients);
 				json_decref(send_rqst);
@@ -364,6 +1214,7 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 			int64_t ts = zclock_usecs ();
 			if (ts < 0) {
 				printf("[%s] Could not assign time stamp!\n",self->shortname);
+				send_msg_request_destroy(self, &msg_req);
 				zlist_destroy(&peers);
 				json_decref(unknown_recipients);
 				json_decref(send_rqst);
@@ -372,17 +1223,18 @@ void send_remote(mediator_t *self, json_msg_t *result, const char* group) {
 			msg_req->ts_added = ts;
 			msg_req->ts_last_sent = ts;
 			msg_req->group = group;
-			if (zlist_append(self->send_msgs,msg_req) == -1) {
-				printf("[%s] Could not add new msg!",self->shortname);
-				zlist_destroy(&peers);
-				json_decref(unknown_recipients);
-				json_decref(send_rqst);
-				return;
-			}
+			msg_req->next = self->send_msgs;
+			self->send_msgs = msg_req;
+			self->outbox_deadline = deadline_earliest(self->outbox_deadline, send_msg_deadline(self, msg_req));
+			STATS_ADD(self->stats->send_requests, 1);
 			msg_req->msg = encode_msg(result->metamodel,result->model,result->type,send_rqst);
-			zyre_shouts(self->remote, group, "%s", msg_req->msg);
+			msg_req->compressed = NULL;
+			send_compressed(self, group, true, msg_req->payload_type, msg_req->msg, &msg_req->compressed);
+			recorder_trace(self->recorder, TRACE_QUEUED, trace_uid, trace_requester, json_array_size(recipients));
+			if (MEDIATOR_PROBE_ENABLED(outbox_enqueue))
+				MEDIATOR_PROBE(outbox_enqueue, trace_uid, trace_requester, json_array_size(recipients), strlen(msg_req->msg), self->send_msg_pool->live);
 		}
-		printf("[%s] stored number of send_msg requests %zu",self->shortname, zlist_size(self->send_msgs));
+		printf("[%s] stored number of send_msg requests %zu",self->shortname, self->send_msg_pool->live);
 		zlist_destroy(&peers);
 		json_decref(unknown_recipients);
 	}
@@ -399,6 +1251,13 @@ void handle_remote_enter(mediator_t *self, zmsg_t *msg) {
 	printf ("[%s] ENTER %s %s <headers> %s\n", self->shortname, peerid, name, address);
 	char* type = zyre_peer_header_value(self->remote, peerid, "type");
 	printf ("[%s] %s has type %s\n",self->shortname, name, type);
+	// remember which codecs the peer accepts, "" if it does not compress
+	zhash_t *headers = headers_packed ? zhash_unpack(headers_packed) : NULL;
+	const char *codecs = headers ? (const char *) zhash_lookup(headers, "codecs") : NULL;
+	zhash_update(self->peer_codecs, peerid, (void *) (codecs ? codecs : ""));
+	zhash_destroy(&headers);
+	if (address)
+		zhash_update(self->peer_addresses, peerid, address);
 	zstr_free(&peerid);
 	zstr_free(&name);
 	zframe_destroy(&headers_packed);
@@ -411,6 +1270,9 @@ void handle_remote_exit (mediator_t *self, zmsg_t *msg) {
 	char *peerid = zmsg_popstr (msg);
 	char *name = zmsg_popstr (msg);
 	printf ("[%s] EXIT %s %s\n", self->shortname, peerid, name);
+	zhash_delete(self->peer_codecs, peerid);
+	zhash_delete(self->peer_addresses, peerid);
+	distribution_peer_left(self, peerid);
 	// Update local group with new peer list
 	//char *peerlist = generate_peers(remote, config);
 	//zyre_shouts(local, localgroup, "%s", peerlist);
@@ -438,12 +1300,15 @@ void handle_remote_send_remote (mediator_t *self, json_msg_t *result, char *peer
 	// if in list of recipients, send acknowledgment
 	json_t *req;
 	json_error_t error;
-	req = json_loads(result->payload, 0, &error);
+	req = message_payload(result, &error);
 	//load the payload=send_request
 	if(!req) {
 		printf("Error parsing JSON payload!\n");
 		return;
 	} else {
+		const char *trace_uid = json_string_value(json_object_get(req,"UID"));
+		if (result->decoded > 0)
+			recorder_trace_at(self->recorder, result->decoded, TRACE_REMOTE_RECEIVED, trace_uid, peerid, result->decode_usecs);
 		json_t *rec = NULL;
 		if (json_object_get(req,"recipients")) {
 			rec = json_object_get(req,"recipients");
@@ -473,27 +1338,35 @@ void handle_remote_send_remote (mediator_t *self, json_msg_t *result, char *peer
 					json_object_set(pl, "ID_receiver", json_string(zyre_uuid(self->remote)));
                                         // zyre_whispers(self->local, peerid, "%s", encode_msg("sherpa_mgs","http://kul/communication_ack.json","communication_ack",pl));
 					char* encoded_msg =  encode_msg("sherpa_mgs","http://kul/communication_ack.json","communication_ack",pl);
-					zyre_whispers(self->remote, peerid, "%s", encoded_msg);
+					whisper_remote(self, peerid, encoded_msg);
 					free(encoded_msg);
                     json_decref(pl);
+					recorder_trace(self->recorder, TRACE_ACK_SENT, trace_uid, peerid, 0);
 					break;
 				}
 			}
 		}
 		//json_decref(rec);
 		// filter by msg requester+uid to see if this msg has already been forwarded to local network
-		filter_list_item_t *it = zlist_first(self->filter_list);
+		filter_list_item_t *it = self->filter_list;
 		int flag = 0;
 		if (!json_object_get(req,"UID")) {
 			printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
 			return;
 		}
-		while (it != NULL) {
-			if (streq(it->sender,peerid) && streq(it->msg_UID,json_string_value(json_object_get(req,"UID")))) {
+		intern_t sender = intern_lookup(self->ids, peerid);
+		intern_t uid = intern_lookup(self->ids, json_string_value(json_object_get(req,"UID")));
+		while (it != NULL && sender != 0 && uid != 0) {
+			if (it->sender == sender && it->msg_UID == uid) {
 				flag = 1;
 				break;
 			}
-			it = zlist_next(self->filter_list);
+			it = it->next;
+		}
+		if (flag == 1) {
+			recorder_trace(self->recorder, TRACE_FILTERED, trace_uid, peerid, 0);
+			if (MEDIATOR_PROBE_ENABLED(filter_hit))
+				MEDIATOR_PROBE(filter_hit, trace_uid, peerid, zclock_usecs() - it->ts);
 		}
 		if (flag == 0) {
 			// if not in list, forward msg to local network
@@ -503,26 +1376,34 @@ void handle_remote_send_remote (mediator_t *self, json_msg_t *result, char *peer
 				return;
 			}
 			char* encoded_msg = json_dumps(json_object_get(req,"payload"), JSON_ENCODE_ANY);
-			zyre_shouts(self->local, self->localgroup, "%s", encoded_msg);
-			free(encoded_msg);
+			shout_local(self, encoded_msg);
+			if (MEDIATOR_PROBE_ENABLED(filter_miss))
+				MEDIATOR_PROBE(filter_miss, trace_uid, peerid, strlen(encoded_msg));
+			arena_json_free(encoded_msg);
+			recorder_trace(self->recorder, TRACE_FORWARDED, trace_uid, peerid, 0);
 			// push this msg into filter list
-			filter_list_item_t *tmp = (filter_list_item_t *) zmalloc (sizeof (filter_list_item_t));
-			if (json_object_get(req,"UID")) {
-				tmp->msg_UID = strdup(json_string_value(json_object_get(req,"UID")));
-			} else {
+			if (!json_string_value(json_object_get(req,"UID"))) {
 				printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
+				json_decref(req);
 				return;
 			}
-			tmp->sender = strdup(peerid);
-			assert(tmp->sender);
 		    int64_t ts = zclock_usecs();
 			if (ts < 0) {
 				printf("[%s] Could not assign time stamp!\n",self->shortname);
+				json_decref(req);
 				return;
-			} else {
-				tmp->ts = ts;
-				zlist_push(self->filter_list,tmp);
 			}
+			filter_list_item_t *tmp = (filter_list_item_t *) pool_alloc (self->filter_pool);
+			assert(tmp);
+			tmp->msg_UID = intern(self->ids, json_string_value(json_object_get(req,"UID")));
+			tmp->sender = intern(self->ids, peerid);
+			assert(tmp->msg_UID && tmp->sender);
+			tmp->ts = ts;
+			tmp->next = self->filter_list;
+			self->filter_list = tmp;
+			// entries are added in the order they expire, so only the first one matters
+			if (self->filter_deadline < 0)
+				self->filter_deadline = ts / 1000 + json_integer_value(json_object_get(self->config, "msg_filter_length")) + 1;
 			printf("adding msg to filter list\n");
 		}
 	}
@@ -530,15 +1411,19 @@ void handle_remote_send_remote (mediator_t *self, json_msg_t *result, char *peer
 }
 
 void handle_remote_shout (mediator_t *self, zmsg_t *msg) {
-	assert (zmsg_size(msg) == 4);
+	// decoded by event_decode
+	assert (zmsg_size(msg) == 5);
 	char *peerid = zmsg_popstr (msg);
 	char *name = zmsg_popstr (msg);
 	char *group = zmsg_popstr (msg);
 	char *message = zmsg_popstr (msg);
 	printf ("[%s] SHOUT %s %s %s %s\n", self->shortname, peerid, name, group, message);
-	json_msg_t *result = (json_msg_t *) zmalloc (sizeof (json_msg_t));
-	if (decode_json(message, result)==0) {
+	json_msg_t *result = event_pop_decoded (msg);
+	if (result) {
 		printf ("[%s] message type %s\n", self->shortname, result->type);
+		stats_count_type(self->stats, result->type);
+		if (MEDIATOR_PROBE_ENABLED(msg_dispatch))
+			MEDIATOR_PROBE(msg_dispatch, (const char *) "remote", result->type, peerid, strlen(message), result->decode_usecs, zclock_usecs() - result->decoded);
 		if (streq (result->type, "send_remote")) {
 			printf("handling remote send\n");
 			handle_remote_send_remote(self, result, peerid);
@@ -553,51 +1438,151 @@ void handle_remote_shout (mediator_t *self, zmsg_t *msg) {
 	zstr_free(&group);
 }
 
+void handle_file_server (mediator_t *self, zmsg_t *msg) {
+	/**
+	 * handles the replies and events of the file server and forwards them to the remote requester
+	 *
+	 * @param mediator_t* to the mediator data
+	 * @param zmsg_t* received from the file server
+	 */
+	char *event = zmsg_popstr (msg);
+	char *peerid = zmsg_popstr (msg);
+	char *uid = zmsg_popstr (msg);
+	if (!event || !peerid || !uid) {
+		printf("[%s] received malformed msg from file server\n", self->shortname);
+	} else if (streq (event, "endpoint")) {
+		char* file_size = zmsg_popstr (msg);
+		char* mtime = zmsg_popstr (msg);
+		char* files = zmsg_popstr (msg);
+		json_t *pl;
+		pl = json_object();
+		json_object_set(pl, "UID", json_string(uid));
+		json_object_set(pl, "URI", json_string(self->file_server_endpoint));
+		json_object_set(pl, "file_size", json_string(file_size)); //use this only for printing, so will leave it a string
+		if (files) {
+			// batch: file_size is the size of all files together
+			json_object_set_new(pl, "files", json_integer(atol(files)));
+		} else
+			json_object_set(pl, "mtime", json_string(mtime)); // lets the requester check its file cache
+		printf("[%s] whispering server endpoint %s to peer %s\n", self->shortname, self->file_server_endpoint, peerid);
+		char* encoded_msg = encode_msg("sherpa_mgs","http://kul/endpoint.json","endpoint",pl);
+		whisper_remote(self, peerid, encoded_msg);
+		free(encoded_msg);
+		query_t *q = mediator_lookup_query(self, QUERY_REMOTE, uid);
+		if (q)
+			q->state = QUERY_RUNNING;
+		zstr_free(&file_size);
+		zstr_free(&mtime);
+		zstr_free(&files);
+		json_decref(pl);
+	} else if (streq (event, "inline")) {
+		// small file: the contents are whispered along with the reply
+		char* file_size = zmsg_popstr (msg);
+		char* mtime = zmsg_popstr (msg);
+		zframe_t *contents = zmsg_pop (msg);
+		json_t *pl;
+		pl = json_object();
+		json_object_set(pl, "UID", json_string(uid));
+		json_object_set(pl, "file_size", json_string(file_size));
+		json_object_set(pl, "mtime", json_string(mtime));
+		printf("[%s] whispering contents of file to peer %s\n", self->shortname, peerid);
+		char* encoded_msg = encode_msg("sherpa_mgs","http://kul/file_content.json","file_content",pl);
+		zmsg_t *reply = zmsg_new();
+		zmsg_addstr(reply, "file_content");
+		zmsg_addstr(reply, encoded_msg);
+		zmsg_append(reply, &contents);
+		stats_count_out(self, peerid, zmsg_content_size(reply));
+		zyre_whisper(self->remote, peerid, &reply);
+		free(encoded_msg);
+		// nothing is left to serve, so the requester does not send remote_file_done
+		query_t *q = mediator_lookup_query(self, QUERY_REMOTE, uid);
+		mediator_remove_query(self, &q);
+		zstr_free(&file_size);
+		zstr_free(&mtime);
+		zframe_destroy(&contents);
+		json_decref(pl);
+	} else if (streq (event, "remote_file_transfer_error")) {
+		char *success = zmsg_popstr (msg);
+		char *error = zmsg_popstr (msg);
+		json_t *pl;
+		pl = json_object();
+		json_object_set(pl, "UID", json_string(uid));
+		json_object_set(pl, "error", json_string(error));
+		json_object_set(pl, "success", json_string(success));
+		printf("[%s] whispering remote peerid %s that remote_file_query's success was %s\n", self->shortname, peerid, success);
+		char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_transfer_error.json","remote_file_transfer_error",pl);
+		whisper_remote(self, peerid, encoded_msg);
+		free(encoded_msg);
+		query_t *q = mediator_lookup_query(self, QUERY_REMOTE, uid);
+		mediator_remove_query(self, &q);
+		zstr_free(&success);
+		zstr_free(&error);
+		json_decref(pl);
+	}
+	zstr_free(&event);
+	zstr_free(&peerid);
+	zstr_free(&uid);
+}
+
 void handle_remote_whisper (mediator_t *self, zmsg_t *msg) {
-	assert (zmsg_size(msg) == 3);
+	// decoded by event_decode; a small file sent with file_content follows the msg
+	assert (zmsg_size(msg) == 4 || zmsg_size(msg) == 5);
 	char *peerid = zmsg_popstr (msg);
 	char *name = zmsg_popstr (msg);
 	char *message = zmsg_popstr (msg);
+	json_msg_t *result = event_pop_decoded (msg);
+	zframe_t *contents = zmsg_pop (msg);
 	printf ("[%s] WHISPER %s %s %s\n", self->shortname, peerid, name, message);
-	json_msg_t *result = (json_msg_t *) zmalloc (sizeof (json_msg_t));
-	if (decode_json(message, result)==0) {
+	if (result) {
 		printf ("[%s] message type %s\n", self->shortname, result->type);
+		stats_count_type(self->stats, result->type);
+		if (MEDIATOR_PROBE_ENABLED(msg_dispatch))
+			MEDIATOR_PROBE(msg_dispatch, (const char *) "remote", result->type, peerid, strlen(message), result->decode_usecs, zclock_usecs() - result->decoded);
 		if(streq(result->type, "communication_ack")) {
 			json_error_t error;
 			json_t * root;
-			root = json_loads(message, 0, &error);
+			root = message_payload(result, &error);
 			if(!root) {
 				printf("Error parsing JSON file! line %d: %s\n", error.line, error.text);
+			} else if (!json_object_get(root,"UID")) {
+				printf("[%s] WARNING: No URI given! Will abort. \n", self->shortname);
+				json_decref(root);
 			} else {
-				send_msg_request_t *it = zlist_first(self->send_msgs);
-				while (it != NULL) {
-					if (json_object_get(root,"UID")) {
-						if (streq(it->uid,json_string_value(json_object_get(root,"UID")))) {
-							recipient_t *inner_it = zlist_first(it->recipients);
-							while (inner_it != NULL) {
-								if (streq(peerid,inner_it->id)) {
-									inner_it->ack = true;
-									break;
-								}
-								inner_it = zlist_next(it->recipients);
+				// neither can be in the outbox unless it is interned
+				intern_t uid = intern_lookup(self->ids, json_string_value(json_object_get(root,"UID")));
+				intern_t sender = intern_lookup(self->ids, peerid);
+				send_msg_request_t *it = self->send_msgs;
+				while (it != NULL && uid != 0 && sender != 0) {
+					if (it->uid == uid) {
+						recipient_t *inner_it = it->recipients;
+						while (inner_it != NULL) {
+							if (inner_it->id == sender) {
+								int64_t rtt = zclock_usecs() - it->ts_last_sent;
+								stats_peer_t *stats = stats_peer(self->stats, peerid);
+								if (stats && !inner_it->ack)
+									histogram_record(&stats->ack_rtt, rtt);
+								recorder_trace(self->recorder, TRACE_ACK, json_string_value(json_object_get(root,"UID")), peerid, rtt);
+								if (MEDIATOR_PROBE_ENABLED(outbox_ack))
+									MEDIATOR_PROBE(outbox_ack, json_string_value(json_object_get(root,"UID")), peerid, rtt, inner_it->ack ? 1 : 0);
+								inner_it->ack = true;
+								break;
 							}
-							break;
+							inner_it = inner_it->next;
 						}
-					} else {
-						printf("[%s] WARNING: No URI given! Will abort. \n", self->shortname);
-						return;
+						break;
 					}
-					it = zlist_next(self->send_msgs);
+					it = it->next;
 				}
+				json_decref(root);
 			}
 		} else if (streq (result->type, "query_remote_file")) {
             //TODO: check if URI is locally available: 1) check if peerid matches, 2) check if file exists
 			json_t *req;
 			json_error_t error;
-			req = json_loads(result->payload, 0, &error);
+			req = message_payload(result, &error);
 			if(!req) {
 				printf("Error parsing JSON payload!\n");
-				return;
+				goto cleanup;
 			} else {
 				const char* uid = NULL;
 				if (json_object_get(req,"UID")) {
@@ -605,99 +1590,64 @@ void handle_remote_whisper (mediator_t *self, zmsg_t *msg) {
 				} else {
 					printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
 					///TODO: report back to requesting compnent
-					return;
+					json_decref(req);
+					goto cleanup;
 				}
-				int rc;
-				const char *args[4];
-				args[0] = json_string_value(json_object_get(req, "URI"));
-				args[1] = self->actor_timeout;
-				args[2] = uid;
-				args[3] = peerid;
-				zactor_t * file_server = zactor_new (server_actor, args);
-				assert(file_server);
-				// wait for endpoint
-				char* endpoint_actor = zstr_recv(file_server);
-				if (streq(endpoint_actor,"remote_file_transfer_error")) {
-					//something went wrong before endpoint could be created, just destroy actor
-					printf("received error from server_actor\n");
-					char *peerid = zstr_recv (file_server);
-					char *recv_uid = zstr_recv (file_server);
-					char *success = zstr_recv (file_server);
-					char *error = zstr_recv (file_server);
-					assert(streq(uid, recv_uid));
+				// Add to remote queries
+				query_t * q = query_new(self->query_pool, strdup(uid), strdup(peerid), result, NULL);
+				result = NULL;
+				q->role = QUERY_REMOTE;
+				if (mediator_add_query(self, q) != 0) {
+					printf("[%s] query %s is already being served, rejecting it\n", self->shortname, uid);
 					json_t *pl;
 					pl = json_object();
-					json_object_set(pl, "UID", json_string(recv_uid));
-					json_object_set(pl, "error", json_string(error));
-					json_object_set(pl, "success", json_string(success));
-					printf("[%s] whispering remote peerid %s that remote_file_query's success was %s\n", self->shortname, peerid, success);
+					json_object_set(pl, "UID", json_string(uid));
+					json_object_set(pl, "error", json_string("Query UID already in use."));
+					json_object_set(pl, "success", json_string("false"));
 					char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_transfer_error.json","remote_file_transfer_error",pl);
-					zyre_whispers(self->remote, peerid , "%s", encoded_msg);
+					whisper_remote(self, peerid, encoded_msg);
 					free(encoded_msg);
-					int rc;
-					rc = zsock_signal (file_server, 123);
-					assert (rc == 0);
-					zactor_destroy (&file_server);
-					zstr_free(&peerid);
-					zstr_free(&recv_uid);
-					zstr_free(&success);
-					zstr_free(&error);
 					json_decref(pl);
-				} else {
-					printf("received endpoint from server_actor\n");
-					char* file_size = zstr_recv(file_server);
-					printf("file size %s\n",file_size);
-					const char s[2] = ":";
-					char *token;
-					token = strtok(endpoint_actor, ":");
-					char* protocol = strdup(token);
-					token = strtok(NULL, ":");
-					char* host = strdup(token);
-					token = strtok(NULL, ":");
-					char* port = strdup(token);
-					while(token!=NULL)
-					token=strtok(NULL, ":");
-					if (streq(host,"//*")) // replace with hostname
-					sprintf(host,"//%s", zsys_hostname());
-					char* endpoint = malloc(255);
-					sprintf(endpoint,"%s:%s:%s", protocol, host, port);
-					///TODO: check that endpoint does not overflow ie is longer than 255 charaters
-					//printf("endpoint: %s \n", endpoint);
-					rc = zhash_insert (self->queries, uid, file_server);
-
-					// Add to remote query_list
-					query_t * q = query_new(uid, peerid, result, file_server);
-					zlist_append(self->remote_query_list, q);
-					zpoller_add(self->poller, file_server);
-					json_t *pl;
-					pl = json_object();
-					json_object_set(pl, "UID", json_object_get(req,"UID"));
-					json_object_set(pl, "URI", json_string(endpoint));
-					char *eptr;
-	//				off_t fs = strtoll(file_size, &eptr, 10);
-	//				json_object_set(pl, "file_size", json_integer(fs));
-					json_object_set(pl, "file_size", json_string(file_size)); //use this only for printing, so will leave it a string
-					printf("[%s] whispering server endpoint %s to peer %s\n", self->shortname,endpoint, peerid);
-					char* encoded_msg = encode_msg("sherpa_mgs","http://kul/endpoint.json","endpoint",pl);
-					zyre_whispers(self->remote, peerid, "%s", encoded_msg);
-					free(encoded_msg);
-					zstr_free(&file_size);
-					free(token);
-					free(protocol);
-					free(host);
-					free(port);
-					free(endpoint);
+					json_decref(req);
+					query_destroy(&q);
+					goto cleanup;
 				}
-				zstr_free(&endpoint_actor);
+				const char *uri = json_string_value(json_object_get(req, "URI"));
+				// share of the outgoing bandwidth the requester asked for
+				char weight[32] = "1";
+				if (json_is_number(json_object_get(req, "weight")))
+					sprintf(weight, "%g", json_number_value(json_object_get(req, "weight")));
+				if (json_is_array(json_object_get(req, "URIs"))) {
+					// batch: ["batch"][uid][peerid][weight][recursive][pattern][path]...
+					zmsg_t *batch = zmsg_new();
+					zmsg_addstr(batch, "batch");
+					zmsg_addstr(batch, uid);
+					zmsg_addstr(batch, peerid);
+					zmsg_addstr(batch, weight);
+					zmsg_addstr(batch, json_is_true(json_object_get(req, "recursive")) ? "true" : "false");
+					const char *pattern = json_string_value(json_object_get(req, "pattern"));
+					zmsg_addstr(batch, pattern ? pattern : "");
+					size_t index;
+					json_t *value;
+					json_array_foreach(json_object_get(req, "URIs"), index, value) {
+						const char *path = json_string_value(value) ? strchr(json_string_value(value), ':') : NULL;
+						if (path)
+							zmsg_addstr(batch, path + 1);
+					}
+					zmsg_send(&batch, self->file_server);
+				} else
+					zstr_sendx (self->file_server, "serve", uid, peerid, uri ? uri : "", weight, NULL);
+				// the file server reports the endpoint once the file is open; handle_file_server whispers it
+				json_decref(req);
 			}
 		} else if (streq (result->type, "endpoint")) {
 			json_t *req;
 			json_error_t error;
-			req = json_loads(result->payload, 0, &error);
+			req = message_payload(result, &error);
 			if(!req) {
 				printf("Error parsing JSON payload!\n");
 				///TODO: report back to requesting compnent
-				return;
+				goto cleanup;
 			} else {
 				const char* uid = NULL;
 				if (json_object_get(req,"UID")) {
@@ -705,149 +1655,294 @@ void handle_remote_whisper (mediator_t *self, zmsg_t *msg) {
 				} else {
 					printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
 					///TODO: report back to requesting compnent
-					return;
+					json_decref(req);
+					goto cleanup;
 				}
-				int rc;
 				const char* file_size = NULL;
 				if (json_object_get(req,"file_size")) {
 					file_size = json_string_value(json_object_get(req,"file_size"));
 				} else {
 					printf("[%s] WARNING: No filesize returned! Will abort. \n", self->shortname);
 					///TODO: report back to requesting compnent
-					return;
+					json_decref(req);
+					goto cleanup;
 				}
-				const char *args[6];
-				args[0] = peerid;
-  				args[1] = uid;
-				args[2] = json_string_value(json_object_get(req, "URI"));
-				// check query for target location were to store the file
-				query_t *q = (query_t *) zlist_first(self->local_query_list);
-				int found = 0;
-				while (q != NULL) {
-					if (streq(q->uid, uid)) {
-						//printf("Found query with uid: %s\n",q->uid);
-						json_t *tmp_msg;
-						printf("msg in q: %s\n",q->msg->payload);
-						tmp_msg = json_loads(q->msg->payload, 0, &error);
-						if(!tmp_msg) {
-							printf("Error parsing JSON payload!\n");
-							///TODO: report back to requesting compnent
-							return;
-						}
-						char* tar = strdup(json_string_value(json_object_get(tmp_msg, "TARGET")));
-						if(!tar) {
-							printf("TARGET for storing file not found in query!\n");
-							///TODO: report back to requesting compnent
-							json_decref(tmp_msg);
-							return;
+				const char* uri = json_string_value(json_object_get(req, "URI"));
+				query_t *q = mediator_lookup_query(self, QUERY_LOCAL, uid);
+				if (q == NULL || !uri) {
+					// query wasn't found, e.g. the file was already fetched from another source
+					printf("[%s] WARNING: No query with this URI found! Releasing server of %s. \n", self->shortname, peerid);
+					json_t *pl;
+					pl = json_object();
+					json_object_set(pl, "UID", json_string(uid));
+					char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
+					whisper_remote(self, peerid, encoded_msg);
+					free(encoded_msg);
+					json_decref(pl);
+					json_decref(req);
+					goto cleanup;
+				}
+				q->candidates--;
+				zlist_append(q->sources, peerid);
+				char *resolved = peer_endpoint(self, peerid, uri);
+				zhash_update(q->endpoints, peerid, resolved);
+				free(resolved);
+				const char *endpoint = (const char *) zhash_lookup(q->endpoints, peerid);
+				if (!q->file_size)
+					q->file_size = strdup(file_size);
+
+				zactor_t * file_client = q->loop;
+				const char* mtime = json_string_value(json_object_get(req,"mtime"));
+				bool cached = false;
+				if (!file_client && self->file_cache && !q->cache_key && mtime) {
+					// the endpoint reply tells size and mtime of the file; fetch it only if it is not cached yet
+					char *path = remote_file_path(q->msg, peerid);
+					char *target = remote_file_target(q->msg);
+					if (path && target) {
+						q->cache_key = file_cache_key(peerid, path, file_size, mtime);
+						if (file_cache_fetch(self->file_cache, q->cache_key, target) == 0) {
+							json_t *pl;
+							pl = json_object();
+							json_object_set(pl, "UID", json_string(uid));
+							char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
+							whisper_remote(self, peerid, encoded_msg);
+							free(encoded_msg);
+							json_object_set(pl, "target", json_string(target));
+							json_object_set(pl, "error", json_string(""));
+							json_object_set(pl, "success", json_string("true"));
+							printf("[%s] whispering file_transfer_report of cached file to local peerid %s\n", self->shortname, q->requester);
+							encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+							query_whisper_requester(self, q, encoded_msg);
+							free(encoded_msg);
+							json_decref(pl);
+							mediator_remove_query(self, &q);
+							cached = true;
 						}
-						found = 1;
-						args[3] = tar;
-						printf("using target: %s\n",tar);
-						json_decref(tmp_msg);
-						break;
 					}
-					q = (query_t *) zlist_next(self->local_query_list);
+					free(path);
+					free(target);
 				}
-				if (found == 0) {
-					// query wasn't found!
-					printf("[%s] WARNING: No query with this URI found! Will abort. \n", self->shortname);
-					return;
+				if (cached) {
+					// answered from the file cache, nothing to fetch
+				} else if (file_client) {
+					// transfer already running; fetch from this peer as well
+					printf("[%s] adding source %s to query %s\n", self->shortname, peerid, uid);
+					// only peers that advertise the codec understand compressed fetch requests
+					zstr_sendx (file_client, "source", peerid, endpoint, file_size,
+							peer_accepts_compression(self, peerid) ? COMPRESSION_CODEC : "", NULL);
+				} else if (q->state == QUERY_QUEUED) {
+					// the source is used once the transfer starts
+					if (strneq(q->file_size, file_size)) {
+						printf("[%s] ignoring source %s: file size %s does not match %s\n", self->shortname, peerid, file_size, q->file_size);
+						zlist_remove(q->sources, (void *) zlist_last(q->sources));
+					} else
+						printf("[%s] query %s is queued, keeping source %s\n", self->shortname, uid, peerid);
+				} else if (zhash_size(self->query_actors) >= self->max_file_transfers) {
+					file_transfer_enqueue(self, q);
+				} else if (file_transfer_start(self, q) != 0) {
+					printf("[%s] could not start file transfer for query %s\n", self->shortname, uid);
 				}
-				args[4] = self->actor_timeout;
-				args[5] = file_size;
-
-				zactor_t * file_client = zactor_new (client_actor, args);
-				rc = zhash_insert (self->queries, uid, file_client);
-				// Required to know when transfer is completed
-  				zpoller_add(self->poller, file_client);
+				json_decref(req);
+			}
+		} else if (streq (result->type, "distribute_file")) {
+			// a remote mediator distributes a file: fetch it like a local query
+			// and report to that mediator instead of a local component
+			json_t *req;
+			json_error_t error;
+			req = message_payload(result, &error);
+			const char* uid = req ? json_string_value(json_object_get(req,"UID")) : NULL;
+			const char* target = req ? json_string_value(json_object_get(req,"TARGET")) : NULL;
+			// any peer may send this, so it may only write below our distribution_dir
+			const char *failure = NULL;
+			if (!self->distribution_dir)
+				failure = "Distributions are not accepted.";
+			else if (!batch_name_valid(target))
+				failure = "TARGET has to be a relative path without '..'.";
+			if (uid && !failure) {
+				char *path = (char *) malloc(strlen(self->distribution_dir) + strlen(target) + 2);
+				assert (path);
+				sprintf(path, "%s/%s", self->distribution_dir, target);
+				json_object_set_new(req, "TARGET", json_string(path));
+				free(result->payload);
+				// the query keeps the msg beyond this event
+				result->payload = arena_escape(json_dumps(req, JSON_ENCODE_ANY));
+				if (batch_make_dirs(path) != 0)
+					printf("[%s] could not create the directories of %s\n", self->shortname, path);
+				free(path);
+				query_t *q = query_new(self->query_pool, strdup(uid), strdup(peerid), result, NULL);
+				result = NULL;
+				q->role = QUERY_LOCAL;
+				q->distributed = true;
+				if (mediator_add_query(self, q) != 0) {
+					failure = "Query UID already in use.";
+					query_destroy(&q);
+				} else {
+					q->candidates = query_remote_file(self, q->msg);
+					if (q->candidates == 0) {
+						failure = "No valid URI given.";
+						mediator_remove_query(self, &q);
+					}
+				}
+			} else if (uid)
+				printf("[%s] refusing distribute_file %s of %s: %s\n", self->shortname, uid, peerid, failure);
+			if (uid && failure) {
+				json_t *pl;
+				pl = json_object();
+				json_object_set(pl, "UID", json_string(uid));
+				json_object_set(pl, "error", json_string(failure));
+				json_object_set(pl, "success", json_string("false"));
+				json_object_set(pl, "target", json_string(""));
+				char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+				whisper_remote(self, peerid, encoded_msg);
+				free(encoded_msg);
+				json_decref(pl);
+			}
+			json_decref(req);
+		} else if (streq (result->type, "file_transfer_report")) {
+			// a recipient of a file we distribute is done
+			distribution_confirm(self, peerid, result);
+		} else if (streq (result->type, "file_transfer_progress") || streq (result->type, "file_transfer_queued")) {
+			// recipients of distributions report these as well; only the result is tracked
+		} else if (streq (result->type, "file_content")) {
+			json_t *req;
+			json_error_t error;
+			req = message_payload(result, &error);
+			const char* uid = req ? json_string_value(json_object_get(req,"UID")) : NULL;
+			query_t *q = uid ? mediator_lookup_query(self, QUERY_LOCAL, uid) : NULL;
+			if (!q || q->loop || !contents) {
+				// e.g. the file is already being fetched from another source
+				printf("[%s] ignoring contents of file from %s\n", self->shortname, peerid);
+				if (q)
+					q->candidates--;
+			} else {
+				char *target = remote_file_target(q->msg);
+				int rc = target ? file_write_atomic(target, zframe_data(contents), zframe_size(contents)) : -1;
+				printf("[%s] received %zu bytes of query %s inline from %s\n", self->shortname, zframe_size(contents), uid, peerid);
+				const char* file_size = json_string_value(json_object_get(req,"file_size"));
+				const char* mtime = json_string_value(json_object_get(req,"mtime"));
+				char *path = remote_file_path(q->msg, peerid);
+				if (rc == 0 && self->file_cache && path && file_size && mtime) {
+					char *key = file_cache_key(peerid, path, file_size, mtime);
+					file_cache_store(self->file_cache, key, target);
+					free(key);
+				}
+				free(path);
+				json_t *pl;
+				pl = json_object();
+				json_object_set(pl, "UID", json_string(uid));
+				// release the servers of sources that answered with an endpoint already
+				char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
+				char *source = (char *) zlist_first(q->sources);
+				while (source != NULL) {
+					whisper_remote(self, source, encoded_msg);
+					source = (char *) zlist_next(q->sources);
+				}
+				free(encoded_msg);
+				json_object_set(pl, "target", json_string(rc == 0 ? target : ""));
+				json_object_set(pl, "error", json_string(rc == 0 ? "" : "Could not write file. Please check target folder."));
+				json_object_set(pl, "success", json_string(rc == 0 ? "true" : "false"));
+				printf("[%s] whispering file_transfer_report to local peerid %s\n", self->shortname, q->requester);
+				encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+				query_whisper_requester(self, q, encoded_msg);
+				free(encoded_msg);
+				json_decref(pl);
+				free(target);
+				mediator_remove_query(self, &q);
+				// the query may have been queued
+				file_transfer_dequeue(self);
 			}
+			json_decref(req);
 		} else if (streq (result->type, "remote_file_done")) {
 			json_t *req;
 			json_error_t error;
-			req = json_loads(result->payload, 0, &error);
+			req = message_payload(result, &error);
 			if(!req) {
 				printf("Error parsing JSON payload!\n");
-				return;
+				goto cleanup;
 			} else {
 				const char* uid = NULL;
 				if (json_object_get(req,"UID")) {
 					uid = json_string_value(json_object_get(req,"UID"));
 				} else {
 					printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
-					return;
-				}
-				printf("[%s] received remote_file_done, killing server %s\n", self->shortname, uid);
-				zactor_t *file_server = (zactor_t*) zhash_lookup(self->queries, uid);
-  				zpoller_remove(self->poller, file_server);
-                zhash_delete (self->queries, uid);
-
-
-                query_t *q = (query_t *) zlist_first(self->remote_query_list);
-				// look up local requester
-				while (q != NULL) {
-					if (streq(q->uid, uid)) {
-						zlist_remove(self->remote_query_list,q);
-						query_destroy(&q);
-						break;
-					}
-					q = (query_t *) zlist_next(self->remote_query_list);
+					json_decref(req);
+					goto cleanup;
 				}
-  				zactor_destroy(&file_server);
+				printf("[%s] received remote_file_done, releasing file of %s\n", self->shortname, uid);
+				zstr_sendx (self->file_server, "done", uid, NULL);
+				query_t *q = mediator_lookup_query(self, QUERY_REMOTE, uid);
+				mediator_remove_query(self, &q);
+				json_decref(req);
 			}
 		} else if (streq (result->type, "remote_file_transfer_error")) {
 			json_t *req;
 			json_error_t error;
-			req = json_loads(result->payload, 0, &error);
+			req = message_payload(result, &error);
 			if(!req) {
 				printf("Error parsing JSON payload!\n");
-				return;
+				goto cleanup;
 			} else {
 				const char* uid = NULL;
 				if (json_object_get(req,"UID")) {
 					uid = json_string_value(json_object_get(req,"UID"));
 				} else {
 					printf("[%s] WARNING: No query URI given! Will abort. \n", self->shortname);
-					return;
+					json_decref(req);
+					goto cleanup;
 				}
-				printf("[%s] received remote_file_transfer_error, killing client\n", self->shortname);
-				zactor_t *file_server = (zactor_t*) zhash_lookup(self->queries, uid);
-				if (!file_server) {
-					// client not started yet, skipping cleanup
-				} else {
-					zpoller_remove(self->poller, file_server);
-					zhash_delete (self->queries, uid);
-					zactor_destroy(&file_server);
+				query_t *q = mediator_lookup_query(self, QUERY_LOCAL, uid);
+				zactor_t *file_server = q ? q->loop : NULL;
+				bool continuing = false;
+				if (q != NULL) {
+					// forget the failed source; the others may still serve the file
+					int active = 0;
+					char *source = (char *) zlist_first(q->sources);
+					while (source != NULL) {
+						if (streq(source, peerid)) {
+							zlist_remove(q->sources, source);
+							active = 1;
+							break;
+						}
+						source = (char *) zlist_next(q->sources);
+					}
+					if (!active)
+						q->candidates--;
+					if (zlist_size(q->sources) > 0 || q->candidates > 0) {
+						printf("[%s] source %s of query %s failed, continuing with other sources\n", self->shortname, peerid, uid);
+						if (active && file_server)
+							zstr_sendx (file_server, "drop_source", peerid, NULL);
+						continuing = true;
+					}
 				}
+				if (!continuing) {
+					printf("[%s] received remote_file_transfer_error, killing client\n", self->shortname);
 
-				//notify local component
-				query_t *q = (query_t *) zlist_first(self->local_query_list);
-				char* requester = NULL;
-				// look up local requester
-				while (q != NULL) {
-					if (streq(q->uid, uid)) {
+					//notify local component
+					char* requester = NULL;
+					if (q != NULL)
 						requester = strdup(q->requester);
-						break;
+					json_t *pl;
+					pl = json_object();
+					json_object_set(pl, "UID", json_string(uid));
+					json_object_set(pl, "error", json_object_get(req,"error"));
+					json_object_set(pl, "success", json_object_get(req,"success"));
+					json_object_set(pl, "target", json_string(""));
+					if(requester != NULL) {
+						printf("[%s] whispering file_transfer_report to local peerid %s\n", self->shortname, requester);
+						char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+						query_whisper_requester(self, q, encoded_msg);
+						free(encoded_msg);
+						free(requester);
+						// stops the client, if it was started already
+						mediator_remove_query(self, &q);
+					} else {
+						printf("[%s] requester of local query %s not found!\n", self->shortname, uid);
 					}
-					q = (query_t *) zlist_next(self->local_query_list);
-				}
-				json_t *pl;
-				pl = json_object();
-				json_object_set(pl, "UID", json_string(uid));
-				json_object_set(pl, "error", json_object_get(req,"error"));
-				json_object_set(pl, "success", json_object_get(req,"success"));
-				json_object_set(pl, "target", json_string(""));
-				if(requester != NULL) {
-					printf("[%s] whispering file_transfer_report to local peerid %s\n", self->shortname, requester);
-					char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
-					zyre_whispers(self->local, requester, "%s", encoded_msg);
-					free(encoded_msg);
-					zlist_remove(self->local_query_list,q);
-					query_destroy(&q);
-				} else {
-					printf("[%s] requester of local query %s not found!\n", self->shortname, uid);
+					json_decref(pl);
+					// a transfer slot may have become free
+					file_transfer_dequeue(self);
 				}
-				json_decref(pl);
+				json_decref(req);
 			}
 		} else {
 			printf ("[%s] unknown msg type\n", self->shortname);
@@ -855,8 +1950,12 @@ void handle_remote_whisper (mediator_t *self, zmsg_t *msg) {
 	} else {
 	        printf ("[%s] message could not be decoded\n", self->shortname);
 	}
+cleanup:
+	zframe_destroy(&contents);
 	zstr_free(&peerid);
 	zstr_free(&name);
+	zstr_free(&message);
+	message_destroy(&result);
 }
 
 void handle_remote_join (mediator_t *self, zmsg_t *msg) {
@@ -920,20 +2019,24 @@ void handle_local_stop(mediator_t *self, zmsg_t *msg) {
 }
 
 void handle_local_shout(mediator_t *self, zmsg_t *msg) {
-	assert (zmsg_size(msg) == 4);
+	// decoded by event_decode
+	assert (zmsg_size(msg) == 5);
 	char *peerid = zmsg_popstr (msg);
 	char *name = zmsg_popstr (msg);
 	char *group = zmsg_popstr (msg);
 	char *message = zmsg_popstr (msg);
 	printf ("[%s] SHOUT %s %s %s %s\n", self->shortname, peerid, name, group, message);
-	json_msg_t *result = (json_msg_t *) zmalloc (sizeof (json_msg_t));
-	if (decode_json(message, result) == 0) {
+	json_msg_t *result = event_pop_decoded (msg);
+	if (result) {
 		printf ("[%s] message type %s\n", self->shortname, result->type);
+		stats_count_type(self->stats, result->type);
+		if (MEDIATOR_PROBE_ENABLED(msg_dispatch))
+			MEDIATOR_PROBE(msg_dispatch, (const char *) "local", result->type, peerid, strlen(message), result->decode_usecs, zclock_usecs() - result->decoded);
 		if (streq (result->type, "query_remote_peer_list")) {
 			// generate remote peer list and whisper it back
 			char *peerlist = generate_peer_list(self, result);
 			if (peerlist) {
-				zyre_whispers(self->local, peerid, "%s", peerlist);
+				whisper_local(self, peerid, peerlist);
 			} else {
 				printf ("[%s] Could not generate remote peer list! \n", self->shortname);
 			}
@@ -941,28 +2044,104 @@ void handle_local_shout(mediator_t *self, zmsg_t *msg) {
 		} else if (streq (result->type, "send_request")) {
 			// query for communication
 			send_remote(self, result, self->remotegroup);
+		} else if (streq (result->type, "distribute_file")) {
+			// send a local file to a group of remote peers
+			distribution_start(self, peerid, result);
+		} else if (streq (result->type, "set_transfer_shaping")) {
+			// adjust the bandwidth of the files we serve at run time
+			json_t *req;
+			json_error_t error;
+			req = message_payload(result, &error);
+			if(!req) {
+				printf("Error parsing JSON payload!\n");
+			} else {
+				char bandwidth[24] = "";
+				char weight[32] = "";
+				if (json_is_integer(json_object_get(req, "bandwidth")))
+					sprintf(bandwidth, "%ld", (long) json_integer_value(json_object_get(req, "bandwidth")));
+				if (json_is_number(json_object_get(req, "weight")))
+					sprintf(weight, "%g", json_number_value(json_object_get(req, "weight")));
+				const char *uid = json_string_value(json_object_get(req, "UID"));
+				zstr_sendx (self->file_server, "shape", bandwidth, uid ? uid : "", weight, NULL);
+				json_decref(req);
+			}
 		} else if (streq (result->type, "query_mediator_uuid")) {
 			// send uuid of local (gossip) and remote network (to be used )
 			char *mediator_uuid_msg = generate_mediator_uuid(self, result);
 			if (mediator_uuid_msg) {
 				//zyre_whispers(self->local, peerid, "%s", mediator_uuid_msg);
-				zyre_shouts(self->local,self->localgroup, "%s", mediator_uuid_msg);
+				shout_local(self, mediator_uuid_msg);
 			} else {
 				printf ("[%s] Could not generate mediator uuid! \n", self->shortname);
 			}
 			zstr_free(&mediator_uuid_msg);
+		} else if (streq (result->type, "dump_trace")) {
+			// write the flight recorder to a file and tell the requester where
+			json_t *req;
+			json_error_t error;
+			req = message_payload(result, &error);
+			if(!req) {
+				printf("Error parsing JSON payload!\n");
+			} else {
+				const char *file = json_string_value(json_object_get(req, "file"));
+				int records = mediator_dump_trace(self, file);
+				json_t *pl = json_object();
+				json_object_set(pl, "UID", json_object_get(req, "UID"));
+				json_object_set_new(pl, "success", records >= 0 ? json_true() : json_false());
+				json_object_set_new(pl, "file", json_string(file ? file : self->trace_file));
+				json_object_set_new(pl, "records", json_integer(records >= 0 ? records : 0));
+				char* encoded_msg = encode_msg("sherpa_mgs","http://kul/trace_dump.json","trace_dump",pl);
+				whisper_local(self, peerid, encoded_msg);
+				free(encoded_msg);
+				json_decref(pl);
+				json_decref(req);
+			}
+		} else if (streq (result->type, "query_mediator_stats")) {
+			// send counters and histograms of the mediator
+			char *mediator_stats_msg = generate_mediator_stats(self, result);
+			if (mediator_stats_msg) {
+				shout_local(self, mediator_stats_msg);
+			} else {
+				printf ("[%s] Could not generate mediator stats! \n", self->shortname);
+			}
+			zstr_free(&mediator_stats_msg);
 		} else if (streq (result->type, "query_remote_file")) {
 			json_t *req;
 			json_error_t error;
-			req = json_loads(result->payload, 0, &error);
+			req = message_payload(result, &error);
 			if(!req) {
 				printf("Error parsing JSON payload!\n");
 				return;
 			} else {
 				const char* uid = json_string_value(json_object_get(req,"UID"));
-                query_t * q = query_new(strdup(uid), strdup(peerid), result, NULL);
-				zlist_append(self->local_query_list, q); 
-				query_remote_file(self, result);
+                query_t * q = query_new(self->query_pool, strdup(uid), strdup(peerid), result, NULL);
+				// the query keeps the msg to look up the TARGET once an endpoint arrives
+				result = NULL;
+				q->role = QUERY_LOCAL;
+				q->batch = json_is_array(json_object_get(req,"URIs"));
+				const char *error = NULL;
+				if (mediator_add_query(self, q) != 0) {
+					error = "Query UID already in use.";
+					query_destroy(&q);
+				} else {
+					q->candidates = query_remote_file(self, q->msg);
+					if (q->candidates == 0) {
+						error = "No valid URI given.";
+						mediator_remove_query(self, &q);
+					}
+				}
+				if (error) {
+					json_t *pl;
+					pl = json_object();
+					json_object_set(pl, "UID", json_string(uid));
+					json_object_set(pl, "error", json_string(error));
+					json_object_set(pl, "success", json_string("false"));
+					json_object_set(pl, "target", json_string(""));
+					char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
+					whisper_local(self, peerid, encoded_msg);
+					free(encoded_msg);
+					json_decref(pl);
+				}
 				json_decref(req);
 			}
 		} else {
@@ -1010,10 +2189,15 @@ void handle_local_evasive (mediator_t *self, zmsg_t *msg) {
 }
 
 void process_send_msgs (mediator_t *self) {
-    send_msg_request_t *it = zlist_first(self->send_msgs);
+    // link points at the pointer to it, so finished entries can be unlinked
+    send_msg_request_t **link = &self->send_msgs;
+    send_msg_request_t *it = *link;
+    char id[INTERN_BUF_SIZE];
+    // the deadlines of the msgs that remain, for mediator_poll_timeout
+    self->outbox_deadline = -1;
     while (it != NULL) {
 		//check if all recipients have acknowledged reception of msg
-		recipient_t *inner_it = zlist_first(it->recipients);
+		recipient_t *inner_it = it->recipients;
 		int flag = 1;
 		json_t *acknowledged;
 		acknowledged = json_array();
@@ -1022,27 +2206,32 @@ void process_send_msgs (mediator_t *self) {
 		while (inner_it != NULL) {
 			if (inner_it->ack == false) {
 				flag = 0;
-				json_array_append(unacknowledged,json_string(inner_it->id));
+				json_array_append_new(unacknowledged,json_string(intern_str(self->ids, inner_it->id, id)));
 			} else
-				json_array_append(acknowledged,json_string(inner_it->id));
-			inner_it = zlist_next(it->recipients);
+				json_array_append_new(acknowledged,json_string(intern_str(self->ids, inner_it->id, id)));
+			inner_it = inner_it->next;
 		}
 		if (flag == 1) {
 			// if all recipients have acknowledged, send report and remove item from list
 			json_t *pl;
 			pl = json_object();
-			json_object_set(pl, "UID", json_string(it->uid));
+			json_object_set(pl, "UID", json_string(intern_str(self->ids, it->uid, id)));
 			json_object_set(pl, "success", json_true());
 			json_object_set(pl, "error", json_string("None"));
 			json_object_set(pl, "recipients_delivered", acknowledged);
 			json_object_set(pl, "recipients_undelivered", unacknowledged);
 			char* encoded_msg = encode_msg("sherpa_mgs","http://kul/communication_report.json","communication_report",pl);
-			zyre_whispers(self->local, it->local_requester, "%s", encoded_msg);
+			whisper_local(self, intern_str(self->ids, it->local_requester, id), encoded_msg);
 			free(encoded_msg);
 			json_decref(pl);
+			STATS_ADD(self->stats->delivered, 1);
+			recorder_trace(self->recorder, TRACE_REPORT, intern_str(self->ids, it->uid, id), NULL, 1);
+			histogram_record(&self->stats->report_latency, zclock_usecs() - it->ts_added);
+			if (MEDIATOR_PROBE_ENABLED(outbox_delivered))
+				MEDIATOR_PROBE(outbox_delivered, intern_str(self->ids, it->uid, id), it->resends, zclock_usecs() - it->ts_added);
 			send_msg_request_t *dummy = it;
-			it = zlist_next(self->send_msgs);
-			zlist_remove(self->send_msgs,dummy);
+			it = *link = it->next;
+			send_msg_request_destroy(self, &dummy);
 		} else {
 			int64_t curr_time = zclock_usecs ();
 			if (curr_time > 0) {
@@ -1052,30 +2241,42 @@ void process_send_msgs (mediator_t *self) {
 				if (curr_time_msec - ts_msec > it->timeout) {
 					json_t *pl;
 					pl = json_object();
-					json_object_set(pl, "UID", json_string(it->uid));
+					json_object_set(pl, "UID", json_string(intern_str(self->ids, it->uid, id)));
 					json_object_set(pl, "success", json_false());
 					json_object_set(pl, "error", json_string("Timeout"));
 					json_object_set(pl, "recipients_delivered", acknowledged);
 					json_object_set(pl, "recipients_undelivered", unacknowledged);
 					char* encoded_msg = encode_msg("sherpa_mgs","http://kul/communication_report.json","communication_report",pl);
-					zyre_whispers(self->local, it->local_requester, "%s", encoded_msg);
+					whisper_local(self, intern_str(self->ids, it->local_requester, id), encoded_msg);
 					free(encoded_msg);
 					json_decref(pl);
+					STATS_ADD(self->stats->timeouts, 1);
+					recorder_trace(self->recorder, TRACE_REPORT, intern_str(self->ids, it->uid, id), NULL, 0);
+					if (MEDIATOR_PROBE_ENABLED(outbox_timeout))
+						MEDIATOR_PROBE(outbox_timeout, intern_str(self->ids, it->uid, id), it->resends, curr_time - it->ts_added);
 					send_msg_request_t *dummy = it;
-					it = zlist_next(self->send_msgs);
-					zlist_remove(self->send_msgs,dummy);
+					it = *link = it->next;
+					send_msg_request_destroy(self, &dummy);
 				} else {
 					double ts_msec = it->ts_last_sent*1.0e-3;
 					if (curr_time_msec - ts_msec > json_integer_value(json_object_get(self->config, "resend_interval"))) {
 						// no timeout -> resend
-						zyre_shouts(self->remote, it->group, "%s", it->msg);
+						send_compressed(self, it->group, true, it->payload_type, it->msg, &it->compressed);
 						it->ts_last_sent = curr_time;
+						STATS_ADD(self->stats->resends, 1);
+						recorder_trace(self->recorder, TRACE_RESEND, intern_str(self->ids, it->uid, id), NULL, ++it->resends);
+						if (MEDIATOR_PROBE_ENABLED(outbox_resend))
+							MEDIATOR_PROBE(outbox_resend, intern_str(self->ids, it->uid, id), it->resends, curr_time - it->ts_added);
 					}
-					it = zlist_next(self->send_msgs);
+					self->outbox_deadline = deadline_earliest(self->outbox_deadline, send_msg_deadline(self, it));
+					link = &it->next;
+					it = *link;
 				}
 			} else {
 				printf ("[%s] could not get current time\n", self->shortname);
-				it = zlist_next(self->send_msgs);
+				self->outbox_deadline = deadline_earliest(self->outbox_deadline, send_msg_deadline(self, it));
+				link = &it->next;
+				it = *link;
 			}
 		}
 		json_decref(acknowledged);
@@ -1084,106 +2285,336 @@ void process_send_msgs (mediator_t *self) {
 	// remove items from filter list that are longer in there than the configured time
 	int64_t curr_time = zclock_usecs ();
 	if (curr_time > 0) {
-		filter_list_item_t *it = zlist_first(self->filter_list);
+		filter_list_item_t **link = &self->filter_list;
+		filter_list_item_t *it = *link;
 		int length = json_integer_value(json_object_get(self->config, "msg_filter_length"));
+		self->filter_deadline = -1;
 		while (it != NULL) {
 			double curr_time_msec = curr_time*1.0e-3;
 			double ts_msec = it->ts*1.0e-3;
 			if (curr_time_msec - ts_msec > length) {
 				filter_list_item_t *dummy = it;
-				it = zlist_next(self->filter_list);
-				zlist_remove(self->filter_list,dummy);
-				free(dummy->msg_UID);
-				free(dummy->sender);
-				free(dummy);
-			} else
-				it = zlist_next(self->filter_list);
+				it = *link = it->next;
+				filter_list_item_destroy(self, &dummy);
+			} else {
+				// newest first, so the last one left expires first
+				self->filter_deadline = it->ts / 1000 + length + 1;
+				link = &it->next;
+				it = *link;
+			}
 		}
 	}
 }
 
-int main(int argc, char *argv[]) {
-    // load configuration file
-    json_t * config = load_config_file(argv[1]);
-    if (config == NULL) {
-      return -1;
-    }
-    mediator_t *self = mediator_new(config);
-    printf("[%s] mediator initialised!\n", self->shortname);
-    
-    //zclock_sleep(10000);
-    while(!zsys_interrupted) {
-    	void *which = zpoller_wait (self->poller, ZMQ_POLL_MSEC);
-        if (which == zyre_socket (self->local)) {
-            printf("\n");
-            printf("[%s] local data received!\n", self->shortname);
+size_t decoder_index (const byte *peerid, size_t size, size_t nbr_decoders) {
+	/**
+	 * @param byte* peerid of the sender of an event
+	 * @param size_t size of the peerid
+	 * @param size_t number of decoders
+	 *
+	 * @return index of the decoder that handles all events of this peer
+	 */
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < size; i++)
+		hash = (hash ^ peerid[i]) * 16777619u;
+	return hash % nbr_decoders;
+}
+
+void handle_event (mediator_t *self, zmsg_t *msg) {
+	/**
+	 * dispatches a zyre event of the local or remote network
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param zmsg_t* ["local" or "remote"][event][frames of the event], decoded by event_decode
+	 */
+	char *network = zmsg_popstr (msg);
+	char *event = zmsg_popstr (msg);
+	if (!network || !event) {
+		zstr_free (&network);
+		zstr_free (&event);
+		return;
+	}
+	// whatever the handlers parse or encode is released as a whole, see arena_t
+	arena_begin (self->arena);
+	if (streq (network, "local")) {
+		if (streq (event, "ENTER")) {
+			handle_local_enter (self, msg);
+		} else if (streq (event, "EXIT")) {
+			handle_local_exit (self, msg);
+		} else if (streq (event, "STOP")) {
+			handle_local_stop (self, msg);
+		} else if (streq (event, "SHOUT")) {
+			handle_local_shout (self, msg);
+		} else if (streq (event, "WHISPER")) {
+			handle_local_whisper (self, msg);
+		} else if (streq (event, "JOIN")) {
+			handle_local_join (self, msg);
+		} else if (streq (event, "EVASIVE")) {
+			handle_local_evasive (self, msg);
+		} else {
+			zmsg_print(msg);
+		}
+	} else {
+		if (streq (event, "ENTER")) {
+			handle_remote_enter (self, msg);
+		} else if (streq (event, "EXIT")) {
+			handle_remote_exit (self, msg);
+		} else if (streq (event, "STOP")) {
+			handle_remote_stop (self, msg);
+		} else if (streq (event, "SHOUT")) {
+			handle_remote_shout (self, msg);
+		} else if (streq (event, "WHISPER")) {
+			handle_remote_whisper (self, msg);
+		} else if (streq (event, "JOIN")) {
+			handle_remote_join (self, msg);
+		} else if (streq (event, "EVASIVE")) {
+			handle_remote_evasive (self, msg);
+		} else {
+			zmsg_print(msg);
+		}
+	}
+	arena_end (self->arena);
+	zstr_free (&network);
+	zstr_free (&event);
+}
+
+void mediator_dispatch (mediator_t *self, zmsg_t **msg_p) {
+	/**
+	 * decodes and handles an event, on a decoder thread if there are any
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param zmsg_t** ["local" or "remote"][event][frames of the event], set to NULL
+	 */
+	zmsg_t *msg = *msg_p;
+	*msg_p = NULL;
+	// count the msg frames of SHOUTs [peerid][name][group][msg...] and
+	// WHISPERs [peerid][name][msg...]
+	zframe_t *network = zmsg_first (msg);
+	zframe_t *event = zmsg_next (msg);
+	if (network && event && (zframe_streq (event, "SHOUT") || zframe_streq (event, "WHISPER"))) {
+		bool remote = !zframe_streq (network, "local");
+		stats_network_t *stats = &self->stats->networks[remote ? STATS_REMOTE : STATS_LOCAL];
+		int headers = zframe_streq (event, "SHOUT") ? 3 : 2;
+		size_t bytes = 0;
+		zframe_t *peer = zmsg_next (msg);
+		zframe_t *frame = peer;
+		while (frame != NULL) {
+			if (headers > 0)
+				headers--;
+			else
+				bytes += zframe_size (frame);
+			frame = zmsg_next (msg);
+		}
+		STATS_ADD(stats->msgs_in, 1);
+		STATS_ADD(stats->bytes_in, bytes);
+		char peerid[STATS_NAME_SIZE] = "";
+		if (peer) {
+			size_t size = zframe_size (peer) < STATS_NAME_SIZE ? zframe_size (peer) : STATS_NAME_SIZE - 1;
+			memcpy (peerid, zframe_data (peer), size);
+			peerid[size] = '\0';
+		}
+		MEDIATOR_PROBE(msg_receive, remote ? "remote" : "local", zframe_streq (event, "SHOUT") ? "SHOUT" : "WHISPER", (const char *) peerid, bytes);
+		if (remote && peer) {
+			stats_peer_t *peer_stats = stats_peer (self->stats, peerid);
+			if (peer_stats) {
+				STATS_ADD(peer_stats->traffic.msgs_in, 1);
+				STATS_ADD(peer_stats->traffic.bytes_in, bytes);
+			}
+		}
+	}
+	if (self->nbr_decoders > 0) {
+		// all events of a peer are decoded by the same thread, so they stay in order
+		zmsg_first (msg);   // network
+		zmsg_next (msg);    // event
+		zframe_t *peer = zmsg_next (msg);
+		size_t decoder = peer ? decoder_index (zframe_data (peer), zframe_size (peer), self->nbr_decoders) : 0;
+		zmsg_send (&msg, self->decoders[decoder]);
+		// with less events in flight than the pipes and the decoded socket
+		// hold, neither this send nor the decoders ever block
+		if (++self->decoding >= DECODER_INFLIGHT && !self->throttled) {
+			printf("[%s] decoders are %zu events behind, pausing the networks\n", self->shortname, self->decoding);
+			zpoller_remove (self->poller, zyre_socket (self->local));
+			zpoller_remove (self->poller, zyre_socket (self->remote));
+			if (self->inproc)
+				zpoller_remove (self->poller, self->inproc);
+			self->throttled = true;
+		}
+	} else {
+		event_decode (self->compressor, self->arena, msg);
+		handle_event (self, msg);
+		zmsg_destroy (&msg);
+	}
+}
+
+int mediator_drain_decoded (mediator_t *self) {
+	/**
+	 * handles all events the decoders handed back so far, without blocking
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 *
+	 * @return 0 if successful and -1 if the socket was interrupted
+	 */
+	while (zsock_events (self->decoded) & ZMQ_POLLIN) {
+		zmsg_t *msg = zmsg_recv (self->decoded);
+		if (!msg)
+			return -1;
+		self->decoding--;
+		handle_event (self, msg);
+		zmsg_destroy (&msg);
+	}
+	if (self->throttled && self->decoding <= DECODER_INFLIGHT / 2) {
+		zpoller_add (self->poller, zyre_socket (self->local));
+		zpoller_add (self->poller, zyre_socket (self->remote));
+		if (self->inproc)
+			zpoller_add (self->poller, self->inproc);
+		self->throttled = false;
+	}
+	return 0;
+}
+
+void handle_inproc (mediator_t *self, zmsg_t *msg) {
+	/**
+	 * handles a msg of a component in the same process as if it was shouted
+	 * on the local network
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 * @param zmsg_t* [identity][msg] received on the inproc socket
+	 */
+	if (zmsg_size(msg) != 2)
+		return;
+	zframe_t *identity = zmsg_pop (msg);
+	char *hex = zframe_strhex (identity);
+	char peerid[64];
+	snprintf (peerid, sizeof (peerid), "inproc-%s", hex);
+	free (hex);
+	if (!zhash_lookup (self->inproc_clients, peerid)) {
+		printf("[%s] in-process component %s connected\n", self->shortname, peerid);
+		zhash_insert (self->inproc_clients, peerid, zframe_dup (identity));
+		zhash_freefn (self->inproc_clients, peerid, inproc_client_free);
+	}
+	zframe_destroy (&identity);
+	zmsg_pushstr (msg, self->localgroup);
+	zmsg_pushstr (msg, peerid);
+	zmsg_pushstr (msg, peerid);
+	zmsg_pushstr (msg, "SHOUT");
+	zmsg_pushstr (msg, "local");
+	mediator_dispatch (self, &msg);
+}
+
+// dump signals received, see mediator_trace_signal
+static volatile sig_atomic_t trace_signals = 0;
+
+// Threads running mediator_run. A process-directed signal is delivered to any
+// thread, usually one of the czmq actors, so the handler forwards it to every
+// loop: the signal interrupts the zpoller_wait of an idle loop, which may wait
+// forever otherwise. A slot is 0 if free, 1 while it is claimed and 2 once the
+// thread is set.
+#define TRACE_LOOPS 16
+static pthread_t trace_loops[TRACE_LOOPS];
+static int trace_loop_slots[TRACE_LOOPS];
+
+static int trace_loop_register (void) {
+	/**
+	 * @return slot of the calling thread, -1 if all are taken
+	 */
+	int i;
+	for (i = 0; i < TRACE_LOOPS; i++) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n (&trace_loop_slots[i], &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			trace_loops[i] = pthread_self ();
+			__atomic_store_n (&trace_loop_slots[i], 2, __ATOMIC_RELEASE);
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void trace_loop_unregister (int slot) {
+	if (slot >= 0)
+		__atomic_store_n (&trace_loop_slots[slot], 0, __ATOMIC_RELEASE);
+}
+
+void mediator_trace_signal (int signum) {
+	/**
+	 * asks the main loops to dump their trace and wakes them up. Only sets a
+	 * flag and calls pthread_kill, so it is safe to call from a signal handler
+	 *
+	 * @param int signal number
+	 */
+	int saved_errno = errno;
+	// several threads may get the signal at once
+	__atomic_fetch_add (&trace_signals, 1, __ATOMIC_RELAXED);
+	pthread_t self = pthread_self ();
+	bool loop = false;
+	int i;
+	for (i = 0; i < TRACE_LOOPS; i++)
+		if (__atomic_load_n (&trace_loop_slots[i], __ATOMIC_ACQUIRE) == 2 && pthread_equal (trace_loops[i], self))
+			loop = true;
+	// a loop that got the signal itself was interrupted already; the others
+	// get it forwarded only from a thread that is not a loop, so it is not
+	// forwarded back and forth
+	if (!loop) {
+		for (i = 0; i < TRACE_LOOPS; i++)
+			if (__atomic_load_n (&trace_loop_slots[i], __ATOMIC_ACQUIRE) == 2)
+				pthread_kill (trace_loops[i], signum);
+	}
+	errno = saved_errno;
+}
+
+static int mediator_loop (mediator_t *self) {
+    self->trace_signals = __atomic_load_n (&trace_signals, __ATOMIC_RELAXED);
+    while(!zsys_interrupted && !self->terminated) {
+    	// block until an event arrives or the next msg has to be resent or expires
+    	void *which = zpoller_wait (self->poller, mediator_poll_timeout (self));
+    	int64_t woken = zclock_usecs ();
+    	// decoded events go first, so the decoders never wait for the main loop
+    	if (self->decoded && mediator_drain_decoded (self) != 0) {
+    	    printf("[%s] interrupted!\n", self->shortname);
+    	    return -1;
+    	}
+        if (which == zyre_socket (self->local) || which == zyre_socket (self->remote)) {
+            bool remote = (which == zyre_socket (self->remote));
+            if (!remote)
+                printf("\n");
+            printf("[%s] %s data received!\n", self->shortname, remote ? "remote" : "local");
             zmsg_t *msg = zmsg_recv (which);
     	    if (!msg) {
     	        printf("[%s] interrupted!\n", self->shortname);
     	        return -1;
             }
-            char *event = zmsg_popstr (msg);
-            if (streq (event, "ENTER")) {
-                handle_local_enter (self, msg);
-            } else if (streq (event, "EXIT")) {
-                handle_local_exit (self, msg);
-            } else if (streq (event, "STOP")) {
-                handle_local_stop (self, msg);
-            } else if (streq (event, "SHOUT")) {
-                handle_local_shout (self, msg);
-            } else if (streq (event, "WHISPER")) {
-                handle_local_whisper (self, msg);
-            } else if (streq (event, "JOIN")) {
-                handle_local_join (self, msg);
-            } else if (streq (event, "EVASIVE")) {
-            	handle_local_evasive (self, msg);
-            } else {
-            	zmsg_print(msg);
+            zmsg_pushstr (msg, remote ? "remote" : "local");
+            mediator_dispatch (self, &msg);
+       } else if (which == self->inproc) {
+            zmsg_t *msg = zmsg_recv (which);
+            if (!msg) {
+    	        printf("[%s] interrupted!\n", self->shortname);
+    	        return -1;
             }
-            zstr_free (&event);
+            handle_inproc (self, msg);
+            zmsg_destroy (&msg);
+       } else if (self->pipe && which == self->pipe) {
+            zmsg_t *msg = zmsg_recv (which);
+            char *command = msg ? zmsg_popstr (msg) : NULL;
+            if (!command || streq (command, "$TERM"))
+                self->terminated = true;
+            zstr_free (&command);
             zmsg_destroy (&msg);
-       } else if (which == zyre_socket (self->remote)) {
-            printf("[%s] remote data received!\n", self->shortname);
+       } else if (self->decoded && which == self->decoded) {
+            // drained above
+       } else if (which == self->file_server) {
             zmsg_t *msg = zmsg_recv (which);
             if (!msg) {
     	        printf("[%s] interrupted!\n", self->shortname);
     	        return -1;
             }
-            char *event = zmsg_popstr (msg);
-            if (streq (event, "ENTER")) {
-                handle_remote_enter (self, msg);
-            } else if (streq (event, "EXIT")) {
-                handle_remote_exit (self, msg);
-            } else if (streq (event, "STOP")) {
-                handle_remote_stop (self, msg);
-            } else if (streq (event, "SHOUT")) {
-                handle_remote_shout (self, msg);
-            } else if (streq (event, "WHISPER")) {
-                handle_remote_whisper (self, msg);
-            } else if (streq (event, "JOIN")) {
-                handle_remote_join (self, msg);
-            } else if (streq (event, "EVASIVE")) {
-            	handle_remote_evasive (self, msg);
-            } else {
-            	zmsg_print(msg);
-            }
-            // check all msgs in send_req list for resend or abort
-            process_send_msgs(self);
-
-            zstr_free (&event);
+            handle_file_server (self, msg);
             zmsg_destroy (&msg);
        } else {
-			// Iterate query actors
-			zactor_t* query = zhash_first(self->queries);
-			const char* uid;
-			while (query != NULL) {
-				if (which == query) {
-					uid = zhash_cursor(self->queries);
-					break;
-				}
-				query = zhash_next(self->queries);
-			}
-			if (query != NULL) {
+			// route the event to the query of this client actor
+			query_t *q = mediator_lookup_actor(self, which);
+			if (q != NULL) {
 				// TODO: use JSON for internal communication?
 				char *query_type = zstr_recv (which);
 				if (streq (query_type, "remote_file_done")) {
@@ -1192,97 +2623,155 @@ int main(int argc, char *argv[]) {
 					char *success = zstr_recv (which);
 					char *error = zstr_recv (which);
 					char *file_path = zstr_recv (which);
-					assert(streq(uid, recv_uid));
+					assert(streq(q->uid, recv_uid));
 					printf("[%s] received remote_file_done from client_actor\n", self->shortname);
-					zpoller_remove(self->poller, query);
-					zhash_delete(self->queries,uid);
-					zactor_destroy (&query); // TODO: required?
-					json_t *pl;
-					pl = json_object();
-					json_object_set(pl, "UID", json_string(recv_uid));
-					printf("[%s] whispering remote peerid %s that query %s is done\n", self->shortname, peerid, recv_uid);
-					char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_done.json","remote_file_done",pl);
-					zyre_whispers(self->remote, peerid , "%s", encoded_msg);
-					free(encoded_msg);
-					json_object_set(pl, "target", json_string(file_path));
-					json_object_set(pl, "error", json_string(error));
-					json_object_set(pl, "success", json_string(success));
-					// look up local requester
-					query_t *q = (query_t *) zlist_first(self->local_query_list);
-					char* requester = NULL;
-					while (q != NULL) {
-						if (streq(q->uid, recv_uid)) {
-							requester = strdup(q->requester);
-							break;
-						}
-						q = (query_t *) zlist_next(self->local_query_list);
-					}
-					if(requester != NULL) {
-						printf("[%s] whispering file_transfer_report to local peerid %s\n", self->shortname, requester);
-						char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_report.json", "file_transfer_report", pl);
-						zyre_whispers(self->local, requester, "%s", encoded_msg);
-						free(encoded_msg);
-						zlist_remove(self->local_query_list,q);
-						query_destroy(&q);
-					} else {
-						printf("[%s] requester of local query %s not found!\n", self->shortname, recv_uid);
-					}
+					file_transfer_finish(self, &q, peerid, success, error, file_path, NULL);
 					zstr_free(&peerid);
 					zstr_free(&recv_uid);
 					zstr_free(&success);
 					zstr_free(&error);
 					zstr_free(&file_path);
-					json_decref(pl);
-				} else if(streq (query_type, "remote_file_transfer_error")) {
+				} else if (streq (query_type, "remote_batch_done")) {
 					char *peerid = zstr_recv (which);
 					char *recv_uid = zstr_recv (which);
 					char *success = zstr_recv (which);
 					char *error = zstr_recv (which);
-					assert(streq(uid, recv_uid));
-					zpoller_remove(self->poller, query);
-					zhash_delete(self->queries,uid);
-					json_t *pl;
-					pl = json_object();
-					json_object_set(pl, "UID", json_string(recv_uid));
-					json_object_set(pl, "error", json_string(error));
-					json_object_set(pl, "success", json_string(success));
-					printf("[%s] whispering remote peerid %s that remote_file_query's success was %s\n", self->shortname, peerid, success);
-					char* encoded_msg = encode_msg("sherpa_mgs","http://kul/remote_file_transfer_error.json","remote_file_transfer_error",pl);
-					zyre_whispers(self->remote, peerid , "%s", encoded_msg);
-					free(encoded_msg);
-					query_t *q = (query_t *) zlist_first(self->remote_query_list);
-					// look up query and remove it
-					while (q != NULL) {
-						if (streq(q->uid, recv_uid)) {
-							zlist_remove(self->remote_query_list,q);
-							query_destroy(&q);
-							break;
-						}
-						q = (query_t *) zlist_next(self->remote_query_list);
-					}
-					int rc;
-					rc = zsock_signal (which, 123);
-					assert (rc == 0);
-					zactor_destroy (&query);
+					char *target = zstr_recv (which);
+					char *report = zstr_recv (which);
+					assert(streq(q->uid, recv_uid));
+					printf("[%s] received remote_batch_done from batch_client_actor\n", self->shortname);
+					json_error_t json_error;
+					json_t *files = report ? json_loads(report, 0, &json_error) : NULL;
+					file_transfer_finish(self, &q, peerid, success, error, target, files);
+					json_decref(files);
 					zstr_free(&peerid);
 					zstr_free(&recv_uid);
 					zstr_free(&success);
 					zstr_free(&error);
+					zstr_free(&target);
+					zstr_free(&report);
+				} else if (streq (query_type, "remote_file_progress")) {
+					char *recv_uid = zstr_recv (which);
+					char *received = zstr_recv (which);
+					char *needed = zstr_recv (which);
+					char *rate = zstr_recv (which);
+					char *eta = zstr_recv (which);
+					char *contiguous = zstr_recv (which);
+					char *file_path = zstr_recv (which);
+					json_t *pl;
+					pl = json_object();
+					json_object_set_new(pl, "UID", json_string(recv_uid));
+					json_object_set_new(pl, "bytes_received", json_integer(atoll(received)));
+					json_object_set_new(pl, "bytes_total", json_integer(atoll(needed)));
+					json_object_set_new(pl, "throughput", json_integer(atoll(rate)));
+					json_object_set_new(pl, "eta", json_integer(atoll(eta)));
+					if (file_path && strlen(file_path) > 0) {
+						json_object_set_new(pl, "file", json_string(file_path));
+						json_object_set_new(pl, "available", json_integer(atoll(contiguous)));
+					}
+					char* encoded_msg = encode_msg("sherpa_msgs", "http://kul/file_transfer_progress.json", "file_transfer_progress", pl);
+					query_whisper_requester(self, q, encoded_msg);
+					free(encoded_msg);
 					json_decref(pl);
+					zstr_free(&recv_uid);
+					zstr_free(&received);
+					zstr_free(&needed);
+					zstr_free(&rate);
+					zstr_free(&eta);
+					zstr_free(&contiguous);
+					zstr_free(&file_path);
 				}
 				zstr_free(&query_type);
 			}
       }
+      // check all msgs in send_req list for resend or abort
+      process_send_msgs(self);
+      mediator_publish_stats(self, woken);
+      int signals = __atomic_load_n (&trace_signals, __ATOMIC_RELAXED);
+      if (self->trace_signals != signals) {
+    	  self->trace_signals = signals;
+    	  mediator_dump_trace(self, NULL);
+      }
     }
     zyre_stop (self->remote);
     zyre_stop (self->local);
-    
-    mediator_destroy (&self);
-
-    //  @end
-    printf ("SHUTDOWN\n");
     return 0;
 }
 
+int mediator_run (mediator_t *self) {
+	/**
+	 * runs the event loop of the mediator until it is interrupted, or
+	 * terminated through the pipe of mediator_actor
+	 *
+	 * @param mediator_t* to the mediator data strucure
+	 *
+	 * @return 0 if the loop was stopped and -1 if a socket was interrupted
+	 */
+	int slot = trace_loop_register ();
+	int rc = mediator_loop (self);
+	trace_loop_unregister (slot);
+	return rc;
+}
+
+void mediator_actor (zsock_t *pipe, void *args) {
+	/**
+	 * runs a mediator on a background thread, see sherpa_comm_mediator.h
+	 *
+	 * @param zsock_t* pipe to the caller
+	 * @param void* json_t* configuration, owned by the mediator
+	 */
+	mediator_t *self = mediator_new ((json_t *) args);
+	if (!self) {
+		printf("[mediator_actor] could not create mediator\n");
+		zsock_signal (pipe, 0);
+		return;
+	}
+	self->pipe = pipe;
+	zpoller_add (self->poller, pipe);
+	zsock_signal (pipe, 0);     //  Signal "ready" to caller
+	printf("[%s] mediator initialised!\n", self->shortname);
+	mediator_run (self);
+	mediator_destroy (&self);
+}
+
+zsock_t * mediator_client_new (const char *shortname) {
+	/**
+	 * connects a component to the mediator running in the same process
+	 *
+	 * @param char* short-name of the mediator
+	 *
+	 * @return zsock_t* to submit msgs on with mediator_submit, NULL on error
+	 */
+	char *endpoint = (char *) malloc (strlen (">inproc://sherpa_comm_mediator-") + strlen (shortname) + 1);
+	assert (endpoint);
+	sprintf (endpoint, ">inproc://sherpa_comm_mediator-%s", shortname);
+	zsock_t *client = zsock_new_dealer (endpoint);
+	free (endpoint);
+	return client;
+}
+
+int mediator_submit (zsock_t *client, const char *msg) {
+	/**
+	 * submits a msg to the mediator, like shouting it on the local network
+	 *
+	 * @param zsock_t* created by mediator_client_new
+	 * @param char* encoded msg, see doc/msg.md
+	 *
+	 * @return 0 if successful and -1 if an error occurred
+	 */
+	return zstr_send (client, msg);
+}
+
+char * mediator_receive (zsock_t *client) {
+	/**
+	 * receives the next msg of the mediator for this component
+	 *
+	 * @param zsock_t* created by mediator_client_new
+	 *
+	 * @return char* encoded msg to be freed by the caller, NULL if interrupted
+	 */
+	return zstr_recv (client);
+}
+
 
 
@@ -8,6 +8,7 @@ int mediator_test (bool verbose) {
         printf ("\n");
     
     // @selftest
+    mediator_use_arena ();
     // Create two mediators
     json_t * config1 = load_config_file("../examples/configs/wasp1.json");
     assert (config1);
@@ -34,6 +35,174 @@ int mediator_test (bool verbose) {
         zyre_dump (mediator2->remote);
         zyre_dump (mediator2->local);
     }
+    // Received msgs are parsed in an arena that is released as a whole; the
+    // decoded fields are copied out of it
+    arena_t *arena = arena_new ();
+    json_msg_t decoded = { 0 };
+    arena_begin (arena);
+    int rc = decode_json ("{\"metamodel\": \"sherpa_msgs\", \"model\": \"m\", \"type\": \"t\", \"payload\": {\"UID\": \"1\"}}", &decoded);
+    assert (arena->blocks && arena->blocks->used > 0);
+    arena_end (arena);
+    assert (rc == 0);
+    assert (arena->blocks->used == 0);
+    assert (streq (decoded.type, "t"));
+    assert (streq (decoded.payload, "{\"UID\": \"1\"}"));
+    free (decoded.metamodel);
+    free (decoded.model);
+    free (decoded.type);
+    free (decoded.payload);
+    // handlers answer in the arena as well; the encoded msg escapes to the heap
+    arena_begin (arena);
+    json_t *reply = json_object ();
+    char *encoded = encode_msg ("sherpa_msgs", "m", "t", reply);
+    assert (arena->blocks->used > 0);
+    assert (!arena_owns (arena, encoded));
+    json_decref (reply);
+    arena_end (arena);
+    assert (streq (encoded, "{\"metamodel\": \"sherpa_msgs\", \"model\": \"m\", \"type\": \"t\", \"payload\": {}}"));
+    free (encoded);
+    arena_destroy (&arena);
+
+    // Records returned to a pool are handed out again before a new slab is
+    // allocated
+    pool_t *pool = pool_new (sizeof (recipient_t), 2);
+    recipient_t *rec1 = (recipient_t *) pool_alloc (pool);
+    recipient_t *rec2 = (recipient_t *) pool_alloc (pool);
+    assert (rec1 && rec2 && rec1 != rec2);
+    assert (pool->live == 2 && pool->capacity == 2);
+    rec1->ack = true;
+    pool_free (pool, rec1);
+    recipient_t *rec3 = (recipient_t *) pool_alloc (pool);
+    assert (rec3 == rec1 && !rec3->ack);
+    pool_alloc (pool);
+    assert (pool->live == 3 && pool->capacity == 4);
+    pool_destroy (&pool);
+
+    // Interned ids have one handle per string and print back unchanged
+    intern_table_t *ids = intern_table_new ();
+    char id_buf [INTERN_BUF_SIZE];
+    intern_t peer = intern (ids, "0123456789ABCDEF0123456789ABCDEF");
+    intern_t uuid = intern (ids, "123e4567-e89b-12d3-a456-426614174000");
+    intern_t other = intern (ids, "msg-1");
+    assert (peer && uuid && other && peer != uuid && uuid != other);
+    intern_t again = intern (ids, "0123456789ABCDEF0123456789ABCDEF");
+    assert (again == peer);
+    assert (intern_lookup (ids, "0123456789abcdef0123456789abcdef") == 0);
+    assert (streq (intern_str (ids, peer, id_buf), "0123456789ABCDEF0123456789ABCDEF"));
+    assert (streq (intern_str (ids, uuid, id_buf), "123e4567-e89b-12d3-a456-426614174000"));
+    assert (streq (intern_str (ids, other, id_buf), "msg-1"));
+    intern_release (ids, peer);
+    assert (intern_lookup (ids, "0123456789ABCDEF0123456789ABCDEF") == peer);
+    intern_release (ids, peer);
+    assert (intern_lookup (ids, "0123456789ABCDEF0123456789ABCDEF") == 0);
+    int n;
+    for (n = 0; n < 1000; n++) {
+        char key [16];
+        sprintf (key, "uid-%d", n);
+        intern_t id = intern (ids, key);
+        assert (id);
+    }
+    assert (intern_lookup (ids, "uid-999") && ids->size == 1002);
+    intern_table_destroy (&ids);
+
+    // Percentiles of a histogram are exact up to the width of their bucket
+    histogram_t *histogram = (histogram_t *) zmalloc (sizeof (histogram_t));
+    for (n = 1; n <= 1000; n++)
+        histogram_record (histogram, n);
+    assert (histogram->count == 1000 && histogram->max == 1000);
+    assert (histogram_percentile (histogram, 50) >= 500);
+    assert (histogram_percentile (histogram, 50) < 500 + 500 / HISTOGRAM_SUB);
+    assert (histogram_percentile (histogram, 100) == 1000);
+    free (histogram);
+
+    // Both mediators publish their stats in pages of their own, consistent
+    // once the gauges are read
+    assert (mediator1->stats_page->magic == STATS_PAGE_MAGIC);
+    assert (mediator1->stats_page != mediator2->stats_page);
+    stats_gauges_t gauges;
+    stats_read_gauges (mediator1->stats, &gauges);
+    assert (gauges.outbox == 0 && (mediator1->stats->seq & 1) == 0);
+
+    // The flight recorder keeps the last records only and dumps the oldest
+    // of them first
+    recorder_t *recorder = recorder_new (3);
+    for (n = 0; n < 5; n++)
+        recorder_trace_at (recorder, n * 10, TRACE_RESEND, "msg-1", "peer", n);
+    assert (recorder->next == 5);
+    int dumped = recorder_dump (recorder, "selftest", "selftest.trace");
+    assert (dumped == 3);
+    FILE *trace = fopen ("selftest.trace", "r");
+    assert (trace);
+    trace_header_t header;
+    trace_record_t record;
+    size_t got = fread (&header, sizeof (header), 1, trace);
+    assert (got == 1);
+    assert (header.records == 3 && header.lost == 2);
+    got = fread (&record, sizeof (record), 1, trace);
+    assert (got == 1);
+    assert (record.value == 2 && record.ts == 20 && streq (record.uid, "msg-1"));
+    fclose (trace);
+    unlink ("selftest.trace");
+    recorder_destroy (&recorder);
+
+    // A dictionary is only used for peers that list its id after the codec
+    assert (codecs_accept (COMPRESSION_CODEC, 0));
+    assert (!codecs_accept (COMPRESSION_CODEC, 42));
+    assert (codecs_accept (COMPRESSION_CODEC " 7 42", 42));
+    assert (!codecs_accept (COMPRESSION_CODEC " 7 420", 42));
+    assert (!codecs_accept ("", 0) && !codecs_accept (NULL, 0));
+    assert (!codecs_accept (COMPRESSION_CODEC "2", 0));
+
+    // An idle mediator blocks until something happens: nothing has to be
+    // resent, so the main loop may wait forever, and the file server does not
+    // wake up either. Only zyre's own beacons and heartbeats remain.
+    assert (mediator_poll_timeout (mediator1) == -1);
+    assert (mediator_poll_timeout (mediator2) == -1);
+    // Every wakeup of the main loop of a running mediator is a sample of its
+    // loop_latency, which its stats page shows to other threads as well
+    json_t *config3 = load_config_file ("../examples/configs/hawk1.json");
+    assert (config3);
+    char page_path [STATS_NAME_SIZE + 32];
+    snprintf (page_path, sizeof (page_path), STATS_PAGE_PREFIX "%s",
+              json_string_value (json_object_get (config3, "short-name")));
+    zactor_t *actor = zactor_new (mediator_actor, config3);
+    assert (actor);
+    zclock_sleep (500);     // it meets the other mediators first
+    int page_fd = shm_open (page_path, O_RDONLY, 0);
+    assert (page_fd >= 0);
+    stats_page_t *page = (stats_page_t *) mmap (NULL, sizeof (stats_page_t), PROT_READ, MAP_SHARED, page_fd, 0);
+    close (page_fd);
+    assert (page != MAP_FAILED);
+    uint64_t loops = STATS_GET (page->stats.loop_latency.count);
+    zclock_sleep (1000);
+    loops = STATS_GET (page->stats.loop_latency.count) - loops;
+    if (verbose)
+        printf ("%lu wakeups of an idle mediator_actor in 1 sec\n", (unsigned long) loops);
+    // polling every msec would cause a thousand
+    assert (loops < 20);
+    munmap (page, sizeof (stats_page_t));
+    // kill -USR1 reaches the idle loop, whichever thread the signal is
+    // delivered to, and it dumps its trace right away
+    char trace_path [STATS_NAME_SIZE + 48];
+    snprintf (trace_path, sizeof (trace_path), "/tmp/sherpa_comm_mediator-%s.trace",
+              json_string_value (json_object_get (config3, "short-name")));
+    unlink (trace_path);
+    struct sigaction action;
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = mediator_trace_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGUSR1, &action, NULL);
+    int kill_rc = kill (getpid (), SIGUSR1);
+    assert (kill_rc == 0);
+    int waited = 0;
+    while (access (trace_path, F_OK) != 0 && waited < 2000) {
+        zclock_sleep (10);
+        waited += 10;
+    }
+    assert (waited < 2000);
+    unlink (trace_path);
+    zactor_destroy (&actor);
+
     mediator_destroy(&mediator1);
     mediator_destroy(&mediator2);
     return 0; 